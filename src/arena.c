@@ -0,0 +1,139 @@
+/*
+ * arena.c
+ */
+
+#include "arena.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+
+#define ARENA_ALIGN(n) (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+void arena_init(arena_t* a, size_t block_size)
+{
+	a->head       = NULL;
+	a->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK;
+}
+
+void* arena_alloc(arena_t* a, size_t size)
+{
+	arena_block_t* b = a->head;
+	size_t need      = ARENA_ALIGN(size ? size : 1);
+
+	if (!b || b->size - b->used < need) {
+		size_t bsize = need > a->block_size ? need : a->block_size;
+
+		b       = f_malloc_raw(ARENA_ALIGN(sizeof(arena_block_t)) + bsize);
+		b->size = bsize;
+		b->used = 0;
+		b->next = a->head;
+		a->head = b;
+	}
+
+	void* r = (char*)b + ARENA_ALIGN(sizeof(arena_block_t)) + b->used;
+	b->used += need;
+
+	return r;
+}
+
+char* arena_strndup(arena_t* a, const char* s, size_t len)
+{
+	if (!s) { return 0; }
+	char* r = arena_alloc(a, len + 1);
+	memcpy(r, s, len);
+	r[len] = 0;
+	return r;
+}
+
+char* arena_strdup(arena_t* a, const char* s)
+{
+	if (!s) { return 0; }
+	return arena_strndup(a, s, strlen(s));
+}
+
+char* arena_asprintf(arena_t* a, const char* fmt, ...)
+{
+	va_list ap;
+	char* r;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0)
+		return 0;
+
+	r = arena_alloc(a, len + 1);
+
+	va_start(ap, fmt);
+	vsnprintf(r, len + 1, fmt, ap);
+	va_end(ap);
+
+	return r;
+}
+
+/*
+ * Same result as join_path(), in a single allocation.
+ */
+char* arena_join(arena_t* a, const char* path, ...)
+{
+	va_list ap;
+	const char* aux;
+	size_t len, l;
+	char* r;
+
+	if (!path) { return 0; }
+
+	len = strlen(path);
+	va_start(ap, path);
+	while ((aux = va_arg(ap, const char* )))
+		len += strlen(aux) + 1;
+	va_end(ap);
+
+	r = arena_alloc(a, len + 1);
+	l = strlen(path);
+	memcpy(r, path, l + 1);
+
+	va_start(ap, path);
+	while ((aux = va_arg(ap, const char* ))) {
+		if (l && r[l - 1] != '/')
+			r[l++] = '/';
+		size_t laux = strlen(aux);
+		memcpy(r + l, aux, laux + 1);
+		l += laux;
+	}
+	va_end(ap);
+
+	return r;
+}
+
+arena_mark_t arena_mark(arena_t* a)
+{
+	arena_mark_t m = { a->head, a->head ? a->head->used : 0 };
+
+	return m;
+}
+
+void arena_rewind(arena_t* a, arena_mark_t m)
+{
+	// rewinding an empty mark keeps the first block for reuse
+	while (a->head && a->head != m.block && (m.block || a->head->next)) {
+		arena_block_t* b = a->head;
+		a->head = b->next;
+		free(b);
+	}
+
+	if (a->head)
+		a->head->used = m.block ? m.used : 0;
+}
+
+void arena_release(arena_t* a)
+{
+	while (a->head) {
+		arena_block_t* b = a->head;
+		a->head = b->next;
+		free(b);
+	}
+}
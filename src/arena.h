@@ -0,0 +1,50 @@
+/*
+ * arena.h
+ */
+
+#ifndef UA_ARENA_H_
+#define UA_ARENA_H_
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define ARENA_DEFAULT_BLOCK 4096
+
+typedef struct arena_block {
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+
+} arena_block_t;
+
+/*
+ * Scratch allocator for short-lived allocations that share one lifetime,
+ * e.g. everything built while dispatching a message or reconstructing a
+ * delta package. Memory is not zeroed and cannot be freed individually;
+ * arena_rewind() or arena_release() frees it in one shot.
+ */
+typedef struct arena {
+	arena_block_t* head;
+	size_t block_size;
+
+} arena_t;
+
+typedef struct arena_mark {
+	arena_block_t* block;
+	size_t used;
+
+} arena_mark_t;
+
+#define AJOIN(arena, a, b ...) (arena_join(arena, a, ## b, NULL))
+
+void arena_init(arena_t* a, size_t block_size);
+void* arena_alloc(arena_t* a, size_t size);
+char* arena_strdup(arena_t* a, const char* s);
+char* arena_strndup(arena_t* a, const char* s, size_t len);
+char* arena_asprintf(arena_t* a, const char* fmt, ...);
+char* arena_join(arena_t* a, const char* path, ...);
+arena_mark_t arena_mark(arena_t* a);
+void arena_rewind(arena_t* a, arena_mark_t m);
+void arena_release(arena_t* a);
+
+#endif /* UA_ARENA_H_ */
@@ -0,0 +1,628 @@
+/*
+ * bkmaint.c
+ */
+
+#include "bkmaint.h"
+#include "package.h"
+#include "xml.h"
+#include "debug.h"
+#include "scheduler.h"
+#include "utlist.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define BKMAINT_CHUNK (256 * 1024)
+
+typedef enum bk_stage_state {
+	STAGE_QUEUED,
+	STAGE_RUNNING,
+	STAGE_READY,
+	STAGE_FAILED,
+
+} bk_stage_state_t;
+
+typedef struct bk_stage {
+	char* pkg_name;
+	char* version;
+	char* src;
+	char* staged;
+	char sha_of_sha[SHA256_B64_LENGTH];
+	struct stat st;
+	bk_stage_state_t state;
+	int cancel;
+
+	struct bk_stage* next;
+	struct bk_stage* prev;
+
+} bk_stage_t;
+
+typedef struct bk_verified {
+	char* file;
+	struct stat st;
+	char sha_of_sha[SHA256_B64_LENGTH];
+
+	UT_hash_handle hh;
+
+} bk_verified_t;
+
+typedef struct bk_maint {
+	pthread_t thread;
+	int running;
+	int stop;
+	int busy;
+
+	char* backup_dir;
+	int interval;
+	uint64_t rate;
+	uint64_t next_ms;
+	pthread_mutex_t* backup_lock;
+
+	bk_stage_t* stages;
+	// only used by the maintenance thread
+	bk_verified_t* verified;
+
+} bk_maint_t;
+
+static pthread_mutex_t bkm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bkm_cond  = PTHREAD_COND_INITIALIZER;
+static bk_maint_t bkm;
+
+static int same_file_state(const struct stat* a, const struct stat* b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void bkm_timed_wait(uint64_t ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec  += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&bkm_cond, &bkm_lock, &ts);
+}
+
+/*
+ * Block while the update flow is busy, then charge bytes against the I/O
+ * budget, sleeping as needed. Returns 0 if maintenance is stopping.
+ */
+static int bkm_checkpoint(uint64_t bytes)
+{
+	int ok;
+
+	pthread_mutex_lock(&bkm_lock);
+	while (!bkm.stop && bkm.busy)
+		pthread_cond_wait(&bkm_cond, &bkm_lock);
+
+	if (bytes && bkm.rate) {
+		uint64_t now = currentms();
+		if (bkm.next_ms < now)
+			bkm.next_ms = now;
+		bkm.next_ms += bytes * 1000 / bkm.rate;
+		while (!bkm.stop && (now = currentms()) < bkm.next_ms)
+			bkm_timed_wait(bkm.next_ms - now);
+	}
+
+	ok = !bkm.stop;
+	pthread_mutex_unlock(&bkm_lock);
+	return ok;
+}
+
+/*
+ * Same result as calc_sha256_x(), with pacing between entries.
+ */
+static int bkm_sha256_x(const char* file, char obuff[SHA256_B64_LENGTH])
+{
+	int err = E_UA_OK;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	pkg_handle_t* ph = pkg_open(file);
+
+	if (!ph)
+		return E_UA_ERR;
+
+	for (int i = 0; i < ph->entry_cnt && !err; i++) {
+		pkg_entry_t* pe = &ph->entries[i];
+		if (pe->is_dir)
+			continue;
+		if (!bkm_checkpoint(pe->size))
+			err = E_UA_ERR;
+		else
+			err = pkg_entry_sha256(ph, pe, hash);
+	}
+
+	if (!err)
+		err = pkg_sha256_x(ph, obuff);
+
+	pkg_close(ph);
+	return err;
+}
+
+static int bkm_copy(const char* from, const char* to)
+{
+	int err  = E_UA_OK;
+	int in   = -1;
+	int out  = -1;
+	char* buf = 0;
+	ssize_t nread;
+
+	do {
+		BOLT_SYS(chkdirp(to), "failed to prepare directory for %s", to);
+		if (!link(from, to))
+			break;
+
+		BOLT_SYS((in = open(from, O_RDONLY)) < 0, "opening file: %s", from);
+		BOLT_SYS((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0, "creating file: %s", to);
+
+		buf = f_malloc_raw(BKMAINT_CHUNK);
+
+		while ((nread = read(in, buf, BKMAINT_CHUNK)) > 0) {
+			BOLT_IF(!bkm_checkpoint(nread), E_UA_ERR, "backup maintenance stopping, copy of %s aborted", from);
+			BOLT_SYS(write(out, buf, nread) != nread, "writing to file: %s", to);
+		}
+		if (err) break;
+		BOLT_SYS(nread < 0, "reading from file: %s", from);
+		BOLT_SYS(fsync(out), "syncing file: %s", to);
+
+	} while (0);
+
+	if (buf) free(buf);
+	if (in >= 0) close(in);
+	if (out >= 0 && close(out)) A_ERROR_MSG("closing file: %s", to);
+
+	return err;
+}
+
+static void bkm_free_stage(bk_stage_t* s)
+{
+	if (s->staged && s->state != STAGE_READY && !access(s->staged, F_OK))
+		unlink(s->staged);
+	f_free(s->pkg_name);
+	f_free(s->version);
+	f_free(s->src);
+	f_free(s->staged);
+	free(s);
+}
+
+static void bkm_run_stage(bk_stage_t* s)
+{
+	int err = E_UA_OK;
+	char sha[SHA256_B64_LENGTH] = {0};
+	struct stat st;
+	char* bname = f_basename(s->src);
+
+	s->staged = JOIN(bkm.backup_dir, "backup", s->pkg_name, BKMAINT_STAGING_DIR, s->version, bname);
+	free(bname);
+
+	do {
+		BOLT_IF(!s->staged, E_UA_ERR, "failed to form staging path for %s", s->src);
+		BOLT_SYS(stat(s->src, &s->st), "stat of %s", s->src);
+		if (!access(s->staged, F_OK))
+			unlink(s->staged);
+
+		BOLT_SUB(bkm_copy(s->src, s->staged));
+		BOLT_SUB(bkm_sha256_x(s->staged, sha));
+		BOLT_IF(strcmp(sha, s->sha_of_sha), E_UA_ERR, "staged copy of %s does not match its sha-of-sha", s->src);
+		BOLT_IF(stat(s->src, &st) || !same_file_state(&st, &s->st), E_UA_ERR, "%s changed while staging", s->src);
+
+	} while (0);
+
+	pthread_mutex_lock(&bkm_lock);
+	s->state = (err || s->cancel) ? STAGE_FAILED : STAGE_READY;
+	if (s->state == STAGE_READY)
+		A_INFO_MSG("Pre-staged backup of %s version %s: %s", s->pkg_name, s->version, s->staged);
+	else {
+		DL_DELETE(bkm.stages, s);
+		bkm_free_stage(s);
+	}
+	pthread_mutex_unlock(&bkm_lock);
+}
+
+static int bkm_is_verified(const pkg_file_t* pf, const struct stat* st)
+{
+	bk_verified_t* v = NULL;
+
+	HASH_FIND_STR(bkm.verified, pf->file, v);
+	return v && same_file_state(&v->st, st) && !strcmp(v->sha_of_sha, pf->sha_of_sha);
+}
+
+static void bkm_set_verified(const pkg_file_t* pf, const struct stat* st, const char* sha)
+{
+	bk_verified_t* v = NULL;
+
+	HASH_FIND_STR(bkm.verified, pf->file, v);
+	if (!v) {
+		v       = f_malloc(sizeof(bk_verified_t));
+		v->file = f_strdup(pf->file);
+		HASH_ADD_KEYPTR(hh, bkm.verified, v->file, strlen(v->file), v);
+	}
+	v->st = *st;
+	strcpy_s(v->sha_of_sha, sha, sizeof(v->sha_of_sha));
+}
+
+static void bkm_verify_pkg(char* manifest)
+{
+	pkg_file_t* list = NULL, * pf, * aux;
+	struct stat st, st2;
+
+	if (list_pkg_manifest(manifest, &list))
+		return;
+
+	DL_FOREACH_SAFE(list, pf, aux) {
+		char sha[SHA256_B64_LENGTH] = {0};
+
+		if (!bkm_checkpoint(0))
+			break;
+
+		if (stat(pf->file, &st) && pf->stored) {
+			// kept in the backup store, nothing checked out
+
+		} else if (stat(pf->file, &st)) {
+			A_WARN_MSG("Backup file %s of version %s is missing, dropping its entry", pf->file, pf->version);
+			pthread_mutex_lock(bkm.backup_lock);
+			remove_pkg_file_manifest(manifest, pf);
+			pthread_mutex_unlock(bkm.backup_lock);
+
+		} else if (!bkm_is_verified(pf, &st)) {
+			if (bkm_sha256_x(pf->file, sha) != E_UA_OK) {
+				if (bkm_checkpoint(0))
+					A_ERROR_MSG("Could not hash backup file %s, leaving it for now", pf->file);
+
+			} else {
+				pthread_mutex_lock(bkm.backup_lock);
+				if (!stat(pf->file, &st2) && same_file_state(&st, &st2)) {
+					if (!S(pf->sha_of_sha)) {
+						A_INFO_MSG("Recording sha-of-sha of backup %s", pf->file);
+						if (!set_pkg_sha_of_sha_manifest(manifest, pf->version, sha)) {
+							strcpy_s(pf->sha_of_sha, sha, sizeof(pf->sha_of_sha));
+							bkm_set_verified(pf, &st, sha);
+						}
+
+					} else if (strcmp(sha, pf->sha_of_sha)) {
+						A_ERROR_MSG("Backup file %s of version %s is corrupted, removing it", pf->file, pf->version);
+						if (!pf->stored)
+							remove_pkg_file_manifest(manifest, pf);
+						unlink(pf->file);
+
+					} else {
+						bkm_set_verified(pf, &st, sha);
+					}
+				}
+				pthread_mutex_unlock(bkm.backup_lock);
+			}
+		}
+	}
+
+	DL_FOREACH_SAFE(list, pf, aux) {
+		DL_DELETE(list, pf);
+		free_pkg_file(pf);
+	}
+}
+
+static int bkm_stage_live(const char* pkg_name, const char* version)
+{
+	bk_stage_t* s;
+	int live = 0;
+
+	pthread_mutex_lock(&bkm_lock);
+	DL_FOREACH(bkm.stages, s) {
+		if (!strcmp(s->pkg_name, pkg_name) && !strcmp(s->version, version)) {
+			live = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bkm_lock);
+
+	return live;
+}
+
+static int bkm_referenced(pkg_file_t* list, const struct stat* dst)
+{
+	pkg_file_t* pf;
+	struct stat st;
+	int ref = 0;
+
+	DL_FOREACH(list, pf) {
+		char* dir = f_dirname(pf->file);
+		ref = dir && !stat(dir, &st) && st.st_dev == dst->st_dev && st.st_ino == dst->st_ino;
+		f_free(dir);
+		if (ref)
+			break;
+	}
+
+	return ref;
+}
+
+/*
+ * Remove version directories no manifest entry refers to, leftover
+ * staging directories and empty package directories.
+ */
+static void bkm_prune_pkg(const char* pkg_dir, const char* pkg_name, char* manifest)
+{
+	pkg_file_t* list = NULL, * pf, * aux;
+	struct dirent* entry;
+	struct stat st;
+	DIR* dir;
+
+	pthread_mutex_lock(bkm.backup_lock);
+
+	int has_manifest = !access(manifest, F_OK);
+	if ((!has_manifest || !list_pkg_manifest(manifest, &list)) && (dir = opendir(pkg_dir))) {
+		while ((entry = readdir(dir)) != NULL) {
+			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+
+			char* path = JOIN(pkg_dir, entry->d_name);
+			if (!path || stat(path, &st) || !S_ISDIR(st.st_mode)) {
+				f_free(path);
+				continue;
+			}
+
+			if (!strcmp(entry->d_name, BKMAINT_STAGING_DIR)) {
+				DIR* sdir = opendir(path);
+				struct dirent* sentry;
+				while (sdir && (sentry = readdir(sdir)) != NULL) {
+					if (strcmp(sentry->d_name, ".") && strcmp(sentry->d_name, "..") &&
+					    !bkm_stage_live(pkg_name, sentry->d_name)) {
+						char* spath = JOIN(path, sentry->d_name);
+						A_INFO_MSG("Pruning stale staging directory %s", spath);
+						rmdirp(spath);
+						f_free(spath);
+					}
+				}
+				if (sdir) closedir(sdir);
+				rmdir(path);
+
+			} else if (has_manifest && !bkm_referenced(list, &st)) {
+				char* sub_manifest = JOIN(path, MANIFEST_PKG);
+				if (sub_manifest && access(sub_manifest, F_OK)) {
+					A_INFO_MSG("Pruning unreferenced backup directory %s", path);
+					rmdirp(path);
+				}
+				f_free(sub_manifest);
+			}
+			f_free(path);
+		}
+		closedir(dir);
+
+		if (!has_manifest)
+			rmdir(pkg_dir);
+	}
+
+	pthread_mutex_unlock(bkm.backup_lock);
+
+	DL_FOREACH_SAFE(list, pf, aux) {
+		DL_DELETE(list, pf);
+		free_pkg_file(pf);
+	}
+}
+
+static void bkm_pass(void)
+{
+	char* root = JOIN(bkm.backup_dir, "backup");
+	struct dirent* entry;
+	struct stat st;
+	DIR* dir;
+
+	if (!root || !(dir = opendir(root))) {
+		f_free(root);
+		return;
+	}
+
+	A_INFO_MSG("Backup maintenance pass over %s", root);
+
+	while ((entry = readdir(dir)) != NULL && bkm_checkpoint(0)) {
+		// package names do not start with a dot, backup store and the like do
+		if (entry->d_name[0] == '.')
+			continue;
+
+		char* pkg_dir = JOIN(root, entry->d_name);
+		if (pkg_dir && !stat(pkg_dir, &st) && S_ISDIR(st.st_mode)) {
+			char* manifest = JOIN(pkg_dir, MANIFEST_PKG);
+			if (manifest) {
+				if (!access(manifest, R_OK))
+					bkm_verify_pkg(manifest);
+				if (bkm_checkpoint(0))
+					bkm_prune_pkg(pkg_dir, entry->d_name, manifest);
+			}
+			f_free(manifest);
+		}
+		f_free(pkg_dir);
+	}
+
+	closedir(dir);
+	f_free(root);
+}
+
+static void* bkm_loop(void* arg)
+{
+	uint64_t next_pass = currentms() + bkm.interval * 1000ULL;
+
+	scheduler_worker();
+
+	pthread_mutex_lock(&bkm_lock);
+	while (!bkm.stop) {
+		bk_stage_t* s = NULL;
+		uint64_t now  = currentms();
+
+		DL_FOREACH(bkm.stages, s) {
+			if (s->state == STAGE_QUEUED)
+				break;
+		}
+
+		if (bkm.busy) {
+			pthread_cond_wait(&bkm_cond, &bkm_lock);
+
+		} else if (s) {
+			s->state = STAGE_RUNNING;
+			pthread_mutex_unlock(&bkm_lock);
+			bkm_run_stage(s);
+			pthread_mutex_lock(&bkm_lock);
+
+		} else if (now >= next_pass) {
+			pthread_mutex_unlock(&bkm_lock);
+			bkm_pass();
+			pthread_mutex_lock(&bkm_lock);
+			next_pass = currentms() + bkm.interval * 1000ULL;
+
+		} else {
+			bkm_timed_wait(next_pass - now);
+		}
+	}
+	pthread_mutex_unlock(&bkm_lock);
+
+	return arg;
+}
+
+int bkmaint_start(const char* backup_dir, int interval, int kbps, pthread_mutex_t* backup_lock)
+{
+	int err = E_UA_OK;
+
+	do {
+		BOLT_IF(!S(backup_dir) || interval <= 0 || !backup_lock, E_UA_ARG, "backup maintenance configuration error");
+		BOLT_IF(bkm.running, E_UA_ERR, "backup maintenance already running");
+
+		bkm.stop        = 0;
+		bkm.busy        = 0;
+		bkm.backup_dir  = f_strdup(backup_dir);
+		bkm.interval    = interval;
+		bkm.rate        = (uint64_t)(kbps > 0 ? kbps : BKMAINT_DEFAULT_KBPS) * 1024;
+		bkm.next_ms     = 0;
+		bkm.backup_lock = backup_lock;
+
+		BOLT_SYS(pthread_create(&bkm.thread, 0, bkm_loop, NULL), "pthread create");
+		bkm.running = 1;
+		A_INFO_MSG("Backup maintenance every %d s, I/O budget %llu KB/s", interval, (unsigned long long)(bkm.rate / 1024));
+
+	} while (0);
+
+	if (err && !bkm.running)
+		Z_FREE(bkm.backup_dir);
+
+	return err;
+}
+
+void bkmaint_stop(void)
+{
+	bk_stage_t* s, * aux;
+	bk_verified_t* v, * vaux;
+
+	if (!bkm.running)
+		return;
+
+	pthread_mutex_lock(&bkm_lock);
+	bkm.stop = 1;
+	pthread_cond_broadcast(&bkm_cond);
+	pthread_mutex_unlock(&bkm_lock);
+
+	pthread_join(bkm.thread, NULL);
+	bkm.running = 0;
+
+	DL_FOREACH_SAFE(bkm.stages, s, aux) {
+		DL_DELETE(bkm.stages, s);
+		bkm_free_stage(s);
+	}
+	HASH_ITER(hh, bkm.verified, v, vaux) {
+		HASH_DEL(bkm.verified, v);
+		f_free(v->file);
+		free(v);
+	}
+	Z_FREE(bkm.backup_dir);
+}
+
+void bkmaint_hold(void)
+{
+	pthread_mutex_lock(&bkm_lock);
+	bkm.busy++;
+	pthread_mutex_unlock(&bkm_lock);
+}
+
+void bkmaint_release(void)
+{
+	pthread_mutex_lock(&bkm_lock);
+	if (bkm.busy > 0 && !--bkm.busy)
+		pthread_cond_broadcast(&bkm_cond);
+	pthread_mutex_unlock(&bkm_lock);
+}
+
+void bkmaint_stage(const char* pkg_name, const pkg_file_t* pkgFile)
+{
+	bk_stage_t* s, * aux;
+
+	if (!pkg_name || !pkgFile || !S(pkgFile->file) || !S(pkgFile->version) || !S(pkgFile->sha_of_sha))
+		return;
+
+	pthread_mutex_lock(&bkm_lock);
+	if (bkm.running) {
+		// one staged package per component, the newest prepare wins
+		DL_FOREACH_SAFE(bkm.stages, s, aux) {
+			if (!strcmp(s->pkg_name, pkg_name)) {
+				if (s->state == STAGE_RUNNING)
+					s->cancel = 1;
+				else {
+					DL_DELETE(bkm.stages, s);
+					bkm_free_stage(s);
+				}
+			}
+		}
+
+		s           = f_malloc(sizeof(bk_stage_t));
+		s->pkg_name = f_strdup(pkg_name);
+		s->version  = f_strdup(pkgFile->version);
+		s->src      = f_strdup(pkgFile->file);
+		s->state    = STAGE_QUEUED;
+		strcpy_s(s->sha_of_sha, pkgFile->sha_of_sha, sizeof(s->sha_of_sha));
+		DL_APPEND(bkm.stages, s);
+		pthread_cond_broadcast(&bkm_cond);
+	}
+	pthread_mutex_unlock(&bkm_lock);
+}
+
+int bkmaint_take(const char* pkg_name, const pkg_file_t* pkgFile, const char* src, const char* dest)
+{
+	int err         = E_UA_OK;
+	bk_stage_t* s   = NULL;
+	struct stat st;
+
+	if (!pkg_name || !pkgFile || !src || !dest)
+		return E_UA_ERR;
+
+	pthread_mutex_lock(&bkm_lock);
+	DL_FOREACH(bkm.stages, s) {
+		if (s->state == STAGE_READY && !strcmp(s->pkg_name, pkg_name) && !strcmp(s->version, pkgFile->version) &&
+		    !strcmp(s->src, src) && !strcmp(s->sha_of_sha, pkgFile->sha_of_sha))
+			break;
+	}
+	if (s)
+		DL_DELETE(bkm.stages, s);
+	pthread_mutex_unlock(&bkm_lock);
+
+	if (!s)
+		return E_UA_ERR;
+
+	do {
+		BOLT_IF(stat(src, &st) || !same_file_state(&st, &s->st), E_UA_ERR, "%s changed since it was staged", src);
+		BOLT_SYS(chkdirp(dest), "failed to prepare directory for %s", dest);
+		BOLT_SYS(rename(s->staged, dest), "moving staged backup %s to %s", s->staged, dest);
+		A_INFO_MSG("Backup of %s taken from pre-staged %s", src, s->staged);
+
+	} while (0);
+
+	if (err)
+		s->state = STAGE_FAILED;
+	bkm_free_stage(s);
+
+	return err;
+}
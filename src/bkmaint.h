@@ -0,0 +1,46 @@
+/*
+ * bkmaint.h
+ */
+
+#ifndef UA_BKMAINT_H_
+#define UA_BKMAINT_H_
+
+#include "handler.h"
+
+#define BKMAINT_DEFAULT_KBPS 4096
+#define BKMAINT_STAGING_DIR  ".staging"
+
+/*
+ * Idle-time maintenance of the backup directory, run by a background
+ * thread every interval seconds: backup files are verified against the
+ * sha-of-sha in their manifest, missing sha-of-sha values are filled in,
+ * entries of missing or corrupted files are dropped and directories no
+ * manifest refers to are removed. All file I/O of the thread is paced to
+ * kbps. Work pauses while the update flow is active, see bkmaint_hold().
+ * Manifests are only modified with backup_lock held.
+ */
+int bkmaint_start(const char* backup_dir, int interval, int kbps, pthread_mutex_t* backup_lock);
+void bkmaint_stop(void);
+
+/*
+ * Mark the update flow busy / idle, calls nest.
+ */
+void bkmaint_hold(void);
+void bkmaint_release(void);
+
+/*
+ * Queue a prepared package for pre-staging. The file is linked or copied
+ * next to the backup of pkg_name in the background and verified against
+ * pkgFile->sha_of_sha, so that backing it up after installation is a
+ * rename. Does nothing if maintenance is not running.
+ */
+void bkmaint_stage(const char* pkg_name, const pkg_file_t* pkgFile);
+
+/*
+ * Move a staged copy of src into dest, if one was staged for pkg_name and
+ * version and src has not changed since. Returns E_UA_OK if dest is now a
+ * verified copy of src, E_UA_ERR otherwise.
+ */
+int bkmaint_take(const char* pkg_name, const pkg_file_t* pkgFile, const char* src, const char* dest);
+
+#endif /* UA_BKMAINT_H_ */
@@ -0,0 +1,259 @@
+/*
+ * bkstore.c
+ */
+
+#include "bkstore.h"
+#include "hash.h"
+#include "package.h"
+#include "xml.h"
+#include "zipwriter.h"
+#include "debug.h"
+#include "utlist.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+static char* store_dir(const char* manifest)
+{
+	char* pkg_dir = f_dirname(manifest);
+	char* root    = pkg_dir ? f_dirname(pkg_dir) : NULL;
+	char* dir     = root ? JOIN(root, BKSTORE_DIR) : NULL;
+
+	f_free(root);
+	f_free(pkg_dir);
+	return dir;
+}
+
+static char* chunk_path(const char* dir, const char* sha)
+{
+	char fan[3] = {sha[0], sha[1], 0};
+
+	return JOIN(dir, fan, sha);
+}
+
+static int store_chunk(struct zip* za, zip_uint64_t index, const char* dir, bks_entry_t* be, unsigned char* buf)
+{
+	int err                = E_UA_OK;
+	struct zip_file* zf    = 0;
+	FILE* out              = 0;
+	EVP_MD_CTX* ctx        = 0;
+	char* tmp              = JOIN(dir, "chunk.tmp");
+	char* path             = 0;
+	uint64_t total         = 0;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	zip_int64_t len;
+
+	do {
+		BOLT_IF(!tmp, E_UA_ERR, "failed to form chunk path");
+		BOLT_SYS(chkdirp(tmp), "failed to prepare directory for %s", tmp);
+		BOLT_IF(!(zf = zip_fopen_index(za, index, ZIP_FL_COMPRESSED)), E_UA_ERR, "failed to open raw data of %s: %s", be->name, zip_strerror(za));
+		BOLT_SYS(!(out = fopen(tmp, "wb")), "creating file: %s", tmp);
+		BOLT_IF(!(ctx = hash_init()), E_UA_ERR, "failed to create digest context");
+
+		while ((len = zip_fread(zf, buf, ua_rw_buff_size)) > 0) {
+			hash_update(ctx, buf, len);
+			BOLT_SYS(fwrite(buf, 1, len, out) != (size_t)len, "writing to file: %s", tmp);
+			total += len;
+		}
+		if (err) break;
+		BOLT_IF(len < 0, E_UA_ERR, "failed to read raw data of %s", be->name);
+		BOLT_IF(total != be->csize, E_UA_ERR, "raw data size mismatch for %s", be->name);
+		BOLT_SYS(fclose(out), "closing file: %s", tmp);
+		out = 0;
+
+		err = hash_final(ctx, hash);
+		ctx = 0;
+		BOLT_IF(err, E_UA_ERR, "failed to hash raw data of %s", be->name);
+		hash_hex(hash, be->sha);
+
+		BOLT_IF(!(path = chunk_path(dir, be->sha)), E_UA_ERR, "failed to form chunk path");
+		if (!access(path, F_OK)) {
+			unlink(tmp);
+		} else {
+			BOLT_SYS(chkdirp(path), "failed to prepare directory for %s", path);
+			BOLT_SYS(rename(tmp, path), "moving chunk %s to %s", tmp, path);
+			be->fresh = 1;
+		}
+
+	} while (0);
+
+	if (out) fclose(out);
+	if (err && tmp) unlink(tmp);
+	if (zf) zip_fclose(zf);
+	hash_free(ctx);
+	f_free(path);
+	f_free(tmp);
+
+	return err;
+}
+
+static void remove_chunks(const char* dir, bks_entry_t* recipe, int released)
+{
+	bks_entry_t* be;
+
+	DL_FOREACH(recipe, be) {
+		if (!be->is_dir && (released ? be->released : be->fresh)) {
+			char* path = chunk_path(dir, be->sha);
+			char* fan  = path ? f_dirname(path) : NULL;
+			if (path) unlink(path);
+			if (fan) rmdir(fan);
+			f_free(fan);
+			f_free(path);
+			be->fresh = be->released = 0;
+		}
+	}
+}
+
+int bkstore_put(const char* manifest, const char* file, bks_entry_t** recipe)
+{
+	int err                = E_UA_OK;
+	int fresh              = 0;
+	uint64_t written       = 0;
+	pkg_handle_t* ph       = 0;
+	bks_entry_t* list      = 0, * be;
+	char* dir              = store_dir(manifest);
+	char* store_manifest   = dir ? JOIN(dir, MANIFEST_STORE) : NULL;
+	unsigned char* buf     = 0;
+	struct zip_stat sb;
+	zip_uint8_t opsys;
+	zip_uint32_t attr;
+
+	do {
+		BOLT_IF(!store_manifest || !recipe, E_UA_ARG, "backup store is not available for %s", manifest);
+		BOLT_IF(!(ph = pkg_open(file)), E_UA_ERR, "failed to open package %s", file);
+		buf = f_malloc_raw(ua_rw_buff_size);
+
+		for (int i = 0; i < ph->entry_cnt && !err; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+
+			BOLT_IF(zip_stat_index(ph->za, pe->index, 0, &sb), E_UA_ERR, "failed reading stat of %s: %s", pe->name, zip_strerror(ph->za));
+
+			be         = f_malloc(sizeof(bks_entry_t));
+			be->name   = f_strdup(pe->name);
+			be->is_dir = pe->is_dir;
+			be->crc    = sb.crc;
+			be->usize  = sb.size;
+			be->csize  = sb.comp_size;
+			be->mtime  = sb.mtime;
+			be->mode   = be->is_dir ? 0755 : 0644;
+			if (!zip_file_get_external_attributes(ph->za, pe->index, 0, &opsys, &attr) && opsys == ZIP_OPSYS_UNIX && (attr >> 16))
+				be->mode = attr >> 16;
+			DL_APPEND(list, be);
+
+			if (be->is_dir)
+				continue;
+
+			BOLT_IF((sb.comp_method != ZIP_CM_STORE && sb.comp_method != ZIP_CM_DEFLATE) ||
+			        ((sb.valid & ZIP_STAT_ENCRYPTION_METHOD) && sb.encryption_method != ZIP_EM_NONE),
+			        E_UA_ERR, "member %s of %s cannot be kept in backup store", pe->name, file);
+			be->method = sb.comp_method;
+
+			BOLT_SUB(store_chunk(ph->za, pe->index, dir, be, buf));
+			if (be->fresh) {
+				fresh++;
+				written += be->csize;
+			}
+		}
+		if (err) break;
+
+		BOLT_SUB(ref_store_manifest(store_manifest, list, 1));
+
+		A_INFO_MSG("Stored %s in backup store: %d member(s), %d new chunk(s), %" PRIu64 " bytes written", file, ph->entry_cnt, fresh, written);
+
+	} while (0);
+
+	if (err) {
+		if (dir)
+			remove_chunks(dir, list, 0);
+		bkstore_free(list);
+	} else {
+		*recipe = list;
+	}
+
+	pkg_close(ph);
+	f_free(buf);
+	f_free(store_manifest);
+	f_free(dir);
+
+	return err;
+}
+
+int bkstore_checkout(const char* manifest, bks_entry_t* recipe, pkg_file_t* pkgFile)
+{
+	int err          = E_UA_OK;
+	int cnt          = 0;
+	char* dir        = store_dir(manifest);
+	char* tmp        = 0;
+	zipw_raw_t* raw  = 0;
+	char** paths     = 0;
+	bks_entry_t* be;
+
+	DL_COUNT(recipe, be, cnt);
+
+	do {
+		BOLT_IF(!dir || !pkgFile || !S(pkgFile->file) || !cnt, E_UA_ARG, "nothing to check out from backup store");
+		BOLT_IF(!(tmp = f_asprintf("%s.tmp", pkgFile->file)), E_UA_ERR, "failed to form temporary path");
+
+		raw   = f_malloc(cnt * sizeof(zipw_raw_t));
+		paths = f_malloc(cnt * sizeof(char*));
+
+		int i = 0;
+		DL_FOREACH(recipe, be) {
+			raw[i].name     = be->name;
+			raw[i].deflated = be->method == ZIP_CM_DEFLATE;
+			raw[i].crc      = be->crc;
+			raw[i].usize    = be->usize;
+			raw[i].csize    = be->csize;
+			raw[i].mode     = be->mode;
+			raw[i].mtime    = be->mtime;
+			if (!be->is_dir) {
+				BOLT_IF(!(paths[i] = chunk_path(dir, be->sha)) || access(paths[i], R_OK), E_UA_ERR, "chunk of %s missing in backup store", be->name);
+				raw[i].data = paths[i];
+			}
+			i++;
+		}
+		if (err) break;
+
+		BOLT_SUB(zipw_assemble(tmp, raw, cnt));
+		BOLT_IF(S(pkgFile->sha_of_sha) && sha256xcmp(tmp, pkgFile->sha_of_sha), E_UA_ERR, "reassembled %s does not match its sha-of-sha", pkgFile->file);
+		BOLT_SYS(rename(tmp, pkgFile->file), "moving %s to %s", tmp, pkgFile->file);
+
+		A_INFO_MSG("Reassembled backup %s from backup store", pkgFile->file);
+
+	} while (0);
+
+	if (err && tmp)
+		unlink(tmp);
+
+	for (int i = 0; paths && i < cnt; i++)
+		f_free(paths[i]);
+	f_free(paths);
+	f_free(raw);
+	f_free(tmp);
+	f_free(dir);
+
+	return err;
+}
+
+void bkstore_release(const char* manifest, bks_entry_t* recipe)
+{
+	char* dir            = store_dir(manifest);
+	char* store_manifest = dir ? JOIN(dir, MANIFEST_STORE) : NULL;
+
+	if (store_manifest && !ref_store_manifest(store_manifest, recipe, -1))
+		remove_chunks(dir, recipe, 1);
+
+	f_free(store_manifest);
+	f_free(dir);
+}
+
+void bkstore_free(bks_entry_t* recipe)
+{
+	bks_entry_t* be, * aux;
+
+	DL_FOREACH_SAFE(recipe, be, aux) {
+		DL_DELETE(recipe, be);
+		f_free(be->name);
+		free(be);
+	}
+}
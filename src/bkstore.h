@@ -0,0 +1,61 @@
+/*
+ * bkstore.h
+ */
+
+#ifndef UA_BKSTORE_H_
+#define UA_BKSTORE_H_
+
+#include "handler.h"
+
+#define BKSTORE_DIR    ".store"
+#define MANIFEST_STORE "manifest_store.xml"
+
+/*
+ * One member of a backed up package. Member data is kept once per content
+ * in the store, as it is found in the archive (stored or raw deflate),
+ * under the SHA-256 of that data.
+ */
+typedef struct bks_entry {
+	char* name;
+	int is_dir;
+	char sha[SHA256_HEX_LENGTH];
+	int method;
+	uint32_t crc;
+	uint64_t usize;
+	uint64_t csize;
+	uint32_t mode;
+	int64_t mtime;
+
+	// chunk was written by this put, or is no longer referenced after release
+	int fresh;
+	int released;
+
+	struct bks_entry* next;
+	struct bks_entry* prev;
+
+} bks_entry_t;
+
+/*
+ * Store the members of package file in the content-addressed store that
+ * serves pkg manifest, backup/.store next to the package directories.
+ * Only chunks not already in the store are written; the reference count
+ * of every chunk in the returned recipe is incremented. Fails, leaving the
+ * store unchanged, if a member uses a method other than store or deflate.
+ */
+int bkstore_put(const char* manifest, const char* file, bks_entry_t** recipe);
+
+/*
+ * Reassemble the package described by recipe into pkgFile->file, verified
+ * against pkgFile->sha_of_sha if that is set.
+ */
+int bkstore_checkout(const char* manifest, bks_entry_t* recipe, pkg_file_t* pkgFile);
+
+/*
+ * Drop one reference to every chunk of recipe, chunks that are no longer
+ * referenced are removed.
+ */
+void bkstore_release(const char* manifest, bks_entry_t* recipe);
+
+void bkstore_free(bks_entry_t* recipe);
+
+#endif /* UA_BKSTORE_H_ */
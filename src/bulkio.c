@@ -0,0 +1,539 @@
+/*
+ * bulkio.c
+ */
+
+#include "bulkio.h"
+#include "misc.h"
+#include "debug.h"
+#include "scheduler.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef SUPPORT_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+int ua_io_depth = BULKIO_DEFAULT_DEPTH;
+int ua_io_cache = BULKIO_CACHE_NORMAL;
+
+#ifdef SUPPORT_IO_URING
+typedef struct bulk_slot {
+	char* buf;
+	struct iovec iov;
+	off_t off;
+	size_t want;
+	ssize_t res;
+	int busy;
+
+} bulk_slot_t;
+
+typedef struct bulk_ring {
+	int fd;
+	int fixed;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_len;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+} bulk_ring_t;
+#endif
+
+struct bulk_reader {
+	int fd;
+	size_t block;
+	char* buf;
+	int done;
+	int direct;
+	int fl;
+	off_t pos;
+	off_t drop_mark;
+#ifdef SUPPORT_IO_URING
+	bulk_ring_t ring;
+	bulk_slot_t* slots;
+	char* area;
+	int depth;
+	int held;
+	int inflight;
+	off_t next_off;
+	off_t end;
+	unsigned issued;
+	unsigned delivered;
+#endif
+};
+
+/*
+ * Leave O_DIRECT for the rest of the file, when the file system refuses
+ * it or a read has to be finished at an unaligned offset.
+ */
+static void bulk_buffered(bulk_reader_t* br)
+{
+	if (br->direct) {
+		fcntl(br->fd, F_SETFL, br->fl);
+		br->direct = 0;
+	}
+}
+
+static void bulk_drop_consumed(bulk_reader_t* br, int force)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (ua_io_cache != BULKIO_CACHE_NORMAL && br->pos > br->drop_mark &&
+	    (force || br->pos - br->drop_mark >= BULKIO_DROP_CHUNK)) {
+		posix_fadvise(br->fd, br->drop_mark, br->pos - br->drop_mark, POSIX_FADV_DONTNEED);
+		br->drop_mark = br->pos;
+	}
+#endif
+}
+
+#ifdef SUPPORT_IO_URING
+static int ring_setup(bulk_ring_t* r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return E_UA_SYS;
+
+	r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = 0;
+	}
+
+	r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = 0;
+		return E_UA_SYS;
+	}
+
+	if (r->cq_len) {
+		r->cq_ptr = mmap(0, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = 0;
+			return E_UA_SYS;
+		}
+	}
+
+	r->sqes = mmap(0, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = 0;
+		return E_UA_SYS;
+	}
+
+	char* sq = r->sq_ptr;
+	char* cq = r->cq_ptr ? r->cq_ptr : r->sq_ptr;
+
+	r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)(sq + p.sq_off.array);
+	r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return E_UA_OK;
+}
+
+static void ring_teardown(bulk_ring_t* r)
+{
+	if (r->sqes) munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr) munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+	if (r->fd >= 0) close(r->fd);
+	r->fd = -1;
+}
+
+static int ring_enter(bulk_ring_t* r, unsigned submit, unsigned wait)
+{
+	int rc;
+
+	while ((rc = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0 && errno == EINTR)
+		submit = 0;
+
+	return rc < 0 ? E_UA_SYS : E_UA_OK;
+}
+
+static int slot_submit(bulk_reader_t* br, int idx)
+{
+	bulk_ring_t* r          = &br->ring;
+	bulk_slot_t* s          = &br->slots[idx];
+	unsigned tail           = *r->sq_tail;
+	unsigned sqi            = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[sqi];
+
+	size_t len;
+
+	s->off  = br->next_off;
+	s->want = (size_t)(br->end - br->next_off) < br->block ? (size_t)(br->end - br->next_off) : br->block;
+	s->res  = 0;
+	s->busy = 1;
+
+	// direct reads of the tail are rounded up, block is aligned
+	len            = br->direct ? (s->want + BULKIO_ALIGN - 1) & ~(size_t)(BULKIO_ALIGN - 1) : s->want;
+	s->iov.iov_len = len;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd        = br->fd;
+	sqe->off       = s->off;
+	sqe->user_data = idx;
+	if (r->fixed) {
+		sqe->opcode    = IORING_OP_READ_FIXED;
+		sqe->addr      = (unsigned long)s->buf;
+		sqe->len       = len;
+		sqe->buf_index = idx;
+	} else {
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr   = (unsigned long)&s->iov;
+		sqe->len    = 1;
+	}
+
+	r->sq_array[sqi] = sqi;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	br->next_off += s->want;
+	br->issued++;
+	br->inflight++;
+
+	return ring_enter(r, 1, 0);
+}
+
+static void ring_reap(bulk_reader_t* br)
+{
+	bulk_ring_t* r = &br->ring;
+	unsigned head  = *r->cq_head;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+		bulk_slot_t* s           = &br->slots[cqe->user_data];
+
+		s->res  = cqe->res;
+		s->busy = 0;
+		br->inflight--;
+		head++;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void ring_drain(bulk_reader_t* br)
+{
+	ring_reap(br);
+	while (br->inflight > 0) {
+		if (ring_enter(&br->ring, 0, 1))
+			break;
+		ring_reap(br);
+	}
+}
+
+static int ring_open(bulk_reader_t* br)
+{
+	struct stat st;
+	off_t blocks;
+
+	if (ua_io_depth <= 1 || fstat(br->fd, &st) || !S_ISREG(st.st_mode))
+		return E_UA_ERR;
+
+	// a reader of one or two blocks gains nothing from a ring
+	if ((blocks = (st.st_size - br->pos + br->block - 1) / br->block) < 3)
+		return E_UA_ERR;
+
+	br->depth    = ua_io_depth > BULKIO_MAX_DEPTH ? BULKIO_MAX_DEPTH : ua_io_depth;
+	if (br->depth > blocks) br->depth = (int)blocks;
+	br->next_off = br->pos;
+	br->end      = st.st_size;
+	br->held     = -1;
+
+	if (ring_setup(&br->ring, br->depth)) {
+		static int once;
+		if (!once++)
+			A_INFO_MSG("io_uring is not available (%s), using blocking reads", strerror(errno));
+		ring_teardown(&br->ring);
+		return E_UA_ERR;
+	}
+
+	br->slots = f_malloc(br->depth * sizeof(bulk_slot_t));
+	if (posix_memalign((void**)&br->area, BULKIO_ALIGN, br->depth * br->block)) {
+		br->area = 0;
+		ring_teardown(&br->ring);
+		return E_UA_ERR;
+	}
+
+	for (int i = 0; i < br->depth; i++) {
+		br->slots[i].buf          = br->area + i * br->block;
+		br->slots[i].iov.iov_base = br->slots[i].buf;
+	}
+
+	// registered buffers spare the kernel mapping pages on every read,
+	// they count against RLIMIT_MEMLOCK on older kernels
+	struct iovec* iov = f_malloc(br->depth * sizeof(struct iovec));
+	for (int i = 0; i < br->depth; i++) {
+		iov[i].iov_base = br->slots[i].buf;
+		iov[i].iov_len  = br->block;
+	}
+	br->ring.fixed = !syscall(__NR_io_uring_register, br->ring.fd, IORING_REGISTER_BUFFERS, iov, br->depth);
+	f_free(iov);
+
+	for (int i = 0; i < br->depth; i++) {
+		if (slot_submit(br, i)) {
+			ring_drain(br);
+			ring_teardown(&br->ring);
+			return E_UA_ERR;
+		}
+	}
+
+	return E_UA_OK;
+}
+
+static ssize_t ring_next(bulk_reader_t* br, const void** data)
+{
+	bulk_slot_t* s;
+	ssize_t n;
+
+	if (br->held >= 0) {
+		int idx  = br->held;
+		br->held = -1;
+		if (br->next_off < br->end && slot_submit(br, idx))
+			return -1;
+	}
+
+	if (br->delivered == br->issued)
+		return 0;
+
+	s = &br->slots[br->delivered % br->depth];
+
+	ring_reap(br);
+	while (s->busy) {
+		if (ring_enter(&br->ring, 0, 1))
+			return -1;
+		ring_reap(br);
+	}
+
+	if (s->res == -EINVAL && br->direct) {
+		bulk_buffered(br);
+		s->res = 0;
+	}
+
+	if (s->res < 0) {
+		errno = (int)-s->res;
+		return -1;
+	}
+
+	if ((size_t)s->res > s->want)
+		s->res = s->want;
+
+	// a short read is finished in place, a file that shrank ends here
+	if ((size_t)s->res < s->want)
+		bulk_buffered(br);
+
+	while ((size_t)s->res < s->want) {
+		if ((n = pread(br->fd, s->buf + s->res, s->want - s->res, s->off + s->res)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!n) {
+			br->done = 1;
+			break;
+		}
+		s->res += n;
+	}
+
+	br->held = br->delivered % br->depth;
+	br->pos  = s->off + s->res;
+	br->delivered++;
+	*data    = s->buf;
+
+	return s->res;
+}
+#endif
+
+bulk_reader_t* bulk_open(int fd, size_t block)
+{
+	bulk_reader_t* br = f_malloc(sizeof(bulk_reader_t));
+
+	br->fd        = fd;
+	br->block     = block ? block : ua_rw_buff_size;
+	br->pos       = lseek(fd, 0, SEEK_CUR);
+	if (br->pos < 0)
+		br->pos = 0;
+	br->drop_mark = br->pos;
+
+#ifdef O_DIRECT
+	// aligned buffers, offsets and lengths; the page cache is bypassed
+	if (ua_io_cache == BULKIO_CACHE_DIRECT && !(br->pos & (BULKIO_ALIGN - 1)) &&
+	    (br->fl = fcntl(fd, F_GETFL)) >= 0 && !fcntl(fd, F_SETFL, br->fl | O_DIRECT)) {
+		br->direct = 1;
+		br->block  = (br->block + BULKIO_ALIGN - 1) & ~(size_t)(BULKIO_ALIGN - 1);
+	}
+#endif
+
+#ifdef SUPPORT_IO_URING
+	br->ring.fd = -1;
+	if (!ring_open(br))
+		return br;
+
+	f_free(br->slots);
+	free(br->area);
+	br->slots = 0;
+	br->area  = 0;
+	br->depth = 0;
+#endif
+
+	if (posix_memalign((void**)&br->buf, BULKIO_ALIGN, br->block)) {
+		A_ERROR_MSG("Failed to malloc %zu bytes", br->block);
+		abort();
+	}
+
+	return br;
+}
+
+ssize_t bulk_next(bulk_reader_t* br, const void** data)
+{
+	ssize_t n;
+
+	if (br->done)
+		return 0;
+
+	// everything handed out so far has been consumed
+	bulk_drop_consumed(br, 0);
+
+#ifdef SUPPORT_IO_URING
+	if (br->depth) {
+		n = ring_next(br, data);
+	} else
+#endif
+	{
+		while ((n = read(br->fd, br->buf, br->block)) < 0) {
+			if (errno == EINVAL && br->direct)
+				bulk_buffered(br);
+			else if (errno != EINTR)
+				break;
+		}
+
+		if (n > 0) {
+			*data    = br->buf;
+			br->pos += n;
+		}
+	}
+
+	if (n > 0)
+		scheduler_pace(n);
+
+	return n;
+}
+
+void bulk_close(bulk_reader_t* br)
+{
+	int _errno = errno;
+
+	if (!br)
+		return;
+
+#ifdef SUPPORT_IO_URING
+	if (br->depth) {
+		ring_drain(br);
+		ring_teardown(&br->ring);
+		// leave the offset past what was handed out, as read() would
+		lseek(br->fd, br->pos, SEEK_SET);
+		free(br->area);
+		f_free(br->slots);
+	}
+#endif
+
+	bulk_drop_consumed(br, 1);
+	bulk_buffered(br);
+	errno = _errno;
+
+	f_free(br->buf);
+	f_free(br);
+}
+
+int bulk_copy(int in, int out, size_t block, size_t* copied)
+{
+	int err           = E_UA_OK;
+	bulk_reader_t* br = bulk_open(in, block);
+	const void* data  = 0;
+	size_t total      = 0;
+	off_t start       = lseek(out, 0, SEEK_CUR);
+	off_t mark;
+	ssize_t n, w;
+
+	if (start < 0)
+		start = 0;
+	mark = start;
+
+	while (!err && (n = bulk_next(br, &data)) != 0) {
+		if (n < 0) {
+			err = E_UA_SYS;
+			break;
+		}
+		for (const char* p = data; n > 0; p += w, n -= w, total += w) {
+			if ((w = write(out, p, n)) < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				err = E_UA_SYS;
+				break;
+			}
+		}
+		bulk_written(out, &mark, start + total, 0);
+	}
+
+	bulk_written(out, &mark, start + total, 1);
+	bulk_close(br);
+
+	if (copied) *copied = total;
+
+	return err;
+}
+
+void bulk_written(int fd, off_t* mark, off_t pos, int force)
+{
+	int _errno = errno;
+
+	if (ua_io_cache == BULKIO_CACHE_NORMAL || pos <= *mark ||
+	    (!force && pos - *mark < BULKIO_DROP_CHUNK))
+		return;
+
+	// dirty pages stay cached until written back
+#ifdef SYNC_FILE_RANGE_WRITE
+	sync_file_range(fd, *mark, pos - *mark, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	fdatasync(fd);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, *mark, pos - *mark, POSIX_FADV_DONTNEED);
+#endif
+	*mark = pos;
+	errno = _errno;
+}
+
+void bulk_drop(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+	if (ua_io_cache != BULKIO_CACHE_NORMAL && fd >= 0)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
@@ -0,0 +1,70 @@
+/*
+ * bulkio.h
+ */
+
+#ifndef UA_BULKIO_H_
+#define UA_BULKIO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define BULKIO_DEFAULT_DEPTH 8
+#define BULKIO_MAX_DEPTH     64
+#define BULKIO_ALIGN         4096
+#define BULKIO_DROP_CHUNK    (8 * 1024 * 1024)
+
+#define BULKIO_CACHE_NORMAL  0
+#define BULKIO_CACHE_DROP    1
+#define BULKIO_CACHE_DIRECT  2
+
+/*
+ * Number of reads kept in flight by a bulk reader, 1 for blocking reads.
+ */
+extern int ua_io_depth;
+
+/*
+ * One of BULKIO_CACHE_*. With DROP, data is dropped from the page cache
+ * once consumed or written back; DIRECT in addition reads with O_DIRECT
+ * where the file system allows it.
+ */
+extern int ua_io_cache;
+
+typedef struct bulk_reader bulk_reader_t;
+
+/*
+ * Sequential reader of fd, from its current offset, in blocks of block
+ * bytes. When libua is built with SUPPORT_IO_URING and fd is a regular
+ * file, up to ua_io_depth reads are queued through io_uring into
+ * registered buffers, so the device keeps reading ahead while the
+ * caller works on a block. Otherwise, or when io_uring is not available
+ * at run time, it falls back to blocking read().
+ */
+bulk_reader_t* bulk_open(int fd, size_t block);
+
+/*
+ * Next block of the file, valid until the next call. Returns its length,
+ * 0 at end of file, -1 with errno set on error.
+ */
+ssize_t bulk_next(bulk_reader_t* br, const void** data);
+
+void bulk_close(bulk_reader_t* br);
+
+/*
+ * Copy what is left of in to out through a bulk reader.
+ */
+int bulk_copy(int in, int out, size_t block, size_t* copied);
+
+/*
+ * Report that fd was written sequentially up to pos. In cache-conscious
+ * mode, every BULKIO_DROP_CHUNK since *mark (all of it when force is
+ * set) is written back and dropped from the page cache.
+ */
+void bulk_written(int fd, off_t* mark, off_t pos, int force);
+
+/*
+ * Drop a file that has been read through from the page cache, in
+ * cache-conscious mode.
+ */
+void bulk_drop(int fd);
+
+#endif /* UA_BULKIO_H_ */
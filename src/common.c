@@ -51,11 +51,37 @@ char* f_asprintf(const char* fmt, ...)
 }
 
 
+/*
+ * Format into buf if it fits, otherwise into a new allocation.
+ * Returns buf, an allocated string, or NULL.
+ */
+char* f_bufprintf(char* buf, size_t size, const char* fmt, ...)
+{
+	char* ret;
+	va_list ap, ap2;
+
+	va_start(ap, fmt);
+	va_copy(ap2, ap);
+	int rc = vsnprintf(buf, size, fmt, ap);
+	va_end(ap);
+
+	if (rc >= 0 && (size_t)rc < size) {
+		va_end(ap2);
+		return buf;
+	}
+
+	rc = vasprintf(&ret, fmt, ap2);
+	va_end(ap2);
+
+	return rc < 0 ? 0 : ret;
+}
+
+
 char* f_strdup(const char* s)
 {
 	if (!s) { return 0; }
 	size_t l = strlen(s) + 1;
-	char* r  = f_malloc(l);
+	char* r  = f_malloc_raw(l);
 	return memcpy(r, s, l);
 }
 
@@ -63,8 +89,7 @@ char* f_strdup(const char* s)
 char* f_strndup(const void* s, size_t len)
 {
 	if (!s) { return 0; }
-	char* s2 = f_malloc(len + 1);
-	if (!s2) { return 0; }
+	char* s2 = f_malloc_raw(len + 1);
 	memcpy(s2, s, len);
 	s2[len] = 0;
 	return s2;
@@ -85,6 +110,21 @@ void* f_malloc(size_t t)
 	return r;
 }
 
+/*
+ * Same as f_malloc() without zeroing, for buffers the caller fills in.
+ */
+void* f_malloc_raw(size_t t)
+{
+	void* r = malloc(t);
+
+	if (!r) {
+		A_ERROR_MSG("Failed to malloc %ld bytes", t);
+		abort();
+	}
+
+	return r;
+}
+
 
 void* f_realloc(void* m, size_t t)
 {
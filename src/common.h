@@ -36,9 +36,11 @@
 size_t strcpy_s(char *dst, const char *src, size_t size);
 
 char* f_asprintf(const char* fmt, ...);
+char* f_bufprintf(char* buf, size_t size, const char* fmt, ...);
 char* f_strdup(const char*);
 char* f_strndup(const void* s, size_t len);
 void* f_malloc(size_t);
+void* f_malloc_raw(size_t);
 void* f_realloc(void*, size_t);
 void f_free(void* p);
 char* f_dirname(const char* s);
@@ -10,6 +10,12 @@
 
 #include "component.h"
 #include "debug.h"
+
+/* state info is shared by the runner and the prepare-update workers */
+static pthread_mutex_t st_lock = PTHREAD_MUTEX_INITIALIZER;
+/* so is ua_intl.component_ctrl, which the API also changes from any thread */
+static pthread_mutex_t ctrl_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static char* st_string[] = {
 	"UA_STATE_UNKNOWN",
 	"UA_STATE_IDLE_INIT",
@@ -27,11 +33,37 @@ void comp_release_state_info(comp_state_info_t* cs_head)
 {
 	comp_state_info_t* cur, * tmp = NULL;
 
+	pthread_mutex_lock(&st_lock);
 	HASH_ITER(hh, cs_head, cur, tmp) {
 		HASH_DEL(cs_head,cur);
 		f_free(cur->pkg_name);
+		f_free(cur->prepared_ver);
+		f_free(cur->campaign_id);
 		f_free(cur);
 	}
+	pthread_mutex_unlock(&st_lock);
+}
+
+int comp_init_state_info(comp_state_info_t** cs_head, char* pkg_name)
+{
+	comp_state_info_t* cs = NULL;
+
+	if (!pkg_name) {
+		A_INFO_MSG("NIL pointer: pkg_name=%p",pkg_name);
+		return E_UA_ERR;
+	}
+
+	pthread_mutex_lock(&st_lock);
+	HASH_FIND_STR(*cs_head, pkg_name, cs);
+	if (!cs) {
+		cs           = f_malloc(sizeof(comp_state_info_t));
+		cs->pkg_name = f_strdup(pkg_name);
+		cs->stage    = UA_STATE_UNKNOWN;
+		HASH_ADD_KEYPTR( hh, *cs_head, cs->pkg_name, strlen(cs->pkg_name ), cs );
+	}
+	pthread_mutex_unlock(&st_lock);
+
+	return E_UA_OK;
 }
 
 ua_stage_t comp_get_update_stage(comp_state_info_t* cs_head, char* pkg_name)
@@ -44,10 +76,12 @@ ua_stage_t comp_get_update_stage(comp_state_info_t* cs_head, char* pkg_name)
 		return st;
 	}
 
+	pthread_mutex_lock(&st_lock);
 	HASH_FIND_STR(cs_head, pkg_name, cs);
 	if (cs) {
 		st = cs->stage;
 	}
+	pthread_mutex_unlock(&st_lock);
 	A_INFO_MSG("update stage of %s is %s", pkg_name, st_string[st]);
 	return st;
 }
@@ -62,6 +96,7 @@ int comp_set_update_stage(comp_state_info_t** cs_head, char* pkg_name, ua_stage_
 		return E_UA_ERR;
 	}
 
+	pthread_mutex_lock(&st_lock);
 	HASH_FIND_STR(*cs_head, pkg_name, cs);
 	if (cs) {
 		A_INFO_MSG("change update stage of %s to %s", pkg_name, st_string[stage]);
@@ -74,6 +109,7 @@ int comp_set_update_stage(comp_state_info_t** cs_head, char* pkg_name, ua_stage_
 		cs->stage    = stage;
 		HASH_ADD_KEYPTR( hh, *cs_head, cs->pkg_name, strlen(cs->pkg_name ), cs );
 	}
+	pthread_mutex_unlock(&st_lock);
 
 	return rc;
 }
@@ -88,10 +124,12 @@ update_rollback_t comp_get_rb_type(comp_ctrl_t* cs_head, char* pkg_name)
 		return ret;
 	}
 
+	pthread_mutex_lock(&ctrl_lock);
 	HASH_FIND_STR(cs_head, pkg_name, cs);
 	if (cs) {
 		ret = cs->rb_type;
 	}
+	pthread_mutex_unlock(&ctrl_lock);
 	A_INFO_MSG("%s rb_type is %d", pkg_name, ret);
 	return ret;
 }
@@ -106,6 +144,7 @@ int comp_set_rb_type(comp_ctrl_t** cs_head, const char* pkg_name, update_rollbac
 		return E_UA_ERR;
 	}
 
+	pthread_mutex_lock(&ctrl_lock);
 	HASH_FIND_STR(*cs_head, pkg_name, cs);
 	if (cs) {
 		A_INFO_MSG("change rb_type of %s to %d", pkg_name, rb_type);
@@ -118,10 +157,21 @@ int comp_set_rb_type(comp_ctrl_t** cs_head, const char* pkg_name, update_rollbac
 		cs->rb_type  = rb_type;
 		HASH_ADD_KEYPTR( hh, *cs_head, cs->pkg_name, strlen(cs->pkg_name ), cs );
 	}
+	pthread_mutex_unlock(&ctrl_lock);
 
 	return rc;
 }
 
+void comp_ctrl_lock(void)
+{
+	pthread_mutex_lock(&ctrl_lock);
+}
+
+void comp_ctrl_unlock(void)
+{
+	pthread_mutex_unlock(&ctrl_lock);
+}
+
 char* comp_get_prepared_version(comp_state_info_t* cs_head, char* pkg_name, char* cid)
 {
 	char* prepared_ver    = NULL;
@@ -132,13 +182,15 @@ char* comp_get_prepared_version(comp_state_info_t* cs_head, char* pkg_name, char
 		return prepared_ver;
 	}
 
+	pthread_mutex_lock(&st_lock);
 	HASH_FIND_STR(cs_head, pkg_name, cs);
-	if (cs) {
+	if (cs && cs->campaign_id) {
 		if(!strcmp(cs->campaign_id, cid)) {
-			prepared_ver = cs->prepared_ver;
+			prepared_ver = f_strdup(cs->prepared_ver);
 		} else 
 			A_INFO_MSG("found prepared_ver for different campaign %s : %s", NULL_STR(cs->campaign_id), NULL_STR(cs->prepared_ver));
 	}
+	pthread_mutex_unlock(&st_lock);
 	A_INFO_MSG("prepared_ver for campaign %s is %s", NULL_STR(cid), NULL_STR(prepared_ver));
 	return prepared_ver;
 }
@@ -153,6 +205,7 @@ int comp_set_prepared_version(comp_state_info_t** cs_head, char* pkg_name, char*
 		return E_UA_ERR;
 	}
 
+	pthread_mutex_lock(&st_lock);
 	HASH_FIND_STR(*cs_head, pkg_name, cs);
 	if (cs) {
 		A_INFO_MSG("change prepared_ver version of %s to %s for campaign: %s", pkg_name, NULL_STR(prepared_ver), NULL_STR(cid));
@@ -169,6 +222,7 @@ int comp_set_prepared_version(comp_state_info_t** cs_head, char* pkg_name, char*
 			HASH_ADD_KEYPTR( hh, *cs_head, cs->pkg_name, strlen(cs->pkg_name ), cs );
 		}
 	}
+	pthread_mutex_unlock(&st_lock);
 
 	return rc;
 }
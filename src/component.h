@@ -16,8 +16,13 @@
 ua_stage_t comp_get_update_stage(comp_state_info_t* cs_head, char* pkg_name);
 int comp_set_update_stage(comp_state_info_t** cs_head, char* pkg_name, ua_stage_t stage);
 void comp_release_state_info(comp_state_info_t* cs_head);
+int comp_init_state_info(comp_state_info_t** cs_head, char* pkg_name);
 update_rollback_t comp_get_rb_type(comp_ctrl_t* cs_head, char* pkg_name);
 int comp_set_rb_type(comp_ctrl_t** cs_head, const char* pkg_name, update_rollback_t rb_type);
+/* held around any other access to ua_intl.component_ctrl */
+void comp_ctrl_lock(void);
+void comp_ctrl_unlock(void);
+/* returns a copy, to be freed by the caller */
 char* comp_get_prepared_version(comp_state_info_t* cs_head, char* pkg_name, char* cid);
 int comp_set_prepared_version(comp_state_info_t** cs_head, char* pkg_name, char* prepared_ver, char* cid);
 
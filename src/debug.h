@@ -51,11 +51,14 @@ extern ua_log_handler_f ua_log_handler;
         sprintf(__now+15, "%03d", (int)(__tv.tv_usec/1000))
 #endif
 
+// log lines up to this length are formatted on the stack
+#define DBG_BUF_LEN 512
+
 #ifdef HAVE_INSTALL_LOG_HANDLER
 
 #define DBG(a,b ...)     do { if (ua_debug) { \
 				      _ltime_; \
-				      char* _str = f_asprintf("[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
+				      char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
 				      if (_str) { \
 					      if (ua_log_handler) { \
 						      ua_log_handler(ua_debug_log, _str); \
@@ -63,14 +66,14 @@ extern ua_log_handler_f ua_log_handler;
 						      printf("%s\n", _str); \
 						      fflush(stdout); \
 					      } \
-					      free(_str); \
+					      if (_str != _dbuf) free(_str); \
 				      } \
 			      } } while (0)
 
 #define DBG_SYS(a,b ...) do { if (ua_debug) { \
 				      int _errno = errno; \
 				      _ltime_; \
-				      char* _str = f_asprintf("[%s] %s:%d error %s(%d): " a, __now, chop_path(__FILE__), __LINE__, strerror(_errno), _errno, ## b); \
+				      char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d error %s(%d): " a, __now, chop_path(__FILE__), __LINE__, strerror(_errno), _errno, ## b); \
 				      if (_str) { \
 					      if (ua_log_handler) { \
 						      ua_log_handler(ua_debug_log, _str); \
@@ -78,7 +81,7 @@ extern ua_log_handler_f ua_log_handler;
 						      printf("%s\n", _str); \
 						      fflush(stdout); \
 					      } \
-					      free(_str); \
+					      if (_str != _dbuf) free(_str); \
 				      } \
 			      } } while (0)
 
@@ -92,41 +95,41 @@ extern ua_log_handler_f ua_log_handler;
 #define A_ERROR_MSG(a,b ...) do { if (ua_debug >= DBG_ERROR) { \
 					  int _errno = errno; \
 					  _ltime_; \
-					  char* _str = f_asprintf("[%s] %s:%d error %s(%d): " a, __now, chop_path(__FILE__), __LINE__, strerror(_errno), _errno, ## b); \
+					  char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d error %s(%d): " a, __now, chop_path(__FILE__), __LINE__, strerror(_errno), _errno, ## b); \
 					  if (_str) { \
 						  printf("%s\n", _str); \
 						  fflush(stdout); \
-						  free(_str); \
+						  if (_str != _dbuf) free(_str); \
 					  } \
 				  } } while (0)
 
 #define A_WARN_MSG(a,b ...)  do { if (ua_debug >= DBG_WARN) { \
 					  _ltime_; \
-					  char* _str = f_asprintf("[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
+					  char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
 					  if (_str) { \
 						  printf("%s\n", _str); \
 						  fflush(stdout); \
-						  free(_str); \
+						  if (_str != _dbuf) free(_str); \
 					  } \
 				  } } while (0)
 
 #define A_INFO_MSG(a,b ...)  do { if (ua_debug >= DBG_INFO) { \
 					  _ltime_; \
-					  char* _str = f_asprintf("[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
+					  char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
 					  if (_str) { \
 						  printf("%s\n", _str); \
 						  fflush(stdout); \
-						  free(_str); \
+						  if (_str != _dbuf) free(_str); \
 					  } \
 				  } } while (0)
 
 #define A_DEBUG_MSG(a,b ...) do { if (ua_debug >= DBG_DEBUG) { \
 					  _ltime_; \
-					  char* _str = f_asprintf("[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
+					  char _dbuf[DBG_BUF_LEN]; char* _str = f_bufprintf(_dbuf, sizeof(_dbuf), "[%s] %s:%d " a, __now, chop_path(__FILE__), __LINE__, ## b); \
 					  if (_str) { \
 						  printf("%s\n", _str); \
 						  fflush(stdout); \
-						  free(_str); \
+						  if (_str != _dbuf) free(_str); \
 					  } \
 				  } } while (0)
 
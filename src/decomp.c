@@ -0,0 +1,183 @@
+/*
+ * decomp.c
+ */
+
+#include "decomp.h"
+#include "misc.h"
+#include "debug.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#ifdef SUPPORT_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SUPPORT_LZ4
+#include <lz4frame.h>
+#endif
+
+static int read_some(int fd, void* buf, size_t len, size_t* got)
+{
+	ssize_t n;
+
+	while ((n = read(fd, buf, len)) < 0 && errno == EINTR);
+	if (n < 0)
+		return E_UA_SYS;
+
+	*got = n;
+	return E_UA_OK;
+}
+
+static int write_all(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return E_UA_SYS;
+		}
+		p   += n;
+		len -= n;
+	}
+
+	return E_UA_OK;
+}
+
+#ifdef SUPPORT_ZSTD
+static int zstd_stream(int in, int out, const char* file)
+{
+	int err             = E_UA_OK;
+	int done            = 1;
+	ZSTD_DStream* ds    = 0;
+	size_t in_size      = ZSTD_DStreamInSize();
+	size_t out_size     = ZSTD_DStreamOutSize();
+	void* ibuf          = f_malloc_raw(in_size);
+	void* obuf          = f_malloc_raw(out_size);
+	size_t got, ret;
+
+	do {
+		BOLT_IF(!ibuf || !obuf || !(ds = ZSTD_createDStream()), E_UA_MEMORY, "failed to create zstd decoder");
+		BOLT_IF(ZSTD_isError(ZSTD_initDStream(ds)), E_UA_ERR, "failed to initialize zstd decoder");
+
+		while (!(err = read_some(in, ibuf, in_size, &got)) && got) {
+			ZSTD_inBuffer ib = {ibuf, got, 0};
+			while (ib.pos < ib.size) {
+				ZSTD_outBuffer ob = {obuf, out_size, 0};
+				ret = ZSTD_decompressStream(ds, &ob, &ib);
+				BOLT_IF(ZSTD_isError(ret), E_UA_ERR, "zstd decoding of %s failed: %s", file, ZSTD_getErrorName(ret));
+				BOLT_SYS(write_all(out, obuf, ob.pos), "writing decompressed data of %s", file);
+				// 0 once a frame is fully decoded and flushed
+				done = !ret;
+			}
+			if (err) break;
+		}
+		BOLT_IF(err, err, "reading %s failed", file);
+		BOLT_IF(!done, E_UA_ERR, "%s ends within a zstd frame", file);
+
+	} while (0);
+
+	if (ds) ZSTD_freeDStream(ds);
+	f_free(obuf);
+	f_free(ibuf);
+
+	return err;
+}
+#endif
+
+#ifdef SUPPORT_LZ4
+static int lz4_stream(int in, int out, const char* file)
+{
+	int err                        = E_UA_OK;
+	size_t hint                    = 1;
+	LZ4F_decompressionContext_t dc = 0;
+	size_t buf_size                = ua_rw_buff_size;
+	char* ibuf                     = f_malloc_raw(buf_size);
+	char* obuf                     = f_malloc_raw(buf_size);
+	size_t got;
+
+	do {
+		BOLT_IF(!ibuf || !obuf || LZ4F_isError(LZ4F_createDecompressionContext(&dc, LZ4F_VERSION)), E_UA_MEMORY, "failed to create lz4 decoder");
+
+		while (!(err = read_some(in, ibuf, buf_size, &got)) && got) {
+			size_t pos = 0;
+			while (pos < got) {
+				size_t isz = got - pos;
+				size_t osz = buf_size;
+				hint = LZ4F_decompress(dc, obuf, &osz, ibuf + pos, &isz, NULL);
+				BOLT_IF(LZ4F_isError(hint), E_UA_ERR, "lz4 decoding of %s failed: %s", file, LZ4F_getErrorName(hint));
+				BOLT_SYS(write_all(out, obuf, osz), "writing decompressed data of %s", file);
+				pos += isz;
+			}
+			if (err) break;
+		}
+		BOLT_IF(err, err, "reading %s failed", file);
+
+		// drain output still buffered in the decoder
+		while (hint) {
+			size_t isz = 0;
+			size_t osz = buf_size;
+			hint = LZ4F_decompress(dc, obuf, &osz, NULL, &isz, NULL);
+			BOLT_IF(LZ4F_isError(hint) || !osz, E_UA_ERR, "%s ends within an lz4 frame", file);
+			BOLT_SYS(write_all(out, obuf, osz), "writing decompressed data of %s", file);
+		}
+
+	} while (0);
+
+	if (dc) LZ4F_freeDecompressionContext(dc);
+	f_free(obuf);
+	f_free(ibuf);
+
+	return err;
+}
+#endif
+
+int decomp_supported(const char* algo)
+{
+#ifdef SUPPORT_ZSTD
+	if (!strcmp(algo, "zstd")) return 1;
+#endif
+#ifdef SUPPORT_LZ4
+	if (!strcmp(algo, "lz4")) return 1;
+#endif
+	return 0;
+}
+
+int decomp_file(const char* algo, const char* in, const char* out)
+{
+	int err     = E_UA_OK;
+	int created = 0;
+	int ifd     = -1, ofd = -1;
+
+	do {
+		BOLT_IF(!decomp_supported(algo), E_UA_ARG, "no built-in decompressor for %s", algo);
+		BOLT_SYS((ifd = open(in, O_RDONLY)) < 0, "opening %s", in);
+		BOLT_SYS(chkdirp(out), "failed to prepare directory for %s", out);
+		BOLT_SYS((ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0, "creating %s", out);
+		created = 1;
+
+		A_INFO_MSG("Decompressing %s (%s) into %s", in, algo, out);
+#ifdef SUPPORT_ZSTD
+		if (!strcmp(algo, "zstd"))
+			err = zstd_stream(ifd, ofd, in);
+#endif
+#ifdef SUPPORT_LZ4
+		if (!strcmp(algo, "lz4"))
+			err = lz4_stream(ifd, ofd, in);
+#endif
+		if (err) break;
+		BOLT_SYS(close(ofd), "closing %s", out);
+		ofd = -1;
+
+	} while (0);
+
+	if (ofd >= 0) close(ofd);
+	if (ifd >= 0) close(ifd);
+	if (err && created)
+		unlink(out);
+
+	return err;
+}
@@ -0,0 +1,25 @@
+/*
+ * decomp.h
+ */
+
+#ifndef UA_DECOMP_H_
+#define UA_DECOMP_H_
+
+#if defined(SUPPORT_ZSTD) || defined(SUPPORT_LZ4)
+#define SUPPORT_BUILTIN_DECOMP
+#endif
+
+/*
+ * Built-in decompressors for delta members, registered as internal
+ * decompression tools. algo is the compression name of manifest_diff,
+ * "zstd" or "lz4".
+ */
+int decomp_supported(const char* algo);
+
+/*
+ * Decompress in into out, streaming through fixed buffers. Concatenated
+ * frames are decoded in turn.
+ */
+int decomp_file(const char* algo, const char* in, const char* out);
+
+#endif /* UA_DECOMP_H_ */
@@ -1,31 +1,45 @@
 #include "delta.h"
+#include "arena.h"
 #include "xml.h"
 #include "utlist.h"
 #include "debug.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "decomp.h"
+#include "rjournal.h"
+#include "bulkio.h"
 #ifdef SHELL_COMMAND_DISABLE
 #include "delta_utils.h"
 #endif
 #include <zip.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/statvfs.h>
+#include <inttypes.h>
 #ifdef __QNX__
 #include <limits.h>
 #else
 #include <linux/limits.h>
 #endif
 #include <unistd.h>
+#include <fcntl.h>
 
 static int add_delta_tool(delta_tool_hh_t** hash, const delta_tool_t* tool, int count, int isPatchTool);
 static void clear_delta_tool(delta_tool_hh_t* hash);
 static char* get_deflt_delta_cap(delta_tool_hh_t* patchTool, delta_tool_hh_t* decompTool);
 static char* get_config_delta_cap(char* delta_cap);
 static char* expand_tool_args(const char* args, const char* old, const char* new, const char* diff);
-static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new, const char* diff);
+static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new, const char* diff, rjournal_t* journal);
 static int verify_file(const char* file, const char* sha256);
 
 #define snprintf_nowarn(...) (snprintf(__VA_ARGS__) < 0 ? abort() : (void)0)
 
 delta_stg_t delta_stg = {0};
+#ifdef SHELL_COMMAND_DISABLE
+/* espatch is reentrant, but runs one at a time until parallel patching is covered by an esdiff test */
+static pthread_mutex_t intl_tool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 const delta_tool_t deflt_patch_tools[] = {
 #ifndef SHELL_COMMAND_DISABLE
@@ -40,7 +54,13 @@ const delta_tool_t deflt_decomp_tools[] = {
 	{"gzip", "gzip", "-cd "OFA " > "NFA, 0},
 	{"bzip2", "bzip2", "-cd "OFA " > "NFA, 0},
 #endif
-	{"xz", "xz", "-cd "OFA " > "NFA, 0}
+	{"xz", "xz", "-cd "OFA " > "NFA, 0},
+#ifdef SUPPORT_ZSTD
+	{"zstd", "zstd", "-cd "OFA " > "NFA, 1},
+#endif
+#ifdef SUPPORT_LZ4
+	{"lz4", "lz4", "-cd "OFA " > "NFA, 1},
+#endif
 };
 
 
@@ -62,6 +82,23 @@ int delta_init(char* cacheDir, delta_cfg_t* deltaConfig)
 		                      get_deflt_delta_cap(delta_stg.patch_tool, delta_stg.decomp_tool);
 		BOLT_IF((delta_stg.delta_cap == NULL), E_UA_ERR, "delta_cap is NULL");
 
+		if (deltaConfig) {
+			delta_stg.zip_cfg.level   = deltaConfig->zip_level;
+			delta_stg.zip_cfg.threads = deltaConfig->zip_threads;
+			delta_stg.patch_mode      = deltaConfig->patch_mode;
+			delta_stg.space_check     = deltaConfig->space_check;
+			delta_stg.xz_threads      = deltaConfig->xz_threads > 0 ? deltaConfig->xz_threads : 0;
+			delta_stg.xz_memlimit     = deltaConfig->xz_memlimit_mb > 0 ? (uint64_t)deltaConfig->xz_memlimit_mb << 20 : 0;
+			if (deltaConfig->zip_rules && deltaConfig->zip_rule_cnt > 0) {
+				delta_stg.zip_cfg.rules    = f_malloc(deltaConfig->zip_rule_cnt * sizeof(delta_zip_rule_t));
+				delta_stg.zip_cfg.rule_cnt = deltaConfig->zip_rule_cnt;
+				for (int i = 0; i < deltaConfig->zip_rule_cnt; i++) {
+					delta_stg.zip_cfg.rules[i]        = deltaConfig->zip_rules[i];
+					delta_stg.zip_cfg.rules[i].suffix = f_strdup(deltaConfig->zip_rules[i].suffix);
+				}
+			}
+		}
+
 	} while (0);
 
 	if (err) {
@@ -84,6 +121,11 @@ void delta_stop()
 		delta_stg.decomp_tool = NULL;
 	}
 
+	for (int i = 0; i < delta_stg.zip_cfg.rule_cnt; i++)
+		f_free(delta_stg.zip_cfg.rules[i].suffix);
+	Z_FREE(delta_stg.zip_cfg.rules);
+	delta_stg.zip_cfg.rule_cnt = 0;
+
 	if (delta_stg.delta_cap != NULL) {
 		free(delta_stg.delta_cap);
 		delta_stg.delta_cap = NULL;
@@ -98,45 +140,48 @@ const char* get_delta_capability()
 }
 
 
-int is_delta_package(const char* pkgFile)
+int is_delta_package_ph(pkg_handle_t* ph)
 {
-	return !libzip_find_file(pkgFile, MANIFEST_DIFF);
+	if (!ph || !pkg_find_entry(ph, MANIFEST_DIFF)) {
+		A_ERROR_MSG("file: %s not found in zip: %s", MANIFEST_DIFF, ph ? ph->file : "null");
+		return 0;
+	}
+
+	A_ERROR_MSG("file: %s found in zip: %s", MANIFEST_DIFF, ph->file);
+#ifdef SUPPORT_LOGGING_INFO
+	if (store_data(0, 0, "D_START", 0, 0, 0))
+		A_INFO_MSG("D_START");
+#endif
+	return 1;
 }
 
-int is_prepared_delta_package(char* archive)
+int is_prepared_delta_package_ph(pkg_handle_t* ph)
 {
-	int err               = E_UA_ERR;
-	int is_prepared_delta = 0;
-	zip_t* zt             = NULL;
-	zip_file_t* zf        = NULL;
-	char* buf             = NULL;
-
-	do {
-		int errorp;
-		BOLT_IF(!archive, E_UA_ERR, "archive is NULL");
-
-		BOLT_IF(!(zt= zip_open(archive, ZIP_RDONLY,&errorp)), E_UA_ERR, "failed to open archive %s", archive);
+	const char* buf = pkg_manifest_diff(ph);
 
-		zip_stat_t zsb;
-		BOLT_IF(!(zf = zip_fopen(zt, MANIFEST_DIFF, 0)), E_UA_ERR, "failed to open file %s", MANIFEST_DIFF);
-
-		BOLT_IF((zip_stat(zt, MANIFEST_DIFF, 0, &zsb) == -1), E_UA_ERR, "failed to stat file %s", MANIFEST_DIFF);
-		A_INFO_MSG("size of %s is %d", MANIFEST_DIFF, zsb.size);
+	if (buf && strstr(buf, "<prepared>") && strstr(buf, "</prepared>")) {
+		A_INFO_MSG("Found prepared delta package");
+		return 1;
+	}
 
-		BOLT_MALLOC(buf, zsb.size +1);
-		BOLT_IF((zip_fread(zf, buf, zsb.size) == -1), E_UA_ERR, "failed to stat file %s", MANIFEST_DIFF);
+	return 0;
+}
 
-		if (strstr(buf, "<prepared>") && strstr(buf, "</prepared>")) {
-			A_INFO_MSG("Found prepared delta package");
-			is_prepared_delta = 1;
-		}
+int is_delta_package(const char* pkgFile)
+{
+	pkg_handle_t* ph = pkg_open(pkgFile);
+	int is_delta     = is_delta_package_ph(ph);
 
-	} while (0);
+	pkg_close(ph);
+	return is_delta;
+}
 
-	if (zf) zip_fclose(zf);
-	if (zt) zip_close(zt);
-	f_free(buf);
+int is_prepared_delta_package(char* archive)
+{
+	pkg_handle_t* ph      = pkg_open(archive);
+	int is_prepared_delta = is_prepared_delta_package_ph(ph);
 
+	pkg_close(ph);
 	return is_prepared_delta;
 }
 
@@ -261,32 +306,131 @@ int process_squashfs_image (const char* squashFile, diff_info_t* di, const char*
 
 
 
+/*
+ * Identity of a reconstruction, a journal left by another one is not used.
+ */
+static char* recon_id(arena_t* a, const char* oldPkgFile, const char* diffPkgFile, const char* newPkgFile)
+{
+	struct stat os, ds;
+
+	if (stat(oldPkgFile, &os) || stat(diffPkgFile, &ds))
+		return NULL;
+
+	return arena_asprintf(a, "%lld:%lld.%09ld %lld:%lld.%09ld %s",
+	                      (long long)ds.st_size, (long long)ds.st_mtim.tv_sec, ds.st_mtim.tv_nsec,
+	                      (long long)os.st_size, (long long)os.st_mtim.tv_sec, os.st_mtim.tv_nsec, newPkgFile);
+}
+
+/*
+ * Record a finished step once what it wrote is on disk: a file and the
+ * directory naming it, or an extracted package directory as a whole.
+ */
+static int journal_step(rjournal_t* journal, char tag, const char* name, const char* path)
+{
+	int err   = E_UA_OK;
+	char* dir = NULL;
+	int fd    = -1;
+
+	do {
+		BOLT_SUB(syncdirp(path));
+		BOLT_SYS(!(dir = f_dirname(path)) || (fd = open(dir, O_RDONLY)) < 0 || fsync(fd),
+		         "failed to sync directory of %s", path);
+
+		err = rjournal_add(journal, tag, name);
+
+	} while (0);
+
+	if (fd >= 0)
+		close(fd);
+	f_free(dir);
+
+	return err;
+}
+
+static uint64_t pkg_size(pkg_handle_t* ph)
+{
+	uint64_t size = 0;
+
+	for (int i = 0; i < ph->entry_cnt; i++)
+		size += ph->entries[i].size;
+
+	return size;
+}
+
+/*
+ * Record the throughput of a step in bytes per ms, as the patch rate is,
+ * for the planner to use next time.
+ */
+static void observe_rate(int id, uint64_t bytes, uint64_t tstart)
+{
+	uint64_t ms = currentms() - tstart;
+
+	if (ms && bytes)
+		metrics_observe(id, bytes / ms);
+}
+
 int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const char* newPkgFile)
+{
+	int err          = E_UA_ERR;
+	pkg_handle_t* ph = pkg_open(diffPkgFile);
+
+	if (ph) {
+		err = delta_reconstruct_ph(oldPkgFile, ph, newPkgFile);
+		pkg_close(ph);
+	}
+
+	return err;
+}
+
+int delta_reconstruct_ph(const char* oldPkgFile, pkg_handle_t* diffPkg, const char* newPkgFile)
 {
 	int err = E_UA_OK;
+	const char* diffPkgFile = diffPkg->file;
+	pkg_handle_t* oldPkg    = 0;
 	diff_info_t* di, * aux, * diList = 0;
 	char* oldFile, * diffFile, * newFile;
 	char* oldPath       = 0, * diffPath = 0, * newPath = 0;
-	char* diff_manifest = 0, * manifest_old = 0, * manifest_diff = 0, * manifest_new = 0;
+	char* diff_manifest = 0, * manifest_diff = 0, * manifest_new = 0;
 	char* top_delta_dir = 0, * pkg_dir = 0, * p = 0;
-      char* delta_pkg_dir = 0;
+	char* delta_pkg_dir = 0, * id = 0, * journal_file = 0;
+	rjournal_t journal  = {.fd = -1};
+	uint64_t tstart;
+	struct stat st;
+	arena_t scratch;
+	arena_mark_t mark;
+
+	TRACE_START(t_recon);
+	arena_init(&scratch, 0);
 
 	do {
-		pkg_dir = f_basename(diffPkgFile);
+		pkg_dir = arena_strdup(&scratch, chop_path(diffPkgFile));
 		if ((p =strrchr(pkg_dir, '.'))) *p = 0;
 		
-		top_delta_dir = JOIN(delta_stg.cache_dir, "delta");
-		delta_pkg_dir = JOIN(top_delta_dir, pkg_dir);
+		top_delta_dir = AJOIN(&scratch, delta_stg.cache_dir, "delta");
+		delta_pkg_dir = AJOIN(&scratch, top_delta_dir, pkg_dir);
 		A_INFO_MSG("delta_pkg_dir: %s", delta_pkg_dir);
-		if (delta_pkg_dir) {
- 			if (!access(delta_pkg_dir, W_OK))
-				rmdirp(delta_pkg_dir);
+
+		// an attempt cut short by power loss is picked up where its journal ends
+		BOLT_IF(!(id = recon_id(&scratch, oldPkgFile, diffPkgFile, newPkgFile)), E_UA_ERR, "failed to stat %s or %s", oldPkgFile, diffPkgFile);
+		journal_file = arena_asprintf(&scratch, "%s.journal", delta_pkg_dir);
+		BOLT_SYS(chkdirp(journal_file), "failed to make directory %s", top_delta_dir);
+		BOLT_SUB(rjournal_open(&journal, journal_file, id));
+		if (!journal.resumed && !access(delta_pkg_dir, W_OK))
+			rmdirp(delta_pkg_dir);
+
+		if (delta_stg.space_check && !journal.resumed) {
+			ua_delta_plan_t plan;
+			BOLT_SUB(delta_plan_ph(oldPkgFile, diffPkg, newPkgFile, &plan));
+			A_INFO_MSG("Reconstruction plan: %d entries, peak disk %" PRIu64 " of %" PRIu64 " free, peak memory %" PRIu64 ", about %" PRIu64 " ms",
+			           plan.entry_cnt, plan.peak_disk, plan.free_disk, plan.peak_mem, plan.est_ms);
+			delta_plan_free(&plan);
+			BOLT_IF(plan.peak_disk > plan.free_disk, E_UA_ERR, "not enough space in %s: %" PRIu64 " needed, %" PRIu64 " free", delta_stg.cache_dir, plan.peak_disk, plan.free_disk);
 		}
 
 #define DTR_MK(type) \
-	BOLT_SYS(newdirp(type ## Path = JOIN(top_delta_dir, pkg_dir, # type), 0755) && (errno != EEXIST), "failed to make directory %s", type ## Path); \
-	manifest_ ## type = JOIN(type ## Path, MANIFEST); do { \
-	} while (0)
+	type ## Path = AJOIN(&scratch, top_delta_dir, pkg_dir, # type); \
+	BOLT_SYS((journal.resumed ? mkdirp(type ## Path, 0755) : newdirp(type ## Path, 0755)) && (errno != EEXIST), "failed to make directory %s", type ## Path); \
+	do { } while (0)
 
 		DTR_MK(old);
 		DTR_MK(diff);
@@ -294,23 +438,39 @@ int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const cha
 
 #undef DTR_MK
 
-		diff_manifest = JOIN(diffPath, MANIFEST_DIFF);
+		diff_manifest = AJOIN(&scratch, diffPath, MANIFEST_DIFF);
+		manifest_diff = AJOIN(&scratch, diffPath, MANIFEST);
+		manifest_new  = AJOIN(&scratch, newPath, MANIFEST);
 
-		BOLT_IF(unzip(oldPkgFile, oldPath), E_UA_ERR, "unzip failed: %s", oldPkgFile);
-		BOLT_IF(unzip(diffPkgFile, diffPath), E_UA_ERR, "unzip failed: %s", diffPkgFile);
+		if (!rjournal_has(&journal, RJ_EXTRACTED, "old")) {
+			tstart = currentms();
+			BOLT_IF(!(oldPkg = pkg_open(oldPkgFile)) || pkg_extract(oldPkg, oldPath), E_UA_ERR, "unzip failed: %s", oldPkgFile);
+			observe_rate(M_UNZIP_KBPS, pkg_size(oldPkg), tstart);
+			BOLT_SUB(journal_step(&journal, RJ_EXTRACTED, "old", oldPath));
+		}
+		if (!rjournal_has(&journal, RJ_EXTRACTED, "diff")) {
+			tstart = currentms();
+			BOLT_IF(pkg_extract(diffPkg, diffPath), E_UA_ERR, "unzip failed: %s", diffPkgFile);
+			observe_rate(M_UNZIP_KBPS, pkg_size(diffPkg), tstart);
+			BOLT_SUB(journal_step(&journal, RJ_EXTRACTED, "diff", diffPath));
+		}
 
 		BOLT_IF(parse_diff_manifest(diff_manifest, &diList), E_UA_ERR, "failed to parse: %s", diff_manifest);
 
 		DL_FOREACH_SAFE(diList, di, aux) {
-			if (!err) {
+			if (!err && rjournal_has(&journal, RJ_DONE, di->name)) {
+				A_INFO_MSG("Already reconstructed: %s", di->name);
+
+			} else if (!err) {
 				bool squashfsDone = 0;
+				mark = arena_mark(&scratch);
 				if(di->old_name != NULL)
-					oldFile  = JOIN(oldPath, di->old_name);
+					oldFile  = AJOIN(&scratch, oldPath, di->old_name);
 				else
-					oldFile  = JOIN(oldPath, di->name);
+					oldFile  = AJOIN(&scratch, oldPath, di->name);
 
-				diffFile = JOIN(diffPath, di->name);
-				newFile  = JOIN(newPath, di->name);
+				diffFile = AJOIN(&scratch, diffPath, di->name);
+				newFile  = AJOIN(&scratch, newPath, di->name);
 
 				if(di->nesting.un_squash_fs.un_squash_fs && di->nesting.squash_fs_uncompressed.squash_fs_uncompressed && di->nesting.single_file_delta.single_file_delta) {
 
@@ -319,7 +479,7 @@ int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const cha
 					char str[PATH_MAX] = {0};
 					snprintf(str, (PATH_MAX - 1), "%s", di->old_name);
 					replaceAll(str, '/', '%');
-					oldFile = JOIN(delta_stg.cache_dir, "art", pkg_dir, str);
+					oldFile = AJOIN(&scratch, delta_stg.cache_dir, "art", pkg_dir, str);
 					squashfsDone = 1;
 				}
 
@@ -327,6 +487,8 @@ int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const cha
 				A_INFO_MSG("diffFile: %s", diffFile);
 				A_INFO_MSG("newFile: %s", newFile);
 
+				TRACE_START(t_entry);
+
 				if (di->type == DT_ADDED) {
 					if (verify_file(diffFile, di->sha256.new) || copy_file(diffFile, newFile)) err = E_UA_ERR;
 
@@ -335,27 +497,33 @@ int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const cha
 
 				} else if (di->type == DT_CHANGED) {
 					if(squashfsDone)  {
-						if (delta_patch(di, oldFile, newFile, diffFile)) err = E_UA_ERR;
+						if (delta_patch(di, oldFile, newFile, diffFile, &journal)) err = E_UA_ERR;
 					} else {
-						if (verify_file(oldFile, di->sha256.old) || delta_patch(di, oldFile, newFile, diffFile) || verify_file(newFile, di->sha256.new)) err = E_UA_ERR;
+						if (verify_file(oldFile, di->sha256.old) || delta_patch(di, oldFile, newFile, diffFile, &journal) || verify_file(newFile, di->sha256.new)) err = E_UA_ERR;
 					}
 				}
 
-				if (!access(oldFile, R_OK))
-					remove(oldFile);
-				if (!access(diffFile, R_OK))
-					remove(diffFile);
+				TRACE_SPAN(t_entry, TRACE_CAT_DELTA, di->type == DT_CHANGED ? "patch-entry" : "copy-entry", di->name, trace_file_size(newFile));
 
 				if(squashfsDone) {
-					if(di->nesting.un_squash_fs.un_squash_fs && di->nesting.squash_fs_uncompressed.squash_fs_uncompressed && di->nesting.single_file_delta.single_file_delta) {
+					// the rebuilt image is written under the name of this unpacked reference copy
+					if (!access(oldFile, R_OK))
+						remove(oldFile);
+					if(!err && di->nesting.un_squash_fs.un_squash_fs && di->nesting.squash_fs_uncompressed.squash_fs_uncompressed && di->nesting.single_file_delta.single_file_delta) {
 						if (process_squashfs_image(newFile, di, pkg_dir, 1) != E_UA_OK) err = E_UA_ERR;
 					}
 					squashfsDone = 0;		
 				}
 
-				free(oldFile);
-				free(diffFile);
-				free(newFile);
+				// inputs go only once the entry is recorded, a restart before that needs them
+				if (!err && di->type != DT_REMOVED && journal_step(&journal, RJ_DONE, di->name, newFile)) err = E_UA_ERR;
+
+				if (!access(oldFile, R_OK))
+					remove(oldFile);
+				if (!access(diffFile, R_OK))
+					remove(diffFile);
+
+				arena_rewind(&scratch, mark);
 
 			}
 
@@ -366,39 +534,388 @@ int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const cha
 
 		if (!err) {
 			rmdirp(oldPath);
+			// the diff directory stays until the package is written, a restart reads its manifest
 			BOLT_IF(copy_file(manifest_diff, manifest_new), E_UA_ERR, "failed to copy manifest");
-			rmdirp(diffPath);
-			BOLT_IF(zip(newPkgFile, newPath), E_UA_ERR, "zip failed: %s", newPkgFile);
+			tstart = currentms();
+			BOLT_IF(zip(newPkgFile, newPath, &delta_stg.zip_cfg), E_UA_ERR, "zip failed: %s", newPkgFile);
+			if (!stat(newPkgFile, &st))
+				observe_rate(M_ZIP_KBPS, st.st_size, tstart);
 
 		}
 
 	} while (0);
 
-	char* tempDir = JOIN(delta_stg.cache_dir, "art", pkg_dir);
+	pkg_close(oldPkg);
+
+	// finished or failed, the next attempt starts over; the journal goes before what it describes
+	rjournal_close(&journal, 1);
+
+	char* tempDir = AJOIN(&scratch, delta_stg.cache_dir, "art", pkg_dir);
 	if (!access(tempDir, R_OK)) {
 		rmdirp(tempDir);
 		
 	}
 
 #define DTR_RM(type) \
-	if ((type ## Path) ) { if (!access(type ## Path, F_OK) && rmdirp(type ## Path)) A_ERROR_MSG("error removing directory %s", type ## Path); free(type ## Path); } \
-	Z_FREE(manifest_ ## type); do { } while (0)
+	if ((type ## Path) ) { if (!access(type ## Path, F_OK) && rmdirp(type ## Path)) A_ERROR_MSG("error removing directory %s", type ## Path); } \
+	do { } while (0)
 
 	DTR_RM(old);
 	DTR_RM(diff);
 	DTR_RM(new);
 
 #undef DTR_RM
-	p = JOIN(top_delta_dir, pkg_dir);
-	rmdir(p);
-	f_free(p);
-	f_free(pkg_dir);
-	f_free(top_delta_dir);
-	Z_FREE(diff_manifest);
+	if (delta_pkg_dir)
+		rmdir(delta_pkg_dir);
+	TRACE_SPAN(t_recon, TRACE_CAT_DELTA, "reconstruct", pkg_dir, trace_file_size(newPkgFile));
+
+	arena_release(&scratch);
+
+	return err;
+}
+
+
+#define PLAN_PROBE_SIZE (8 << 20)
+
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Measure once how fast the device holding cache_dir writes and reads a
+ * few MiB, through the page cache but synced and dropped in between.
+ */
+static void probe_throughput(uint32_t* read_kbps, uint32_t* write_kbps)
+{
+	char* file = 0;
+	char* buf  = 0;
+	int fd     = -1;
+	uint64_t t, ms;
+	ssize_t n;
+	size_t done;
+
+	pthread_mutex_lock(&probe_lock);
+
+	do {
+		if (delta_stg.write_kbps)
+			break;
+
+		// a failed probe is not repeated, a nominal 100 MB/s stands in
+		delta_stg.read_kbps = delta_stg.write_kbps = 100 * 1024;
+
+		file = f_asprintf("%s/.probe.XXXXXX", delta_stg.cache_dir);
+		if ((fd = mkstemp(file)) < 0) {
+			A_WARN_MSG("failed to create probe file %s: %s", file, strerror(errno));
+			break;
+		}
+		unlink(file);
+		buf = f_malloc(ua_rw_buff_size);
+
+		t = currentms();
+		for (done = 0; done < PLAN_PROBE_SIZE; done += n)
+			if ((n = write(fd, buf, ua_rw_buff_size)) <= 0) break;
+		if (done < PLAN_PROBE_SIZE || fdatasync(fd)) {
+			A_WARN_MSG("failed to write probe file in %s", delta_stg.cache_dir);
+			break;
+		}
+		if ((ms = currentms() - t))
+			delta_stg.write_kbps = done * 1000 / 1024 / ms;
+
+#ifdef POSIX_FADV_DONTNEED
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+		t = currentms();
+		for (done = 0; done < PLAN_PROBE_SIZE; done += n)
+			if ((n = pread(fd, buf, ua_rw_buff_size, done)) <= 0) break;
+		if ((ms = currentms() - t))
+			delta_stg.read_kbps = done * 1000 / 1024 / ms;
+
+		A_INFO_MSG("Throughput of %s: read %u KB/s, write %u KB/s", delta_stg.cache_dir, delta_stg.read_kbps, delta_stg.write_kbps);
+
+	} while (0);
+
+	*read_kbps  = delta_stg.read_kbps;
+	*write_kbps = delta_stg.write_kbps;
+
+	pthread_mutex_unlock(&probe_lock);
+
+	if (fd >= 0) close(fd);
+	f_free(file);
+	f_free(buf);
+}
+
+static inline uint64_t u64_max(uint64_t a, uint64_t b)
+{
+	return a > b ? a : b;
+}
+
+static inline uint64_t u64_min(uint64_t a, uint64_t b)
+{
+	return a < b ? a : b;
+}
+
+static uint64_t io_ms(uint64_t bytes, uint32_t kbps)
+{
+	return kbps ? bytes * 1000 / ((uint64_t)kbps * 1024) : 0;
+}
+
+/*
+ * Average of a rate observed by earlier reconstructions, in KB per second,
+ * 0 if there is none yet.
+ */
+static uint32_t seen_kbps(int id)
+{
+	ua_metric_t m;
+
+	// samples are in bytes per ms
+	if (metrics_read(id, &m) || m.value <= 0 || m.sum <= 0)
+		return 0;
+
+	return (uint64_t)m.sum / m.value * 1000 / 1024;
+}
+
+/*
+ * Whether an entry is decompressed into a .z file next to its diff member
+ * before patching, as delta_patch() does.
+ */
+static int plan_has_tmp(diff_info_t* di)
+{
+	delta_tool_hh_t* patchdth = 0;
+
+	if (!strcmp(di->compression, "none"))
+		return 0;
+
+	if (strcmp(di->format, "none"))
+		HASH_FIND_STR(delta_stg.patch_tool, di->format, patchdth);
+	if (patchdth && patchdth->tool.intl)
+		return 0;
+#ifdef SUPPORT_BUILTIN_DECOMP
+	// without a patch step a built-in decompressor writes the new file itself
+	if (!patchdth && decomp_supported(di->compression))
+		return 0;
+#endif
+	return 1;
+}
+
+/*
+ * Memory of a built-in decompressor: the default zstd and lz4 windows, a
+ * single-threaded xz decoder at preset 9, or the limit of the threaded one.
+ */
+static uint64_t plan_mem_decomp(const char* compression)
+{
+#ifdef SUPPORT_BUILTIN_DECOMP
+	if (decomp_supported(compression))
+		return 8 << 20;
+#endif
+#ifdef SHELL_COMMAND_DISABLE
+	if (!strcmp(compression, "xz")) {
+		if (delta_stg.xz_threads == 1)
+			return 65 << 20;
+		return delta_stg.xz_memlimit ? delta_stg.xz_memlimit : (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4;
+	}
+#endif
+	XL4_UNUSED(compression);
+	return 0;
+}
+
+static uint64_t plan_zip_size(pkg_entry_t* pe, uint64_t size)
+{
+	if (!pe || !pe->size)
+		return size;
+
+	return size * pe->comp_size / pe->size;
+}
+
+int delta_plan_ph(const char* oldPkgFile, pkg_handle_t* diffPkg, const char* newPkgFile, ua_delta_plan_t* plan)
+{
+	int err = E_UA_OK;
+	pkg_handle_t* oldPkg = 0;
+	pkg_entry_t* oe, * de;
+	diff_info_t* di, * diList = 0;
+	ua_delta_plan_entry_t* pe;
+	const char* manifest;
+	char* dir = 0;
+	struct statvfs vfs;
+	struct stat cs, ns;
+	ua_budget_t budget;
+	uint64_t disk, left_old, zip_size = 0, mem;
+	uint64_t o, d, n, tmp;
+	uint32_t patch_kbps = seen_kbps(M_PATCH_KBPS);
+	int i, zip_threads, zip_local = 1;
+
+	memset(plan, 0, sizeof(ua_delta_plan_t));
+
+	do {
+		BOLT_IF(!delta_stg.cache_dir, E_UA_ERR, "delta is not initialized");
+		BOLT_IF(!(oldPkg = pkg_open(oldPkgFile)), E_UA_ERR, "failed to open %s", oldPkgFile);
+		BOLT_IF(!(manifest = pkg_manifest_diff(diffPkg)), E_UA_ERR, "no %s in %s", MANIFEST_DIFF, diffPkg->file);
+		BOLT_IF(parse_diff_manifest_buf(manifest, &diList), E_UA_ERR, "failed to parse %s of %s", MANIFEST_DIFF, diffPkg->file);
+
+		BOLT_SYS(statvfs(delta_stg.cache_dir, &vfs), "failed to get file system status of %s", delta_stg.cache_dir);
+		plan->free_disk = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+
+		// the new package counts only when written to the same file system
+		if (newPkgFile && (dir = f_dirname(newPkgFile)) && !stat(dir, &ns) && !stat(delta_stg.cache_dir, &cs))
+			zip_local = ns.st_dev == cs.st_dev;
+
+		probe_throughput(&plan->read_kbps, &plan->write_kbps);
+		scheduler_get_budget(&budget);
+		if (budget.io_kbps > 0) {
+			if (plan->read_kbps > (uint32_t)budget.io_kbps) plan->read_kbps = budget.io_kbps;
+			if (plan->write_kbps > (uint32_t)budget.io_kbps) plan->write_kbps = budget.io_kbps;
+		}
+
+		// both packages are extracted first
+		disk = 0;
+		for (i = 0; i < oldPkg->entry_cnt; i++) {
+			disk += oldPkg->entries[i].size;
+			plan->read_bytes += oldPkg->entries[i].comp_size;
+		}
+		left_old = disk;
+		for (i = 0; i < diffPkg->entry_cnt; i++) {
+			disk += diffPkg->entries[i].size;
+			plan->read_bytes += diffPkg->entries[i].comp_size;
+		}
+		plan->write_bytes = disk;
+		plan->peak_disk   = disk;
+		plan->est_ms      = u64_max(io_ms(plan->read_bytes, plan->read_kbps) + io_ms(plan->write_bytes, plan->write_kbps),
+		                            io_ms(disk, seen_kbps(M_UNZIP_KBPS)));
+
+		DL_COUNT(diList, di, plan->entry_cnt);
+		plan->entries = f_malloc(plan->entry_cnt * sizeof(ua_delta_plan_entry_t));
+
+		mem = (uint64_t)(ua_io_depth > 1 ? ua_io_depth : 1) * ua_rw_buff_size;
+		pe  = plan->entries;
+		DL_FOREACH(diList, di) {
+			oe  = pkg_find_entry(oldPkg, di->old_name ? di->old_name : di->name);
+			de  = pkg_find_entry(diffPkg, di->name);
+			o   = (oe && di->type != DT_ADDED) ? oe->size : 0;
+			d   = (de && di->type != DT_UNCHANGED && di->type != DT_REMOVED) ? de->size : 0;
+			tmp = 0;
+
+			pe->name   = f_strdup(di->name);
+			pe->change = di->type == DT_ADDED ? "added" : di->type == DT_REMOVED ? "removed" :
+			             di->type == DT_CHANGED ? "changed" : "unchanged";
+
+			if (di->type == DT_ADDED) {
+				n               = d;
+				pe->read_bytes  = 2 * d;
+				pe->write_bytes = n;
+
+			} else if (di->type == DT_UNCHANGED) {
+				n               = o;
+				pe->read_bytes  = 2 * o;
+				pe->write_bytes = n;
+
+			} else if (di->type == DT_CHANGED) {
+				// the manifest carries no sizes, the patch rebuilds roughly the larger of the two
+				n   = u64_max(o, d);
+				tmp = plan_has_tmp(di) ? n : 0;
+				pe->read_bytes  = o + d + tmp + (strcmp(di->format, "none") ? o : 0) + n;
+				pe->write_bytes = tmp + n;
+				if (strcmp(di->compression, "none"))
+					mem = u64_max(mem, plan_mem_decomp(di->compression));
+#ifdef SHELL_COMMAND_DISABLE
+				if (strcmp(di->format, "none"))
+					mem = u64_max(mem, 5 << 20);
+#endif
+			} else {
+				n = 0;
+			}
+
+			// an unpacked squashfs image is kept next to the reference while patching
+			if (di->nesting.un_squash_fs.un_squash_fs)
+				tmp += o;
+
+			pe->new_size = n;
+			pe->est_ms   = io_ms(pe->read_bytes, plan->read_kbps) + io_ms(pe->write_bytes, plan->write_kbps);
+			if (di->type == DT_CHANGED && strcmp(di->format, "none") && patch_kbps)
+				pe->est_ms = u64_max(pe->est_ms, io_ms(n, patch_kbps));
+
+			// the new entry is complete before its inputs are removed
+			plan->peak_disk = u64_max(plan->peak_disk, disk + n + tmp);
+			disk            = disk + n - u64_min(disk + n, o + d);
+			left_old       -= u64_min(left_old, o);
+
+			plan->new_pkg_size += n;
+			plan->read_bytes   += pe->read_bytes;
+			plan->write_bytes  += pe->write_bytes;
+			plan->est_ms       += pe->est_ms;
+
+			if (n)
+				zip_size += plan_zip_size(oe ? oe : de, n);
+			pe++;
+		}
+
+		// entries of the old package not in the manifest go with its directory
+		disk -= u64_min(disk, left_old);
+
+		// members are streamed into the archive
+		if (zip_local)
+			plan->peak_disk = u64_max(plan->peak_disk, disk + zip_size);
+		plan->read_bytes  += plan->new_pkg_size;
+		plan->write_bytes += zip_size;
+		plan->est_ms      += u64_max(io_ms(plan->new_pkg_size, plan->read_kbps) + io_ms(zip_size, plan->write_kbps),
+		                             io_ms(zip_size, seen_kbps(M_ZIP_KBPS)));
+
+		// a worker reads a block with its dictionary into a deflate state, and
+		// two blocks per worker wait for the writer
+		zip_threads = delta_stg.zip_cfg.threads > 0 ? delta_stg.zip_cfg.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (zip_threads > ZIPW_MAX_THREADS) zip_threads = ZIPW_MAX_THREADS;
+		if (zip_threads < 1) zip_threads = 1;
+		plan->peak_mem = u64_max(mem, (uint64_t)zip_threads * (3 * ZIPW_BLOCK_SIZE + (288 << 10)) + ua_rw_buff_size);
+
+	} while (0);
+
+	while ((di = diList)) {
+		DL_DELETE(diList, di);
+		free_diff_info(di);
+	}
+	f_free(dir);
+	pkg_close(oldPkg);
+
+	if (err)
+		delta_plan_free(plan);
 
 	return err;
 }
 
+int delta_plan(const char* oldPkgFile, const char* diffPkgFile, const char* newPkgFile, ua_delta_plan_t* plan)
+{
+	int err          = E_UA_ERR;
+	pkg_handle_t* ph = pkg_open(diffPkgFile);
+
+	memset(plan, 0, sizeof(ua_delta_plan_t));
+
+	if (ph) {
+		err = delta_plan_ph(oldPkgFile, ph, newPkgFile, plan);
+		pkg_close(ph);
+	}
+
+	return err;
+}
+
+void delta_plan_free(ua_delta_plan_t* plan)
+{
+	for (int i = 0; i < plan->entry_cnt; i++)
+		f_free(plan->entries[i].name);
+	Z_FREE(plan->entries);
+	plan->entry_cnt = 0;
+}
+
+#ifndef SHELL_COMMAND_DISABLE
+/*
+ * A built-in decompressor does not need its command line tool installed.
+ */
+static int is_builtin_decomp(const delta_tool_t* tool, int isPatchTool)
+{
+#ifdef SUPPORT_BUILTIN_DECOMP
+	return !isPatchTool && tool->intl && decomp_supported(tool->algo);
+#else
+	XL4_UNUSED(tool);
+	XL4_UNUSED(isPatchTool);
+	return 0;
+#endif
+}
+#endif
 
 static int add_delta_tool(delta_tool_hh_t** hash, const delta_tool_t* tool, int count, int isPatchTool)
 {
@@ -408,7 +925,7 @@ static int add_delta_tool(delta_tool_hh_t** hash, const delta_tool_t* tool, int
 	for (i = 0; i < count; i++) {
 		if (S((tool + i)->algo) && S((tool + i)->path) && S((tool + i)->args) &&
 #ifndef SHELL_COMMAND_DISABLE
-		    !is_cmd_runnable((tool + i)->path) &&
+		    (is_builtin_decomp(tool + i, isPatchTool) || !is_cmd_runnable((tool + i)->path)) &&
 #endif
 		    (SUBSTRCNT((tool + i)->args, OFA) == 1) && (SUBSTRCNT((tool + i)->args, NFA) == 1) && (SUBSTRCNT((tool + i)->args, PFA) == (isPatchTool ? 1 : 0))) {
 			dth            = f_malloc(sizeof(delta_tool_hh_t));
@@ -567,6 +1084,10 @@ static char* get_deflt_delta_cap(delta_tool_hh_t* patchTool, delta_tool_hh_t* de
 	if (dth) strcat(compression, "2,");
 	HASH_FIND_STR(decompTool, "xz", dth);
 	if (dth) strcat(compression, "3,");
+	HASH_FIND_STR(decompTool, "zstd", dth);
+	if (dth) strcat(compression, "4,");
+	HASH_FIND_STR(decompTool, "lz4", dth);
+	if (dth) strcat(compression, "5,");
 
 	if (strlen(format) > 2)
 		format[strlen(format) - 1] = ';';
@@ -614,7 +1135,23 @@ __attribute__((unused)) static char* expand_tool_args(const char* args, const ch
 	return res;
 }
 
-static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new, const char* diff)
+#ifdef SHELL_COMMAND_DISABLE
+typedef struct journal_entry {
+	rjournal_t* journal;
+	const char* name;
+
+} journal_entry_t;
+
+static void entry_in_place(void* arg)
+{
+	journal_entry_t* je = (journal_entry_t*)arg;
+
+	// without the record a restart patches the entry again from the old file
+	rjournal_add(je->journal, RJ_IN_PLACE, je->name);
+}
+#endif
+
+static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new, const char* diff, rjournal_t* journal)
 {
 	int err     = E_UA_OK;
 	char* diffp = 0;
@@ -625,6 +1162,8 @@ static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new,
 #endif
 	delta_tool_hh_t* decompdth, * patchdth = 0;
 
+	scheduler_enter(SCHED_CPU);
+
 	do {
 #ifndef SHELL_COMMAND_DISABLE
 #define TOOL_EXEC(_t, _o, _n, _p) { \
@@ -644,23 +1183,65 @@ static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new,
 		if (strcmp(diffInfo->compression, "none") && !(patchdth && patchdth->tool.intl)) {
 			HASH_FIND_STR(delta_stg.decomp_tool, diffInfo->compression, decompdth);
 			BOLT_IF(!decompdth, E_UA_ERR, "Decompression %s not found", diffInfo->compression);
-			diffp = f_asprintf("%s%s", diff, ".z");
+#ifdef SUPPORT_BUILTIN_DECOMP
+			if (decompdth->tool.intl && decomp_supported(diffInfo->compression)) {
+				// without a patch step the member is decompressed straight into place
+				diffp = patchdth ? f_asprintf("%s%s", diff, ".z") : NULL;
+				err   = decomp_file(diffInfo->compression, diff, diffp ? diffp : new);
+				if (err) { A_INFO_MSG("Decompression failed"); break; }
+				if (!patchdth) break;
+			} else
+#endif
+			{
+				diffp = f_asprintf("%s%s", diff, ".z");
 #ifndef SHELL_COMMAND_DISABLE
-			TOOL_EXEC(decompdth, diff, diffp, 0);
+				TOOL_EXEC(decompdth, diff, diffp, 0);
 #else
-			err = xzdec(diff, diffp);
+				// decoder threads beyond the job's own CPU slot come out of the budget
+				int want  = delta_stg.xz_threads ? delta_stg.xz_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+				int extra = scheduler_claim(SCHED_CPU, want - 1);
+				err = xzdec_ex(diff, diffp, &(xzdec_cfg_t){.threads = 1 + extra, .memlimit = delta_stg.xz_memlimit});
+				scheduler_release(SCHED_CPU, extra);
 #endif
-			if (err) { A_INFO_MSG("Decompression failed"); break; }
+				if (err) { A_INFO_MSG("Decompression failed"); break; }
+			}
 		}
 
 		if (patchdth) {
+			uint64_t tstart = currentms();
+			struct stat st;
 			chkdirp(new);
 #ifndef SHELL_COMMAND_DISABLE
 			TOOL_EXEC(patchdth, old, new, diffp ? diffp : diff);
 #else
-			err = espatch(old, new, diffp ? diffp : diff);
+			journal_entry_t je = {.journal = journal, .name = diffInfo->name};
+			int resumed        = 0;
+
+			if (pthread_mutex_trylock(&intl_tool_lock)) {
+				// do not hold a CPU slot while another espatch run has the tool
+				scheduler_leave(SCHED_CPU);
+				pthread_mutex_lock(&intl_tool_lock);
+				scheduler_enter(SCHED_CPU);
+			}
+			if (journal && rjournal_has(journal, RJ_IN_PLACE, diffInfo->name)) {
+				if ((resumed = !espatch_resume(new, diffp ? diffp : diff)))
+					A_INFO_MSG("Resumed patching %s in place", diffInfo->name);
+				else
+					A_INFO_MSG("Resuming %s failed, patching it again", diffInfo->name);
+			}
+			if (!resumed)
+				err = espatch_journal(old, new, diffp ? diffp : diff, delta_stg.patch_mode, journal ? entry_in_place : NULL, &je);
+			pthread_mutex_unlock(&intl_tool_lock);
 #endif
 			if (err) { A_INFO_MSG("Patching failed"); break; }
+
+			uint64_t tpatch = currentms() - tstart;
+			if (!stat(new, &st)) {
+				metrics_add(M_BYTES_PATCHED, st.st_size);
+				metrics_observe(M_PATCH_MS, tpatch);
+				if (tpatch)
+					metrics_observe(M_PATCH_KBPS, st.st_size / tpatch);
+			}
 		} else {
 			BOLT_SUB(copy_file(diffp ? diffp : diff, new));
 		}
@@ -669,7 +1250,13 @@ static int delta_patch(diff_info_t* diffInfo, const char* old, const char* new,
 #endif
 	} while (0);
 
-	if (diffp) free(diffp);
+	scheduler_leave(SCHED_CPU);
+
+	if (diffp) {
+		// the decompressed patch is only needed by this entry
+		remove(diffp);
+		free(diffp);
+	}
 
 	return err;
 }
@@ -8,6 +8,8 @@
 
 #include "misc.h"
 #include "uthash.h"
+#include "zipwriter.h"
+#include "package.h"
 #ifdef LIBUA_VER_2_0
 #include "esyncua.h"
 #else
@@ -83,6 +85,14 @@ typedef struct delta_stg {
 	delta_tool_hh_t* patch_tool;
 	delta_tool_hh_t* decomp_tool;
 	int use_external_algo;
+	int patch_mode;
+	int space_check;
+	// throughput of cache_dir, probed once for planning
+	uint32_t read_kbps;
+	uint32_t write_kbps;
+	int xz_threads;
+	uint64_t xz_memlimit;
+	zipw_cfg_t zip_cfg;
 } delta_stg_t;
 
 
@@ -96,8 +106,19 @@ void delta_stop(void);
 const char* get_delta_capability(void);
 int is_delta_package(const char* pkgFile);
 int is_prepared_delta_package(char* archive);
+int is_delta_package_ph(pkg_handle_t* ph);
+int is_prepared_delta_package_ph(pkg_handle_t* ph);
 int delta_reconstruct(const char* oldPkgFile, const char* diffPkgFile, const char* newPkgFile);
+int delta_reconstruct_ph(const char* oldPkgFile, pkg_handle_t* diffPkg, const char* newPkgFile);
 int delta_use_external_algo(void);
+
+/*
+ * Estimate disk, memory, I/O and time of a reconstruction from the
+ * manifest and the ZIP central directories, nothing is extracted.
+ */
+int delta_plan(const char* oldPkgFile, const char* diffPkgFile, const char* newPkgFile, ua_delta_plan_t* plan);
+int delta_plan_ph(const char* oldPkgFile, pkg_handle_t* diffPkg, const char* newPkgFile, ua_delta_plan_t* plan);
+void delta_plan_free(ua_delta_plan_t* plan);
 void free_diff_info(diff_info_t* di);
 void free_delta_tool_hh (delta_tool_hh_t* dth);
 int process_squashfs_image (const char* squashFile, diff_info_t* di, const char* pkg_dir, bool repackaging);
@@ -1,8 +1,53 @@
 #ifndef __DELTA_UTILS__
 #define __DELTA_UTILS__
 
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct xzdec_cfg {
+	// decoder threads, 0 = number of online CPUs, 1 = single-threaded decoder
+	uint32_t threads;
+	// memory above which the threaded decoder uses fewer threads, 0 = a quarter of RAM
+	uint64_t memlimit;
+	// size of each of the input and output buffers, 0 = 1 MiB
+	size_t buf_size;
+} xzdec_cfg_t;
+
 int xzdec(const char *infile, const char *outfile);
+
+/*
+ * Decompress infile into outfile. Without cfg the stream is decoded by a
+ * single thread. Multi-threaded decoding needs liblzma 5.4 or later.
+ */
+int xzdec_ex(const char *infile, const char *outfile, const xzdec_cfg_t *cfg);
 const char *espatch_get_version(void);
 int espatch(const char *oldfile, const char *newfile, const char *patchfile);
 
+enum espatch_mode {
+	ESPATCH_AUTO,         // out of place, retried in place if that fails
+	ESPATCH_OUT_OF_PLACE, // reference is only read, new file is written from scratch
+	ESPATCH_IN_PLACE,     // new file starts as a reflink or copy of the reference
+};
+
+/*
+ * Patch the reference into the new file. When both name the same file
+ * (a flash bank) it is patched in place regardless of mode.
+ */
+int espatch_ex(const char *oldfile, const char *newfile, const char *patchfile, enum espatch_mode mode);
+
+/*
+ * Like espatch_ex. When the new file holds a synced copy of the reference
+ * and is about to be patched in place, in_place(arg) is called; from then
+ * on every write is synced, and a run cut short by power loss can be
+ * finished with espatch_resume().
+ */
+int espatch_journal(const char *oldfile, const char *newfile, const char *patchfile, enum espatch_mode mode,
+                    void (*in_place)(void *arg), void *arg);
+
+/*
+ * Finish an interrupted in-place run on newfile, through the decoder's
+ * power interruption support. Fails if the image can not be recovered.
+ */
+int espatch_resume(const char *newfile, const char *patchfile);
+
 #endif
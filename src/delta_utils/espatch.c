@@ -23,6 +23,11 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 #ifdef LIBUA_VER_2_0
 	#include "esyncua.h"
@@ -34,21 +39,26 @@
 
 #define ESPERROR_STRINGS
 #include "esdeltadec.h"
+#include "../bulkio.h"
+#include "../scheduler.h"
 
 #include "common.h"
+#include "delta_utils.h"
 
 #define XSTR(s) str(s)
 #define str(s) #s
 #define SRCREF  __FILE__"("XSTR(__LINE__)")"
-static int verbose=0;
+static const int verbose=1;
 
 #define dbprintf   if (verbose>0) printf
 #define db2printf  if (verbose>1) printf
 #define db3printf  if (verbose>2) printf
 #define db4printf  if (verbose>3) printf
 
-static size_t g_total_mem=0;
-static size_t g_total_max=0;
+// the decoder allocates on the thread running espatch, so usage is per run
+static __thread size_t g_total_mem=0;
+static __thread size_t g_total_max=0;
+static pthread_once_t dbg_level_once = PTHREAD_ONCE_INIT;
 
 XL4_PUB void* es_malloc(size_t size,const char *srcref)
 {
@@ -79,21 +89,29 @@ XL4_PUB void es_free(void* ptr,const char *srcref)
 
 static bool __copyfile(int fdsrc, int fddst)
 {
-	uint8_t *buffer;
-	const size_t buf_size = 16384;
-	size_t n;
-	buffer = (uint8_t *)malloc(buf_size);
-	if (!buffer) return false;
-	do {
-		n = read(fdsrc, buffer, buf_size);
-		if (n>0)
-			n = write(fddst, buffer, n);
-	} while (n>0);
-	free(buffer);
+	bool ok = bulk_copy(fdsrc, fddst, 0, NULL) == 0;
 	lseek(fddst, 0, SEEK_SET);
-	return n>=0;
+	return ok;
+}
+
+// share the reference extents when the file system supports it, copy otherwise
+static bool __clonefile(int fdsrc, int fddst)
+{
+#ifdef FICLONE
+	if (!ioctl(fddst, FICLONE, fdsrc)) {
+		dbprintf("Reference reflinked\n");
+		return true;
+	}
+#endif
+	return __copyfile(fdsrc, fddst);
 }
 
+enum esprun {
+	ESPRUN_OUT_OF_PLACE,  // reference read as is, only the new image is written
+	ESPRUN_CLONE,         // new image starts as a clone of the reference
+	ESPRUN_FLASH,         // reference and new image are the same bank
+};
+
 struct espatchctx {
 	int  reffd;
 	int  newfd;
@@ -103,9 +121,13 @@ struct espatchctx {
 	bool checkreadref;
 	offset_t pwr_interrupt_pos;
 	size_t newsize;
+	// new image is synced after every write, so an interrupted in-place run can resume
+	bool durable;
 
 	uint8_t *scratchbuf;
 	size_t  scratchsize;
+
+	uint8_t *erasebuf;
 };
 
 static size_t scratchmem_readblock(struct espatchctx *ctx, offset_t blkoffset, uint8_t* buffer, size_t length)
@@ -121,10 +143,11 @@ static size_t scratchmem_readblock(struct espatchctx *ctx, offset_t blkoffset, u
 static size_t scratchmem_eraseblock(struct espatchctx *ctx, offset_t blkoffset, size_t length)
 {
 	if ((blkoffset + length) > ctx->scratchsize) {
-		ctx->scratchbuf = realloc(ctx->scratchbuf, blkoffset + length);
-		if (ctx->scratchbuf == NULL) {
+		uint8_t *buf = realloc(ctx->scratchbuf, blkoffset + length);
+		if (buf == NULL) {
 			return (size_t)0;
 		}
+		ctx->scratchbuf = buf;
 		ctx->scratchsize = blkoffset + length;
 	}
 	db2printf("Erase scrmem %zu, %zu\n",blkoffset,length);
@@ -138,10 +161,11 @@ static size_t scratchmem_writeblock(struct espatchctx *ctx,
                                     size_t length)
 {
 	if (blkoffset + length > ctx->scratchsize) {
-		ctx->scratchbuf = realloc(ctx->scratchbuf, blkoffset + length);
-		if (ctx->scratchbuf == NULL) {
+		uint8_t *buf = realloc(ctx->scratchbuf, blkoffset + length);
+		if (buf == NULL) {
 			return (size_t)0;
 		}
+		ctx->scratchbuf = buf;
 		ctx->scratchsize = blkoffset + length;
 	}
 	db2printf("Write scrmem %zu, %zu\n",blkoffset,length);
@@ -163,6 +187,7 @@ size_t flash_readblock (void* user,
 	assert(fd > 0);
 	lseek(fd,blkoffset,SEEK_SET);
 	size_t n = read(fd,buffer,length);
+	scheduler_pace(length);
 	if (n < length && (bank==efb_new)) {
 		// incase new file is smaller than expected (happens with resume testing)
 		// then fill to end with crap.
@@ -178,16 +203,18 @@ size_t flash_eraseblock(void* user, enum espflashbank bank, offset_t blkoffset,
 	if (bank==efb_scratch && ctx->scratchbuf!=NULL) {
 		return scratchmem_eraseblock(ctx, blkoffset, length);
 	}
-	static uint8_t ffbuf[16384];
-	if (ffbuf[0] == 0) {
-		memset(ffbuf,0xff,sizeof(ffbuf));
+	const size_t erasebuf_size = 16384;
+	if (ctx->erasebuf == NULL) {
+		if ((ctx->erasebuf = malloc(erasebuf_size)) == NULL)
+			return (size_t)0;
+		memset(ctx->erasebuf,0xff,erasebuf_size);
 	}
 	int fd = (bank==efb_new) ? ctx->newfd : (bank==efb_ref) ? ctx->reffd : ctx->scratchfd;
 	lseek(fd,blkoffset,SEEK_SET);
 	size_t len = length;
 	while (len) {
-		size_t nb = len < sizeof(ffbuf) ? len : sizeof(ffbuf);
-		if (write(fd,ffbuf,nb) != nb)
+		size_t nb = len < erasebuf_size ? len : erasebuf_size;
+		if (write(fd,ctx->erasebuf,nb) != nb)
 			break;
 		len -= nb;
 	}
@@ -218,20 +245,28 @@ size_t flash_writeblock(void* user, enum espflashbank bank, offset_t blkoffset,
 	len = write(fd,buffer,len);
 	if ((len > 0) && (bank==efb_new)) {
 		ctx->newsize = blkoffset + len;
+		if (ctx->durable && fdatasync(fd)) {
+			printf("Error syncing new file: %d\n",errno);
+			len = 0;
+		}
 	}
 	return len;
 }
 
-char* sprintsize(size_t size) {
-	static char buf[64];
+char* sprintsize(size_t size, char* buf, size_t buflen) {
 	if (size >= 1024*1024*20) {
-		snprintf(buf,sizeof(buf),"%d.%03dMiBytes",(uint32_t)(size/(1024*1024)),(uint32_t)(size%(1024*1024)/1024));
+		snprintf(buf,buflen,"%d.%03dMiBytes",(uint32_t)(size/(1024*1024)),(uint32_t)(size%(1024*1024)/1024));
 	} else {
-		snprintf(buf,sizeof(buf),"%d.%03dKiBytes",(uint32_t)(size/1024),(uint32_t)(size%1024));
+		snprintf(buf,buflen,"%d.%03dKiBytes",(uint32_t)(size/1024),(uint32_t)(size%1024));
 	}
 	return buf;
 }
 
+static void set_dbg_level(void)
+{
+	espDbgSetLevel(verbose);
+}
+
 const char *espatch_get_version(void)
 {
 	return ESDELTA_VERSION;
@@ -250,15 +285,14 @@ void read_file(int fd)
 	free(buf);
 }
 #endif
-int espatch(const char *reffile, const char *newfile, const char * patchfile)
+static enum esperr espatch_run(const char *reffile, const char *newfile, const char * patchfile, enum esprun run,
+                               void (*in_place)(void *arg), void *arg)
 {
-	bool test_inplace = false;
+	bool test_inplace = run != ESPRUN_OUT_OF_PLACE;
 	size_t inputbufsize=4096;
 	size_t test_power_interrupt_at=0;
 	bool   test_power_resume = false;
 	bool   fuzz_input = false;
-	bool   use_scratch_file = false;
-	const char *scratchfile=NULL;
 
 	uint8_t *inputbuffer = NULL;
 	uint8_t *esbuffer = NULL;
@@ -273,17 +307,16 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 
 	bzero(comment, sizeof(comment));
 
-	if (use_scratch_file) {
-		if (scratchfile == NULL) {
-			scratchfile = "/tmp/esp_scratch.flash";
-		}
-	}
-
 	enum esperr res=ESPERR_UNKOWN;
 	struct esp *esp=es_malloc(SIZEOF_ESP_STRUCT,SRCREF);
-	verbose = 1;
+	struct espflashaccess flash;
+	struct espatchctx espatchctx;
+
+	memset(&espatchctx, 0, sizeof(espatchctx));
+	g_total_mem = g_total_max = 0;
 	if (verbose) {
-		espDbgSetLevel(verbose);
+		// the level is global to the decoder library, set once for all runs
+		pthread_once(&dbg_level_once, set_dbg_level);
 	}
 
 	int patchfd=open(patchfile,O_RDONLY,0);
@@ -293,18 +326,14 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 		goto cleanup;
 	}
 
-	struct espflashaccess flash;
-	struct espatchctx espatchctx;
-
-	memset(&espatchctx, 0, sizeof(espatchctx));
-	espatchctx.newfd = open(newfile,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+	espatchctx.newfd = open(newfile,O_RDWR|O_CREAT|((run == ESPRUN_FLASH) ? 0 : O_TRUNC),S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
 	if (espatchctx.newfd < 0) {
 		printf("Error opening %s for writing\n",newfile);
 		res=ESPERR_READ;
 		goto cleanup;
 	}
 
-	if (test_power_resume) {
+	if (test_power_resume || run == ESPRUN_FLASH) {
 		espatchctx.reffd = espatchctx.newfd;
 	} else {
 		espatchctx.reffd = open(reffile,O_RDONLY);
@@ -319,17 +348,9 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 		}
 	}
 
-	if (use_scratch_file) {
-		espatchctx.scratchfd = open(scratchfile,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
-		if (espatchctx.scratchfd < 0) {
-			printf("Error opening %s for writing\n",scratchfile);
-			res=ESPERR_READ;
-			goto cleanup;
-		}
-	} else {
-		espatchctx.scratchsize= 16384;
-		espatchctx.scratchbuf = malloc(espatchctx.scratchsize);
-	}
+	// scratch flash is private memory of the run
+	espatchctx.scratchsize= 16384;
+	espatchctx.scratchbuf = malloc(espatchctx.scratchsize);
 
 	inputbuffer=es_malloc(inputbufsize,SRCREF);
 	if (!inputbuffer) goto cleanup;
@@ -342,10 +363,25 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 	rdbuf = (uint8_t *)malloc(rdbuf_size);
 	if (!rdbuf) goto cleanup;
 
-	test_inplace = true;
-	if (test_inplace && !test_power_resume) {
-		__copyfile(espatchctx.reffd, espatchctx.newfd);
+	if (test_inplace && !test_power_resume && run == ESPRUN_CLONE) {
+		if (!__clonefile(espatchctx.reffd, espatchctx.newfd)) {
+			printf("Error copying %s to %s\n",reffile,newfile);
+			res = ESPERR_READ;
+			goto cleanup;
+		}
+	}
+	if (test_inplace)
 		espatchctx.checkreadref = true;
+
+	if (in_place && test_inplace) {
+		// the reference copy has to be on disk before the caller may count on resuming
+		if (fsync(espatchctx.newfd)) {
+			printf("Error syncing %s\n",newfile);
+			res = ESPERR_READ;
+			goto cleanup;
+		}
+		espatchctx.durable = true;
+		in_place(arg);
 	}
 
 	espatchctx.pwr_interrupt_pos = test_power_interrupt_at;
@@ -382,6 +418,7 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 					res = ESPERR_EOF;
 					break;
 				}
+				scheduler_pace(len);
 				totalpatchlen += len;
 			}
 			res = espProcess(esp,inputbuffer, len+ix, &ix);
@@ -394,6 +431,7 @@ int espatch(const char *reffile, const char *newfile, const char * patchfile)
 	}
 cleanup:
 	if (espatchctx.reffd >= 0  && espatchctx.reffd != espatchctx.newfd) {
+		bulk_drop(espatchctx.reffd);
 		close(espatchctx.reffd);
 	}
 	if (espatchctx.scratchfd > 0) {
@@ -402,6 +440,9 @@ cleanup:
 	if (espatchctx.scratchbuf != NULL) {
 		free(espatchctx.scratchbuf);
 	}
+	if (espatchctx.erasebuf != NULL) {
+		free(espatchctx.erasebuf);
+	}
 
 	if (espatchctx.newfd > 0 && res >= ESPOK && espatchctx.newsize) {
 		dbprintf("Truncate %zu\n",espatchctx.newsize);
@@ -416,8 +457,15 @@ cleanup:
 			printf("Error truncating new file: %d\n",errno);
 		}
 	}
-	if (espatchctx.newfd > 0) close(espatchctx.newfd);
-	if (patchfd > 0) close(patchfd);
+	if (espatchctx.newfd > 0) {
+		off_t mark = 0;
+		bulk_written(espatchctx.newfd, &mark, lseek(espatchctx.newfd, 0, SEEK_END), 1);
+		close(espatchctx.newfd);
+	}
+	if (patchfd > 0) {
+		bulk_drop(patchfd);
+		close(patchfd);
+	}
 	if (res >= ESPOK) {
 		espatchctx.newfd=open(newfile,O_RDONLY);
 		if (espCheckNew(esp)) {
@@ -426,6 +474,7 @@ cleanup:
 			printf("Error: New image SHA mismatch\n");
 			res = ESPERR_IMGSHA;
 		}
+		bulk_drop(espatchctx.newfd);
 		close(espatchctx.newfd);
 	} else {
 		printf("Error: %d,%s [line:%d]\n",res,str_esperr[res],espDbgGetErrorLine(esp));
@@ -442,6 +491,47 @@ cleanup:
 	if (wrbuf) free(wrbuf);
 
 	if (inputbuffer) es_free(inputbuffer, SRCREF);
+	if (esp) es_free(esp, SRCREF);
+
+	return res;
+}
+
+int espatch_journal(const char *reffile, const char *newfile, const char * patchfile, enum espatch_mode mode,
+                    void (*in_place)(void *arg), void *arg)
+{
+	struct stat rs, ns;
+	enum esperr res;
+
+	if (!stat(reffile, &rs) && !stat(newfile, &ns) && rs.st_dev == ns.st_dev && rs.st_ino == ns.st_ino) {
+		res = espatch_run(reffile, newfile, patchfile, ESPRUN_FLASH, NULL, NULL);
+
+	} else if (mode == ESPATCH_IN_PLACE) {
+		res = espatch_run(reffile, newfile, patchfile, ESPRUN_CLONE, in_place, arg);
+
+	} else {
+		res = espatch_run(reffile, newfile, patchfile, ESPRUN_OUT_OF_PLACE, NULL, NULL);
+		// a patch made for in-place application expects the reference in the new image
+		if (res < ESPOK && res != ESPERR_READ && mode == ESPATCH_AUTO) {
+			printf("Out-of-place patching failed, retrying in place\n");
+			res = espatch_run(reffile, newfile, patchfile, ESPRUN_CLONE, in_place, arg);
+		}
+	}
 
 	return !(res >= ESPOK);
 }
+
+int espatch_resume(const char *newfile, const char * patchfile)
+{
+	// the half patched image is both reference and target, as after power loss on a flash bank
+	return !(espatch_run(newfile, newfile, patchfile, ESPRUN_FLASH, NULL, NULL) >= ESPOK);
+}
+
+int espatch_ex(const char *reffile, const char *newfile, const char * patchfile, enum espatch_mode mode)
+{
+	return espatch_journal(reffile, newfile, patchfile, mode, NULL, NULL);
+}
+
+int espatch(const char *reffile, const char *newfile, const char * patchfile)
+{
+	return espatch_ex(reffile, newfile, patchfile, ESPATCH_AUTO);
+}
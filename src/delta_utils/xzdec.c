@@ -1,7 +1,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 //
 /// \file       xzdec.c
-/// \brief      Simple single-threaded tool to uncompress .xz or .lzma files
+/// \brief      Simple tool to uncompress .xz or .lzma files, optionally
+///             decoding the blocks of a multi-block stream in parallel
 //
 //  Author:     Lasse Collin
 //
@@ -17,7 +18,14 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include "delta_utils.h"
+#include "../bulkio.h"
+
+// I/O buffer size when the caller does not set one
+#define XZDEC_BUF_SIZE (1024 * 1024)
 
 static void my_errorf(const char *fmt, ...)
 {
@@ -29,24 +37,75 @@ static void my_errorf(const char *fmt, ...)
 	va_end(ap);
 }
 
-int  xzdec(const char *infile, const char *outfile)
+// Write all of buf, retrying short writes.
+static int write_all(int fd, const uint8_t *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		size -= (size_t)n;
+	}
+	return 0;
+}
+
+int xzdec(const char *infile, const char *outfile)
+{
+	return xzdec_ex(infile, outfile, NULL);
+}
+
+int xzdec_ex(const char *infile, const char *outfile, const xzdec_cfg_t *cfg)
 {
 	lzma_ret ret;
-	FILE *file = NULL, *out_file=NULL;
+	int in_fd = -1, out_fd = -1;
 	int err = -1;
-    lzma_action action = LZMA_RUN;
-	// The same lzma_stream is used for all files that we decode. This way
-	// we don't need to reallocate memory for every file if they use same
-	// compression settings.
+	lzma_action action = LZMA_RUN;
 	lzma_stream strm = LZMA_STREAM_INIT;
-	file = fopen(infile, "rb");
-	if (!file) return err;
-
-	out_file = fopen(outfile, "wb");
-	if (!out_file) goto error;
+	uint8_t *out_buf = NULL;
+	bulk_reader_t *in_br = NULL;
+	const size_t buf_size = (cfg && cfg->buf_size) ? cfg->buf_size : XZDEC_BUF_SIZE;
+	const uint32_t threads = cfg ? cfg->threads : 1;
+
+	in_fd = open(infile, O_RDONLY);
+	if (in_fd < 0) return err;
+
+	out_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) goto error;
+
+	// Input is read ahead while the decoder works on the previous block
+	in_br = bulk_open(in_fd, buf_size);
+	out_buf = malloc(buf_size);
+	if (!in_br || !out_buf) {
+		my_errorf("%s", strerror(ENOMEM));
+		goto error;
+	}
 
 	// Initialize the decoder
-	ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+#if LZMA_VERSION >= 50040002
+	if (threads != 1) {
+		// Blocks of a multi-block stream are decoded in parallel,
+		// a single-block stream is decoded by one thread. Above
+		// memlimit_threading the decoder uses fewer threads, down
+		// to one, instead of failing.
+		lzma_mt mt = { 0 };
+		uint64_t physmem = lzma_physmem();
+
+		mt.flags = LZMA_CONCATENATED;
+		mt.threads = threads ? threads : lzma_cputhreads();
+		if (mt.threads == 0)
+			mt.threads = 1;
+		mt.memlimit_threading = (cfg && cfg->memlimit) ? cfg->memlimit
+				: (physmem ? physmem / 4 : UINT64_MAX);
+		mt.memlimit_stop = UINT64_MAX;
+
+		ret = lzma_stream_decoder_mt(&strm, &mt);
+	} else
+#endif
+		ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
 	// The only reasonable error here is LZMA_MEM_ERROR.
 	if (ret != LZMA_OK) {
 		my_errorf("%s", ret == LZMA_MEM_ERROR ? strerror(ENOMEM)
@@ -54,30 +113,26 @@ int  xzdec(const char *infile, const char *outfile)
 		goto error;
 	}
 
-	// Input and output buffers
-	uint8_t in_buf[BUFSIZ];
-	uint8_t out_buf[BUFSIZ];
-
 	strm.avail_in = 0;
 	strm.next_out = out_buf;
-	strm.avail_out = BUFSIZ;
+	strm.avail_out = buf_size;
 	while (1) {
-		if (strm.avail_in == 0) {
-			strm.next_in = in_buf;
-			strm.avail_in = fread(in_buf, 1, BUFSIZ, file);
+		if (strm.avail_in == 0 && action == LZMA_RUN) {
+			const void *in_buf = NULL;
+			ssize_t n = bulk_next(in_br, &in_buf);
 
-			if (ferror(file)) {
-				// POSIX says that fread() sets errno if
-				// an error occurred. ferror() doesn't
-				// touch errno.
+			if (n < 0) {
 				my_errorf("%s: Error reading input file",
 						 strerror(errno));
 				goto error;
 			}
 
+			strm.next_in = in_buf;
+			strm.avail_in = (size_t)n;
+
 			// When using LZMA_CONCATENATED, we need to tell
 			// liblzma when it has got all the input.
-			if (feof(file))
+			if (n == 0)
 				action = LZMA_FINISH;
 		}
 
@@ -87,20 +142,19 @@ int  xzdec(const char *infile, const char *outfile)
 		// This way as much data as possible gets written to output
 		// even if decoder detected an error.
 		if (strm.avail_out == 0 || ret != LZMA_OK) {
-			const size_t write_size = BUFSIZ - strm.avail_out;
+			const size_t write_size = buf_size - strm.avail_out;
 
-			if (fwrite(out_buf, 1, write_size, out_file)
-					!= write_size) {
+			if (write_all(out_fd, out_buf, write_size)) {
 				// Wouldn't be a surprise if writing to stderr
 				// would fail too but at least try to show an
 				// error message.
-				my_errorf("Cannot write to standard output: "
+				my_errorf("Cannot write to output file: "
 						"%s", strerror(errno));
 				goto error;
 			}
 
 			strm.next_out = out_buf;
-			strm.avail_out = BUFSIZ;
+			strm.avail_out = buf_size;
 		}
 
 		if (ret != LZMA_OK) {
@@ -109,7 +163,6 @@ int  xzdec(const char *infile, const char *outfile)
 				// that there's no trailing garbage.
 				assert(strm.avail_in == 0);
 				assert(action == LZMA_FINISH);
-				assert(feof(file));
 				err = 0;
 				break;
 			}
@@ -148,8 +201,11 @@ int  xzdec(const char *infile, const char *outfile)
 	}
 
 error:
-	if (file) fclose(file);
-	if (out_file) fclose(out_file);
+	lzma_end(&strm);
+	bulk_close(in_br);
+	if (in_fd >= 0) close(in_fd);
+	if (out_fd >= 0 && close(out_fd) && !err) err = -1;
+	free(out_buf);
 
 	return err;
 }
@@ -16,6 +16,14 @@
 #include "ua_version.h"
 #include "updater.h"
 #include "component.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "jsonfast.h"
+#include "rbplan.h"
+#include "bkmaint.h"
+#include "bkstore.h"
+#include "bulkio.h"
 
 #if defined(SUPPORT_SIGNATURE_VERIFICATION) || defined(SUPPORT_UA_DOWNLOAD)
 #include "ua_download.h"
@@ -30,6 +38,8 @@
 #endif
 static void process_message(ua_component_context_t* uacc, const char* msg, size_t len);
 static void process_run(ua_component_context_t* uacc, process_f func, json_object* jObj, int turnover);
+static void process_run_prepare(ua_component_context_t* uacc, json_object* jObj);
+static void* prepare_worker(void* arg);
 static void process_query_package(ua_component_context_t* uacc, json_object* jsonObj);
 static void process_ready_download(ua_component_context_t* uacc, json_object* jsonObj);
 static void process_prepare_update(ua_component_context_t* uacc, json_object* jsonObj);
@@ -41,6 +51,8 @@ static void process_log_report(ua_component_context_t* uacc, json_object* jsonOb
 static void process_update_status(ua_component_context_t* uacc, json_object* jsonObj);
 static void process_query_updates(ua_component_context_t* uacc, json_object* jsonObj);
 static void process_sequence_info(ua_component_context_t* uacc, json_object* jsonObj);
+static void process_query_metrics(ua_component_context_t* uacc, json_object* jsonObj);
+static void process_resource_budget(ua_component_context_t* uacc, json_object* jsonObj);
 static download_state_t prepare_download_action(ua_component_context_t* uacc, pkg_info_t* update_pkg);
 static int transfer_file_action(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg_file_t* pkgFile);
 static void send_download_status(ua_component_context_t* uacc, pkg_info_t* pkgInfo, download_state_t state);
@@ -48,7 +60,10 @@ static int send_update_report(const char* pkgName, const char* version, int inde
  int send_sequence_query(void);
 static int send_query_updates(void);
 static int backup_package(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg_file_t* pkgFile);
-static int patch_delta(char* pkgManifest, char* version, char* diffFile, char* newFile);
+static int backup_to_store(ua_component_context_t* uacc, pkg_file_t* backupFile, const char* src_file);
+static int backup_view_ok(pkg_file_t* pkgFile);
+static char* backup_view(pkg_info_t* pkgInfo, pkg_file_t* pkgFile);
+static int patch_delta(char* pkgManifest, char* version, pkg_handle_t* diffPkg, char* newFile);
 static char* install_state_string(install_state_t state);
 static char* download_state_string(download_state_t state);
 static char* update_stage_string(update_stage_t stage);
@@ -56,6 +71,10 @@ static char* log_type_string(log_type_t log);
 static void release_comp_sequence(comp_sequence_t* seq);
 static char* get_component_custom_message(char* pkgName);
 static int is_fake_rb_version_enabled(const char* pkgName, int* dl_required);
+static msg_prio_t msg_priority(const char* type);
+static void runner_purge_queue(runner_info_t* ri, uint64_t now, const char* key);
+static incoming_msg_t* runner_next_message(runner_info_t* ri);
+static void free_incoming_msg(incoming_msg_t* im);
 void* runner_loop(void* arg);
 
 #ifdef SUPPORT_UA_DOWNLOAD
@@ -77,6 +96,11 @@ bool download_postponed;
 int ua_debug          = 0;
 ua_internal_t ua_intl = {0};
 runner_info_hash_tree_t* ri_tree = NULL;
+static pthread_mutex_t ver_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static ver_cache_t* ver_cache = NULL;
+static pthread_mutex_t prepare_lock   = PTHREAD_MUTEX_INITIALIZER;
+// sequence numbers are also sent from the prepare-update workers
+static pthread_mutex_t seq_lock       = PTHREAD_MUTEX_INITIALIZER;
 
 
 
@@ -119,6 +143,24 @@ int ua_init(ua_cfg_t* uaConfig)
 		ua_intl.max_retry                     = uaConfig->max_retry;
 		ua_intl.async_query_package           = 0;
 		ua_intl.qp_failure_response           = uaConfig->qp_failure_response;
+		ua_intl.metrics_query                 = uaConfig->metrics_query;
+		ua_intl.cache_version                 = uaConfig->cache_version;
+		ua_intl.prepare_workers               = uaConfig->prepare_workers;
+		ua_intl.backup_dedup                  = uaConfig->backup_dedup;
+		ua_intl.rollback_view                 = uaConfig->rollback_view;
+		ua_intl.budget_message                = uaConfig->budget_message;
+
+		scheduler_init(uaConfig->cpu_jobs, uaConfig->io_jobs);
+
+		ua_budget_t budget = {
+			.io_kbps   = uaConfig->io_rate_kbps,
+			.cpu_share = uaConfig->cpu_share,
+			.nice      = uaConfig->worker_nice,
+			.io_prio   = uaConfig->worker_io_prio,
+			.idle      = uaConfig->worker_idle,
+		};
+		BOLT_IF(scheduler_budget(&budget), E_UA_ARG, "invalid resource budget");
+		ua_intl.msg_timeout_ms                = (uaConfig->msg_timeout > 0 ? uaConfig->msg_timeout : MSG_TIMEOUT) * 1000ULL;
 
 		srand(time(0));
 
@@ -127,6 +169,10 @@ int ua_init(ua_cfg_t* uaConfig)
 		ua_intl.diag_file = S(ua_intl.diag_dir) ? JOIN(ua_intl.diag_dir, DIAGNOSTIC_DATA_FILE) : NULL;
 		#endif
 
+		#ifdef SUPPORT_UA_TRACE
+		BOLT_SUB(trace_init(uaConfig->trace_file, uaConfig->trace_events));
+		#endif
+
 		#if defined(SUPPORT_SIGNATURE_VERIFICATION) && !defined(SUPPORT_UA_DOWNLOAD)
 		ua_intl.ua_dl_dir = S(uaConfig->backup_dir) ? f_strdup(uaConfig->backup_dir) : NULL;
 		#endif
@@ -145,9 +191,14 @@ int ua_init(ua_cfg_t* uaConfig)
 		BOLT_SYS(pthread_mutex_init(&ua_intl.backup_lock, 0), "lock init");
 		BOLT_SYS(pthread_mutex_init(&ua_intl.lock, 0), "backup lock init");
 
+		if (uaConfig->backup_maintenance > 0 && S(ua_intl.backup_dir))
+			BOLT_SUB(bkmaint_start(ua_intl.backup_dir, uaConfig->backup_maintenance, uaConfig->backup_maint_kbps, &ua_intl.backup_lock));
+
 		ua_intl.state = UAI_STATE_INITIALIZED;
 
 		if (uaConfig->rw_buffer_size) ua_rw_buff_size = uaConfig->rw_buffer_size * 1024;
+		if (uaConfig->io_queue_depth) ua_io_depth = uaConfig->io_queue_depth;
+		ua_io_cache = uaConfig->io_cache_mode;
 
 	} while (0);
 
@@ -163,10 +214,15 @@ int ua_stop(void)
 {
 	int rc = 0;
 
+	bkmaint_stop();
+
 	Z_FREE(ua_intl.cache_dir);
 	Z_FREE(ua_intl.backup_dir);
 	Z_FREE(ua_intl.record_file);
+	pthread_mutex_lock(&seq_lock);
 	release_comp_sequence(ua_intl.seq_out);
+	ua_intl.seq_out = NULL;
+	pthread_mutex_unlock(&seq_lock);
 
 	#ifdef SUPPORT_UA_DOWNLOAD
 	if (ua_intl.ua_dl_dir) { free(ua_intl.ua_dl_dir); ua_intl.ua_dl_dir = NULL; }
@@ -180,7 +236,13 @@ int ua_stop(void)
 	#endif
 
 	delta_stop();
+	ua_invalidate_version_cache(NULL);
 	xmlCleanupParser();
+
+	#ifdef SUPPORT_UA_TRACE
+	trace_stop();
+	#endif
+
 	if (ua_intl.state >= UAI_STATE_INITIALIZED) {
 		rc            = xl4bus_client_stop();
 		ua_intl.state = UAI_STATE_NOT_KNOWN;
@@ -217,6 +279,9 @@ int ua_register(ua_handler_t* uah, int len)
 			BOLT_IF(!ri->component.uar || !S(ri->component.type), E_UA_ARG, "registration error");
 			BOLT_IF((ri->component.uar->on_get_version == NULL || ri->component.uar->on_install == NULL)
 			        && ri->component.uar->on_message == NULL, E_UA_ARG, "registration error");
+			char* qname = f_asprintf("queue_depth:%s", ri->component.type);
+			ri->queue_metric = metrics_register(qname, UA_METRIC_GAUGE);
+			free(qname);
 			BOLT_SYS(pthread_mutex_init(&ri->lock, 0), "lock init");
 			BOLT_SYS(pthread_cond_init(&ri->cond, 0), "cond init");
 			BOLT_SYS(pthread_create(&ri->thread, 0, runner_loop, ri), "pthread create");
@@ -272,6 +337,7 @@ int ua_unregister(ua_handler_t* uah, int len)
 					release_comp_sequence(ri->component.seq_in);
 					ri->component.record_file = NULL;
 					comp_release_state_info(ri->component.st_info);
+					rb_plan_free(ri->component.rb_plan);
 					Z_FREE(ri->component.update_manifest);
 					Z_FREE(ri->component.backup_manifest);
 					Z_FREE(ri->component.type);
@@ -489,7 +555,7 @@ void handle_delivered(const char* msg, int ok)
 	enum json_tokener_error jErr;
 
 	if (msg) {
-		json_object* jObj = json_tokener_parse_verbose(msg, &jErr);
+		json_object* jObj = ua_json_parse(msg, &jErr);
 		if (jObj) {
 			get_pkg_type_from_json(jObj, &pkg_type);
 			get_type_from_json(jObj, &msg_type);
@@ -566,6 +632,11 @@ void handle_message(const char* type, const char* msg, size_t len)
 	int err = E_UA_OK;
 	UT_array ri_list;
 	char* jsonType     = NULL;
+	char* pkgName      = NULL;
+	char* pkgError     = NULL;
+	char* key          = NULL;
+	int terminal       = 0;
+	msg_prio_t prio    = MSG_PRIO_COMMAND;
 	enum json_tokener_error jErr;
 
 	if (!type || !msg) return;
@@ -577,7 +648,7 @@ void handle_message(const char* type, const char* msg, size_t len)
 	if (!l)
 		A_DEBUG_MSG("Ignoring message for non-registered handler <%s> : %s", type, msg);
 	else {
-		json_object* jObj = json_tokener_parse_verbose(msg, &jErr);
+		json_object* jObj = ua_json_parse(msg, &jErr);
 		if (jErr == json_tokener_success) {
 			if (get_type_from_json(jObj, &jsonType) == E_UA_OK) {
 				if (!strcmp(jsonType, BMT_SOTA_REPORT)) {
@@ -585,6 +656,14 @@ void handle_message(const char* type, const char* msg, size_t len)
 				}else {
 					A_INFO_MSG("Incoming message for <%s> : %s", type, msg);
 				}
+
+				prio = msg_priority(jsonType);
+				// only reports about a package supersede each other; one that
+				// carries an error (e.g. DCE_ABORTED) ends it and is always kept
+				if (prio == MSG_PRIO_REPORT && !get_pkg_name_from_json(jObj, &pkgName) && pkgName) {
+					key      = f_asprintf("%s/%s", jsonType, pkgName);
+					terminal = !get_pkg_error_from_json(jObj, &pkgError) && pkgError;
+				}
 			}
 
 		}
@@ -596,16 +675,30 @@ void handle_message(const char* type, const char* msg, size_t len)
 	for (int j = 0; j < l; j++) {
 		runner_info_t* ri = *(runner_info_t**) utarray_eltptr(&ri_list, j);
 		BOLT_SYS(pthread_mutex_lock(&ri->lock), "lock failed");
-		incoming_msg_t* im = f_malloc(sizeof(incoming_msg_t));
-		im->msg     = f_strdup(msg);
+		arena_t ma;
+		arena_init(&ma, sizeof(incoming_msg_t) + strlen(msg) + (key ? strlen(key) : 0) + 64);
+		incoming_msg_t* im = arena_alloc(&ma, sizeof(incoming_msg_t));
+		im->msg     = arena_strdup(&ma, msg);
 		im->msg_len = len;
 		im->msg_ts  = currentms();
-		DL_APPEND(ri->queue, im);
+		im->prio    = prio;
+		im->key     = terminal ? NULL : arena_strdup(&ma, key);
+		im->next    = im->prev = NULL;
+		im->arena   = ma;
+		runner_purge_queue(ri, im->msg_ts, im->key);
+		DL_APPEND(ri->queue[prio], im);
+		metrics_add(ri->queue_metric, 1);
+		metrics_add(M_QUEUE_DEPTH, 1);
+		TRACE_MARK(TRACE_CAT_MSG, "receive", ri->component.type, len);
 		BOLT_SYS(pthread_cond_signal(&ri->cond), "cond signal");
 		BOLT_SYS(pthread_mutex_unlock(&ri->lock), "unlock failed");
 
 	}
 
+	if (l)
+		metrics_add(M_MSG_RECEIVED, 1);
+
+	Z_FREE(key);
 	utarray_done(&ri_list);
 
 	if (err) A_ERROR_MSG("Error while appending message to queue for %s : %s", type, msg);
@@ -703,29 +796,114 @@ void* runner_loop(void* arg)
 			continue;
 		}
 
-		while (info->run && !(im = info->queue))
+		while (info->run && !(im = runner_next_message(info)))
 			pthread_cond_wait(&info->cond, &info->lock);
 
 		if (im) {
-			DL_DELETE(info->queue, im);
 			pthread_mutex_unlock(&info->lock);
 
 			uint64_t tnow = currentms();
-			uint64_t tout = im->msg_ts + MSG_TIMEOUT * 1000;
+			uint64_t tout = im->msg_ts + ua_intl.msg_timeout_ms;
+
+			metrics_add(info->queue_metric, -1);
+			metrics_add(M_QUEUE_DEPTH, -1);
+			metrics_observe(M_MSG_AGE_MS, (int64_t)(tnow - im->msg_ts));
 
-			if (tnow < tout)
+			TRACE_SPAN(im->msg_ts * 1000ULL, TRACE_CAT_MSG, "queue-wait", info->component.type, im->msg_len);
+
+			if (tnow < tout) {
+				bkmaint_hold();
 				process_message(&info->component, im->msg, im->msg_len);
-			else
+				bkmaint_release();
+			} else {
 				A_INFO_MSG("message timed out: %s", im->msg);
+				metrics_add(M_MSG_TIMED_OUT, 1);
+			}
 
-			free(im->msg);
-			free(im);
+			free_incoming_msg(im);
 		}
 	}
 
 	return NULL;
 }
 
+static msg_prio_t msg_priority(const char* type)
+{
+	if (!strcmp(type, BMT_QUERY_PACKAGE) ||
+	    !strcmp(type, BMT_QUERY_UPDATES) ||
+	    !strcmp(type, BMT_QUERY_SEQUENCE) ||
+	    !strcmp(type, BMT_QUERY_METRICS) ||
+	    !strcmp(type, BMT_RESOURCE_BUDGET) ||
+	    !strcmp(type, BMT_UPDATE_STATUS))
+		return MSG_PRIO_QUERY;
+
+#ifdef SUPPORT_UA_DOWNLOAD
+	if (!strcmp(type, BMT_QUERY_TRUST))
+		return MSG_PRIO_QUERY;
+#endif
+
+#ifdef SUPPORT_SIGNATURE_VERIFICATION
+	if (!strcmp(type, BMT_QUERY_KEY))
+		return MSG_PRIO_QUERY;
+#endif
+
+	if (!strcmp(type, BMT_SOTA_REPORT) ||
+	    !strcmp(type, BMT_DOWNLOAD_REPORT) ||
+	    !strcmp(type, BMT_LOG_REPORT))
+		return MSG_PRIO_REPORT;
+
+	return MSG_PRIO_COMMAND;
+}
+
+/* Drop queued messages that have expired, or that are superseded by a newer
+ * message with the same key. Terminal reports are queued without a key and
+ * are never dropped this way. Called with ri->lock held. */
+static void runner_purge_queue(runner_info_t* ri, uint64_t now, const char* key)
+{
+	incoming_msg_t* im, * aux;
+
+	for (int p = 0; p < MSG_PRIO_COUNT; p++) {
+		DL_FOREACH_SAFE(ri->queue[p], im, aux) {
+			if (now >= im->msg_ts + ua_intl.msg_timeout_ms) {
+				A_INFO_MSG("message timed out in queue: %s", im->msg);
+				metrics_add(M_MSG_TIMED_OUT, 1);
+
+			} else if (key && im->key && !strcmp(key, im->key)) {
+				A_DEBUG_MSG("message superseded in queue: %s", im->msg);
+				metrics_add(M_MSG_SUPERSEDED, 1);
+
+			} else {
+				continue;
+			}
+
+			DL_DELETE(ri->queue[p], im);
+			metrics_add(ri->queue_metric, -1);
+			metrics_add(M_QUEUE_DEPTH, -1);
+			free_incoming_msg(im);
+		}
+	}
+}
+
+/* Take the oldest message of the highest priority class. Called with ri->lock held. */
+static incoming_msg_t* runner_next_message(runner_info_t* ri)
+{
+	incoming_msg_t* im = NULL;
+
+	for (int p = 0; p < MSG_PRIO_COUNT && !im; p++) {
+		if ((im = ri->queue[p]))
+			DL_DELETE(ri->queue[p], im);
+	}
+
+	return im;
+}
+
+static void free_incoming_msg(incoming_msg_t* im)
+{
+	arena_t ma = im->arena;
+
+	arena_release(&ma);
+}
+
 int get_local_next_rollback_version(char* manifest, char* currentVer, char** nextVer)
 {
 	int err                  = E_UA_OK;
@@ -757,6 +935,7 @@ static int handler_update_outgoing_seq_num(comp_sequence_t** seq, char* name, in
 	int num            = update_num > 0 ? update_num : 0;
 	comp_sequence_t* s = NULL;
 
+	pthread_mutex_lock(&seq_lock);
 	HASH_FIND_STR(*seq, name, s);
 	if (s) {
 		num = update_num > 0 ? update_num : s->num + 1;
@@ -769,6 +948,7 @@ static int handler_update_outgoing_seq_num(comp_sequence_t** seq, char* name, in
 	s->name = f_strdup(name);
 	s->num  = num;
 	HASH_ADD_KEYPTR( hh, *seq, s->name, strlen(s->name), s );
+	pthread_mutex_unlock(&seq_lock);
 
 	return num;
 }
@@ -778,6 +958,7 @@ int handler_chk_incoming_seq_outdated(comp_sequence_t** seq, char* name, int num
 	int outdated       = 0;
 	comp_sequence_t* s = NULL;
 
+	pthread_mutex_lock(&seq_lock);
 	HASH_FIND_STR(*seq, name, s);
 	if (s) {
 		if (s->num >= num) {
@@ -795,6 +976,7 @@ int handler_chk_incoming_seq_outdated(comp_sequence_t** seq, char* name, int num
 		s->num  = num;
 		HASH_ADD_KEYPTR( hh, *seq, s->name, strlen(s->name), s );
 	}
+	pthread_mutex_unlock(&seq_lock);
 
 	return outdated;
 }
@@ -817,7 +999,7 @@ static void process_message(ua_component_context_t* uacc, const char* msg, size_
 	enum json_tokener_error jErr;
 	int seq = -1;
 
-	json_object* jObj = json_tokener_parse_verbose(msg, &jErr);
+	json_object* jObj = ua_json_parse(msg, &jErr);
 
 	if (jErr == json_tokener_success) {
 		if ( !get_seq_num_from_json(jObj, &seq) &&
@@ -831,12 +1013,15 @@ static void process_message(ua_component_context_t* uacc, const char* msg, size_
 
 		if (get_type_from_json(jObj, &type) == E_UA_OK) {
 			int processed = 0;
+			TRACE_START(t_msg);
 			if (uacc->uar->on_message) {
+				TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 				processed = (*uacc->uar->on_message)(type, msg);
 #else
 				processed = (*uacc->uar->on_message)(type, jObj);
 #endif
+				TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_message", type, 0);
 			}
 			if (!processed) {
 				if (!strcmp(type, BMT_QUERY_PACKAGE)) {
@@ -850,7 +1035,10 @@ static void process_message(ua_component_context_t* uacc, const char* msg, size_
 					if(ua_intl.ua_download_required)
 						ua_dl_stop_sending_completed_status();
 				#endif
-					process_run(uacc, process_prepare_update, jObj, 1);
+					if (ua_intl.prepare_workers > 1)
+						process_run_prepare(uacc, jObj);
+					else
+						process_run(uacc, process_prepare_update, jObj, 1);
 				} else if (!strcmp(type, BMT_CONFIRM_UPDATE)) {
 					process_run(uacc, process_confirm_update, jObj, 0);
 				} else if (!strcmp(type, BMT_DOWNLOAD_REPORT)) {
@@ -865,6 +1053,10 @@ static void process_message(ua_component_context_t* uacc, const char* msg, size_
 					process_run(uacc, process_update_status, jObj, 0);
 				} else if (!strcmp(type, BMT_QUERY_UPDATES)) {
 					process_run(uacc, process_query_updates, jObj, 0);
+				} else if (!strcmp(type, BMT_QUERY_METRICS) && ua_intl.metrics_query) {
+					process_run(uacc, process_query_metrics, jObj, 0);
+				} else if (!strcmp(type, BMT_RESOURCE_BUDGET) && ua_intl.budget_message) {
+					process_run(uacc, process_resource_budget, jObj, 0);
 				#ifdef SUPPORT_UA_DOWNLOAD
 				} else if (!strcmp(type, BMT_START_DOWNLOAD)) {
 					process_run(uacc, process_start_download, jObj, 1);
@@ -885,6 +1077,7 @@ static void process_message(ua_component_context_t* uacc, const char* msg, size_
 			} else {
 				A_ERROR_MSG("libary has no further action, since UA has processed this message %s", json_object_to_json_string(jObj));
 			}
+			TRACE_SPAN(t_msg, TRACE_CAT_MSG, type, uacc->type, len);
 		}
 	} else {
 		A_ERROR_MSG("Failed to parse json (%s): %s", json_tokener_error_desc(jErr), msg);
@@ -899,7 +1092,13 @@ static void* worker_action(void* arg)
 {
 	ua_component_context_t* uacc = arg;
 
+	scheduler_worker();
+
+	TRACE_START(t_work);
+	bkmaint_hold();
 	uacc->worker.worker_func(uacc, uacc->worker.worker_jobj);
+	bkmaint_release();
+	TRACE_SPAN(t_work, TRACE_CAT_MSG, "worker", uacc->type, 0);
 
 	json_object_put(uacc->worker.worker_jobj);
 
@@ -914,7 +1113,11 @@ static void process_run(ua_component_context_t* uacc, process_f func, json_objec
 		func(uacc, jObj);
 
 	} else {
-		if (!uacc->worker.worker_running) {
+		pthread_mutex_lock(&prepare_lock);
+		int preparing = uacc->prepare_running;
+		pthread_mutex_unlock(&prepare_lock);
+
+		if (!uacc->worker.worker_running && !preparing) {
 			uacc->worker.worker_running = 1;
 			uacc->worker.worker_func    = func;
 			uacc->worker.worker_jobj    = json_object_get(jObj);
@@ -931,10 +1134,129 @@ static void process_run(ua_component_context_t* uacc, process_f func, json_objec
 
 		} else {
 			A_INFO_MSG("UA worker busy, discarding this message.");
+			metrics_add(M_MSG_WORKER_BUSY, 1);
 		}
 	}
 }
 
+/* Queue a prepare-update, and start another worker if the per-handler limit
+ * allows it. Workers keep taking queued packages until none is left. */
+static void process_run_prepare(ua_component_context_t* uacc, json_object* jObj)
+{
+	prepare_job_t* job = NULL;
+	char* pkgName      = NULL;
+	int spawn          = 0;
+
+	if (get_pkg_name_from_json(jObj, &pkgName)) {
+		A_ERROR_MSG("prepare-update msg doesn't have a package name");
+		return;
+	}
+
+	pthread_mutex_lock(&prepare_lock);
+
+	if (uacc->worker.worker_running) {
+		A_INFO_MSG("UA worker busy, discarding this message.");
+		metrics_add(M_MSG_WORKER_BUSY, 1);
+
+	} else {
+		DL_FOREACH(uacc->prepare_jobs, job) {
+			if (!strcmp(job->pkg_name, pkgName))
+				break;
+		}
+
+		if (job) {
+			A_INFO_MSG("prepare-update for %s is already queued, discarding this message.", pkgName);
+
+		} else {
+			comp_init_state_info(&uacc->st_info, pkgName);
+
+			job           = f_malloc(sizeof(prepare_job_t));
+			job->pkg_name = f_strdup(pkgName);
+			job->jobj     = json_object_get(jObj);
+			DL_APPEND(uacc->prepare_jobs, job);
+
+			if (uacc->prepare_running < ua_intl.prepare_workers) {
+				uacc->prepare_running++;
+				spawn = 1;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&prepare_lock);
+
+	if (spawn) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, 1);
+		if (pthread_create(&thread, &attr, prepare_worker, uacc)) {
+			A_ERROR_MSG("pthread create");
+			pthread_mutex_lock(&prepare_lock);
+			if (!--uacc->prepare_running) {
+				prepare_job_t* aux;
+				DL_FOREACH_SAFE(uacc->prepare_jobs, job, aux) {
+					DL_DELETE(uacc->prepare_jobs, job);
+					json_object_put(job->jobj);
+					free(job->pkg_name);
+					free(job);
+				}
+			}
+			pthread_mutex_unlock(&prepare_lock);
+		}
+		pthread_attr_destroy(&attr);
+	}
+}
+
+static void* prepare_worker(void* arg)
+{
+	ua_component_context_t* uacc = arg;
+	prepare_job_t* job;
+
+	scheduler_worker();
+
+	while (1) {
+		pthread_mutex_lock(&prepare_lock);
+		DL_FOREACH(uacc->prepare_jobs, job) {
+			if (!job->active)
+				break;
+		}
+		if (job)
+			job->active = 1;
+		else
+			uacc->prepare_running--;
+		pthread_mutex_unlock(&prepare_lock);
+
+		if (!job)
+			break;
+
+		ua_component_context_t ctx = {0};
+		ctx.type                     = uacc->type;
+		ctx.uar                      = uacc->uar;
+		ctx.record_file              = uacc->record_file;
+		ctx.is_rollback_installation = uacc->is_rollback_installation;
+		ctx.max_retry                = uacc->max_retry;
+		ctx.retry_cnt                = uacc->retry_cnt;
+		ctx.usr_ref                  = uacc->usr_ref;
+		ctx.parent                   = uacc;
+
+		TRACE_START(t_work);
+		bkmaint_hold();
+		process_prepare_update(&ctx, job->jobj);
+		bkmaint_release();
+		TRACE_SPAN(t_work, TRACE_CAT_MSG, "prepare-worker", job->pkg_name, 0);
+
+		pthread_mutex_lock(&prepare_lock);
+		DL_DELETE(uacc->prepare_jobs, job);
+		pthread_mutex_unlock(&prepare_lock);
+
+		json_object_put(job->jobj);
+		free(job->pkg_name);
+		free(job);
+	}
+
+	return NULL;
+}
+
 
 static void process_query_package(ua_component_context_t* uacc, json_object* jsonObj)
 {
@@ -979,17 +1301,7 @@ static void process_query_package(ua_component_context_t* uacc, json_object* jso
 
 		}else {
 			json_object* pkgObject = json_object_new_object();
-#ifdef LIBUA_VER_2_0
-			ua_callback_ctl_t uactl = {0};
-			uactl.type     = pkgInfo.type;
-			uactl.pkg_name = pkgInfo.name;
-			uactl.ref      = uacc->usr_ref;
-			if ((uae = (*uar->on_get_version)(&uactl)) == E_UA_OK)
-				installedVer = uactl.version;
-
-#else
-			uae = (*uar->on_get_version)(pkgInfo.type, pkgInfo.name, &installedVer);
-#endif
+			uae = get_installed_version(uacc, pkgInfo.type, pkgInfo.name, NULL, &installedVer, NULL);
 			if (uae == E_UA_OK)
 				A_INFO_MSG("DMClient is querying version info of : %s Returning %s", pkgInfo.name, NULL_STR(installedVer));
 			else
@@ -1088,6 +1400,7 @@ static void process_query_package(ua_component_context_t* uacc, json_object* jso
 				json_object_object_add(bodyObject, "package", pkgObject);
 				
 			Z_FREE(backup_manifest);
+			Z_FREE(installedVer);
 		}
 
 		json_object* jObject = json_object_new_object();
@@ -1101,6 +1414,7 @@ static void process_query_package(ua_component_context_t* uacc, json_object* jso
 			A_INFO_MSG("Not sending query-package response, UA reported system error!");
 
 		json_object_put(jObject);
+		f_free(custom_msg);
 
 	}
 }
@@ -1126,38 +1440,51 @@ static void process_prepare_update(ua_component_context_t* uacc, json_object* js
 	pkg_file_t pkgFile     = {0}, updateFile = {0};
 	update_err_t updateErr = UE_NONE;
 	install_state_t state  = INSTALL_READY;
+	ua_component_context_t* owner = uacc->parent ? uacc->parent : uacc;
+	json_pkg_version_t pv;
+	json_cmd_t cmd;
 
 	#ifdef SUPPORT_UA_DOWNLOAD
 	char tmp_filename[PATH_MAX] = {0};
 	#endif
 
 	memset(&uacc->update_pkg, 0, sizeof(pkg_info_t));
+	json_cmd_parse(jsonObj, &cmd);
+
+	uacc->update_pkg.type    = cmd.pkg_type;
+	uacc->update_pkg.name    = cmd.pkg_name;
+	uacc->update_pkg.version = cmd.pkg_version;
 
-	if (!get_pkg_type_from_json(jsonObj, &uacc->update_pkg.type) &&
-	    !get_pkg_name_from_json(jsonObj, &uacc->update_pkg.name) &&
-	    !get_pkg_version_from_json(jsonObj, &uacc->update_pkg.version)) {
-		ua_stage_t st = comp_get_update_stage(uacc->st_info, uacc->update_pkg.name);
+	if (cmd.pkg_type && cmd.pkg_name && cmd.pkg_version) {
+		ua_stage_t st = comp_get_update_stage(owner->st_info, uacc->update_pkg.name);
 		if ( st == UA_STATE_PREPARE_UPDATE_STARTED ) {
 			A_INFO_MSG("skipping, still prcocessing prepare-update for version %s of %s", uacc->update_pkg.version, uacc->update_pkg.name);
 			return;
 
 		}
-		char* campaign_id = NULL;
-		json_get_property(jsonObj, json_type_string, &campaign_id, "body", "campaign", "id", NULL);
+		char* campaign_id = cmd.campaign_id;
 		if(campaign_id) {
 			A_INFO_MSG("prepare-update campaign id is %s", campaign_id);
-			Z_STRDUP(ua_intl.cur_campaign_id, campaign_id);
+			pthread_mutex_lock(&ua_intl.lock);
+			if (!ua_intl.cur_campaign_id || strcmp(ua_intl.cur_campaign_id, campaign_id))
+				Z_STRDUP(ua_intl.cur_campaign_id, campaign_id);
+			pthread_mutex_unlock(&ua_intl.lock);
 
 		} else
 			A_INFO_MSG("no campaign id in prepare-update");
 
 		if ( st == UA_STATE_PREPARE_UPDATE_DONE ) {
-			char* prepared_ver = comp_get_prepared_version(uacc->st_info, uacc->update_pkg.name, ua_intl.cur_campaign_id);
+			pthread_mutex_lock(&ua_intl.lock);
+			char* cid = f_strdup(ua_intl.cur_campaign_id);
+			pthread_mutex_unlock(&ua_intl.lock);
+			char* prepared_ver = comp_get_prepared_version(owner->st_info, uacc->update_pkg.name, cid);
+			f_free(cid);
 
 			if (prepared_ver) {
 				if (!strcmp(prepared_ver, uacc->update_pkg.version)) {
 					A_INFO_MSG("version %s of %s has been marked prepared, sending back INSTALL_READY with no further processing", uacc->update_pkg.version, uacc->update_pkg.name);
 					send_install_status(uacc, INSTALL_READY, 0, UE_NONE);
+					f_free(prepared_ver);
 					return;
 				} else {
 					A_INFO_MSG("%s prepare-update has different version(%s) than the saved prepared_ver: %s ",
@@ -1166,6 +1493,7 @@ static void process_prepare_update(ua_component_context_t* uacc, json_object* js
 			} else {
 				A_INFO_MSG("version %s has been marked prepared, but found no version record.", uacc->update_pkg.version);
 			}
+			f_free(prepared_ver);
 		}
 
 
@@ -1174,23 +1502,27 @@ static void process_prepare_update(ua_component_context_t* uacc, json_object* js
 			sleep(5);
 		#endif
 
-		comp_set_update_stage(&uacc->st_info, uacc->update_pkg.name, UA_STATE_PREPARE_UPDATE_STARTED);
+		comp_set_update_stage(&owner->st_info, uacc->update_pkg.name, UA_STATE_PREPARE_UPDATE_STARTED);
 
-		get_pkg_rollback_version_from_json(jsonObj, &uacc->update_pkg.rollback_version);
+		uacc->update_pkg.rollback_version = cmd.rollback_version;
 		pkgFile.version = S(uacc->update_pkg.rollback_version) ? uacc->update_pkg.rollback_version : uacc->update_pkg.version;
 		if (uacc->update_pkg.rollback_version)
-			get_pkg_rollback_versions_from_json(jsonObj, &uacc->update_pkg.rollback_versions);
+			uacc->update_pkg.rollback_versions = cmd.rollback_versions;
 		uacc->backup_manifest = JOIN(ua_intl.backup_dir, "backup", uacc->update_pkg.name, MANIFEST_PKG);
 
-		if (( (!get_pkg_file_from_json(jsonObj, pkgFile.version, &pkgFile.file)
+		json_cmd_version(&cmd, pkgFile.version, &pv);
+		pkgFile.file = pv.file;
+		if (pv.downloaded >= 0)
+			pkgFile.downloaded = pv.downloaded;
+
+		if (( (pkgFile.file
 				#ifdef SUPPORT_UA_DOWNLOAD
 		       || ua_intl.ua_download_required
 				#endif
-		       ) &&
-		      !get_pkg_downloaded_from_json(jsonObj, pkgFile.version, &pkgFile.downloaded)) ||
+		       ) && pv.downloaded >= 0) ||
 		    ((!get_pkg_file_manifest(uacc->backup_manifest, pkgFile.version, &pkgFile)) && (bck = 1))) {
-			get_pkg_sha256_from_json(jsonObj, pkgFile.version, pkgFile.sha256b64);
-			get_pkg_delta_sha256_from_json(jsonObj, pkgFile.version, pkgFile.delta_sha256b64);
+			json_sha256_copy(pv.sha256, pkgFile.sha256b64);
+			json_sha256_copy(pv.delta_sha256, pkgFile.delta_sha256b64);
 
 			#ifdef SUPPORT_UA_DOWNLOAD
 			if (ua_intl.ua_download_required && bck != 1) {
@@ -1228,12 +1560,12 @@ static void process_prepare_update(ua_component_context_t* uacc, json_object* js
 			free(pkgFile.file);
 		}
 		if (state == INSTALL_READY) {
-			uacc->retry_cnt = 0;
-			comp_set_prepared_version(&uacc->st_info, uacc->update_pkg.name, uacc->update_pkg.version, ua_intl.cur_campaign_id);
-			comp_set_update_stage(&uacc->st_info, uacc->update_pkg.name, UA_STATE_PREPARE_UPDATE_DONE);
+			owner->retry_cnt = 0;
+			comp_set_prepared_version(&owner->st_info, uacc->update_pkg.name, uacc->update_pkg.version, ua_intl.cur_campaign_id);
+			comp_set_update_stage(&owner->st_info, uacc->update_pkg.name, UA_STATE_PREPARE_UPDATE_DONE);
 		}
 		else
-			comp_set_update_stage(&uacc->st_info, uacc->update_pkg.name, st);
+			comp_set_update_stage(&owner->st_info, uacc->update_pkg.name, st);
 
 		Z_FREE(uacc->backup_manifest);
 		memset(&uacc->update_pkg, 0, sizeof(pkg_info_t));
@@ -1324,7 +1656,7 @@ static void process_ready_update(ua_component_context_t* uacc, json_object* json
 }
 
 
-static int patch_delta(char* pkgManifest, char* version, char* diffFile, char* newFile)
+static int patch_delta(char* pkgManifest, char* version, pkg_handle_t* diffPkg, char* newFile)
 {
 	int err = E_UA_ERR;
 
@@ -1334,9 +1666,9 @@ static int patch_delta(char* pkgManifest, char* version, char* diffFile, char* n
 
 	pkg_file_t* pkgFile = f_malloc(sizeof(pkg_file_t));
 
-	if (pkgManifest && diffFile && newFile && pkgFile &&
+	if (pkgManifest && diffPkg && newFile && pkgFile &&
 	    (get_pkg_file_manifest(pkgManifest, version, pkgFile) == E_UA_OK) ) {
-		err = delta_reconstruct(pkgFile->file, diffFile, newFile);
+		err = delta_reconstruct_ph(pkgFile->file, diffPkg, newFile);
 
 	}
 
@@ -1395,23 +1727,27 @@ static void process_confirm_update(ua_component_context_t* uacc, json_object* js
 		memset(p_path, 0, PATH_MAX);
 		snprintf(p_path, (PATH_MAX - 1), "%s-%s.x",pkgInfo.name, pkgInfo.version);
 		char* temp_delta_dir = JOIN(ua_intl.cache_dir, "delta", p_path);
+		char* view_dir = JOIN(ua_intl.cache_dir, pkgInfo.name, BACKUP_VIEW_DIR);
 
 		if (backup_manifest && update_manifest) {
 			if (!access(update_manifest, F_OK)) {
 				if (comp_get_rb_type(ua_intl.component_ctrl, uacc->update_pkg.name) != URB_NONE)
 					comp_set_rb_type(&ua_intl.component_ctrl, uacc->update_pkg.name, URB_NONE);
 
+				pthread_mutex_lock(&ua_intl.backup_lock);
 				if (!get_body_rollback_from_json(jsonObj, &rollback)
 				    && rollback
 				    && !get_pkg_rollback_version_from_json(jsonObj, &pkgInfo.rollback_version))
 					remove_old_backup(backup_manifest, pkgInfo.rollback_version);
 				else
 					remove_old_backup(backup_manifest, pkgInfo.version);
+				pthread_mutex_unlock(&ua_intl.backup_lock);
 
 				A_INFO_MSG("Removing update_manifest %s", update_manifest);
 				remove(update_manifest);
 
 				if (uacc->uar->on_confirm_update) {
+					TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 					ua_callback_ctl_t uactl = {0};
 					uactl.type     = pkgInfo.type;
@@ -1422,6 +1758,7 @@ static void process_confirm_update(ua_component_context_t* uacc, json_object* js
 #else
 					(uacc->uar->on_confirm_update)(pkgInfo.type, pkgInfo.name, pkgInfo.version);
 #endif
+					TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_confirm_update", pkgInfo.name, 0);
 				}
 
 			} else {
@@ -1436,6 +1773,11 @@ static void process_confirm_update(ua_component_context_t* uacc, json_object* js
 			rmdirp(delta_dir);
 		}
 
+		if (view_dir && !access(view_dir, F_OK)) {
+			A_INFO_MSG("Deleting %s", view_dir);
+			rmdirp(view_dir);
+		}
+
 		if (!access(temp_delta_dir, R_OK)) {
 			A_INFO_MSG("Deleting %s\n", temp_delta_dir);
 			remove(temp_delta_dir);
@@ -1461,6 +1803,7 @@ static void process_confirm_update(ua_component_context_t* uacc, json_object* js
 
 		Z_FREE(delta_dir);
 		Z_FREE(temp_delta_dir);
+		Z_FREE(view_dir);
 		Z_FREE(backup_manifest);
 		Z_FREE(update_manifest);
 		uacc->retry_cnt = 0;
@@ -1605,6 +1948,127 @@ static void process_update_status(ua_component_context_t* uacc, json_object* jso
 
 }
 
+static void process_query_metrics(ua_component_context_t* uacc, json_object* jsonObj)
+{
+	char* replyId        = NULL;
+	ua_metric_t* metrics = NULL;
+	int cnt              = 0;
+
+	if (get_replyid_from_json(jsonObj, &replyId)) {
+		A_ERROR_MSG("query-metrics has no reply-id");
+		return;
+	}
+
+	json_object* metricsObject = json_object_new_object();
+
+	if ((cnt = ua_get_metrics(NULL, 0)) > 0) {
+		metrics = f_malloc(cnt * sizeof(ua_metric_t));
+		cnt     = ua_get_metrics(metrics, cnt);
+	}
+
+	for (int i = 0; i < cnt; i++) {
+		ua_metric_t* m = &metrics[i];
+
+		if (m->type == UA_METRIC_HISTOGRAM) {
+			json_object* histObject  = json_object_new_object();
+			json_object* bucketArray = json_object_new_array();
+			int last                 = UA_METRIC_BUCKETS - 1;
+
+			while (last > 0 && !m->buckets[last])
+				last--;
+			for (int b = 0; b <= last; b++)
+				json_object_array_add(bucketArray, json_object_new_int64(m->buckets[b]));
+
+			json_object_object_add(histObject, "count", json_object_new_int64(m->value));
+			json_object_object_add(histObject, "sum", json_object_new_int64(m->sum));
+			json_object_object_add(histObject, "max", json_object_new_int64(m->max));
+			json_object_object_add(histObject, "buckets", bucketArray);
+			json_object_object_add(metricsObject, m->name, histObject);
+
+		} else {
+			json_object_object_add(metricsObject, m->name, json_object_new_int64(m->value));
+		}
+	}
+
+	json_object* bodyObject = json_object_new_object();
+	json_object_object_add(bodyObject, "type", json_object_new_string(uacc->type));
+	json_object_object_add(bodyObject, "metrics", metricsObject);
+
+	json_object* jObject = json_object_new_object();
+	json_object_object_add(jObject, "type", json_object_new_string(BMT_QUERY_METRICS));
+	json_object_object_add(jObject, "reply-to", json_object_new_string(replyId));
+	json_object_object_add(jObject, "body", bodyObject);
+
+	ua_send_message(jObject);
+
+	json_object_put(jObject);
+	f_free(metrics);
+}
+
+/*
+ * Read an integer field of the body into field, which is left as it is
+ * when the body does not have it.
+ */
+static int get_budget_field(json_object* jsonObj, const char* name, int* field)
+{
+	int64_t value;
+
+	if (json_get_property(jsonObj, json_type_int, &value, "body", name, NULL))
+		return E_UA_OK;
+
+	if (value < INT_MIN || value > INT_MAX)
+		return E_UA_ARG;
+
+	*field = (int)value;
+
+	return E_UA_OK;
+}
+
+/*
+ * Fields missing from the body keep their current value; the budget in
+ * effect is sent back when the message has a reply-id.
+ */
+static void process_resource_budget(ua_component_context_t* uacc, json_object* jsonObj)
+{
+	char* replyId = NULL;
+	ua_budget_t budget;
+	int err;
+
+	scheduler_get_budget(&budget);
+
+	err = get_budget_field(jsonObj, "io-kbps", &budget.io_kbps) |
+	      get_budget_field(jsonObj, "cpu-share", &budget.cpu_share) |
+	      get_budget_field(jsonObj, "nice", &budget.nice) |
+	      get_budget_field(jsonObj, "io-prio", &budget.io_prio) |
+	      get_budget_field(jsonObj, "idle", &budget.idle);
+
+	if (err || (err = scheduler_budget(&budget)))
+		A_ERROR_MSG("resource-budget out of range: %s", json_object_to_json_string(jsonObj));
+
+	if (get_replyid_from_json(jsonObj, &replyId))
+		return;
+
+	scheduler_get_budget(&budget);
+
+	json_object* bodyObject = json_object_new_object();
+	json_object_object_add(bodyObject, "type", json_object_new_string(uacc->type));
+	json_object_object_add(bodyObject, "status", json_object_new_string(err ? "failed" : "ok"));
+	json_object_object_add(bodyObject, "io-kbps", json_object_new_int(budget.io_kbps));
+	json_object_object_add(bodyObject, "cpu-share", json_object_new_int(budget.cpu_share));
+	json_object_object_add(bodyObject, "nice", json_object_new_int(budget.nice));
+	json_object_object_add(bodyObject, "io-prio", json_object_new_int(budget.io_prio));
+	json_object_object_add(bodyObject, "idle", json_object_new_int(budget.idle));
+
+	json_object* jObject = json_object_new_object();
+	json_object_object_add(jObject, "type", json_object_new_string(BMT_RESOURCE_BUDGET));
+	json_object_object_add(jObject, "reply-to", json_object_new_string(replyId));
+	json_object_object_add(jObject, "body", bodyObject);
+
+	ua_send_message(jObject);
+
+	json_object_put(jObject);
+}
+
 static void process_query_updates(ua_component_context_t* uacc, json_object* jsonObj)
 {
 	char* replyTo;
@@ -1630,6 +2094,8 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 	char* installedVer    = 0;
 	int err               = E_UA_OK;
 	pkg_info_t* pkgInfo   = (uacc != NULL) ? &uacc->update_pkg : NULL;
+	pkg_handle_t* ph      = NULL;
+	int view              = bck && backup_view_ok(pkgFile);
 
 	updateFile->version = f_strdup(pkgFile->version);
 
@@ -1639,44 +2105,37 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 			A_ERROR_MSG("UA:on_transfer_file returned error");
 	}
 
-	if (err == E_UA_OK && !ua_intl.package_verification_disabled) {
-		if (S(pkgFile->delta_sha256b64))
+	if (err == E_UA_OK && !ua_intl.package_verification_disabled && !view) {
+		if (bck && pkgFile->stored) {
+			// reassembled from the backup store with new headers, only the members are as backed up
+			if (sha256xcmp(pkgFile->file, pkgFile->sha_of_sha)) {
+				A_ERROR_MSG("Backup %s does not match its sha-of-sha", pkgFile->file);
+				err = E_UA_ERR;
+			}
+		} else if (S(pkgFile->delta_sha256b64))
 			err =  verify_file_hash_b64(pkgFile->file, pkgFile->delta_sha256b64);
 		else
 			err =  verify_file_hash_b64(pkgFile->file, pkgFile->sha256b64);
 	}
 
 	if(err == E_UA_OK) {
-#ifdef LIBUA_VER_2_0
-		ua_callback_ctl_t uactl = {0};
-		uactl.type     = pkgInfo->type;
-		uactl.pkg_name = pkgInfo->name;
-		uactl.ref      = uacc->usr_ref;
-		if ((err = (*uar->on_get_version)(&uactl)) == E_UA_OK)
-			installedVer = uactl.version;
-		else {
-			A_INFO_MSG("prepare update get versin failed with error = %d", uactl.update_error);
-			*ue = uactl.update_error;
-		}
-
-#else
-		err = (*uar->on_get_version)(pkgInfo->type, pkgInfo->name, &installedVer);
-		if (err != E_UA_OK) {
+		err = get_installed_version(uacc, pkgInfo->type, pkgInfo->name, NULL, &installedVer, ue);
+		if (err != E_UA_OK)
 			A_ERROR_MSG("prepare update get version for %s failed!", pkgInfo->name);
-		}
-
-#endif
 	}
 
 
 		
-	if (err == E_UA_OK && ua_intl.delta && is_delta_package(pkgFile->file) && !is_prepared_delta_package(pkgFile->file)) {
+	if (err == E_UA_OK && (ua_intl.delta || uacc->update_manifest != NULL))
+		ph = pkg_open(pkgFile->file);
+
+	if (err == E_UA_OK && ua_intl.delta && is_delta_package_ph(ph) && !is_prepared_delta_package_ph(ph)) {
 		char* bname = f_basename(pkgFile->file);
 		updateFile->file = JOIN(ua_intl.cache_dir, "delta", bname);
 		free(bname);
 
 
-		if (uacc->backup_manifest == NULL || (err = patch_delta(uacc->backup_manifest, installedVer, pkgFile->file, updateFile->file)) == E_UA_ERR) {
+		if (uacc->backup_manifest == NULL || (err = patch_delta(uacc->backup_manifest, installedVer, ph, updateFile->file)) == E_UA_ERR) {
 			if (err == E_UA_ERR)
 				*ue = UE_INCREMENTAL_FAILED;
 			state = INSTALL_FAILED;
@@ -1686,7 +2145,7 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 		updateFile->downloaded = 0;
 
 	} else {
-		updateFile->file = f_strdup(pkgFile->file);
+		updateFile->file = view ? backup_view(pkgInfo, pkgFile) : f_strdup(pkgFile->file);
 		memcpy(updateFile->sha256b64, pkgFile->sha256b64, sizeof(updateFile->sha256b64));
 		if (err == E_UA_OK)
 			updateFile->downloaded = 1;
@@ -1694,6 +2153,7 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 
 	if (err == E_UA_OK) {
 		if (uar->on_prepare_install) {
+			TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 			ua_callback_ctl_t uactl = {0};
 			uactl.type     = pkgInfo->type;
@@ -1712,6 +2172,7 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 #else
 			state = (*uar->on_prepare_install)(pkgInfo->type, pkgInfo->name, updateFile->version, updateFile->file, &newFile);
 #endif
+			TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_prepare_install", pkgInfo->name, 0);
 			if (S(newFile)) {
 				A_INFO_MSG("UA indicated to update using this new file: %s", newFile);
 				free(updateFile->file);
@@ -1726,14 +2187,30 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 
 	if (state == INSTALL_READY) {
 		if (uacc->update_manifest != NULL) {
-			if (!calc_sha256_x(updateFile->file, updateFile->sha_of_sha)) {
+			// the UA may have swapped the file for another one
+			view = view && same_file(updateFile->file, pkgFile->file);
+
+			if (view)
+				memcpy(updateFile->sha_of_sha, pkgFile->sha_of_sha, sizeof(updateFile->sha_of_sha));
+			else if (ph && !strcmp(ph->file, updateFile->file))
+				err = pkg_sha256_x(ph, updateFile->sha_of_sha);
+			else
+				err = calc_sha256_x(updateFile->file, updateFile->sha_of_sha);
+
+			if (!err && view) {
+				add_pkg_file_manifest_verified(uacc->update_manifest, updateFile);
+			} else if (!err) {
 				add_pkg_file_manifest(uacc->update_manifest, updateFile);
+				if (!bck && !ua_intl.backup_dedup && !is_delta_package(updateFile->file))
+					bkmaint_stage(uacc->update_pkg.name, updateFile);
 			} else {
 				A_ERROR_MSG("Error in calculating sha_of_sha, returning INSTALL_FAILED");
 				state = INSTALL_FAILED;
 			}
 		}
 	}
+	pkg_close(ph);
+	Z_FREE(installedVer);
 	return state;
 
 }
@@ -1746,6 +2223,7 @@ static int transfer_file_action(ua_component_context_t* uacc, pkg_info_t* pkgInf
 	char* newFile     = NULL;
 
 	if (uar && uar->on_transfer_file && pkgInfo) {
+		TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 		ua_callback_ctl_t uactl = {0};
 		uactl.type     = pkgInfo->type;
@@ -1759,6 +2237,7 @@ static int transfer_file_action(ua_component_context_t* uacc, pkg_info_t* pkgInf
 #else
 		ret = (*uar->on_transfer_file)(pkgInfo->type, pkgInfo->name, pkgFile->version, pkgFile->file, &newFile);
 #endif
+		TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_transfer_file", pkgInfo->name, 0);
 		if (!ret && S(newFile)) {
 			A_INFO_MSG("UA transfered file %s to new path %s", pkgFile->file, newFile);
 			pkgFile->file = newFile;
@@ -1777,6 +2256,7 @@ static download_state_t prepare_download_action(ua_component_context_t* uacc, pk
 	download_state_t state = DOWNLOAD_CONSENT;
 
 	if (uar && uar->on_prepare_download) {
+		TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 		ua_callback_ctl_t uactl = {0};
 		uactl.type     = update_pkg->type;
@@ -1789,6 +2269,7 @@ static download_state_t prepare_download_action(ua_component_context_t* uacc, pk
 #else
 		state = (*uar->on_prepare_download)(update_pkg->type, update_pkg->name, update_pkg->version);
 #endif
+		TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_prepare_download", update_pkg->name, 0);
 		send_download_status(uacc, update_pkg, state);
 	}
 
@@ -1811,6 +2292,7 @@ install_state_t pre_update_action(ua_component_context_t* uacc)
 	pkg_file_t* pkgFile   = &uacc->update_file_info;
 
 	if (uar->on_pre_install) {
+		TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 		ua_callback_ctl_t uactl = {0};
 		uactl.type     = pkgInfo->type;
@@ -1823,6 +2305,7 @@ install_state_t pre_update_action(ua_component_context_t* uacc)
 #else
 		state = (*uar->on_pre_install)(pkgInfo->type, pkgInfo->name, pkgFile->version, pkgFile->file);
 #endif
+		TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_pre_install", pkgInfo->name, 0);
 	}
 	if (state == INSTALL_IN_PROGRESS) {
 		//Send update-status (INSTALL_IN_PROGRESS) with reply-id
@@ -1873,6 +2356,7 @@ install_state_t update_action(ua_component_context_t* uacc)
 			return INSTALL_FAILED;
 		}
 		A_INFO_MSG("Asking UA to install version %s with file %s.", pkgFile->version, pkgFile->file);
+		TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 		ua_callback_ctl_t uactl = {0};
 		uactl.type        = pkgInfo->type;
@@ -1886,7 +2370,9 @@ install_state_t update_action(ua_component_context_t* uacc)
 #else
 		state = (*uar->on_install)(pkgInfo->type, pkgInfo->name, pkgFile->version, pkgFile->file);
 #endif
+		TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_install", pkgInfo->name, 0);
 		if ((state == INSTALL_COMPLETED) && uar->on_set_version) {
+			TRACE_START(t_sv);
 #ifdef LIBUA_VER_2_0
 			ua_callback_ctl_t uactl = {0};
 			uactl.type     = pkgInfo->type;
@@ -1900,6 +2386,8 @@ install_state_t update_action(ua_component_context_t* uacc)
 			err = (*uar->on_set_version)(pkgInfo->type, pkgInfo->name, pkgFile->version);
 
 #endif
+			TRACE_SPAN(t_sv, TRACE_CAT_CALLBACK, "on_set_version", pkgInfo->name, 0);
+			ua_invalidate_version_cache(pkgInfo->name);
 			if (err != E_UA_OK)
 				A_INFO_MSG("set version for %s failed!", pkgInfo->name);
 
@@ -1930,7 +2418,10 @@ void post_update_action(ua_component_context_t* uacc)
 		return;
 	}
 
+	ua_invalidate_version_cache(uacc->update_pkg.name);
+
 	if (uar->on_post_install) {
+		TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 		ua_callback_ctl_t uactl = {0};
 		uactl.type     = uacc->update_pkg.type;
@@ -1942,6 +2433,7 @@ void post_update_action(ua_component_context_t* uacc)
 #else
 		(*uar->on_post_install)(uacc->update_pkg.type, uacc->update_pkg.name);
 #endif
+		TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_post_install", uacc->update_pkg.name, 0);
 	}
 
 }
@@ -2016,6 +2508,7 @@ int send_install_status(ua_component_context_t* uacc, install_state_t state, pkg
 	err = ua_send_message(jObject);
 
 	json_object_put(jObject);
+	f_free(custom_msg);
 
 	return err;
 
@@ -2111,6 +2604,8 @@ static int backup_package(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg
 
 	char* bname = f_basename(pkgFile->file);
 
+	TRACE_START(t_bck);
+
 	if (backupFile != NULL && bname != NULL && uacc->backup_manifest != NULL) {
 		backupFile->file       = JOIN(ua_intl.backup_dir, "backup", pkgInfo->name, pkgFile->version, bname);
 		backupFile->version    = f_strdup(pkgFile->version);
@@ -2121,6 +2616,7 @@ static int backup_package(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg
 			strcpy_s(backupFile->sha_of_sha, pkgFile->sha_of_sha, sizeof(backupFile->sha_of_sha));
 
 			if (!strcmp(pkgFile->file, backupFile->file) ||
+			    same_file(pkgFile->file, backupFile->file) ||
 			    !sha256xcmp(backupFile->file, backupFile->sha256b64)) {
 				A_INFO_MSG("Back up already exists: %s", backupFile->file);
 
@@ -2143,12 +2639,23 @@ static int backup_package(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg
 
 				}
 
-				if (make_file_hard_link(src_file, backupFile->file) != E_UA_OK)
-					err = copy_file(src_file, backupFile->file);
-				if (err == E_UA_OK)
-					add_pkg_file_manifest(uacc->backup_manifest, backupFile);
-				else
-					A_INFO_MSG("Backing up failed: %s", backupFile->file);
+				if (ua_intl.backup_dedup && backup_to_store(uacc, backupFile, src_file) == E_UA_OK) {
+					TRACE_SPAN(t_bck, TRACE_CAT_BACKUP, "backup", pkgInfo->name, 0);
+
+				} else if (access(backupFile->file, F_OK) &&
+				           bkmaint_take(pkgInfo->name, backupFile, src_file, backupFile->file) == E_UA_OK) {
+					TRACE_SPAN(t_bck, TRACE_CAT_BACKUP, "backup", pkgInfo->name, trace_file_size(backupFile->file));
+					add_pkg_file_manifest_verified(uacc->backup_manifest, backupFile);
+
+				} else {
+					if (make_file_hard_link(src_file, backupFile->file) != E_UA_OK)
+						err = copy_file(src_file, backupFile->file);
+					TRACE_SPAN(t_bck, TRACE_CAT_BACKUP, "backup", pkgInfo->name, trace_file_size(backupFile->file));
+					if (err == E_UA_OK)
+						add_pkg_file_manifest(uacc->backup_manifest, backupFile);
+					else
+						A_INFO_MSG("Backing up failed: %s", backupFile->file);
+				}
 
 				if (src_file != pkgFile->file) {
 					A_INFO_MSG("Removing installation file after backup: %s", src_file);
@@ -2169,6 +2676,57 @@ static int backup_package(ua_component_context_t* uacc, pkg_info_t* pkgInfo, pkg
 	return err;
 }
 
+static int backup_view_ok(pkg_file_t* pkgFile)
+{
+	file_stamp_t fs;
+
+	return ua_intl.rollback_view && S(pkgFile->sha_of_sha) &&
+	       !file_stamp(pkgFile->file, &fs) && file_stamp_eq(&pkgFile->verified, &fs);
+}
+
+static char* backup_view(pkg_info_t* pkgInfo, pkg_file_t* pkgFile)
+{
+	struct stat st;
+	char* bname = f_basename(pkgFile->file);
+	char* view  = (bname && S(ua_intl.cache_dir)) ? JOIN(ua_intl.cache_dir, pkgInfo->name, BACKUP_VIEW_DIR, bname) : NULL;
+
+	// a hard link shares the inode, so the backup itself becomes read-only
+	if (!stat(pkgFile->file, &st) && (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
+		chmod(pkgFile->file, st.st_mode & ~(S_IWUSR | S_IWGRP | S_IWOTH) & 07777);
+
+	if (!view || make_file_hard_link(pkgFile->file, view) != E_UA_OK) {
+		Z_FREE(view);
+		view = f_strdup(pkgFile->file);
+	}
+
+	A_INFO_MSG("Using verified backup %s for rollback, no copy or re-hash", view);
+	f_free(bname);
+
+	return view;
+}
+
+static int backup_to_store(ua_component_context_t* uacc, pkg_file_t* backupFile, const char* src_file)
+{
+	int err             = E_UA_OK;
+	bks_entry_t* recipe = NULL;
+
+	do {
+		BOLT_IF(sha256xcmp(src_file, backupFile->sha_of_sha), E_UA_ERR, "Possibly corrupted package file (%s), not stored", src_file);
+		BOLT_SUB(bkstore_put(uacc->backup_manifest, src_file, &recipe));
+
+		if ((err = add_pkg_store_manifest(uacc->backup_manifest, backupFile, recipe)) != E_UA_OK)
+			bkstore_release(uacc->backup_manifest, recipe);
+
+	} while (0);
+
+	bkstore_free(recipe);
+
+	if (err)
+		A_INFO_MSG("Backup store not used for %s, keeping full copy", src_file);
+
+	return err;
+}
+
 
 static char* install_state_string(install_state_t state)
 {
@@ -2350,20 +2908,25 @@ void handler_set_internal_state(ua_internal_state_t st)
 int ua_rollback_disabled(const char* pkgName)
 {
 	comp_ctrl_t* rbc = NULL;
+	int disabled     = 0;
 
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, rbc);
 	if (rbc) {
 		A_INFO_MSG("rollback_disabled flag for %s is set (%d)", rbc->pkg_name, rbc->rb_disable);
-		return rbc->rb_disable;
+		disabled = rbc->rb_disable;
 	}
+	comp_ctrl_unlock();
 
-	return 0;
+	return disabled;
 }
 
 static int send_query_updates(void)
 {
 	int err = E_UA_ERR;
 
+	pthread_mutex_lock(&ua_intl.lock);
+
 	if (ua_intl.query_reply_id == NULL) {
 		json_object* jObject    = json_object_new_object();
 		ua_intl.query_reply_id = randstring(REPLY_ID_STR_LEN);
@@ -2379,6 +2942,8 @@ static int send_query_updates(void)
 
 	}
 
+	pthread_mutex_unlock(&ua_intl.lock);
+
 	return err;
 }
 
@@ -2416,6 +2981,7 @@ void ua_rollback_control(const char* pkgName, int disable)
 {
 	comp_ctrl_t* rbc = NULL;
 
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, rbc);
 	if (rbc) {
 		if (!disable) {
@@ -2436,6 +3002,7 @@ void ua_rollback_control(const char* pkgName, int disable)
 			HASH_ADD_KEYPTR( hh, ua_intl.component_ctrl, rbc->pkg_name, strlen(rbc->pkg_name), rbc);
 		}
 	}
+	comp_ctrl_unlock();
 
 }
 
@@ -2445,6 +3012,7 @@ static int is_fake_rb_version_enabled(const char* pkgName, int* dl_required)
 	int enabled = 0;
 
 	if(pkgName){
+		comp_ctrl_lock();
 		HASH_FIND_STR(ua_intl.component_ctrl, pkgName, ctl);
 		if (ctl) {
 			enabled = ctl->enable_fake_rb_version;
@@ -2452,6 +3020,7 @@ static int is_fake_rb_version_enabled(const char* pkgName, int* dl_required)
 				*dl_required = ctl->rb_download_required;
 
 		}
+		comp_ctrl_unlock();
 	}
 
 	return enabled;
@@ -2464,6 +3033,7 @@ int ua_enable_fake_rollback_version(const char* pkgName)
 	if(!pkgName) return E_UA_ERR;
 	A_INFO_MSG("Enable fake rollback for %s", pkgName);
 
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, rbc);
 	if (rbc) {
 		rbc->enable_fake_rb_version = 1;
@@ -2475,6 +3045,7 @@ int ua_enable_fake_rollback_version(const char* pkgName)
 			rbc->enable_fake_rb_version = 1;
 			HASH_ADD_KEYPTR( hh, ua_intl.component_ctrl, rbc->pkg_name, strlen(rbc->pkg_name), rbc);
 	}
+	comp_ctrl_unlock();
 
 	return E_UA_OK;
 
@@ -2487,6 +3058,7 @@ int ua_config_rollback_with_empty_backup(const char* pkgName, int enable, int do
 	if(!pkgName) return E_UA_ERR;
 	A_INFO_MSG("Config rb with empty backup for %s, enable = %d, dl_required = %d", pkgName, download_required);
 
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, rbc);
 	if (rbc) {
 		rbc->enable_fake_rb_version = enable;
@@ -2500,6 +3072,7 @@ int ua_config_rollback_with_empty_backup(const char* pkgName, int enable, int do
 			rbc->rb_download_required = download_required;
 			HASH_ADD_KEYPTR( hh, ua_intl.component_ctrl, rbc->pkg_name, strlen(rbc->pkg_name), rbc);
 	}
+	comp_ctrl_unlock();
 
 	return E_UA_OK;
 
@@ -2523,11 +3096,14 @@ char* get_component_custom_message(char* pkgName)
 		return message;
 	}
 
+	// a copy, the entry's message may be replaced as soon as the lock is dropped
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, cs);
 	if (cs && cs->custom_msg) {
-		message = cs->custom_msg;
+		message = f_strdup(cs->custom_msg);
 		//A_INFO_MSG("custom message of %s is %s", pkgName, message ? message : "NIL");
 	}
+	comp_ctrl_unlock();
 	return message;
 }
 
@@ -2541,6 +3117,7 @@ int ua_set_custom_message(const char* pkgName, char* message)
 		return E_UA_ERR;
 	}
 
+	comp_ctrl_lock();
 	HASH_FIND_STR(ua_intl.component_ctrl, pkgName, cs);
 	if (cs) {
 		Z_FREE(cs->custom_msg);
@@ -2560,6 +3137,7 @@ int ua_set_custom_message(const char* pkgName, char* message)
 			HASH_ADD_KEYPTR( hh,  ua_intl.component_ctrl, cs->pkg_name, strlen(cs->pkg_name ), cs );
 		}
 	}
+	comp_ctrl_unlock();
 
 	return rc;
 }
@@ -2643,6 +3221,128 @@ char* ua_get_cur_campaign_id(void)
 	return ua_intl.cur_campaign_id;
 }
 
+int ua_get_metrics(ua_metric_t* metrics, int count)
+{
+	return metrics_snapshot(metrics, count);
+}
+
+int ua_set_budget(const ua_budget_t* budget)
+{
+	return scheduler_budget(budget);
+}
+
+void ua_get_budget(ua_budget_t* budget)
+{
+	if (budget)
+		scheduler_get_budget(budget);
+}
+
+int ua_delta_plan(const char* old_pkg, const char* diff_pkg, const char* new_pkg, ua_delta_plan_t* plan)
+{
+	if (!S(old_pkg) || !S(diff_pkg) || !plan)
+		return E_UA_ARG;
+
+	return delta_plan(old_pkg, diff_pkg, new_pkg, plan);
+}
+
+void ua_delta_plan_free(ua_delta_plan_t* plan)
+{
+	if (plan)
+		delta_plan_free(plan);
+}
+
+int get_installed_version(ua_component_context_t* uacc, const char* type, const char* pkgName, char* pkgPath, char** version, update_err_t* ue)
+{
+	int err           = E_UA_OK;
+	char* ver         = NULL;
+	ver_cache_t* vc   = NULL;
+	ua_routine_t* uar = uacc->uar;
+
+	*version = NULL;
+
+	if (ua_intl.cache_version && pkgName) {
+		pthread_mutex_lock(&ver_cache_lock);
+		HASH_FIND_STR(ver_cache, pkgName, vc);
+		// the version of another package path is asked again
+		if (vc && !strcmp(S(vc->pkg_path) ? vc->pkg_path : "", S(pkgPath) ? pkgPath : ""))
+			*version = f_strdup(vc->version);
+		pthread_mutex_unlock(&ver_cache_lock);
+
+		if (*version) {
+			A_DEBUG_MSG("cached version of %s : %s", pkgName, *version);
+			metrics_add(M_VERSION_CACHE_HIT, 1);
+			return E_UA_OK;
+		}
+	}
+
+	TRACE_START(t_cb);
+#ifdef LIBUA_VER_2_0
+	ua_callback_ctl_t uactl = {0};
+	uactl.type     = type;
+	uactl.pkg_name = pkgName;
+	uactl.pkg_path = pkgPath;
+	uactl.ref      = uacc->usr_ref;
+	if ((err = (*uar->on_get_version)(&uactl)) == E_UA_OK)
+		ver = uactl.version;
+	else if (ue)
+		*ue = uactl.update_error;
+
+#else
+	err = (*uar->on_get_version)(type, pkgName, &ver);
+#endif
+	TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_get_version", pkgName, 0);
+
+	if (err == E_UA_OK && ver) {
+		*version = f_strdup(ver);
+
+		if (ua_intl.cache_version && pkgName && S(ver)) {
+			pthread_mutex_lock(&ver_cache_lock);
+			HASH_FIND_STR(ver_cache, pkgName, vc);
+			if (!vc) {
+				vc           = f_malloc(sizeof(ver_cache_t));
+				vc->pkg_name = f_strdup(pkgName);
+				HASH_ADD_KEYPTR( hh, ver_cache, vc->pkg_name, strlen(vc->pkg_name), vc);
+			}
+			Z_STRDUP(vc->version, ver);
+			Z_FREE(vc->pkg_path);
+			if (S(pkgPath))
+				vc->pkg_path = f_strdup(pkgPath);
+			pthread_mutex_unlock(&ver_cache_lock);
+		}
+	}
+
+	return err;
+}
+
+int ua_invalidate_version_cache(const char* pkgName)
+{
+	ver_cache_t* vc, * aux;
+
+	pthread_mutex_lock(&ver_cache_lock);
+
+	HASH_ITER(hh, ver_cache, vc, aux) {
+		if (!pkgName || !strcmp(vc->pkg_name, pkgName)) {
+			A_DEBUG_MSG("invalidate cached version of %s", vc->pkg_name);
+			HASH_DEL(ver_cache, vc);
+			f_free(vc->pkg_name);
+			f_free(vc->pkg_path);
+			f_free(vc->version);
+			free(vc);
+		}
+	}
+
+	pthread_mutex_unlock(&ver_cache_lock);
+
+	return E_UA_OK;
+}
+
+#ifdef SUPPORT_UA_TRACE
+int ua_trace_dump(const char* path)
+{
+	return trace_dump(path);
+}
+#endif
+
 #ifdef SUPPORT_SIGNATURE_VERIFICATION
 static void process_query_key(ua_component_context_t* uacc, json_object* jsonObj)
 {
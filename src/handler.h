@@ -5,6 +5,7 @@
 #ifndef UA_HANDLER_H_
 #define UA_HANDLER_H_
 #include "misc.h"
+#include "arena.h"
 #include <json.h>
 
 #ifdef LIBUA_VER_2_0
@@ -25,6 +26,9 @@
 #include <pthread.h>
 #define MSG_TIMEOUT 10
 
+// under cache_dir/<pkg>, read-only links to backups handed out for rollback
+#define BACKUP_VIEW_DIR "rbview"
+
 
 #if ESYNC_ALLIANCE
 #define BMT_PREFIX "esync."
@@ -46,6 +50,8 @@
 #define BMT_SESSION_REQUEST BMT_PREFIX "session-request"
 #define BMT_DOWNLOAD_POSTPONED BMT_PREFIX "download-postponed"
 #define BMT_QUERY_UPDATES  BMT_PREFIX "query-updates"
+#define BMT_QUERY_METRICS  BMT_PREFIX "query-metrics"
+#define BMT_RESOURCE_BUDGET BMT_PREFIX "resource-budget"
 
 
 
@@ -91,12 +97,28 @@ typedef struct pkg_file {
 	char sha256b64[SHA256_B64_LENGTH];
 	char delta_sha256b64[SHA256_B64_LENGTH];
 	char sha_of_sha[SHA256_B64_LENGTH];
+	// members are kept in the backup store, file exists only once checked out
+	int stored;
+	// file as it was when sha_of_sha was last checked against it, zero if unknown
+	file_stamp_t verified;
 } pkg_file_t;
 
+typedef enum msg_prio {
+	MSG_PRIO_QUERY,   // queries and replies, answered first
+	MSG_PRIO_COMMAND, // update commands, processed in order
+	MSG_PRIO_REPORT,  // reports, a newer one supersedes the queued one
+	MSG_PRIO_COUNT
+} msg_prio_t;
+
 typedef struct incoming_msg {
 	char* msg;
 	size_t msg_len;
 	uint64_t msg_ts;
+	msg_prio_t prio;
+	char* key;
+
+	// backs this struct, msg and key, released at once after dispatch
+	arena_t arena;
 
 	struct incoming_msg* next;
 	struct incoming_msg* prev;
@@ -115,6 +137,16 @@ typedef struct worker_info {
 
 } worker_info_t;
 
+typedef struct prepare_job {
+	char* pkg_name;
+	json_object* jobj;
+	int active;
+
+	struct prepare_job* next;
+	struct prepare_job* prev;
+
+} prepare_job_t;
+
 typedef enum esync_bus_conn_state {
 	BUS_CONN_NONE,
 	BUS_CONN_BROKER_NOT_CONNECTED,
@@ -175,6 +207,16 @@ typedef struct comp_ctrl {
 
 }comp_ctrl_t;
 
+/* version reported by on_get_version(), for the package path it was asked with */
+typedef struct ver_cache {
+	char* pkg_name;
+	char* pkg_path;
+	char* version;
+
+	UT_hash_handle hh;
+
+}ver_cache_t;
+
 
 typedef struct comp_sequence {
 	char* name;
@@ -215,6 +257,13 @@ typedef struct ua_internal {
 	int dmc_handler_done;
 	int async_query_package;
 	int qp_failure_response;
+	int metrics_query;
+	int budget_message;
+	uint64_t msg_timeout_ms;
+	int cache_version;
+	int prepare_workers;
+	int backup_dedup;
+	int rollback_view;
 
 #if defined(SUPPORT_UA_DOWNLOAD) || defined(SUPPORT_SIGNATURE_VERIFICATION)
 	async_update_status_t update_status_info;
@@ -265,6 +314,10 @@ typedef struct ua_component_context {
 	int cleanup_ok_after_update;
 	int max_retry;
 	int retry_cnt;
+	prepare_job_t* prepare_jobs; //prepare-update requests queued or running.
+	int prepare_running;         //Number of prepare-update worker threads.
+	ua_component_context_t* parent; //Set on per-package prepare-update contexts.
+	struct rb_plan* rb_plan;        //Rollback candidates of the current rollback chain.
 
 	void* usr_ref;
 
@@ -276,7 +329,8 @@ typedef struct runner_info {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 	int run;
-	incoming_msg_t* queue;
+	incoming_msg_t* queue[MSG_PRIO_COUNT];
+	int queue_metric;
 	ua_component_context_t component;
 } runner_info_t;
 
@@ -288,6 +342,7 @@ install_state_t prepare_install_action(ua_component_context_t* uacc, pkg_file_t*
 install_state_t pre_update_action(ua_component_context_t* uacc);
 install_state_t update_action(ua_component_context_t* uacc);
 void post_update_action(ua_component_context_t* uacc);
+int get_installed_version(ua_component_context_t* uacc, const char* type, const char* pkgName, char* pkgPath, char** version, update_err_t* ue);
 
 void handler_set_internal_state(ua_internal_state_t st);
 int send_install_status(ua_component_context_t* uacc, install_state_t state, pkg_file_t* pkgFile, update_err_t ue);
@@ -0,0 +1,247 @@
+/*
+ * hash.c
+ */
+
+#include "hash.h"
+#include "debug.h"
+#include "metrics.h"
+#include "bulkio.h"
+#include "scheduler.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new  EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+static const char b64_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char hex_table[] = "0123456789abcdef";
+
+static pthread_once_t md_once = PTHREAD_ONCE_INIT;
+static const EVP_MD* sha256_md;
+
+typedef struct hash_pool {
+	int cnt;
+	int next;
+	int err;
+	int (*fn)(void* arg, int worker, int idx);
+	void* arg;
+	pthread_mutex_t lock;
+
+} hash_pool_t;
+
+typedef struct hash_worker {
+	hash_pool_t* pool;
+	int worker;
+
+} hash_worker_t;
+
+static void md_fetch(void)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	// explicitly fetched, so contexts skip the implicit provider lookup
+	sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#endif
+	if (!sha256_md)
+		sha256_md = EVP_sha256();
+
+	A_INFO_MSG("SHA-256 engine: %s", hash_engine());
+}
+
+const char* hash_engine(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int a, b, c, d;
+
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)))
+		return "SHA-NI";
+#elif defined(__aarch64__) && defined(__linux__) && defined(HWCAP_SHA2)
+	if (getauxval(AT_HWCAP) & HWCAP_SHA2)
+		return "ARMv8 SHA2";
+#endif
+	return "generic";
+}
+
+EVP_MD_CTX* hash_init(void)
+{
+	EVP_MD_CTX* ctx;
+
+	pthread_once(&md_once, md_fetch);
+
+	if ((ctx = EVP_MD_CTX_new()) && !EVP_DigestInit_ex(ctx, sha256_md, NULL)) {
+		EVP_MD_CTX_free(ctx);
+		ctx = NULL;
+	}
+
+	return ctx;
+}
+
+void hash_update(EVP_MD_CTX* ctx, const void* data, size_t len)
+{
+	EVP_DigestUpdate(ctx, data, len);
+}
+
+int hash_final(EVP_MD_CTX* ctx, unsigned char out[SHA256_DIGEST_LENGTH])
+{
+	unsigned int len = 0;
+	int ok           = EVP_DigestFinal_ex(ctx, out, &len);
+
+	EVP_MD_CTX_free(ctx);
+
+	return (ok && len == SHA256_DIGEST_LENGTH) ? E_UA_OK : E_UA_ERR;
+}
+
+void hash_free(EVP_MD_CTX* ctx)
+{
+	if (ctx) EVP_MD_CTX_free(ctx);
+}
+
+int hash_buf(const void* data, size_t len, unsigned char out[SHA256_DIGEST_LENGTH])
+{
+	EVP_MD_CTX* ctx = hash_init();
+
+	if (!ctx)
+		return E_UA_ERR;
+
+	hash_update(ctx, data, len);
+	return hash_final(ctx, out);
+}
+
+int hash_fd(int fd, unsigned char out[SHA256_DIGEST_LENGTH])
+{
+	int err           = E_UA_OK;
+	bulk_reader_t* br = bulk_open(fd, ua_rw_buff_size);
+	EVP_MD_CTX* ctx   = hash_init();
+	const void* data;
+	ssize_t nread;
+
+	do {
+		BOLT_IF(!ctx, E_UA_MEMORY, "failed to set up hashing");
+
+		// the next blocks are read while this one is hashed
+		while ((nread = bulk_next(br, &data)) != 0) {
+			BOLT_SYS(nread < 0, "reading data to hash");
+			hash_update(ctx, data, nread);
+			metrics_add(M_BYTES_HASHED, nread);
+		}
+		if (err) break;
+
+		err = hash_final(ctx, out);
+		ctx = NULL;
+
+	} while (0);
+
+	hash_free(ctx);
+	bulk_close(br);
+
+	return err;
+}
+
+void hash_hex(const unsigned char in[SHA256_DIGEST_LENGTH], char out[SHA256_HEX_LENGTH])
+{
+	for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		out[i * 2]     = hex_table[in[i] >> 4];
+		out[i * 2 + 1] = hex_table[in[i] & 0xf];
+	}
+	out[SHA256_DIGEST_LENGTH * 2] = 0;
+}
+
+void hash_b64(const unsigned char in[SHA256_DIGEST_LENGTH], char out[SHA256_B64_LENGTH])
+{
+	int i, j = 0;
+	uint32_t v;
+
+	for (i = 0; i + 3 <= SHA256_DIGEST_LENGTH; i += 3) {
+		v        = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2];
+		out[j++] = b64_table[(v >> 18) & 0x3f];
+		out[j++] = b64_table[(v >> 12) & 0x3f];
+		out[j++] = b64_table[(v >> 6) & 0x3f];
+		out[j++] = b64_table[v & 0x3f];
+	}
+
+	// 32 bytes leave two, encoded with one pad character
+	v        = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8;
+	out[j++] = b64_table[(v >> 18) & 0x3f];
+	out[j++] = b64_table[(v >> 12) & 0x3f];
+	out[j++] = b64_table[(v >> 6) & 0x3f];
+	out[j++] = '=';
+	out[j]   = 0;
+}
+
+static void* hash_worker(void* arg)
+{
+	hash_worker_t* w    = (hash_worker_t*)arg;
+	hash_pool_t* pool   = w->pool;
+	int idx, err;
+
+	if (w->worker)
+		scheduler_worker();
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		idx = pool->err ? pool->cnt : pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (idx >= pool->cnt)
+			break;
+
+		if ((err = pool->fn(pool->arg, w->worker, idx))) {
+			pthread_mutex_lock(&pool->lock);
+			if (!pool->err) pool->err = err;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return 0;
+}
+
+int hash_parallel(int cnt, int threads, int (*fn)(void* arg, int worker, int idx), void* arg)
+{
+	hash_pool_t pool = {.cnt = cnt, .fn = fn, .arg = arg};
+	hash_worker_t workers[HASH_MAX_THREADS];
+	pthread_t tids[HASH_MAX_THREADS];
+	int nthreads = threads > 0 ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int started  = 1;
+	int claimed;
+
+	if (nthreads > HASH_MAX_THREADS) nthreads = HASH_MAX_THREADS;
+	if (nthreads > cnt) nthreads = cnt;
+	if (nthreads < 1) nthreads = 1;
+	// helpers count against the CPU jobs of all workers, the calling
+	// thread stands in for its own job
+	claimed  = scheduler_claim(SCHED_CPU, nthreads - 1);
+	nthreads = 1 + claimed;
+
+	pthread_mutex_init(&pool.lock, 0);
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].pool   = &pool;
+		workers[i].worker = i;
+	}
+
+	// the calling thread is worker 0
+	for (; started < nthreads; started++) {
+		if (pthread_create(&tids[started], 0, hash_worker, &workers[started])) {
+			A_ERROR_MSG("pthread create");
+			break;
+		}
+	}
+
+	hash_worker(&workers[0]);
+
+	for (int i = 1; i < started; i++)
+		pthread_join(tids[i], 0);
+	scheduler_release(SCHED_CPU, claimed);
+
+	pthread_mutex_destroy(&pool.lock);
+
+	return pool.err;
+}
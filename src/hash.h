@@ -0,0 +1,51 @@
+/*
+ * hash.h
+ */
+
+#ifndef UA_HASH_H_
+#define UA_HASH_H_
+
+#include "misc.h"
+#include <openssl/evp.h>
+
+#define HASH_MAX_THREADS 16
+
+/*
+ * SHA-256 of the agent. The digest is fetched from OpenSSL once and every
+ * context is created from it; OpenSSL runs the SHA-NI / ARMv8 SHA2 code
+ * paths when the CPU has them, see hash_engine().
+ */
+EVP_MD_CTX* hash_init(void);
+void hash_update(EVP_MD_CTX* ctx, const void* data, size_t len);
+
+/*
+ * Write the digest and free ctx.
+ */
+int hash_final(EVP_MD_CTX* ctx, unsigned char out[SHA256_DIGEST_LENGTH]);
+void hash_free(EVP_MD_CTX* ctx);
+
+int hash_buf(const void* data, size_t len, unsigned char out[SHA256_DIGEST_LENGTH]);
+
+/*
+ * Digest of everything that can be read from fd.
+ */
+int hash_fd(int fd, unsigned char out[SHA256_DIGEST_LENGTH]);
+
+void hash_hex(const unsigned char in[SHA256_DIGEST_LENGTH], char out[SHA256_HEX_LENGTH]);
+void hash_b64(const unsigned char in[SHA256_DIGEST_LENGTH], char out[SHA256_B64_LENGTH]);
+
+/*
+ * Name of the SHA-256 instructions the CPU offers, "generic" if none.
+ */
+const char* hash_engine(void);
+
+/*
+ * Run fn for every idx in [0, cnt) on up to threads workers (0 = one per
+ * online CPU), so that several inputs are hashed at once. Helpers beyond
+ * the calling thread are taken from the CPU job budget. worker is the
+ * index of the calling worker, below HASH_MAX_THREADS. Stops handing out
+ * work after the first error and returns it.
+ */
+int hash_parallel(int cnt, int threads, int (*fn)(void* arg, int worker, int idx), void* arg);
+
+#endif /* UA_HASH_H_ */
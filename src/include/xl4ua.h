@@ -6,6 +6,8 @@
 #define XL4UA_H_
 
 #include <libxl4bus/types.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <libxl4bus/build_config.h>
 
 typedef enum install_state {
@@ -238,6 +240,24 @@ typedef struct delta_tool {
 
 } delta_tool_t;
 
+typedef enum delta_zip_method {
+	DZM_DEFLATE,
+	DZM_STORE,
+
+} delta_zip_method_t;
+
+typedef struct delta_zip_rule {
+	// file name suffix of the package entries this rule applies to, e.g. ".img"
+	char* suffix;
+
+	// compression method of matching entries
+	delta_zip_method_t method;
+
+	// deflate level 1-9 of matching entries, 0 = zip_level
+	int level;
+
+} delta_zip_rule_t;
+
 typedef struct delta_cfg {
 	char* delta_cap;
 	delta_tool_t* patch_tools;
@@ -245,6 +265,40 @@ typedef struct delta_cfg {
 	delta_tool_t* decomp_tools;
 	int decomp_tool_cnt;
 
+	// deflate level 1-9 of reconstructed packages, 0 = default (6).
+	// Entries that are already compressed are always stored.
+	int zip_level;
+
+	// number of threads compressing entries of a reconstructed package,
+	// 0 = default, number of online CPUs.
+	int zip_threads;
+
+	// per-entry compression rules, the first matching suffix applies.
+	delta_zip_rule_t* zip_rules;
+	int zip_rule_cnt;
+
+	// how the built-in espatch applies a patch,
+	// 0 = default, out of place: the reference is only read and the new file is
+	// written from the patch, retried in place if the patch requires it.
+	// 1 = out of place only.
+	// 2 = in place: the new file starts as a reflink (or copy) of the reference.
+	int patch_mode;
+
+	// threads of the built-in xz decompressor, blocks of a multi-block
+	// stream are decoded in parallel.
+	// 0 = default, number of online CPUs. 1 = single-threaded.
+	// Threads beyond the first are taken from the cpu_jobs budget.
+	int xz_threads;
+
+	// memory the built-in xz decompressor may use for threads, in MB. Above
+	// it fewer threads are used. 0 = default, a quarter of physical memory.
+	int xz_memlimit_mb;
+
+	// plan each reconstruction first (see ua_delta_plan()) and fail before
+	// extracting anything if cache_dir can not hold its peak use.
+	// 0 = default, no planning. 1 = check.
+	int space_check;
+
 } delta_cfg_t;
 
 typedef enum update_rollback {
@@ -285,6 +339,16 @@ typedef struct ua_cfg {
 	char* diag_dir;
 	#endif
 
+	#ifdef SUPPORT_UA_TRACE
+	// enables recording of update lifecycle trace events.
+	// 0 = default, tracing is disabled unless trace_file is set.
+	// n = number of most recent events kept in memory.
+	int trace_events;
+
+	// (optional) Chrome trace-event JSON file written on ua_stop.
+	char* trace_file;
+	#endif
+
 	// enables delta support
 	int delta;
 
@@ -337,6 +401,102 @@ typedef struct ua_cfg {
 	//1 = enabled, "failure" is sent on read version error.
 	int qp_failure_response;
 
+	//Indicate whether UA answers query-metrics messages on esyncbus.
+	//0 = default, query-metrics is ignored.
+	//1 = enabled, reply with a snapshot of libua metrics.
+	int metrics_query;
+
+	//Specifies how long, in seconds, an incoming esyncbus message may wait
+	//in the queue before it is dropped.
+	//0 = default, 10 seconds.
+	int msg_timeout;
+
+	//Cache the version returned by on_get_version per package and path, the cache is
+	//invalidated after on_set_version, post install, or ua_invalidate_version_cache().
+	//0 = default, on_get_version is called for every request.
+	//1 = enabled.
+	int cache_version;
+
+	//Maximum number of prepare-update requests of one handler processed
+	//concurrently, each package in its own worker thread.
+	//0 = default, one package at a time.
+	int prepare_workers;
+
+	//Maximum number of concurrent CPU-heavy jobs (patching, hashing) in libua.
+	//0 = default, number of online CPUs.
+	int cpu_jobs;
+
+	//Maximum number of concurrent I/O-heavy jobs (unzip, zip, copy) in libua.
+	//0 = default, 2.
+	int io_jobs;
+
+	//Interval, in seconds, of background backup maintenance run while UA is idle:
+	//backups are verified against their manifest, missing sha-of-sha values are
+	//recorded, stale and corrupted backups are removed, and prepared packages are
+	//pre-staged so that backing them up after installation is a rename.
+	//0 = default, disabled.
+	int backup_maintenance;
+
+	//I/O budget of backup maintenance, in KB per second.
+	//0 = default, 4096.
+	int backup_maint_kbps;
+
+	//Keep backups in a content-addressed store under backup_dir/backup/.store,
+	//each package member once per content, shared between versions and packages.
+	//A backup is reassembled when it is needed for rollback or delta reconstruction.
+	//0 = default, every backup is a full copy of the package.
+	//1 = enabled.
+	int backup_dedup;
+
+	//Hand a backup used for rollback to the UA as a read-only hard link, when the
+	//backup is unchanged since its sha-of-sha was last checked.
+	//0 = default, the backup is hashed again before every rollback.
+	//1 = enabled, the backup is made read-only and is not copied or hashed again.
+	int rollback_view;
+
+	//Number of reads kept in flight while files are copied, hashed or decompressed,
+	//when libua is built with SUPPORT_IO_URING.
+	//0 = default, 8.
+	//1 = one blocking read at a time.
+	int io_queue_depth;
+
+	//Page cache use of bulk file I/O (copy, hash, unzip, patch), to keep large
+	//packages from pushing the working set of other processes out of memory.
+	//0 = default, files are read and written through the page cache.
+	//1 = data is dropped from the page cache once consumed or written back.
+	//2 = as 1, and files are read with O_DIRECT where the file system allows it.
+	int io_cache_mode;
+
+	//I/O budget of bulk file I/O, in KB per second, shared by all threads.
+	//0 = default, unlimited.
+	int io_rate_kbps;
+
+	//CPU time of each update worker thread (prepare, install, backup maintenance),
+	//in percent of one CPU, see ua_set_budget().
+	//0 = default, unlimited.
+	int cpu_share;
+
+	//Nice value of update worker threads, 0 to 19.
+	//0 = default, unchanged.
+	int worker_nice;
+
+	//I/O priority of update worker threads.
+	//0 = default, unchanged.
+	//1 to 8 = best-effort class, level 0 to 7.
+	//9 = idle class.
+	int worker_io_prio;
+
+	//Run update worker threads with the SCHED_IDLE scheduling policy.
+	//0 = default, disabled.
+	//1 = enabled.
+	int worker_idle;
+
+	//Indicate whether UA accepts resource-budget messages on esyncbus, which
+	//change the budget of update work while it runs.
+	//0 = default, resource-budget is ignored.
+	//1 = enabled.
+	int budget_message;
+
 #ifdef SUPPORT_UA_DOWNLOAD
 	// specifies whether UA is to handle package download.
 	int ua_download_required;
@@ -348,6 +508,111 @@ typedef struct ua_cfg {
 } ua_cfg_t;
 
 
+typedef enum ua_metric_type {
+	UA_METRIC_COUNTER,
+	UA_METRIC_GAUGE,
+	UA_METRIC_HISTOGRAM
+} ua_metric_type_t;
+
+#define UA_METRIC_NAME_LEN 48
+#define UA_METRIC_BUCKETS  32
+
+typedef struct ua_metric {
+	// metric name, e.g. "msg_received" or "queue_depth:/ECU/ROOT"
+	char name[UA_METRIC_NAME_LEN];
+
+	ua_metric_type_t type;
+
+	// counter or gauge value, number of samples for histogram
+	int64_t value;
+
+	// (histogram) sum and largest of all samples
+	int64_t sum;
+	int64_t max;
+
+	// (histogram) buckets[0] counts samples <= 0,
+	// buckets[i] counts samples in [2^(i-1), 2^i), the last bucket is open ended.
+	uint64_t buckets[UA_METRIC_BUCKETS];
+
+} ua_metric_t;
+
+// resource budget of update work, see ua_set_budget()
+typedef struct ua_budget {
+	// bulk file I/O, in KB per second, shared by all threads, 0 = unlimited
+	int io_kbps;
+
+	// CPU time of each update worker thread, in percent of one CPU, 0 = unlimited
+	int cpu_share;
+
+	// nice value of update worker threads, 1 to 19, 0 = as the thread started
+	int nice;
+
+	// I/O priority of update worker threads, 0 = as the thread started,
+	// 1 to 8 = best-effort level 0 to 7, 9 = idle class
+	int io_prio;
+
+	// 1 = update worker threads run with the SCHED_IDLE policy
+	int idle;
+
+} ua_budget_t;
+
+// one entry of a delta reconstruction plan
+typedef struct ua_delta_plan_entry {
+	// name of the entry in the new package
+	char* name;
+
+	// "added", "removed", "changed" or "unchanged", as in manifest_diff.xml
+	const char* change;
+
+	// estimated size of the reconstructed entry, for a changed entry the
+	// larger of the old entry and its diff member
+	uint64_t new_size;
+
+	// bytes read and written to reconstruct and verify the entry
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+
+	// estimated time, in ms
+	uint64_t est_ms;
+
+} ua_delta_plan_entry_t;
+
+// resources a delta reconstruction needs, see ua_delta_plan()
+typedef struct ua_delta_plan {
+	// bytes used in the file system of cache_dir at the worst point
+	uint64_t peak_disk;
+
+	// bytes available in the file system of cache_dir when planned
+	uint64_t free_disk;
+
+	// memory allocated by libua at the worst point, external tools excluded
+	uint64_t peak_mem;
+
+	// all bytes read and written: extraction, entries and the new package
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+
+	// estimated size of the reconstructed package
+	uint64_t new_pkg_size;
+
+	// throughput of the device holding cache_dir, in KB per second
+	uint32_t read_kbps;
+	uint32_t write_kbps;
+
+	// estimated time of the whole reconstruction, in ms
+	uint64_t est_ms;
+
+	ua_delta_plan_entry_t* entries;
+	int entry_cnt;
+
+} ua_delta_plan_t;
+
+// package archive opened for random access, see ua_pkg_open()
+typedef struct pkg_handle ua_pkg_t;
+
+// entry of a package opened for random access, see ua_pkg_entry_open()
+typedef struct pkg_stream ua_pkg_entry_t;
+
 typedef struct ua_handler {
 	//component handler type
 	char* type_handler;
@@ -624,6 +889,139 @@ XL4_PUB
  */
 char* ua_get_cur_campaign_id(void);
 
+XL4_PUB
+/**
+ * Take a snapshot of libua internal metrics (message queue, hashing,
+ * copy and patch throughput, bus errors).
+ * @param metrics array to fill in, may be NULL to query the number of metrics.
+ * @param count number of elements in metrics array.
+ * @return number of metrics written to the array, or the number of
+ *         available metrics if metrics is NULL.
+ */
+int ua_get_metrics(ua_metric_t* metrics, int count);
+
+XL4_PUB
+/**
+ * Change the resource budget of update work (delta reconstruction, hashing,
+ * backup) while it runs, e.g. to slow it down during foreground-critical
+ * periods. Work in progress picks up the new budget at its next block.
+ * Without privileges, a thread's nice value, I/O priority and SCHED_IDLE
+ * policy can be lowered but not raised back; raising is attempted and
+ * otherwise applies to worker threads started afterwards.
+ * @param budget new budget, NULL to lift all limits.
+ * @return E_UA_OK on success, E_UA_ARG for values out of range.
+ */
+int ua_set_budget(const ua_budget_t* budget);
+
+XL4_PUB
+/**
+ * Get the resource budget of update work in effect.
+ * @param budget filled in with the budget.
+ */
+void ua_get_budget(ua_budget_t* budget);
+
+XL4_PUB
+/**
+ * Plan the reconstruction of a package from a delta package without
+ * extracting anything, only manifest_diff.xml and the ZIP central
+ * directories are read. Times are estimated from the throughput of the
+ * device holding cache_dir, measured once with a short write and read,
+ * and from the patch throughput seen so far.
+ * @param old_pkg package the delta applies to.
+ * @param diff_pkg delta package.
+ * @param new_pkg package to reconstruct, to tell whether it is written to
+ *        the file system of cache_dir. NULL if it is.
+ * @param plan filled in, release with ua_delta_plan_free().
+ * @return E_UA_OK on success, E_UA_ERR if a package can not be read.
+ */
+int ua_delta_plan(const char* old_pkg, const char* diff_pkg, const char* new_pkg, ua_delta_plan_t* plan);
+
+XL4_PUB
+/**
+ * Release the entries of a plan filled in by ua_delta_plan().
+ * @param plan plan to release.
+ */
+void ua_delta_plan_free(ua_delta_plan_t* plan);
+
+XL4_PUB
+/**
+ * Discard the cached installed version of a package, so that the next
+ * request calls on_get_version again. Only relevant when cache_version
+ * is enabled in ua_cfg_t.
+ * @param pkgName package name, or NULL to discard all cached versions.
+ * @return E_UA_OK.
+ */
+int ua_invalidate_version_cache(const char* pkgName);
+
+XL4_PUB
+/**
+ * Open a package archive for reading single entries without extracting it.
+ * @param archive pathname of zip archive.
+ * @return package handle, or NULL on failure.
+ */
+ua_pkg_t* ua_pkg_open(const char* archive);
+
+XL4_PUB
+/**
+ * Close a package handle. All entries must be closed first.
+ * @param pkg package handle returned by ua_pkg_open().
+ */
+void ua_pkg_close(ua_pkg_t* pkg);
+
+XL4_PUB
+/**
+ * Open an entry of the package for random access. Entries of one package
+ * may be opened and read from different threads.
+ * @param pkg package handle returned by ua_pkg_open().
+ * @param name entry name within the archive, e.g. "images/rootfs.img".
+ * @param size if not NULL, set to the uncompressed size of the entry.
+ * @return entry handle, or NULL if the entry does not exist.
+ */
+ua_pkg_entry_t* ua_pkg_entry_open(ua_pkg_t* pkg, const char* name, uint64_t* size);
+
+XL4_PUB
+/**
+ * Read entry data at a given offset. Stored entries are read directly from
+ * the archive file; compressed entries are decompressed, reading forward is
+ * fast and reading backward restarts decompression from the beginning.
+ * @param entry entry handle returned by ua_pkg_entry_open().
+ * @param buf buffer to read into.
+ * @param len number of bytes to read.
+ * @param offset offset within the uncompressed entry.
+ * @return number of bytes read, 0 at end of entry, or -1 on error.
+ */
+int64_t ua_pkg_pread(ua_pkg_entry_t* entry, void* buf, size_t len, uint64_t offset);
+
+XL4_PUB
+/**
+ * Map a stored (uncompressed) entry into memory without copying it.
+ * The mapping is valid until ua_pkg_entry_close().
+ * @param entry entry handle returned by ua_pkg_entry_open().
+ * @param addr set to the first byte of entry data.
+ * @param len if not NULL, set to the size of entry data.
+ * @return E_UA_OK, or E_UA_ERR if the entry is compressed.
+ */
+int ua_pkg_mmap(ua_pkg_entry_t* entry, const void** addr, uint64_t* len);
+
+XL4_PUB
+/**
+ * Close an entry handle and release its mapping, if any.
+ * @param entry entry handle returned by ua_pkg_entry_open().
+ */
+void ua_pkg_entry_close(ua_pkg_entry_t* entry);
+
+#ifdef SUPPORT_UA_TRACE
+XL4_PUB
+/**
+ * Write the recorded update lifecycle trace events to a file,
+ * in Chrome trace-event JSON format (chrome://tracing, Perfetto).
+ * Tracing is enabled by trace_events or trace_file in ua_cfg_t.
+ * @param path pathname of the output file.
+ * @return E_UA_OK on success, E_UA_ERR on failure
+ */
+int ua_trace_dump(const char* path);
+#endif /* SUPPORT_UA_TRACE */
+
 #ifdef HAVE_INSTALL_LOG_HANDLER
 typedef enum ua_log_type {
 	ua_debug_log,
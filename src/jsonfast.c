@@ -0,0 +1,376 @@
+/*
+ * jsonfast.c
+ */
+
+#include "jsonfast.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef JSON_TOKENER_DEFAULT_DEPTH
+#define JSON_TOKENER_DEFAULT_DEPTH 32
+#endif
+
+#define JSONF_KEY_BUF   256
+#define JSONF_INT_DIGITS 18
+
+// value not handled here, re-parse with json-c
+#define JSONF_FALLBACK -1
+
+typedef struct jsonf_ctx {
+	const char* p;
+	const char* end;
+	int depth;
+
+	// strings with escapes are decoded here
+	char* buf;
+	size_t buf_len;
+	char sbuf[JSONF_KEY_BUF];
+
+} jsonf_ctx_t;
+
+static int parse_value(jsonf_ctx_t* ctx, json_object** out);
+
+static inline void skip_ws(jsonf_ctx_t* ctx)
+{
+	const char* p = ctx->p;
+	while (p < ctx->end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+		p++;
+	ctx->p = p;
+}
+
+/*
+ * First '"' or '\\' in [p, end), or end.
+ */
+static inline const char* scan_string(const char* p, const char* end)
+{
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		int m     = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+		if (m)
+			return p + __builtin_ctz(m);
+		p += 16;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t quote = vdupq_n_u8('"');
+	const uint8x16_t bslash = vdupq_n_u8('\\');
+	while (end - p >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*)p);
+		if (vmaxvq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash))))
+			break;
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '"' && *p != '\\')
+		p++;
+	return p;
+}
+
+static int buf_reserve(jsonf_ctx_t* ctx, size_t len)
+{
+	if (len <= ctx->buf_len)
+		return 0;
+
+	size_t n  = ctx->buf_len * 2 > len ? ctx->buf_len * 2 : len;
+	char* buf = ctx->buf == ctx->sbuf ? malloc(n) : realloc(ctx->buf, n);
+	if (!buf)
+		return JSONF_FALLBACK;
+
+	if (ctx->buf == ctx->sbuf)
+		memcpy(buf, ctx->sbuf, sizeof(ctx->sbuf));
+	ctx->buf     = buf;
+	ctx->buf_len = n;
+	return 0;
+}
+
+/*
+ * Parse string starting after the opening quote. On return *str points
+ * into the input, or into ctx->buf if the string had escapes; it is not
+ * NUL terminated.
+ */
+static int parse_string(jsonf_ctx_t* ctx, const char** str, size_t* len)
+{
+	const char* start = ctx->p;
+	const char* p     = scan_string(start, ctx->end);
+	size_t n          = 0;
+
+	if (p >= ctx->end)
+		return JSONF_FALLBACK;
+
+	if (*p == '"') {
+		*str   = start;
+		*len   = p - start;
+		ctx->p = p + 1;
+		return 0;
+	}
+
+	while (1) {
+		size_t chunk = p - start;
+		if (buf_reserve(ctx, n + chunk + 1))
+			return JSONF_FALLBACK;
+		memcpy(ctx->buf + n, start, chunk);
+		n += chunk;
+
+		if (p >= ctx->end)
+			return JSONF_FALLBACK;
+		if (*p == '"')
+			break;
+
+		if (p + 1 >= ctx->end)
+			return JSONF_FALLBACK;
+
+		char c;
+		switch (p[1]) {
+			case '"': c = '"'; break;
+			case '\\': c = '\\'; break;
+			case '/': c = '/'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			default:
+				// \u escapes and anything invalid
+				return JSONF_FALLBACK;
+		}
+		ctx->buf[n++] = c;
+		start         = p + 2;
+		p             = scan_string(start, ctx->end);
+	}
+
+	*str   = ctx->buf;
+	*len   = n;
+	ctx->p = p + 1;
+	return 0;
+}
+
+static int parse_number(jsonf_ctx_t* ctx, json_object** out)
+{
+	const char* p = ctx->p;
+	int neg       = 0;
+	uint64_t v    = 0;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+
+	const char* digits = p;
+	while (p < ctx->end && *p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+
+	// fractions, exponents, leading zeros and large values keep json-c semantics
+	if (p == digits || p - digits > JSONF_INT_DIGITS || (*digits == '0' && p - digits > 1) ||
+	    (p < ctx->end && (*p == '.' || *p == 'e' || *p == 'E')))
+		return JSONF_FALLBACK;
+
+	*out   = json_object_new_int64(neg ? -(int64_t)v : (int64_t)v);
+	ctx->p = p;
+	return 0;
+}
+
+static int parse_literal(jsonf_ctx_t* ctx, const char* lit, size_t len)
+{
+	if ((size_t)(ctx->end - ctx->p) < len || memcmp(ctx->p, lit, len))
+		return JSONF_FALLBACK;
+	ctx->p += len;
+	return 0;
+}
+
+static int parse_object(jsonf_ctx_t* ctx, json_object** out)
+{
+	json_object* obj = json_object_new_object();
+	int err          = 0;
+
+	ctx->p++;
+	skip_ws(ctx);
+	if (ctx->p < ctx->end && *ctx->p == '}') {
+		ctx->p++;
+		*out = obj;
+		return 0;
+	}
+
+	while (1) {
+		const char* key;
+		size_t key_len;
+		json_object* val = NULL;
+
+		if (ctx->p >= ctx->end || *ctx->p != '"') {
+			err = JSONF_FALLBACK;
+			break;
+		}
+		ctx->p++;
+		if ((err = parse_string(ctx, &key, &key_len)))
+			break;
+
+		skip_ws(ctx);
+		if (ctx->p >= ctx->end || *ctx->p != ':') {
+			err = JSONF_FALLBACK;
+			break;
+		}
+		ctx->p++;
+
+		// value may reuse ctx->buf, keep the key aside
+		char kbuf[JSONF_KEY_BUF];
+		char* k = key_len < sizeof(kbuf) ? kbuf : f_malloc_raw(key_len + 1);
+		memcpy(k, key, key_len);
+		k[key_len] = 0;
+
+		skip_ws(ctx);
+		if (!(err = parse_value(ctx, &val)))
+			json_object_object_add(obj, k, val);
+		if (k != kbuf)
+			free(k);
+		if (err)
+			break;
+
+		skip_ws(ctx);
+		if (ctx->p < ctx->end && *ctx->p == ',') {
+			ctx->p++;
+			skip_ws(ctx);
+			continue;
+		}
+		if (ctx->p < ctx->end && *ctx->p == '}') {
+			ctx->p++;
+			break;
+		}
+		err = JSONF_FALLBACK;
+		break;
+	}
+
+	if (err)
+		json_object_put(obj);
+	else
+		*out = obj;
+	return err;
+}
+
+static int parse_array(jsonf_ctx_t* ctx, json_object** out)
+{
+	json_object* arr = json_object_new_array();
+	int err          = 0;
+
+	ctx->p++;
+	skip_ws(ctx);
+	if (ctx->p < ctx->end && *ctx->p == ']') {
+		ctx->p++;
+		*out = arr;
+		return 0;
+	}
+
+	while (1) {
+		json_object* val = NULL;
+
+		if ((err = parse_value(ctx, &val)))
+			break;
+		json_object_array_add(arr, val);
+
+		skip_ws(ctx);
+		if (ctx->p < ctx->end && *ctx->p == ',') {
+			ctx->p++;
+			skip_ws(ctx);
+			continue;
+		}
+		if (ctx->p < ctx->end && *ctx->p == ']') {
+			ctx->p++;
+			break;
+		}
+		err = JSONF_FALLBACK;
+		break;
+	}
+
+	if (err)
+		json_object_put(arr);
+	else
+		*out = arr;
+	return err;
+}
+
+static int parse_value(jsonf_ctx_t* ctx, json_object** out)
+{
+	const char* str;
+	size_t len;
+	int err;
+
+	*out = NULL;
+	if (ctx->p >= ctx->end)
+		return JSONF_FALLBACK;
+
+	switch (*ctx->p) {
+		case '{':
+		case '[':
+			if (++ctx->depth >= JSON_TOKENER_DEFAULT_DEPTH)
+				return JSONF_FALLBACK;
+			err = *ctx->p == '{' ? parse_object(ctx, out) : parse_array(ctx, out);
+			ctx->depth--;
+			return err;
+
+		case '"':
+			ctx->p++;
+			if ((err = parse_string(ctx, &str, &len)))
+				return err;
+			*out = json_object_new_string_len(str, len);
+			return 0;
+
+		case 't':
+			if ((err = parse_literal(ctx, "true", 4)))
+				return err;
+			*out = json_object_new_boolean(1);
+			return 0;
+
+		case 'f':
+			if ((err = parse_literal(ctx, "false", 5)))
+				return err;
+			*out = json_object_new_boolean(0);
+			return 0;
+
+		case 'n':
+			return parse_literal(ctx, "null", 4);
+
+		default:
+			if (*ctx->p == '-' || (*ctx->p >= '0' && *ctx->p <= '9'))
+				return parse_number(ctx, out);
+			return JSONF_FALLBACK;
+	}
+}
+
+json_object* jsonf_parse(const char* str, enum json_tokener_error* err)
+{
+	json_object* obj = NULL;
+	jsonf_ctx_t ctx;
+
+	ctx.p       = str;
+	ctx.end     = str + strlen(str);
+	ctx.depth   = 0;
+	ctx.buf     = ctx.sbuf;
+	ctx.buf_len = sizeof(ctx.sbuf);
+
+	skip_ws(&ctx);
+	int rc = parse_value(&ctx, &obj);
+	if (!rc) {
+		skip_ws(&ctx);
+		if (ctx.p != ctx.end) {
+			json_object_put(obj);
+			rc = JSONF_FALLBACK;
+		}
+	}
+
+	if (ctx.buf != ctx.sbuf)
+		free(ctx.buf);
+
+	if (rc)
+		return json_tokener_parse_verbose(str, err);
+
+	*err = json_tokener_success;
+	return obj;
+}
@@ -0,0 +1,29 @@
+/*
+ * jsonfast.h
+ */
+
+#ifndef UA_JSONFAST_H_
+#define UA_JSONFAST_H_
+
+#include <json.h>
+
+#ifdef SUPPORT_FAST_JSON
+
+/*
+ * Drop-in replacement for json_tokener_parse_verbose(), building the same
+ * json_object tree. Strict RFC 8259 input without \u escapes or fractional
+ * numbers is parsed directly, with string bodies scanned 16 bytes at a time
+ * where SSE2 or NEON is available. Anything else, including every error,
+ * is handed to the json-c tokener so results and error codes do not change.
+ */
+json_object* jsonf_parse(const char* str, enum json_tokener_error* err);
+
+#define ua_json_parse(str, err) jsonf_parse(str, err)
+
+#else
+
+#define ua_json_parse(str, err) json_tokener_parse_verbose(str, err)
+
+#endif
+
+#endif /* UA_JSONFAST_H_ */
@@ -0,0 +1,151 @@
+/*
+ * metrics.c
+ */
+
+#include "metrics.h"
+#include "misc.h"
+#include <pthread.h>
+
+typedef struct metric {
+	char name[UA_METRIC_NAME_LEN];
+	ua_metric_type_t type;
+	int64_t value;
+	int64_t sum;
+	int64_t max;
+	uint64_t buckets[UA_METRIC_BUCKETS];
+
+} metric_t;
+
+#define M_DEF(_id, _name, _type) [_id] = { .name = _name, .type = _type }
+
+static metric_t metrics[METRICS_MAX] = {
+	M_DEF(M_MSG_RECEIVED,       "msg_received",       UA_METRIC_COUNTER),
+	M_DEF(M_MSG_TIMED_OUT,      "msg_timed_out",      UA_METRIC_COUNTER),
+	M_DEF(M_MSG_SUPERSEDED,     "msg_superseded",     UA_METRIC_COUNTER),
+	M_DEF(M_MSG_WORKER_BUSY,    "msg_worker_busy",    UA_METRIC_COUNTER),
+	M_DEF(M_MSG_AGE_MS,         "msg_age_ms",         UA_METRIC_HISTOGRAM),
+	M_DEF(M_VERSION_CACHE_HIT,  "version_cache_hit",  UA_METRIC_COUNTER),
+	M_DEF(M_QUEUE_DEPTH,        "queue_depth",        UA_METRIC_GAUGE),
+	M_DEF(M_BUS_SEND_FAILED,    "bus_send_failed",    UA_METRIC_COUNTER),
+	M_DEF(M_BYTES_HASHED,       "bytes_hashed",       UA_METRIC_COUNTER),
+	M_DEF(M_BYTES_COPIED,       "bytes_copied",       UA_METRIC_COUNTER),
+	M_DEF(M_BYTES_PATCHED,      "bytes_patched",      UA_METRIC_COUNTER),
+	M_DEF(M_PATCH_MS,           "patch_ms",           UA_METRIC_HISTOGRAM),
+	M_DEF(M_PATCH_KBPS,         "patch_kbps",         UA_METRIC_HISTOGRAM),
+	M_DEF(M_UNZIP_KBPS,         "unzip_kbps",         UA_METRIC_HISTOGRAM),
+	M_DEF(M_ZIP_KBPS,           "zip_kbps",           UA_METRIC_HISTOGRAM),
+	M_DEF(M_SCHED_WAIT_MS,      "sched_wait_ms",      UA_METRIC_HISTOGRAM),
+};
+
+#undef M_DEF
+
+static int metrics_cnt = M_STATIC_COUNT;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bucket_index(int64_t value)
+{
+	int idx = 0;
+
+	if (value <= 0)
+		return 0;
+
+	idx = 64 - __builtin_clzll((uint64_t)value);
+
+	return idx < UA_METRIC_BUCKETS ? idx : UA_METRIC_BUCKETS - 1;
+}
+
+int metrics_register(const char* name, ua_metric_type_t type)
+{
+	int id = -1;
+
+	if (!S(name))
+		return -1;
+
+	pthread_mutex_lock(&metrics_lock);
+
+	for (int i = 0; i < metrics_cnt; i++) {
+		if (!strcmp(metrics[i].name, name)) {
+			id = i;
+			break;
+		}
+	}
+
+	if (id < 0 && metrics_cnt < METRICS_MAX) {
+		strcpy_s(metrics[metrics_cnt].name, name, sizeof(metrics[metrics_cnt].name));
+		metrics[metrics_cnt].type = type;
+		id = metrics_cnt;
+		__atomic_store_n(&metrics_cnt, metrics_cnt + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&metrics_lock);
+
+	return id;
+}
+
+void metrics_add(int id, int64_t value)
+{
+	if (id >= 0 && id < METRICS_MAX)
+		__atomic_add_fetch(&metrics[id].value, value, __ATOMIC_RELAXED);
+}
+
+void metrics_set(int id, int64_t value)
+{
+	if (id >= 0 && id < METRICS_MAX)
+		__atomic_store_n(&metrics[id].value, value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(int id, int64_t value)
+{
+	metric_t* m;
+	int64_t max;
+
+	if (id < 0 || id >= METRICS_MAX)
+		return;
+
+	m = &metrics[id];
+	__atomic_add_fetch(&m->value, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&m->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void metric_copy(ua_metric_t* out, metric_t* m)
+{
+	memcpy(out->name, m->name, sizeof(out->name));
+	out->type  = m->type;
+	out->value = __atomic_load_n(&m->value, __ATOMIC_RELAXED);
+	out->sum   = __atomic_load_n(&m->sum, __ATOMIC_RELAXED);
+	out->max   = __atomic_load_n(&m->max, __ATOMIC_RELAXED);
+	for (int b = 0; b < UA_METRIC_BUCKETS; b++)
+		out->buckets[b] = __atomic_load_n(&m->buckets[b], __ATOMIC_RELAXED);
+}
+
+int metrics_snapshot(ua_metric_t* out, int count)
+{
+	int cnt = __atomic_load_n(&metrics_cnt, __ATOMIC_ACQUIRE);
+
+	if (!out || count <= 0)
+		return cnt;
+
+	if (cnt > count)
+		cnt = count;
+
+	for (int i = 0; i < cnt; i++)
+		metric_copy(&out[i], &metrics[i]);
+
+	return cnt;
+}
+
+int metrics_read(int id, ua_metric_t* out)
+{
+	if (id < 0 || id >= __atomic_load_n(&metrics_cnt, __ATOMIC_ACQUIRE))
+		return E_UA_ARG;
+
+	metric_copy(out, &metrics[id]);
+
+	return E_UA_OK;
+}
@@ -0,0 +1,46 @@
+/*
+ * metrics.h
+ */
+
+#ifndef UA_METRICS_H_
+#define UA_METRICS_H_
+
+#ifdef LIBUA_VER_2_0
+#include "esyncua.h"
+#else
+#include "xl4ua.h"
+#endif
+
+#include <stdint.h>
+
+#define METRICS_MAX 64
+
+typedef enum metric_id {
+	M_MSG_RECEIVED,
+	M_MSG_TIMED_OUT,
+	M_MSG_SUPERSEDED,
+	M_MSG_WORKER_BUSY,
+	M_MSG_AGE_MS,
+	M_VERSION_CACHE_HIT,
+	M_QUEUE_DEPTH,
+	M_BUS_SEND_FAILED,
+	M_BYTES_HASHED,
+	M_BYTES_COPIED,
+	M_BYTES_PATCHED,
+	M_PATCH_MS,
+	M_PATCH_KBPS,
+	M_UNZIP_KBPS,
+	M_ZIP_KBPS,
+	M_SCHED_WAIT_MS,
+	M_STATIC_COUNT
+
+} metric_id_t;
+
+int metrics_register(const char* name, ua_metric_type_t type);
+void metrics_add(int id, int64_t value);
+void metrics_set(int id, int64_t value);
+void metrics_observe(int id, int64_t value);
+int metrics_snapshot(ua_metric_t* out, int count);
+int metrics_read(int id, ua_metric_t* out);
+
+#endif /* UA_METRICS_H_ */
@@ -11,11 +11,15 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <zip.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
-#include <openssl/buffer.h>
 #include "utlist.h"
 #include "debug.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "zipwriter.h"
+#include "package.h"
+#include "hash.h"
+#include "bulkio.h"
 #if defined __QNX__
 #include <inttypes.h>
 #endif
@@ -34,16 +38,6 @@ static char* libzip_get_error(int ze);
 
 size_t ua_rw_buff_size = 16 * 1024;
 
-struct sha256_list {
-	struct sha256_list* next;
-	unsigned char sha256[SHA256_DIGEST_LENGTH];
-};
-
-int sha256cmp(struct sha256_list* a, struct sha256_list* b)
-{
-	return memcmp(a->sha256, b->sha256, SHA256_DIGEST_LENGTH);
-}
-
 uint64_t currentms(void)
 {
 	struct timespec tp;
@@ -164,6 +158,43 @@ int chkdirp(const char* path)
 }
 
 
+int syncdirp(const char* path)
+{
+	int err = E_UA_OK;
+	int fd  = -1;
+	DIR* dir;
+	struct dirent* entry;
+	struct stat st;
+	char* filepath;
+
+	do {
+		BOLT_SYS((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st), "failed to open %s", path);
+
+		if (S_ISDIR(st.st_mode)) {
+			BOLT_SYS(!(dir = opendir(path)), "failed to open directory %s", path);
+			while ((entry = readdir(dir)) != NULL) {
+				if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+					continue;
+				filepath = JOIN(path, entry->d_name);
+				err      = syncdirp(filepath);
+				free(filepath);
+				if (err) break;
+			}
+			closedir(dir);
+			if (err) break;
+		}
+
+		// entries first, so the directory is synced with what it names
+		BOLT_SYS(fsync(fd), "failed to sync %s", path);
+
+	} while (0);
+
+	if (fd >= 0)
+		close(fd);
+
+	return err;
+}
+
 int newdirp(const char* path, int umask)
 {
 	int rc;
@@ -240,6 +271,7 @@ static int libzip_unzip(const char* archive, const char* path)
 	struct zip* za;
 	struct zip_file* zf;
 	struct zip_stat sb;
+	off_t mark;
 
 	A_INFO_MSG("unzipping(libzip) archive %s to %s", archive, path);
 
@@ -247,7 +279,7 @@ static int libzip_unzip(const char* archive, const char* path)
 		BOLT_IF(!(za = zip_open(archive, ZIP_RDONLY, &zerr)), E_UA_ERR,
 		        "failed to open file as ZIP %s : %s", archive, aux = libzip_get_error(zerr));
 
-		BOLT_MALLOC(buf, ua_rw_buff_size);
+		buf = f_malloc_raw(ua_rw_buff_size);
 
 		for (i = 0; i < zip_get_num_entries(za, 0); i++) {
 			BOLT_IF(zip_stat_index(za, i, 0, &sb), E_UA_ERR, "failed reading stat at index %d: %s", i, zip_strerror(za));
@@ -261,14 +293,18 @@ static int libzip_unzip(const char* archive, const char* path)
 				BOLT_SYS(chkdirp(fpath), "failed to prepare directory for %s", fpath);
 				BOLT_SYS((fd = open(fpath, O_RDWR | O_TRUNC | O_CREAT, 0644)) < 0, "failed to open/create %s", fpath);
 
-				sum = 0;
+				sum  = 0;
+				mark = 0;
 				while (sum != (long)sb.size) {
 					BOLT_IF((len = zip_fread(zf, buf, ua_rw_buff_size)) == -1,
 					        E_UA_ERR, "error reading %s : %s", sb.name, zip_file_strerror(zf));
 					BOLT_IF((write(fd, buf, len) < len), E_UA_ERR, "error writing %s", sb.name);
 					sum += len;
+					bulk_written(fd, &mark, sum, 0);
+					scheduler_pace(len);
 				}
 
+				bulk_written(fd, &mark, sum, 1);
 				close(fd);
 				zip_fclose(zf);
 			}
@@ -281,6 +317,11 @@ static int libzip_unzip(const char* archive, const char* path)
 	if (buf) free(buf);
 	if (za && zip_close(za)) { err = E_UA_ERR;  A_ERROR_MSG("failed to close zip archive %s : %s", archive, zip_strerror(za)); }
 
+	if (ua_io_cache != BULKIO_CACHE_NORMAL && (fd = open(archive, O_RDONLY)) >= 0) {
+		bulk_drop(fd);
+		close(fd);
+	}
+
 	if (err) {
 		if (aux) free(aux);
 		if (fpath) free(fpath);
@@ -316,6 +357,8 @@ static int zip_unzip(const char* archive, const char* path)
 
 int unzip(const char* archive, const char* path)
 {
+	scheduler_enter(SCHED_IO);
+	TRACE_START(t_zip);
 #ifndef SHELL_COMMAND_DISABLE
 	int err = zip_unzip(archive, path);
 #else
@@ -325,6 +368,9 @@ int unzip(const char* archive, const char* path)
 		err = libzip_unzip(archive, path);
 	}
 
+	TRACE_SPAN(t_zip, TRACE_CAT_ARCHIVE, "unzip", chop_path(archive), trace_file_size(archive));
+	scheduler_leave(SCHED_IO);
+
 	return err;
 }
 
@@ -358,54 +404,18 @@ static int libzip_zip(const char* archive, const char* path)
 	return err;
 }
 
-#ifndef SHELL_COMMAND_DISABLE
-static int zip_zip(const char* archive, const char* path)
-{
-	A_INFO_MSG("zipping(zip) %s to %s", path, archive);
-
-	int err = E_UA_OK;
-
-	if (archive && path) {
-#if defined ANDROID_BUILD || defined __QNX__
-		char* wd;
-		if( (wd=getcwd(NULL, 0)) == NULL) {
-			A_ERROR_MSG("failed to get current directory\n");
-		}
-#else
-		char* wd = (char*)get_current_dir_name();
-#endif
-		do {
-			BOLT_SYS(chdir(path), "failed to chdir to %s", path);
-			BOLT_SYS(chkdirp(archive), "failed to prepare directory for %s", archive);
-			remove(archive);
-
-			char* op = f_asprintf("%s", archive);
-			char* const argv[] = {"zip", "-r", op, ".", NULL};
-			A_INFO_MSG("shell command(%s %s %s %s)\n", argv[0], argv[1], argv[2], argv[3]);
-			BOLT_SYS(run_cmd(argv[0], argv), "failed to zip files");
-			free(op);
-		} while (0);
-
-		if (chdir(wd) != 0) {
-			A_WARN_MSG("chdir failed: %s\n", strerror(errno));
-		}
-		f_free(wd);
-	}
-	return err;
-}
-#endif
-
-int zip(const char* archive, const char* path)
+int zip(const char* archive, const char* path, const zipw_cfg_t* cfg)
 {
-#ifndef SHELL_COMMAND_DISABLE
-	int err = zip_zip(archive, path);
-#else
-	int err = E_UA_ERR;
-#endif
+	scheduler_enter(SCHED_IO);
+	TRACE_START(t_zip);
+	int err = zipw_archive(archive, path, cfg);
 
 	if (err != E_UA_OK)
 		err = libzip_zip(archive, path);
 
+	TRACE_SPAN(t_zip, TRACE_CAT_ARCHIVE, "zip", chop_path(archive), trace_file_size(archive));
+	scheduler_leave(SCHED_IO);
+
 	return err;
 }
 
@@ -535,32 +545,33 @@ int libzip_find_file(const char* archive, const char* path)
 
 int copy_file(const char* from, const char* to)
 {
-	int err   = E_UA_OK;
-	FILE* in  = 0;
-	FILE* out = 0;
-	char* buf = 0;
-	size_t nread;
+	int err       = E_UA_OK;
+	int in        = -1;
+	int out       = -1;
+	size_t copied = 0;
 
 	A_INFO_MSG("copying file from %s to %s", from, to);
 
+	scheduler_enter(SCHED_IO);
+	TRACE_START(t_copy);
+
 	do {
-		BOLT_SYS(!(in = fopen(from, "r")), "opening file: %s", from);
+		BOLT_SYS((in = open(from, O_RDONLY)) < 0, "opening file: %s", from);
 
 		BOLT_SYS(chkdirp(to), "failed to prepare directory for %s", to);
-		BOLT_SYS(!(out = fopen(to, "w")), "creating file: %s", to);
+		BOLT_SYS((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0, "creating file: %s", to);
 
-		BOLT_MALLOC(buf, ua_rw_buff_size);
-
-		do {
-			BOLT_SYS(((nread = fread(buf, sizeof(char), ua_rw_buff_size, in)) == 0) && ferror(in), "reading from file: %s", from);
-			BOLT_SYS(nread && (fwrite(buf, sizeof(char), nread, out) != nread), "writing to file: %s", to);
-		} while (nread);
+		err = bulk_copy(in, out, ua_rw_buff_size, &copied);
+		metrics_add(M_BYTES_COPIED, copied);
+		BOLT_SYS(err, "copying %s to %s", from, to);
 
 	} while (0);
 
-	if (buf) free(buf);
-	if (in && fclose(in)) A_ERROR_MSG("closing file: %s", from);
-	if (out && fclose(out)) A_ERROR_MSG("closing file: %s", to);
+	if (in >= 0 && close(in)) A_ERROR_MSG("closing file: %s", from);
+	if (out >= 0 && close(out)) A_ERROR_MSG("closing file: %s", to);
+
+	TRACE_SPAN(t_copy, TRACE_CAT_ARCHIVE, "copy", chop_path(to), trace_file_size(to));
+	scheduler_leave(SCHED_IO);
 
 	return err;
 }
@@ -579,215 +590,75 @@ int make_file_hard_link(const char* from, const char* to)
 	return err;
 }
 
-int calc_sha256(const char* fpath, unsigned char obuff[SHA256_DIGEST_LENGTH])
+int file_stamp(const char* path, file_stamp_t* fs)
 {
-	int err = E_UA_OK;
-	FILE* file;
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-	SHA256_CTX ctx;
-#else /* OpenSSL 3.0 Support */
-	EVP_MD_CTX *ctx;
-	const EVP_MD *md;
-	unsigned int sha256_len;
-#endif /* OpenSSL 3.0 Support */
-	char* buf = 0;
-	size_t nread;
-
-	do {
-		BOLT_SYS(!(file = fopen(fpath, "rb")), "opening file: %s", fpath);
-
-		BOLT_MALLOC(buf, ua_rw_buff_size);
-
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-		SHA256_Init(&ctx);
-#else /* OpenSSL 3.0 Support */
-		md = EVP_get_digestbyname("sha256");
-		ctx = EVP_MD_CTX_new();
-		EVP_DigestInit_ex(ctx, md, NULL);
-#endif /* OpenSSL 3.0 Support */
-
-		while ((nread = fread(buf, sizeof(char), ua_rw_buff_size, file))) {
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-			SHA256_Update(&ctx, buf, nread);
-#else /* OpenSSL 3.0 Support */
-			EVP_DigestUpdate(ctx, buf, nread);
-#endif /* OpenSSL 3.0 Support */
-		}
+	struct stat st;
 
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-		SHA256_Final(obuff, &ctx);
-#else /* OpenSSL 3.0 Support */
-		EVP_DigestFinal_ex(ctx, obuff, &sha256_len);
-		EVP_MD_CTX_free(ctx);
-#endif /* OpenSSL 3.0 Support */
+	if (!path || !fs || stat(path, &st) || !S_ISREG(st.st_mode))
+		return E_UA_ERR;
 
-		BOLT_SYS(fclose(file), "closing file: %s", fpath);
-
-	} while (0);
+	fs->dev      = st.st_dev;
+	fs->ino      = st.st_ino;
+	fs->size     = st.st_size;
+	fs->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
 
-	if (buf) free(buf);
-
-	return err;
+	return E_UA_OK;
 }
 
-int calc_sha256_hex(const char* fpath, char obuff[SHA256_HEX_LENGTH])
+int file_stamp_eq(const file_stamp_t* a, const file_stamp_t* b)
 {
-	int i, err = E_UA_OK;
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-
-	if (!(err = calc_sha256(fpath, hash))) {
-		for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-			sprintf(obuff + (i * 2), "%02x", (unsigned char)hash[i]);
-		}
-
-		obuff[SHA256_HEX_LENGTH - 1] = 0;
-
-	}
-
-	return err;
+	return a->size && a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns;
 }
 
-
-int calc_sha256_x(const char* archive, char obuff[SHA256_B64_LENGTH])
+int same_file(const char* a, const char* b)
 {
-	int i, zerr, err = E_UA_OK;
-	char* buf = 0;
-	unsigned char hash[SHA256_DIGEST_LENGTH];
-	zip_uint64_t sum = 0;
-	zip_int64_t len = 0;
-	char* zstr = 0;
-	struct zip* za;
-	struct zip_file* zf;
-	struct zip_stat sb;
-	struct sha256_list* sl         = 0;
-	struct sha256_list* aux        = 0;
-	struct sha256_list* sha256List = 0;
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-	SHA256_CTX ctx;
-#else /* OpenSSL 3.0 Support */
-	EVP_MD_CTX *ctx;
-	const EVP_MD *md;
-	unsigned int sha256_len;
-#endif /* OpenSSL 3.0 Support */
-
-	do {
-		BOLT_IF(!(za = zip_open(archive, ZIP_RDONLY, &zerr)), E_UA_ERR,
-		        "failed to open file as ZIP %s : %s", archive, zstr = libzip_get_error(zerr));
-
-		BOLT_MALLOC(buf, ua_rw_buff_size);
-
-		for (i = 0; i < zip_get_num_entries(za, 0); i++) {
-			BOLT_IF(zip_stat_index(za, i, 0, &sb), E_UA_ERR, "failed reading stat at index %d: %s", i, zip_strerror(za));
-
-			if (sb.name[strlen(sb.name) - 1] != '/') {
-				if (!strcmp(sb.name, MANIFEST) ||
-				    !strcmp(sb.name, MANIFEST_DIFF) ||
-				    !strncmp(sb.name, XL4_X_PREFIX, strlen(XL4_X_PREFIX)) ||
-				    !strncmp(sb.name, XL4_SIGNATURE_PREFIX, strlen(XL4_SIGNATURE_PREFIX)))
-					continue;
+	file_stamp_t fa, fb;
 
-				BOLT_IF(!(zf = zip_fopen_index(za, i, 0)), E_UA_ERR, "failed to open/find %s: %s", sb.name, zip_strerror(za));
+	return !file_stamp(a, &fa) && !file_stamp(b, &fb) && fa.dev == fb.dev && fa.ino == fb.ino;
+}
 
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-				SHA256_Init(&ctx);
-				SHA256_Update(&ctx, sb.name, strlen(sb.name));
-#else /* OpenSSL 3.0 Support */
-				md = EVP_get_digestbyname("sha256");
-				ctx = EVP_MD_CTX_new();
-				EVP_DigestInit_ex(ctx, md, NULL);
-				EVP_DigestUpdate(ctx, sb.name, strlen(sb.name));
-#endif /* OpenSSL 3.0 Support */
-
-				sum = 0;
-				len = (zip_int64_t)ua_rw_buff_size;
-				while (len == (zip_int64_t)ua_rw_buff_size) {
-					BOLT_IF((len = zip_fread(zf, buf, (zip_uint64_t)ua_rw_buff_size)) == -1, E_UA_ERR, "error reading %s : %s", sb.name, zip_file_strerror(zf));
-					if(len > 0) {
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-						SHA256_Update(&ctx, buf, len);
-#else /* OpenSSL 3.0 Support */
-						EVP_DigestUpdate(ctx, buf, len);
-#endif /* OpenSSL 3.0 Support */
-						sum += (zip_uint64_t)len;
-					}
-				}
+int calc_sha256(const char* fpath, unsigned char obuff[SHA256_DIGEST_LENGTH])
+{
+	int err = E_UA_OK;
+	int fd  = -1;
 
-				if (sum != sb.size) {
-					A_INFO_MSG("ZIP warning: reported size of file %s is %" PRIu64 ", total bytes read: %" PRIu64 "", sb.name, sb.size, sum);
-				}
+	scheduler_enter(SCHED_CPU);
+	TRACE_START(t_hash);
 
-				sl = f_malloc(sizeof(struct sha256_list));
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-				SHA256_Final(sl->sha256, &ctx);
-#else /* OpenSSL 3.0 Support */
-				EVP_DigestFinal_ex(ctx, sl->sha256, &sha256_len);
-				EVP_MD_CTX_free(ctx);
-#endif /* OpenSSL 3.0 Support */
-				LL_APPEND(sha256List, sl);
+	do {
+		BOLT_SYS((fd = open(fpath, O_RDONLY)) < 0, "opening file: %s", fpath);
+		BOLT_SUB(hash_fd(fd, obuff));
 
-				zip_fclose(zf);
-			}
-		}
+	} while (0);
 
-		if (!err) {
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-			SHA256_Init(&ctx);
-#else /* OpenSSL 3.0 Support */
-			md = EVP_get_digestbyname("sha256");
-			ctx = EVP_MD_CTX_new();
-			EVP_DigestInit_ex(ctx, md, NULL);
-#endif /* OpenSSL 3.0 Support */
-
-			LL_SORT(sha256List, sha256cmp);
-			LL_FOREACH(sha256List, sl) {
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-				SHA256_Update(&ctx, sl->sha256, SHA256_DIGEST_LENGTH);
-#else /* OpenSSL 3.0 Support */
-				EVP_DigestUpdate(ctx, sl->sha256, SHA256_DIGEST_LENGTH);
-#endif /* OpenSSL 3.0 Support */
-			}
-#if OPENSSL_VERSION_NUMBER < 0x30000000L
-			SHA256_Final(hash, &ctx);
-#else /* OpenSSL 3.0 Support */
-			EVP_DigestFinal_ex(ctx, hash, &sha256_len);
-			EVP_MD_CTX_free(ctx);
-#endif /* OpenSSL 3.0 Support */
-
-			err = base64_encode(hash, obuff);
-		}
+	if (fd >= 0) close(fd);
 
-	} while (0);
+	TRACE_SPAN(t_hash, TRACE_CAT_HASH, "sha256", chop_path(fpath), trace_file_size(fpath));
+	scheduler_leave(SCHED_CPU);
 
-	if (buf) free(buf);
-	if (za && zip_close(za)) { err = E_UA_ERR;  A_ERROR_MSG("failed to close zip archive %s : %s", archive, zip_strerror(za)); }
+	return err;
+}
 
-	LL_FOREACH_SAFE(sha256List, sl, aux) {
-		LL_DELETE(sha256List, sl);
-		free(sl);
-	}
+int calc_sha256_hex(const char* fpath, char obuff[SHA256_HEX_LENGTH])
+{
+	int err = E_UA_OK;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
 
-	if (err) {
-		if (zstr) free(zstr);
-	}
+	if (!(err = calc_sha256(fpath, hash)))
+		hash_hex(hash, obuff);
 
 	return err;
 }
 
-int base64_encode(unsigned char hash[SHA256_DIGEST_LENGTH], char b64buff[SHA256_B64_LENGTH])
-{
-	int err       = E_UA_ERR;
-	BIO* b64      = NULL;
-	BUF_MEM* bptr = NULL;
 
-	b64 = BIO_push(BIO_new(BIO_f_base64()), BIO_new(BIO_s_mem()));
+int calc_sha256_x(const char* archive, char obuff[SHA256_B64_LENGTH])
+{
+	int err          = E_UA_ERR;
+	pkg_handle_t* ph = pkg_open(archive);
 
-	if (b64 && BIO_write(b64, hash, SHA256_DIGEST_LENGTH) > 0) {
-		(void)BIO_flush(b64);
-		BIO_get_mem_ptr(b64, &bptr);
-		memcpy(b64buff, bptr->data, SHA256_B64_LENGTH - 1);
-		b64buff[SHA256_B64_LENGTH - 1] = 0;
-		BIO_free_all(b64);
-		err = E_UA_OK;
+	if (ph) {
+		err = pkg_sha256_x(ph, obuff);
+		pkg_close(ph);
 	}
 
 	return err;
@@ -810,6 +681,13 @@ int calculate_sha256_b64(const char* file, char b64buff[SHA256_B64_LENGTH])
 
 }
 
+int base64_encode(unsigned char hash[SHA256_DIGEST_LENGTH], char b64buff[SHA256_B64_LENGTH])
+{
+	hash_b64(hash, b64buff);
+
+	return E_UA_OK;
+}
+
 int verify_file_hash_b64(const char* file, const char* sha256_b64)
 {
 	int err = E_UA_ERR;
@@ -75,12 +75,28 @@ static inline const char* chop_path(const char* path)
 
 extern size_t ua_rw_buff_size;
 
+/*
+ * Identity of a file's content as far as stat() tells, used to trust an
+ * earlier hash check of a file that has not been touched since.
+ */
+typedef struct file_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+
+} file_stamp_t;
+
 uint64_t currentms(void);
 int unzip(const char* archive, const char* path);
-int zip(const char* archive, const char* path);
+struct zipw_cfg;
+int zip(const char* archive, const char* path, const struct zipw_cfg* cfg);
 int libzip_find_file(const char* archive, const char* path);
 int copy_file(const char* from, const char* to);
 int make_file_hard_link(const char* from, const char* to);
+int file_stamp(const char* path, file_stamp_t* fs);
+int file_stamp_eq(const file_stamp_t* a, const file_stamp_t* b);
+int same_file(const char* a, const char* b);
 int calc_sha256(const char* path, unsigned char obuff[SHA256_DIGEST_LENGTH]);
 int calc_sha256_hex(const char* path, char obuff[SHA256_HEX_LENGTH]);
 int calc_sha256_x(const char* archive, char obuff[SHA256_B64_LENGTH]);
@@ -94,6 +110,10 @@ int mkdirp(const char* path, int umask);
 int newdirp(const char* path, int umask);
 int rmdirp(const char* path);
 int chkdirp(const char* path);
+/*
+ * fsync path, and when it is a directory everything below it first.
+ */
+int syncdirp(const char* path);
 int run_cmd(const char* cmd, char* const argv[]);
 char* randstring(int length);
 int reply_id_matched(char* s1, char* s2);
@@ -0,0 +1,751 @@
+/*
+ * package.c
+ */
+
+#include "package.h"
+#include "delta.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "hash.h"
+#include "bulkio.h"
+#include "utlist.h"
+#include "debug.h"
+#include "trace.h"
+#include "metrics.h"
+#include "scheduler.h"
+#if defined __QNX__
+#include <inttypes.h>
+#endif
+
+/* below this much member data, threads cost more than they save */
+#define PKG_HASH_PARALLEL_MIN (16 * 1024 * 1024)
+
+struct sha256_list {
+	struct sha256_list* next;
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+static int sha256cmp(struct sha256_list* a, struct sha256_list* b)
+{
+	return memcmp(a->sha256, b->sha256, SHA256_DIGEST_LENGTH);
+}
+
+pkg_handle_t* pkg_open(const char* file)
+{
+	int zerr, err = E_UA_OK;
+	zip_int64_t cnt;
+	struct zip_stat sb;
+	pkg_handle_t* ph = 0;
+	char ebuf[256];
+
+	do {
+		BOLT_IF(!S(file), E_UA_ARG, "package file is not specified");
+
+		ph       = f_malloc(sizeof(pkg_handle_t));
+		ph->file = f_strdup(file);
+		ph->fd   = -1;
+		pthread_mutex_init(&ph->lock, NULL);
+
+		if (!(ph->za = zip_open(file, ZIP_RDONLY, &zerr))) {
+			zip_error_to_str(ebuf, sizeof(ebuf), zerr, errno);
+			BOLT_SAY(E_UA_ERR, "failed to open file as ZIP %s : %s", file, ebuf);
+		}
+
+		BOLT_IF((cnt = zip_get_num_entries(ph->za, 0)) < 0, E_UA_ERR, "failed to read entries of %s", file);
+
+		if (cnt)
+			ph->entries = f_malloc(cnt * sizeof(pkg_entry_t));
+
+		for (zip_int64_t i = 0; i < cnt; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+
+			BOLT_IF(zip_stat_index(ph->za, i, 0, &sb), E_UA_ERR, "failed reading stat at index %d: %s", (int)i, zip_strerror(ph->za));
+
+			pe->name   = f_strdup(sb.name);
+			pe->index  = i;
+			pe->size   = sb.size;
+			pe->comp_size = (sb.valid & ZIP_STAT_COMP_SIZE) ? sb.comp_size : sb.size;
+			pe->is_dir = S(sb.name) && sb.name[strlen(sb.name) - 1] == '/';
+			pe->stored = (sb.valid & ZIP_STAT_COMP_METHOD) && sb.comp_method == ZIP_CM_STORE &&
+			             (!(sb.valid & ZIP_STAT_ENCRYPTION_METHOD) || sb.encryption_method == ZIP_EM_NONE);
+			ph->entry_cnt++;
+		}
+
+	} while (0);
+
+	if (err) {
+		pkg_close(ph);
+		ph = 0;
+	}
+
+	return ph;
+}
+
+void pkg_close(pkg_handle_t* ph)
+{
+	if (!ph)
+		return;
+
+	if (ph->za && zip_close(ph->za)) {
+		A_ERROR_MSG("failed to close zip archive %s : %s", ph->file, zip_strerror(ph->za));
+		zip_discard(ph->za);
+	}
+
+	for (int i = 0; i < ph->entry_cnt; i++)
+		f_free(ph->entries[i].name);
+
+	if (ph->fd >= 0)
+		close(ph->fd);
+
+	pthread_mutex_destroy(&ph->lock);
+	f_free(ph->entries);
+	f_free(ph->manifest_diff);
+	f_free(ph->file);
+	free(ph);
+}
+
+pkg_entry_t* pkg_find_entry(pkg_handle_t* ph, const char* name)
+{
+	zip_int64_t idx;
+
+	if (!ph || !name)
+		return 0;
+
+	if ((idx = zip_name_locate(ph->za, name, 0)) < 0 || idx >= ph->entry_cnt)
+		return 0;
+
+	return &ph->entries[idx];
+}
+
+const char* pkg_manifest_diff(pkg_handle_t* ph)
+{
+	int err             = E_UA_OK;
+	pkg_entry_t* pe     = 0;
+	struct zip_file* zf = 0;
+	char* buf           = 0;
+
+	if (!ph)
+		return 0;
+
+	if (ph->manifest_diff_read)
+		return ph->manifest_diff;
+
+	ph->manifest_diff_read = 1;
+
+	do {
+		if (!(pe = pkg_find_entry(ph, MANIFEST_DIFF)))
+			break;
+
+		BOLT_IF(!(zf = zip_fopen_index(ph->za, pe->index, 0)), E_UA_ERR, "failed to open file %s", MANIFEST_DIFF);
+
+		buf = f_malloc(pe->size + 1);
+		BOLT_IF(zip_fread(zf, buf, pe->size) != (zip_int64_t)pe->size, E_UA_ERR, "failed to read file %s", MANIFEST_DIFF);
+
+		ph->manifest_diff = buf;
+		buf               = 0;
+
+	} while (0);
+
+	if (zf) zip_fclose(zf);
+	f_free(buf);
+
+	return ph->manifest_diff;
+}
+
+int pkg_extract(pkg_handle_t* ph, const char* path)
+{
+	int fd              = -1;
+	int err             = E_UA_OK;
+	char* buf           = 0;
+	char* fpath         = 0;
+	struct zip_file* zf = 0;
+	zip_int64_t len;
+	zip_uint64_t sum;
+	off_t mark;
+
+	if (!ph || !S(path))
+		return E_UA_ARG;
+
+	A_INFO_MSG("unzipping(libzip) archive %s to %s", ph->file, path);
+
+	scheduler_enter(SCHED_IO);
+	TRACE_START(t_zip);
+
+	do {
+		buf = f_malloc_raw(ua_rw_buff_size);
+
+		for (int i = 0; i < ph->entry_cnt; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+
+			fpath = JOIN(path, pe->name);
+			if (pe->is_dir) {
+				BOLT_SYS(mkdirp(fpath, 0755) && (errno != EEXIST), "failed to make directory %s", fpath);
+			} else {
+				BOLT_IF(!(zf = zip_fopen_index(ph->za, pe->index, 0)), E_UA_ERR, "failed to open/find %s: %s", pe->name, zip_strerror(ph->za));
+				BOLT_SYS(chkdirp(fpath), "failed to prepare directory for %s", fpath);
+				BOLT_SYS((fd = open(fpath, O_RDWR | O_TRUNC | O_CREAT, 0644)) < 0, "failed to open/create %s", fpath);
+
+				sum  = 0;
+				mark = 0;
+				while (sum != pe->size) {
+					BOLT_IF((len = zip_fread(zf, buf, ua_rw_buff_size)) <= 0,
+					        E_UA_ERR, "error reading %s : %s", pe->name, zip_file_strerror(zf));
+					BOLT_IF((write(fd, buf, len) < len), E_UA_ERR, "error writing %s", pe->name);
+					sum += len;
+					bulk_written(fd, &mark, sum, 0);
+					scheduler_pace(len);
+				}
+
+				bulk_written(fd, &mark, sum, 1);
+				close(fd);
+				fd = -1;
+				zip_fclose(zf);
+				zf = 0;
+			}
+			Z_FREE(fpath);
+
+			if (err) break;
+		}
+
+	} while (0);
+
+	// a member that failed part way is still open
+	if (fd >= 0) close(fd);
+	if (zf) zip_fclose(zf);
+	f_free(buf);
+	f_free(fpath);
+
+	if (ua_io_cache != BULKIO_CACHE_NORMAL && (fd = open(ph->file, O_RDONLY)) >= 0) {
+		bulk_drop(fd);
+		close(fd);
+	}
+
+	TRACE_SPAN(t_zip, TRACE_CAT_ARCHIVE, "unzip", chop_path(ph->file), trace_file_size(ph->file));
+	scheduler_leave(SCHED_IO);
+
+	return err;
+}
+
+static int entry_sha256(struct zip* za, pkg_entry_t* pe, char* buf)
+{
+	int err             = E_UA_OK;
+	struct zip_file* zf = 0;
+	zip_uint64_t sum    = 0;
+	zip_int64_t len     = 0;
+	EVP_MD_CTX* ctx     = 0;
+
+	do {
+		BOLT_IF(!(zf = zip_fopen_index(za, pe->index, 0)), E_UA_ERR, "failed to open/find %s: %s", pe->name, zip_strerror(za));
+		BOLT_IF(!(ctx = hash_init()), E_UA_ERR, "failed to create digest context");
+
+		hash_update(ctx, pe->name, strlen(pe->name));
+
+		len = (zip_int64_t)ua_rw_buff_size;
+		while (len == (zip_int64_t)ua_rw_buff_size) {
+			BOLT_IF((len = zip_fread(zf, buf, (zip_uint64_t)ua_rw_buff_size)) == -1, E_UA_ERR, "error reading %s : %s", pe->name, zip_file_strerror(zf));
+			if (len > 0) {
+				hash_update(ctx, buf, len);
+				sum += (zip_uint64_t)len;
+				scheduler_pace(len);
+			}
+		}
+		if (err) break;
+
+		metrics_add(M_BYTES_HASHED, sum);
+
+		if (sum != pe->size) {
+			A_INFO_MSG("ZIP warning: reported size of file %s is %" PRIu64 ", total bytes read: %" PRIu64 "", pe->name, pe->size, sum);
+		}
+
+		err = hash_final(ctx, pe->sha256);
+		ctx = 0;
+		BOLT_IF(err, E_UA_ERR, "failed to hash %s", pe->name);
+		pe->hashed = 1;
+
+	} while (0);
+
+	hash_free(ctx);
+	if (zf) zip_fclose(zf);
+
+	return err;
+}
+
+int pkg_entry_sha256(pkg_handle_t* ph, pkg_entry_t* pe, unsigned char hash[SHA256_DIGEST_LENGTH])
+{
+	int err   = E_UA_OK;
+	char* buf = 0;
+
+	if (!ph || !pe)
+		return E_UA_ARG;
+
+	if (!pe->hashed) {
+		buf = f_malloc_raw(ua_rw_buff_size);
+		err = buf ? entry_sha256(ph->za, pe, buf) : E_UA_MEMORY;
+		f_free(buf);
+	}
+
+	if (!err)
+		memcpy(hash, pe->sha256, SHA256_DIGEST_LENGTH);
+
+	return err;
+}
+
+typedef struct pkg_hash_job {
+	pkg_handle_t* ph;
+	pkg_entry_t** todo;
+	struct zip* za[HASH_MAX_THREADS];
+	char* buf[HASH_MAX_THREADS];
+
+} pkg_hash_job_t;
+
+static int pkg_hash_one(void* arg, int worker, int idx)
+{
+	pkg_hash_job_t* job = (pkg_hash_job_t*)arg;
+	int zerr            = 0;
+
+	// libzip handles are not shared between threads, so every worker
+	// besides the caller reads through its own
+	if (!job->za[worker]) {
+		job->za[worker] = worker ? zip_open(job->ph->file, ZIP_RDONLY, &zerr) : job->ph->za;
+		if (!job->za[worker]) {
+			A_ERROR_MSG("failed to open %s for hashing: %d", job->ph->file, zerr);
+			return E_UA_ERR;
+		}
+	}
+
+	if (!job->buf[worker] && !(job->buf[worker] = f_malloc_raw(ua_rw_buff_size)))
+		return E_UA_MEMORY;
+
+	return entry_sha256(job->za[worker], job->todo[idx], job->buf[worker]);
+}
+
+static int pkg_hash_entries(pkg_handle_t* ph, pkg_entry_t** todo, int cnt)
+{
+	pkg_hash_job_t job = {.ph = ph, .todo = todo};
+	int err            = hash_parallel(cnt, 0, pkg_hash_one, &job);
+
+	for (int i = 0; i < HASH_MAX_THREADS; i++) {
+		if (i && job.za[i]) zip_discard(job.za[i]);
+		f_free(job.buf[i]);
+	}
+
+	return err;
+}
+
+static int pkg_sha256_skip(pkg_entry_t* pe)
+{
+	return pe->is_dir ||
+	       !strcmp(pe->name, MANIFEST) ||
+	       !strcmp(pe->name, MANIFEST_DIFF) ||
+	       !strncmp(pe->name, XL4_X_PREFIX, strlen(XL4_X_PREFIX)) ||
+	       !strncmp(pe->name, XL4_SIGNATURE_PREFIX, strlen(XL4_SIGNATURE_PREFIX));
+}
+
+int pkg_sha256_x(pkg_handle_t* ph, char obuff[SHA256_B64_LENGTH])
+{
+	int err                        = E_UA_OK;
+	int todo_cnt                   = 0;
+	uint64_t todo_size             = 0;
+	pkg_entry_t** todo             = 0;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	struct sha256_list* sl         = 0;
+	struct sha256_list* aux        = 0;
+	struct sha256_list* sha256List = 0;
+	EVP_MD_CTX* ctx                = 0;
+
+	if (!ph)
+		return E_UA_ARG;
+
+	if (ph->sha_x_done) {
+		memcpy(obuff, ph->sha_x, SHA256_B64_LENGTH);
+		return E_UA_OK;
+	}
+
+	scheduler_enter(SCHED_CPU);
+	TRACE_START(t_hash);
+
+	do {
+		if (ph->entry_cnt > 1)
+			todo = f_malloc(ph->entry_cnt * sizeof(pkg_entry_t*));
+
+		for (int i = 0; todo && i < ph->entry_cnt; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+
+			if (!pkg_sha256_skip(pe) && !pe->hashed) {
+				todo[todo_cnt++] = pe;
+				todo_size       += pe->size;
+			}
+		}
+
+		// several members of a large package are hashed at once
+		if (todo_cnt > 1 && todo_size >= PKG_HASH_PARALLEL_MIN)
+			BOLT_SUB(pkg_hash_entries(ph, todo, todo_cnt));
+
+		for (int i = 0; i < ph->entry_cnt; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+
+			if (pkg_sha256_skip(pe))
+				continue;
+
+			sl = f_malloc(sizeof(struct sha256_list));
+			LL_APPEND(sha256List, sl);
+			BOLT_SUB(pkg_entry_sha256(ph, pe, sl->sha256));
+		}
+		if (err) break;
+
+		BOLT_IF(!(ctx = hash_init()), E_UA_ERR, "failed to create digest context");
+
+		LL_SORT(sha256List, sha256cmp);
+		LL_FOREACH(sha256List, sl) {
+			hash_update(ctx, sl->sha256, SHA256_DIGEST_LENGTH);
+		}
+		err = hash_final(ctx, hash);
+		ctx = 0;
+		BOLT_IF(err, E_UA_ERR, "failed to hash digests of %s", ph->file);
+
+		hash_b64(hash, ph->sha_x);
+		ph->sha_x_done = 1;
+		memcpy(obuff, ph->sha_x, SHA256_B64_LENGTH);
+
+	} while (0);
+
+	hash_free(ctx);
+	f_free(todo);
+
+	LL_FOREACH_SAFE(sha256List, sl, aux) {
+		LL_DELETE(sha256List, sl);
+		free(sl);
+	}
+
+	TRACE_SPAN(t_hash, TRACE_CAT_HASH, "sha_of_sha", chop_path(ph->file), trace_file_size(ph->file));
+	scheduler_leave(SCHED_CPU);
+
+	return err;
+}
+
+#define ZIP_EOCD_SIG     0x06054b50
+#define ZIP64_LOC_SIG    0x07064b50
+#define ZIP64_EOCD_SIG   0x06064b50
+#define ZIP_CDIR_SIG     0x02014b50
+#define ZIP_LOCAL_SIG    0x04034b50
+#define ZIP_EOCD_LEN     22
+#define ZIP_CDIR_LEN     46
+#define ZIP_LOCAL_LEN    30
+#define ZIP_MAX_COMMENT  0xffff
+
+static uint16_t rd16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const unsigned char* p)
+{
+	return (uint32_t)rd16(p) | ((uint32_t)rd16(p + 2) << 16);
+}
+
+static uint64_t rd64(const unsigned char* p)
+{
+	return (uint64_t)rd32(p) | ((uint64_t)rd32(p + 4) << 32);
+}
+
+static int read_at(int fd, void* buf, size_t len, uint64_t off)
+{
+	ssize_t r;
+	size_t done = 0;
+
+	while (done < len) {
+		if ((r = pread(fd, (char*)buf + done, len - done, off + done)) <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return E_UA_ERR;
+		}
+		done += r;
+	}
+
+	return E_UA_OK;
+}
+
+/*
+ * libzip does not expose where entry data is located in the archive, read
+ * local header offsets from the central directory. Records are in the same
+ * order as libzip indexes for an archive opened read-only.
+ */
+static int pkg_load_offsets(pkg_handle_t* ph)
+{
+	int err                = E_UA_OK;
+	unsigned char* tail    = 0;
+	unsigned char* cdir    = 0;
+	unsigned char* p, * eocd = 0;
+	unsigned char z64[56];
+	struct stat st;
+	size_t tail_len;
+	uint64_t cd_off, cd_size, cd_cnt;
+
+	if (ph->offsets_loaded)
+		return E_UA_OK;
+
+	do {
+		if (ph->fd < 0)
+			BOLT_SYS((ph->fd = open(ph->file, O_RDONLY)) < 0, "failed to open %s", ph->file);
+
+		BOLT_SYS(fstat(ph->fd, &st), "failed to stat %s", ph->file);
+		BOLT_IF(st.st_size < ZIP_EOCD_LEN, E_UA_ERR, "not a ZIP archive: %s", ph->file);
+
+		tail_len = st.st_size < ZIP_EOCD_LEN + ZIP_MAX_COMMENT ? (size_t)st.st_size : ZIP_EOCD_LEN + ZIP_MAX_COMMENT;
+		tail     = f_malloc(tail_len);
+		BOLT_IF(read_at(ph->fd, tail, tail_len, st.st_size - tail_len), E_UA_ERR, "failed to read %s", ph->file);
+
+		for (size_t i = tail_len - ZIP_EOCD_LEN + 1; i > 0; i--) {
+			if (rd32(tail + i - 1) == ZIP_EOCD_SIG) {
+				eocd = tail + i - 1;
+				break;
+			}
+		}
+		BOLT_IF(!eocd, E_UA_ERR, "end of central directory not found: %s", ph->file);
+
+		cd_cnt  = rd16(eocd + 10);
+		cd_size = rd32(eocd + 12);
+		cd_off  = rd32(eocd + 16);
+
+		if ((cd_cnt == 0xffff || cd_size == 0xffffffff || cd_off == 0xffffffff) &&
+		    eocd - tail >= 20 && rd32(eocd - 20) == ZIP64_LOC_SIG) {
+			BOLT_IF(read_at(ph->fd, z64, sizeof(z64), rd64(eocd - 20 + 8)) || rd32(z64) != ZIP64_EOCD_SIG,
+			        E_UA_ERR, "invalid zip64 end of central directory: %s", ph->file);
+			cd_cnt  = rd64(z64 + 32);
+			cd_size = rd64(z64 + 40);
+			cd_off  = rd64(z64 + 48);
+		}
+
+		BOLT_IF(cd_off + cd_size > (uint64_t)st.st_size, E_UA_ERR, "invalid central directory: %s", ph->file);
+		cdir = f_malloc(cd_size + 1);
+		BOLT_IF(read_at(ph->fd, cdir, cd_size, cd_off), E_UA_ERR, "failed to read central directory: %s", ph->file);
+
+		p = cdir;
+		for (uint64_t i = 0; i < cd_cnt && i < (uint64_t)ph->entry_cnt; i++) {
+			pkg_entry_t* pe = &ph->entries[i];
+			const char* name;
+			uint16_t nlen, elen, clen;
+			uint64_t lho;
+
+			BOLT_IF(p + ZIP_CDIR_LEN > cdir + cd_size || rd32(p) != ZIP_CDIR_SIG, E_UA_ERR, "corrupt central directory: %s", ph->file);
+
+			nlen = rd16(p + 28);
+			elen = rd16(p + 30);
+			clen = rd16(p + 32);
+			lho  = rd32(p + 42);
+			BOLT_IF(p + ZIP_CDIR_LEN + nlen + elen + clen > cdir + cd_size, E_UA_ERR, "corrupt central directory: %s", ph->file);
+
+			if (lho == 0xffffffff) {
+				unsigned char* x = p + ZIP_CDIR_LEN + nlen;
+
+				while (x + 4 <= p + ZIP_CDIR_LEN + nlen + elen) {
+					uint16_t id = rd16(x), len = rd16(x + 2);
+
+					if (id == 0x0001) {
+						int skip = (rd32(p + 24) == 0xffffffff) + (rd32(p + 20) == 0xffffffff);
+						if (len >= (skip + 1) * 8)
+							lho = rd64(x + 4 + skip * 8);
+						break;
+					}
+					x += 4 + len;
+				}
+			}
+
+			name = zip_get_name(ph->za, pe->index, ZIP_FL_ENC_RAW);
+			BOLT_IF(!name || strlen(name) != nlen || memcmp(name, p + ZIP_CDIR_LEN, nlen),
+			        E_UA_ERR, "central directory order mismatch at %d: %s", (int)i, ph->file);
+
+			pe->lho = lho;
+			p      += ZIP_CDIR_LEN + nlen + elen + clen;
+		}
+		if (err) break;
+
+		ph->offsets_loaded = 1;
+
+	} while (0);
+
+	f_free(tail);
+	f_free(cdir);
+
+	return err;
+}
+
+static int pkg_data_offset(pkg_handle_t* ph, pkg_entry_t* pe, uint64_t* offset)
+{
+	int err = E_UA_OK;
+	unsigned char lh[ZIP_LOCAL_LEN];
+
+	do {
+		if (pe->data_offset)
+			break;
+
+		BOLT_SUB(pkg_load_offsets(ph));
+		BOLT_IF(read_at(ph->fd, lh, sizeof(lh), pe->lho) || rd32(lh) != ZIP_LOCAL_SIG,
+		        E_UA_ERR, "invalid local header for %s", pe->name);
+
+		pe->data_offset = pe->lho + ZIP_LOCAL_LEN + rd16(lh + 26) + rd16(lh + 28);
+
+	} while (0);
+
+	*offset = pe->data_offset;
+
+	return err;
+}
+
+ua_pkg_t* ua_pkg_open(const char* archive)
+{
+	return pkg_open(archive);
+}
+
+void ua_pkg_close(ua_pkg_t* pkg)
+{
+	pkg_close(pkg);
+}
+
+ua_pkg_entry_t* ua_pkg_entry_open(ua_pkg_t* pkg, const char* name, uint64_t* size)
+{
+	pkg_entry_t* pe;
+	pkg_stream_t* ps = 0;
+	uint64_t off;
+	int stored;
+
+	if (!pkg || !name)
+		return 0;
+
+	// name lookup and data offset both go through libzip
+	pthread_mutex_lock(&pkg->lock);
+	if ((pe = pkg_find_entry(pkg, name)) && !pe->is_dir && pe->stored && pkg_data_offset(pkg, pe, &off)) {
+		A_INFO_MSG("falling back to streamed access for %s", name);
+		pe->stored = 0;
+	}
+	stored = pe ? pe->stored : 0;
+	pthread_mutex_unlock(&pkg->lock);
+
+	if (!pe || pe->is_dir) {
+		A_ERROR_MSG("file: %s not found in zip: %s", name, pkg->file);
+		return 0;
+	}
+
+	ps         = f_malloc(sizeof(pkg_stream_t));
+	ps->ph     = pkg;
+	ps->pe     = pe;
+	ps->stored = stored;
+
+	if (size)
+		*size = pe->size;
+
+	return ps;
+}
+
+int64_t ua_pkg_pread(ua_pkg_entry_t* entry, void* buf, size_t len, uint64_t offset)
+{
+	int err      = E_UA_OK;
+	int64_t done = 0;
+	zip_int64_t r;
+	char skip[4096];
+	pkg_handle_t* ph;
+	pkg_entry_t* pe;
+
+	if (!entry || (!buf && len))
+		return -1;
+
+	ph = entry->ph;
+	pe = entry->pe;
+
+	if (offset >= pe->size)
+		return 0;
+
+	if (len > pe->size - offset)
+		len = pe->size - offset;
+
+	if (entry->stored)
+		return read_at(ph->fd, buf, len, pe->data_offset + offset) ? -1 : (int64_t)len;
+
+	pthread_mutex_lock(&ph->lock);
+
+	do {
+		if (entry->zf && offset < entry->pos) {
+			zip_fclose(entry->zf);
+			entry->zf = 0;
+		}
+
+		if (!entry->zf) {
+			BOLT_IF(!(entry->zf = zip_fopen_index(ph->za, pe->index, 0)), E_UA_ERR,
+			        "failed to open/find %s: %s", pe->name, zip_strerror(ph->za));
+			entry->pos = 0;
+		}
+
+		while (entry->pos < offset) {
+			uint64_t n = offset - entry->pos < sizeof(skip) ? offset - entry->pos : sizeof(skip);
+			BOLT_IF((r = zip_fread(entry->zf, skip, n)) <= 0, E_UA_ERR, "error reading %s : %s", pe->name, zip_file_strerror(entry->zf));
+			entry->pos += r;
+		}
+		if (err) break;
+
+		while ((size_t)done < len) {
+			BOLT_IF((r = zip_fread(entry->zf, (char*)buf + done, len - done)) <= 0, E_UA_ERR, "error reading %s : %s", pe->name, zip_file_strerror(entry->zf));
+			entry->pos += r;
+			done       += r;
+		}
+
+	} while (0);
+
+	if (err && entry->zf) {
+		zip_fclose(entry->zf);
+		entry->zf = 0;
+	}
+
+	pthread_mutex_unlock(&ph->lock);
+
+	return err ? -1 : done;
+}
+
+int ua_pkg_mmap(ua_pkg_entry_t* entry, const void** addr, uint64_t* len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t start, delta;
+	void* map;
+
+	if (!entry || !addr || !entry->stored)
+		return E_UA_ERR;
+
+	if (!entry->map && entry->pe->size) {
+		start = entry->pe->data_offset & ~((uint64_t)page - 1);
+		delta = entry->pe->data_offset - start;
+
+		if ((map = mmap(NULL, entry->pe->size + delta, PROT_READ, MAP_SHARED, entry->ph->fd, start)) == MAP_FAILED) {
+			A_ERROR_MSG("failed to map %s: %s", entry->pe->name, strerror(errno));
+			return E_UA_SYS;
+		}
+		(void)madvise(map, entry->pe->size + delta, MADV_SEQUENTIAL);
+
+		entry->map     = map;
+		entry->map_len = entry->pe->size + delta;
+	}
+
+	*addr = entry->map ? (char*)entry->map + (entry->map_len - entry->pe->size) : NULL;
+	if (len)
+		*len = entry->pe->size;
+
+	return E_UA_OK;
+}
+
+void ua_pkg_entry_close(ua_pkg_entry_t* entry)
+{
+	if (!entry)
+		return;
+
+	if (entry->map)
+		munmap(entry->map, entry->map_len);
+
+	if (entry->zf) {
+		pthread_mutex_lock(&entry->ph->lock);
+		zip_fclose(entry->zf);
+		pthread_mutex_unlock(&entry->ph->lock);
+	}
+
+	free(entry);
+}
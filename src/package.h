@@ -0,0 +1,101 @@
+/*
+ * package.h
+ */
+
+#ifndef UA_PACKAGE_H_
+#define UA_PACKAGE_H_
+
+#ifdef LIBUA_VER_2_0
+#include "esyncua.h"
+#else
+#include "xl4ua.h"
+#endif
+
+#include "misc.h"
+#include <zip.h>
+#include <pthread.h>
+
+typedef struct pkg_entry {
+	char* name;
+	zip_uint64_t index;
+	zip_uint64_t size;
+	zip_uint64_t comp_size;
+	int is_dir;
+	int stored;
+	uint64_t lho;
+	uint64_t data_offset;
+	int hashed;
+	unsigned char sha256[SHA256_DIGEST_LENGTH];
+
+} pkg_entry_t;
+
+/*
+ * Package archive opened once and shared by every step of the update flow
+ * that needs to look inside it. The central directory is read at open time;
+ * manifest content, per-entry hashes and sha_of_sha are filled in lazily and
+ * kept until pkg_close(). The cached state is not thread safe; only the
+ * ua_pkg_* entry functions may be used from several threads.
+ */
+typedef struct pkg_handle {
+	char* file;
+	struct zip* za;
+	pkg_entry_t* entries;
+	int entry_cnt;
+
+	// raw descriptor for stored entries, libzip access is serialized by lock
+	int fd;
+	int offsets_loaded;
+	pthread_mutex_t lock;
+
+	char* manifest_diff;
+	int manifest_diff_read;
+
+	int sha_x_done;
+	char sha_x[SHA256_B64_LENGTH];
+
+} pkg_handle_t;
+
+pkg_handle_t* pkg_open(const char* file);
+void pkg_close(pkg_handle_t* ph);
+
+pkg_entry_t* pkg_find_entry(pkg_handle_t* ph, const char* name);
+
+/*
+ * Returns content of manifest_diff.xml, read once and cached in the handle,
+ * or NULL if the package does not contain it.
+ */
+const char* pkg_manifest_diff(pkg_handle_t* ph);
+
+/*
+ * Extract all entries into directory path.
+ */
+int pkg_extract(pkg_handle_t* ph, const char* path);
+
+/*
+ * SHA256 of entry name and content, cached per entry.
+ */
+int pkg_entry_sha256(pkg_handle_t* ph, pkg_entry_t* pe, unsigned char hash[SHA256_DIGEST_LENGTH]);
+
+/*
+ * Same result as calc_sha256_x(), computed from cached entry hashes.
+ */
+int pkg_sha256_x(pkg_handle_t* ph, char obuff[SHA256_B64_LENGTH]);
+
+/*
+ * Open entry of a package for random access, exported as ua_pkg_entry_t.
+ * Stored entries are read with pread() from the archive file, others are
+ * decompressed forward from the closest position.
+ */
+typedef struct pkg_stream {
+	pkg_handle_t* ph;
+	pkg_entry_t* pe;
+	// pe->stored as decided under ph->lock at open, read lock-free after
+	int stored;
+	struct zip_file* zf;
+	uint64_t pos;
+	void* map;
+	size_t map_len;
+
+} pkg_stream_t;
+
+#endif /* UA_PACKAGE_H_ */
@@ -0,0 +1,169 @@
+/*
+ * rbplan.c
+ */
+
+#include "rbplan.h"
+#include "xml.h"
+#include "debug.h"
+#include "utlist.h"
+#include <string.h>
+#include <unistd.h>
+
+static void manifest_stamp(const char* manifest, file_stamp_t* fs)
+{
+	if (!manifest || access(manifest, R_OK) || file_stamp(manifest, fs))
+		memset(fs, 0, sizeof(file_stamp_t));
+}
+
+static int rb_plan_current(rb_plan_t* plan, const char* pkg_name, const char* manifest, json_object* rollback_versions)
+{
+	file_stamp_t fs;
+
+	if (!plan || strcmp(plan->pkg_name, pkg_name) || strcmp(SAFE_STR(plan->manifest), SAFE_STR(manifest)))
+		return 0;
+
+	manifest_stamp(manifest, &fs);
+	if (fs.size != plan->manifest_fs.size || fs.mtime_ns != plan->manifest_fs.mtime_ns ||
+	    fs.ino != plan->manifest_fs.ino || fs.dev != plan->manifest_fs.dev)
+		return 0;
+
+	if (rollback_versions == plan->versions)
+		return 1;
+
+	// a new message, compare its list once and keep it for later lookups
+	if ((int)json_object_array_length(rollback_versions) != plan->cnt)
+		return 0;
+	for (int i = 0; i < plan->cnt; i++) {
+		const char* ver = json_object_get_string(json_object_array_get_idx(rollback_versions, i));
+		if (!ver || strcmp(ver, plan->cand[i].version))
+			return 0;
+	}
+
+	json_object_put(plan->versions);
+	plan->versions = json_object_get(rollback_versions);
+
+	return 1;
+}
+
+static rb_plan_t* rb_plan_build(const char* pkg_name, const char* manifest, json_object* rollback_versions)
+{
+	int cnt         = json_object_array_length(rollback_versions);
+	rb_plan_t* plan = f_malloc(sizeof(rb_plan_t));
+	pkg_file_t* pf  = NULL;
+	int with_backup = 0;
+
+	plan->pkg_name = f_strdup(pkg_name);
+	plan->manifest = f_strdup(manifest);
+	plan->versions = json_object_get(rollback_versions);
+	plan->cand     = f_malloc(cnt * sizeof(rb_candidate_t));
+	manifest_stamp(manifest, &plan->manifest_fs);
+
+	for (int i = 0; i < cnt; i++) {
+		rb_candidate_t* c = &plan->cand[plan->cnt];
+		rb_candidate_t* dup;
+
+		c->version = f_strdup(SAFE_STR(json_object_get_string(json_object_array_get_idx(rollback_versions, i))));
+		c->index   = plan->cnt++;
+
+		// the first occurrence is the one rollback moves on from
+		HASH_FIND_STR(plan->by_version, c->version, dup);
+		if (!dup)
+			HASH_ADD_KEYPTR(hh, plan->by_version, c->version, strlen(c->version), c);
+	}
+
+	// list is in reverse document order, keep the first entry of a version
+	if (plan->manifest_fs.size && parse_pkg_manifest((char*)manifest, &plan->backups) == E_UA_OK) {
+		DL_FOREACH(plan->backups, pf) {
+			rb_candidate_t* c = rb_plan_find(plan, pf->version);
+			file_stamp_t fs;
+			if (!c)
+				continue;
+			c->backup   = NULL;
+			c->in_store = 0;
+			if (!file_stamp(pf->file, &fs) && !access(pf->file, R_OK))
+				c->backup = pf;
+			else if (pf->stored)
+				c->in_store = 1;
+			else
+				A_WARN_MSG("Backup package %s of %s is not readable", SAFE_STR(pf->file), pf->version);
+		}
+	}
+
+	for (int i = 0; i < plan->cnt; i++)
+		with_backup += plan->cand[i].backup || plan->cand[i].in_store;
+
+	A_INFO_MSG("Rollback plan for %s: %d version(s), %d with backup package", pkg_name, plan->cnt, with_backup);
+
+	return plan;
+}
+
+rb_plan_t* rb_plan_get(rb_plan_t** plan, const char* pkg_name, const char* manifest, json_object* rollback_versions)
+{
+	if (!plan || !pkg_name || !json_object_is_type(rollback_versions, json_type_array) ||
+	    json_object_array_length(rollback_versions) <= 0)
+		return NULL;
+
+	if (!rb_plan_current(*plan, pkg_name, manifest, rollback_versions)) {
+		rb_plan_free(*plan);
+		*plan = rb_plan_build(pkg_name, manifest, rollback_versions);
+	}
+
+	return *plan;
+}
+
+rb_candidate_t* rb_plan_find(rb_plan_t* plan, const char* version)
+{
+	rb_candidate_t* c = NULL;
+
+	if (plan && version)
+		HASH_FIND_STR(plan->by_version, version, c);
+
+	return c;
+}
+
+rb_candidate_t* rb_plan_next(rb_plan_t* plan, const char* version)
+{
+	if (!plan || !version)
+		return NULL;
+
+	rb_candidate_t* c = rb_plan_find(plan, version);
+	int idx           = c ? c->index + 1 : 0;
+
+	return idx < plan->cnt ? &plan->cand[idx] : NULL;
+}
+
+int rb_plan_copy_backup(const rb_candidate_t* c, pkg_file_t* pkgFile)
+{
+	if (!c || !c->backup || !pkgFile)
+		return E_UA_ERR;
+
+	memcpy(pkgFile, c->backup, sizeof(pkg_file_t));
+	pkgFile->next    = pkgFile->prev = NULL;
+	pkgFile->version = f_strdup(c->backup->version);
+	pkgFile->file    = f_strdup(c->backup->file);
+
+	return E_UA_OK;
+}
+
+void rb_plan_free(rb_plan_t* plan)
+{
+	pkg_file_t* pf, * aux;
+
+	if (!plan)
+		return;
+
+	HASH_CLEAR(hh, plan->by_version);
+	for (int i = 0; i < plan->cnt; i++)
+		f_free(plan->cand[i].version);
+
+	DL_FOREACH_SAFE(plan->backups, pf, aux) {
+		DL_DELETE(plan->backups, pf);
+		free_pkg_file(pf);
+	}
+
+	json_object_put(plan->versions);
+	f_free(plan->cand);
+	f_free(plan->manifest);
+	f_free(plan->pkg_name);
+	free(plan);
+}
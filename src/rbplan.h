@@ -0,0 +1,69 @@
+/*
+ * rbplan.h
+ */
+
+#ifndef UA_RBPLAN_H_
+#define UA_RBPLAN_H_
+
+#include "handler.h"
+#include "uthash.h"
+#include <sys/stat.h>
+
+typedef struct rb_candidate {
+	char* version;
+	// position in rollback-versions
+	int index;
+	// backup manifest entry of this version, file was a readable regular
+	// file when the plan was built
+	pkg_file_t* backup;
+	// backup is only in the backup store, it is checked out through the manifest
+	int in_store;
+
+	UT_hash_handle hh;
+
+} rb_candidate_t;
+
+/*
+ * Rollback candidates of one package, in rollback-versions order, built
+ * once from the message and a single read of the backup manifest. The
+ * plan is rebuilt when the package, the rollback-versions list or the
+ * backup manifest changes; it is kept across ready-update messages of
+ * the same rollback chain.
+ */
+typedef struct rb_plan {
+	char* pkg_name;
+	char* manifest;
+	// backup manifest as parsed, zero if it was not readable
+	file_stamp_t manifest_fs;
+	// rollback-versions array last checked against the plan, referenced
+	json_object* versions;
+
+	rb_candidate_t* cand;
+	int cnt;
+	rb_candidate_t* by_version;
+	pkg_file_t* backups;
+
+} rb_plan_t;
+
+/*
+ * Return the plan for rollback_versions, reusing *plan if it is still
+ * current. Returns NULL if rollback_versions is not a non-empty array.
+ */
+rb_plan_t* rb_plan_get(rb_plan_t** plan, const char* pkg_name, const char* manifest, json_object* rollback_versions);
+
+rb_candidate_t* rb_plan_find(rb_plan_t* plan, const char* version);
+
+/*
+ * Candidate following version, or the first one if version is not part
+ * of the plan.
+ */
+rb_candidate_t* rb_plan_next(rb_plan_t* plan, const char* version);
+
+/*
+ * Copy backup entry of c into pkgFile, version and file are duplicated.
+ */
+int rb_plan_copy_backup(const rb_candidate_t* c, pkg_file_t* pkgFile);
+
+void rb_plan_free(rb_plan_t* plan);
+
+#endif /* UA_RBPLAN_H_ */
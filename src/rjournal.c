@@ -0,0 +1,181 @@
+/*
+ * rjournal.c
+ */
+
+#include "rjournal.h"
+#include "common.h"
+#include "debug.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+static void sync_dir(const char* path)
+{
+	char* dir = f_dirname(path);
+	int fd    = dir ? open(dir, O_RDONLY) : -1;
+
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	f_free(dir);
+}
+
+static int write_all(int fd, const char* buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, buf, len)) < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void add_record(rjournal_t* j, const char* key, size_t len)
+{
+	rj_record_t* r;
+
+	HASH_FIND(hh, j->records, key, len, r);
+	if (!r) {
+		r      = f_malloc(sizeof(rj_record_t));
+		r->key = f_strndup(key, len);
+		HASH_ADD_KEYPTR(hh, j->records, r->key, len, r);
+	}
+}
+
+/*
+ * Load the records after a header matching id, returns the length of the
+ * journal up to its last complete line, 0 if it has to be started over.
+ */
+static off_t load_records(rjournal_t* j, const char* id)
+{
+	struct stat st;
+	char* buf = NULL, * line, * nl;
+	size_t hlen = strlen(RJ_VERSION) + 1 + strlen(id);
+	off_t valid = 0;
+	ssize_t n   = 0;
+
+	do {
+		if (fstat(j->fd, &st) || st.st_size <= (off_t)hlen)
+			break;
+
+		buf = f_malloc(st.st_size + 1);
+		if ((n = pread(j->fd, buf, st.st_size, 0)) != st.st_size)
+			break;
+
+		if (strncmp(buf, RJ_VERSION " ", strlen(RJ_VERSION) + 1) || strncmp(buf + strlen(RJ_VERSION) + 1, id, strlen(id)) || buf[hlen] != '\n')
+			break;
+
+		valid = hlen + 1;
+		for (line = buf + valid; line < buf + n && (nl = memchr(line, '\n', buf + n - line)); line = nl + 1) {
+			if (nl - line > 2 && line[1] == ' ')
+				add_record(j, line, nl - line);
+			valid = nl + 1 - buf;
+		}
+
+	} while (0);
+
+	f_free(buf);
+
+	return valid;
+}
+
+int rjournal_open(rjournal_t* j, const char* path, const char* id)
+{
+	int err = E_UA_OK;
+	char* header = NULL;
+	off_t valid;
+
+	memset(j, 0, sizeof(rjournal_t));
+	j->fd = -1;
+
+	do {
+		BOLT_IF(strchr(id, '\n'), E_UA_ARG, "invalid journal id");
+		BOLT_SYS((j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0, "failed to open journal %s", path);
+		j->path = f_strdup(path);
+
+		if ((valid = load_records(j, id)) > 0) {
+			// a line cut short by power loss is dropped, later records go after the last full one
+			BOLT_SYS(ftruncate(j->fd, valid) || lseek(j->fd, valid, SEEK_SET) < 0, "failed to trim journal %s", path);
+			j->resumed = 1;
+			A_INFO_MSG("Resuming from journal %s, %d record(s)", path, HASH_COUNT(j->records));
+			break;
+		}
+
+		header = f_asprintf("%s %s\n", RJ_VERSION, id);
+		BOLT_SYS(ftruncate(j->fd, 0) || lseek(j->fd, 0, SEEK_SET) < 0 || write_all(j->fd, header, strlen(header)) || fsync(j->fd), "failed to start journal %s", path);
+		sync_dir(path);
+
+	} while (0);
+
+	f_free(header);
+
+	if (err)
+		rjournal_close(j, 0);
+
+	return err;
+}
+
+int rjournal_has(rjournal_t* j, char tag, const char* name)
+{
+	rj_record_t* r = NULL;
+	char* key;
+
+	if (!j || j->fd < 0)
+		return 0;
+
+	key = f_asprintf("%c %s", tag, name);
+	HASH_FIND_STR(j->records, key, r);
+	free(key);
+
+	return r != NULL;
+}
+
+int rjournal_add(rjournal_t* j, char tag, const char* name)
+{
+	int err = E_UA_OK;
+	char* line = NULL;
+
+	do {
+		BOLT_IF(!j || j->fd < 0, E_UA_ARG, "journal not open");
+		BOLT_IF(strchr(name, '\n'), E_UA_ARG, "name can not be journaled: %s", name);
+
+		line = f_asprintf("%c %s\n", tag, name);
+		BOLT_SYS(write_all(j->fd, line, strlen(line)) || fdatasync(j->fd), "failed to write journal %s", j->path);
+		add_record(j, line, strlen(line) - 1);
+
+	} while (0);
+
+	f_free(line);
+
+	return err;
+}
+
+void rjournal_close(rjournal_t* j, int discard)
+{
+	rj_record_t* r, * aux;
+
+	HASH_ITER(hh, j->records, r, aux) {
+		HASH_DEL(j->records, r);
+		free(r->key);
+		free(r);
+	}
+
+	if (j->fd >= 0)
+		close(j->fd);
+	j->fd = -1;
+
+	if (discard && j->path && unlink(j->path) && errno != ENOENT)
+		A_WARN_MSG("failed to remove journal %s: %s", j->path, strerror(errno));
+
+	Z_FREE(j->path);
+}
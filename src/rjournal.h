@@ -0,0 +1,57 @@
+/*
+ * rjournal.h
+ */
+
+#ifndef UA_RJOURNAL_H_
+#define UA_RJOURNAL_H_
+
+#include "uthash.h"
+
+// package extracted, name is the directory
+#define RJ_EXTRACTED 'X'
+// in-place patching of an entry started, the new file holds the reference
+#define RJ_IN_PLACE  'P'
+// entry reconstructed, verified and written back
+#define RJ_DONE      'D'
+
+#define RJ_VERSION   "rj1"
+
+typedef struct rj_record {
+	char* key;
+
+	UT_hash_handle hh;
+
+} rj_record_t;
+
+/*
+ * Append-only journal of a delta reconstruction, one record per line.
+ * Every record is synced before rjournal_add() returns, so after power
+ * loss the journal holds a prefix of what was done; a torn last line is
+ * dropped when the journal is opened again.
+ */
+typedef struct rjournal {
+	int fd;
+	char* path;
+	int resumed;
+	rj_record_t* records;
+
+} rjournal_t;
+
+/*
+ * Open the journal at path. Records are kept when its header matches id,
+ * which identifies the inputs and output of the reconstruction, and
+ * j->resumed is set; otherwise the journal is started over.
+ */
+int rjournal_open(rjournal_t* j, const char* path, const char* id);
+
+int rjournal_has(rjournal_t* j, char tag, const char* name);
+
+int rjournal_add(rjournal_t* j, char tag, const char* name);
+
+/*
+ * Close the journal; with discard set it is removed, as the work it
+ * records is finished or abandoned.
+ */
+void rjournal_close(rjournal_t* j, int discard);
+
+#endif /* UA_RJOURNAL_H_ */
@@ -0,0 +1,275 @@
+/*
+ * scheduler.c
+ */
+
+#include "scheduler.h"
+#include "metrics.h"
+#include "misc.h"
+#include "debug.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#define SCHED_DEFAULT_IO_JOBS 2
+#define SCHED_PACE_WINDOW_US  1000000
+#define SCHED_IOPRIO_CLASS_BE 2
+#define SCHED_IOPRIO_CLASS_ID 3
+#define SCHED_IOPRIO_SHIFT    13
+
+typedef struct sched_slot {
+	int limit;
+	int active;
+
+} sched_slot_t;
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond  = PTHREAD_COND_INITIALIZER;
+static sched_slot_t sched_slots[SCHED_CLASS_COUNT];
+static __thread int sched_depth[SCHED_CLASS_COUNT];
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static ua_budget_t budget;
+static unsigned budget_gen;
+static uint64_t io_next_us;
+
+static __thread int sched_worker;
+static __thread unsigned sched_gen;
+static __thread uint64_t pace_wall, pace_cpu;
+// priorities the thread had when it became a worker, and whether the budget changed them
+static __thread int sched_nice0, sched_ioprio0;
+static __thread int sched_niced, sched_ioprioed;
+
+void scheduler_init(int cpu_jobs, int io_jobs)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	pthread_mutex_lock(&sched_lock);
+	sched_slots[SCHED_CPU].limit = cpu_jobs > 0 ? cpu_jobs : (cpus > 0 ? (int)cpus : 1);
+	sched_slots[SCHED_IO].limit  = io_jobs > 0 ? io_jobs : SCHED_DEFAULT_IO_JOBS;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+
+	A_INFO_MSG("scheduler limits: cpu %d, io %d", sched_slots[SCHED_CPU].limit, sched_slots[SCHED_IO].limit);
+}
+
+void scheduler_enter(sched_class_t cls)
+{
+	uint64_t tstart;
+
+	/* A thread already holding a slot of this class keeps using it. */
+	if (sched_depth[cls]++)
+		return;
+
+	tstart = currentms();
+
+	pthread_mutex_lock(&sched_lock);
+	while (sched_slots[cls].limit && sched_slots[cls].active >= sched_slots[cls].limit)
+		pthread_cond_wait(&sched_cond, &sched_lock);
+	sched_slots[cls].active++;
+	pthread_mutex_unlock(&sched_lock);
+
+	metrics_observe(M_SCHED_WAIT_MS, currentms() - tstart);
+}
+
+void scheduler_leave(sched_class_t cls)
+{
+	if (--sched_depth[cls])
+		return;
+
+	pthread_mutex_lock(&sched_lock);
+	sched_slots[cls].active--;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+int scheduler_claim(sched_class_t cls, int want)
+{
+	int got = want > 0 ? want : 0;
+
+	pthread_mutex_lock(&sched_lock);
+	if (sched_slots[cls].limit && got > sched_slots[cls].limit - sched_slots[cls].active)
+		got = sched_slots[cls].limit > sched_slots[cls].active ? sched_slots[cls].limit - sched_slots[cls].active : 0;
+	sched_slots[cls].active += got;
+	pthread_mutex_unlock(&sched_lock);
+
+	return got;
+}
+
+void scheduler_release(sched_class_t cls, int cnt)
+{
+	if (cnt <= 0)
+		return;
+
+	pthread_mutex_lock(&sched_lock);
+	sched_slots[cls].active -= cnt;
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+static uint64_t clock_us(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+	struct timespec ts = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+/*
+ * Give the calling thread the priorities of the budget, a field of 0 goes
+ * back to what the thread started with. Settings that need privileges to
+ * raise are left as they are when that fails.
+ */
+static void sched_apply(const ua_budget_t* b)
+{
+#ifdef __linux__
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	struct sched_param sp;
+	int policy, prio;
+	int nice = b->nice ? b->nice : sched_nice0;
+
+	memset(&sp, 0, sizeof(sp));
+	if (!pthread_getschedparam(pthread_self(), &policy, &sp)) {
+#ifdef SCHED_IDLE
+		if (b->idle && policy == SCHED_OTHER)
+			pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+		else if (!b->idle && policy == SCHED_IDLE)
+			pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+#endif
+	}
+
+	if ((b->nice || sched_niced) && setpriority(PRIO_PROCESS, tid, nice))
+		A_WARN_MSG("failed to set nice %d: %s", nice, strerror(errno));
+	else
+		sched_niced = !!b->nice;
+
+#ifdef SYS_ioprio_set
+	prio = !b->io_prio ? sched_ioprio0 :
+	       b->io_prio > 8 ? SCHED_IOPRIO_CLASS_ID << SCHED_IOPRIO_SHIFT :
+	       (SCHED_IOPRIO_CLASS_BE << SCHED_IOPRIO_SHIFT) | (b->io_prio - 1);
+	if ((b->io_prio || sched_ioprioed) && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, tid, prio))
+		A_WARN_MSG("failed to set I/O priority %d: %s", b->io_prio, strerror(errno));
+	else
+		sched_ioprioed = !!b->io_prio;
+#endif
+	XL4_UNUSED(prio);
+#else
+	XL4_UNUSED(b);
+#endif
+}
+
+int scheduler_budget(const ua_budget_t* b)
+{
+	ua_budget_t nb;
+
+	memset(&nb, 0, sizeof(nb));
+	if (b) {
+		if (b->io_kbps < 0 || b->cpu_share < 0 || b->cpu_share > 100 ||
+		    b->nice < 0 || b->nice > 19 || b->io_prio < 0 || b->io_prio > 9)
+			return E_UA_ARG;
+		nb      = *b;
+		nb.idle = !!nb.idle;
+	}
+
+	pthread_mutex_lock(&budget_lock);
+	budget = nb;
+	budget_gen++;
+	pthread_mutex_unlock(&budget_lock);
+
+	A_INFO_MSG("resource budget: io %d KB/s, cpu %d%%, nice %d, io prio %d, idle %d",
+	           nb.io_kbps, nb.cpu_share, nb.nice, nb.io_prio, nb.idle);
+
+	return E_UA_OK;
+}
+
+void scheduler_get_budget(ua_budget_t* b)
+{
+	pthread_mutex_lock(&budget_lock);
+	*b = budget;
+	pthread_mutex_unlock(&budget_lock);
+}
+
+void scheduler_worker(void)
+{
+	ua_budget_t b;
+
+#ifdef __linux__
+	if (!sched_worker) {
+		pid_t tid = (pid_t)syscall(SYS_gettid);
+		int prio;
+
+		errno = 0;
+		prio  = getpriority(PRIO_PROCESS, tid);
+		sched_nice0 = errno ? 0 : prio;
+#ifdef SYS_ioprio_get
+		prio = syscall(SYS_ioprio_get, 1 /* IOPRIO_WHO_PROCESS */, tid);
+		sched_ioprio0 = prio > 0 ? prio : 0;
+#endif
+	}
+#endif
+	sched_worker = 1;
+
+	pthread_mutex_lock(&budget_lock);
+	b         = budget;
+	sched_gen = budget_gen;
+	pthread_mutex_unlock(&budget_lock);
+
+	sched_apply(&b);
+}
+
+void scheduler_pace(size_t bytes)
+{
+	uint64_t now, wait = 0;
+	ua_budget_t b;
+	int changed;
+
+	pthread_mutex_lock(&budget_lock);
+	b       = budget;
+	changed = sched_worker && sched_gen != budget_gen;
+	sched_gen = budget_gen;
+
+	// every caller books its share of the I/O budget, then sleeps outside the lock
+	if (bytes && b.io_kbps) {
+		now = clock_us(CLOCK_MONOTONIC);
+		if (io_next_us < now)
+			io_next_us = now;
+		io_next_us += (uint64_t)bytes * 1000000 / ((uint64_t)b.io_kbps * 1024);
+		wait        = io_next_us - now;
+	}
+	pthread_mutex_unlock(&budget_lock);
+
+	if (changed)
+		sched_apply(&b);
+
+	// a worker above its CPU share sleeps until it is back to it
+	if (sched_worker && b.cpu_share) {
+		uint64_t wall = clock_us(CLOCK_MONOTONIC);
+		uint64_t cpu  = clock_us(CLOCK_THREAD_CPUTIME_ID);
+
+		if (!pace_wall || wall - pace_wall > SCHED_PACE_WINDOW_US) {
+			pace_wall = wall;
+			pace_cpu  = cpu;
+		} else {
+			uint64_t due = (cpu - pace_cpu) * 100 / b.cpu_share;
+			if (due > wall - pace_wall && due - (wall - pace_wall) > wait)
+				wait = due - (wall - pace_wall);
+		}
+	}
+
+	if (wait >= 1000)
+		sleep_us(wait);
+}
@@ -0,0 +1,52 @@
+/*
+ * scheduler.h
+ */
+
+#ifndef UA_SCHEDULER_H_
+#define UA_SCHEDULER_H_
+
+#ifdef LIBUA_VER_2_0
+#include "esyncua.h"
+#else
+#include "xl4ua.h"
+#endif
+
+#include <stddef.h>
+
+typedef enum sched_class {
+	SCHED_CPU,
+	SCHED_IO,
+	SCHED_CLASS_COUNT
+
+} sched_class_t;
+
+/*
+ * Jobs of each class are admitted up to the configured limit, across all
+ * handlers and workers. A class with no limit set admits everything, which
+ * is also the behavior when scheduler_init has not been called.
+ */
+void scheduler_init(int cpu_jobs, int io_jobs);
+void scheduler_enter(sched_class_t cls);
+void scheduler_leave(sched_class_t cls);
+
+/*
+ * Take up to want more slots of a class without waiting, for the helper
+ * threads of a job. Returns how many were taken, to be given back with
+ * scheduler_release().
+ */
+int scheduler_claim(sched_class_t cls, int want);
+void scheduler_release(sched_class_t cls, int cnt);
+
+/*
+ * Resource budget of update work. Threads doing update work call
+ * scheduler_worker() once, which gives them the nice value, I/O priority
+ * and policy of the budget. Bulk work calls scheduler_pace() between
+ * blocks: all threads are held to the I/O rate, worker threads also to
+ * their CPU share, and pick up a changed budget there.
+ */
+int scheduler_budget(const ua_budget_t* budget);
+void scheduler_get_budget(ua_budget_t* budget);
+void scheduler_worker(void);
+void scheduler_pace(size_t bytes);
+
+#endif /* UA_SCHEDULER_H_ */
@@ -0,0 +1,199 @@
+/*
+ * trace.c
+ */
+
+#include "trace.h"
+#include "misc.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+typedef struct trace_stg {
+	pthread_mutex_t lock;
+	trace_event_t* events;
+	unsigned int max;
+	unsigned int head;
+	unsigned int count;
+	uint64_t dropped;
+	unsigned int next_tid;
+	int enabled;
+	char* file;
+
+} trace_stg_t;
+
+static trace_stg_t trace_stg = {PTHREAD_MUTEX_INITIALIZER};
+static __thread unsigned int trace_tid = 0;
+
+static void trace_write_str(FILE* fp, const char* s);
+
+int trace_init(const char* file, int max_events)
+{
+	int err = E_UA_OK;
+
+	do {
+		BOLT_IF(max_events < 0, E_UA_ARG, "invalid trace buffer size %d", max_events);
+		if (!max_events && !S(file))
+			break;
+
+		pthread_mutex_lock(&trace_stg.lock);
+		Z_FREE(trace_stg.events);
+		Z_FREE(trace_stg.file);
+		trace_stg.max     = max_events ? max_events : TRACE_DEFAULT_EVENTS;
+		trace_stg.events  = f_malloc(trace_stg.max * sizeof(trace_event_t));
+		trace_stg.file    = S(file) ? f_strdup(file) : NULL;
+		trace_stg.head    = 0;
+		trace_stg.count   = 0;
+		trace_stg.dropped = 0;
+		trace_stg.enabled = 1;
+		pthread_mutex_unlock(&trace_stg.lock);
+
+		A_INFO_MSG("tracing enabled, %u events, output: %s", trace_stg.max, NULL_STR(trace_stg.file));
+
+	} while (0);
+
+	return err;
+}
+
+void trace_stop(void)
+{
+	if (!trace_stg.enabled)
+		return;
+
+	if (trace_stg.file)
+		trace_dump(trace_stg.file);
+
+	pthread_mutex_lock(&trace_stg.lock);
+	trace_stg.enabled = 0;
+	Z_FREE(trace_stg.events);
+	Z_FREE(trace_stg.file);
+	trace_stg.max   = 0;
+	trace_stg.head  = 0;
+	trace_stg.count = 0;
+	pthread_mutex_unlock(&trace_stg.lock);
+}
+
+int trace_enabled(void)
+{
+	return trace_stg.enabled;
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec tp;
+
+	if (!trace_stg.enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+
+	return ((uint64_t)tp.tv_sec) * 1000000ULL +
+	       tp.tv_nsec / 1000ULL;
+}
+
+int64_t trace_file_size(const char* path)
+{
+	struct stat st;
+
+	if (!path || stat(path, &st))
+		return 0;
+
+	return (int64_t)st.st_size;
+}
+
+void trace_record(char ph, const char* cat, const char* name, const char* arg, uint64_t ts, uint64_t dur, int64_t bytes)
+{
+	trace_event_t* ev;
+
+	pthread_mutex_lock(&trace_stg.lock);
+
+	if (trace_stg.enabled && trace_stg.events) {
+		if (!trace_tid)
+			trace_tid = ++trace_stg.next_tid;
+
+		ev = &trace_stg.events[trace_stg.head];
+		trace_stg.head = (trace_stg.head + 1) % trace_stg.max;
+		if (trace_stg.count < trace_stg.max)
+			trace_stg.count++;
+		else
+			trace_stg.dropped++;
+
+		ev->ts    = ts;
+		ev->dur   = dur;
+		ev->bytes = bytes;
+		ev->tid   = trace_tid;
+		ev->ph    = ph;
+		ev->cat   = cat;
+		strcpy_s(ev->name, SAFE_STR(name), sizeof(ev->name));
+		strcpy_s(ev->arg, SAFE_STR(arg), sizeof(ev->arg));
+	}
+
+	pthread_mutex_unlock(&trace_stg.lock);
+}
+
+int trace_dump(const char* path)
+{
+	int err  = E_UA_OK;
+	FILE* fp = NULL;
+	unsigned int i, first;
+
+	do {
+		BOLT_IF(!S(path), E_UA_ARG, "no trace file specified");
+		BOLT_IF(!trace_stg.enabled, E_UA_ERR, "tracing is not enabled");
+		BOLT_SYS(chkdirp(path), "failed to prepare directory for %s", path);
+		BOLT_SYS(!(fp = fopen(path, "w")), "creating file: %s", path);
+
+		pthread_mutex_lock(&trace_stg.lock);
+
+		fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"libua\"}}", (int)getpid());
+
+		first = (trace_stg.head + trace_stg.max - trace_stg.count) % trace_stg.max;
+		for (i = 0; i < trace_stg.count; i++) {
+			trace_event_t* ev = &trace_stg.events[(first + i) % trace_stg.max];
+
+			fprintf(fp, ",\n{\"name\":");
+			trace_write_str(fp, ev->name);
+			fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ",", ev->cat, ev->ph, ev->ts);
+			if (ev->ph == 'X')
+				fprintf(fp, "\"dur\":%" PRIu64 ",", ev->dur);
+			else
+				fprintf(fp, "\"s\":\"t\",");
+			fprintf(fp, "\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":", (int)getpid(), ev->tid);
+			trace_write_str(fp, ev->arg);
+			fprintf(fp, ",\"bytes\":%" PRId64 "}}", ev->bytes);
+		}
+
+		fprintf(fp, "\n],\"otherData\":{\"dropped\":%" PRIu64 "}}\n", trace_stg.dropped);
+
+		pthread_mutex_unlock(&trace_stg.lock);
+
+		A_INFO_MSG("wrote %u trace events to %s", i, path);
+
+	} while (0);
+
+	if (fp && fclose(fp)) {
+		A_ERROR_MSG("closing file: %s", path);
+		err = E_UA_SYS;
+	}
+
+	return err;
+}
+
+static void trace_write_str(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
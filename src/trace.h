@@ -0,0 +1,64 @@
+/*
+ * trace.h
+ */
+
+#ifndef UA_TRACE_H_
+#define UA_TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_CAT_MSG      "message"
+#define TRACE_CAT_CALLBACK "callback"
+#define TRACE_CAT_ARCHIVE  "archive"
+#define TRACE_CAT_DELTA    "delta"
+#define TRACE_CAT_HASH     "hash"
+#define TRACE_CAT_BACKUP   "backup"
+
+#define TRACE_DEFAULT_EVENTS 8192
+#define TRACE_NAME_LEN       32
+#define TRACE_ARG_LEN        96
+
+typedef struct trace_event {
+	uint64_t ts;
+	uint64_t dur;
+	int64_t bytes;
+	unsigned int tid;
+	char ph;
+	const char* cat;
+	char name[TRACE_NAME_LEN];
+	char arg[TRACE_ARG_LEN];
+
+} trace_event_t;
+
+#ifdef SUPPORT_UA_TRACE
+
+int trace_init(const char* file, int max_events);
+void trace_stop(void);
+int trace_enabled(void);
+uint64_t trace_now(void);
+int64_t trace_file_size(const char* path);
+void trace_record(char ph, const char* cat, const char* name, const char* arg, uint64_t ts, uint64_t dur, int64_t bytes);
+int trace_dump(const char* path);
+
+/*
+ * TRACE_START declares the start timestamp of a span, TRACE_SPAN records
+ * the span from that timestamp up to now. Arguments of TRACE_SPAN and
+ * TRACE_MARK are only evaluated when tracing is enabled.
+ */
+#define TRACE_START(t) uint64_t t = trace_now()
+#define TRACE_SPAN(t, cat, name, arg, bytes) do { if (trace_enabled()) { \
+		uint64_t _ts = (t); trace_record('X', cat, name, arg, _ts, trace_now() - _ts, bytes); } \
+} while (0)
+#define TRACE_MARK(cat, name, arg, bytes) do { if (trace_enabled()) { \
+		trace_record('i', cat, name, arg, trace_now(), 0, bytes); } \
+} while (0)
+
+#else
+
+#define TRACE_START(t)
+#define TRACE_SPAN(t, cat, name, arg, bytes) do {} while (0)
+#define TRACE_MARK(cat, name, arg, bytes)    do {} while (0)
+
+#endif /* SUPPORT_UA_TRACE */
+
+#endif /* UA_TRACE_H_ */
@@ -15,6 +15,9 @@
 #include "pthread.h"
 #include "debug.h"
 #include "component.h"
+#include "trace.h"
+#include "jsonfast.h"
+#include "rbplan.h"
 
 extern ua_internal_t ua_intl;
 json_object* update_get_pkg_info_jo(pkg_info_t* pkg)
@@ -223,26 +226,16 @@ int update_installed_version_same(ua_component_context_t* uacc, char* target_ver
 {
 	char* install_version = NULL;
 	int err               = E_UA_ERR;
+	int same              = 0;
 
-#ifdef LIBUA_VER_2_0
-	ua_callback_ctl_t uactl = {0};
-	uactl.type     = uacc->update_pkg.type;
-	uactl.pkg_name = uacc->update_pkg.name;
-	uactl.pkg_path = uacc->update_file_info.file;
-	uactl.ref      = uacc->usr_ref;
-	if ((err = (uacc->uar->on_get_version)(&uactl)) == E_UA_OK)
-		install_version = uactl.version;
-
-#else
-	err = (uacc->uar->on_get_version)(uacc->update_pkg.type,
-	                                  uacc->update_pkg.name,
-	                                  &install_version);
-
-#endif
+	err = get_installed_version(uacc, uacc->update_pkg.type, uacc->update_pkg.name,
+	                            uacc->update_file_info.file, &install_version, NULL);
 	if (err != E_UA_OK)
 		A_ERROR_MSG("Error get version for %s.", uacc->update_pkg.name);
 	A_INFO_MSG("target_version = %s, install_version = %s", NULL_STR(target_version), NULL_STR(install_version));
-	return (S(target_version) && S(install_version) && !strcmp(target_version, install_version));
+	same = (S(target_version) && S(install_version) && !strcmp(target_version, install_version));
+	f_free(install_version);
+	return same;
 
 }
 
@@ -279,13 +272,18 @@ install_state_t update_start_install_operations(ua_component_context_t* uacc, in
 	return update_sts;
 }
 
+static rb_plan_t* update_rb_plan(ua_component_context_t* uacc)
+{
+	return rb_plan_get(&uacc->rb_plan, uacc->update_pkg.name, uacc->backup_manifest, uacc->update_pkg.rollback_versions);
+}
+
 char* update_get_next_rollback_version(ua_component_context_t* uacc, char* cur_version)
 {
-	char* rb_version = NULL;
+	char* rb_version  = NULL;
+	rb_candidate_t* c = NULL;
 
-	if (uacc->update_pkg.rollback_versions != NULL)
-		get_pkg_next_rollback_version(uacc->update_pkg.rollback_versions,
-		                              cur_version, &rb_version);
+	if (cur_version && (c = rb_plan_next(update_rb_plan(uacc), cur_version)))
+		rb_version = (char*)json_object_get_string(json_object_array_get_idx(uacc->update_pkg.rollback_versions, c->index));
 
 	return rb_version;
 }
@@ -307,10 +305,11 @@ static int update_get_rollback_package(ua_component_context_t* uacc, pkg_file_t*
 
 	if (rb_file_info && rb_version) {
 		char* filepath = 0;
-		if (!get_pkg_downloaded_from_json(uacc->cur_msg, rb_version, &rb_file_info->downloaded)
-		    && rb_file_info->downloaded
-		    && !get_pkg_sha256_from_json(uacc->cur_msg, rb_version, rb_file_info->sha256b64)
-		    && !get_pkg_file_from_json(uacc->cur_msg, rb_version, &filepath)) {
+		json_pkg_version_t pv;
+		get_pkg_version_info_from_json(uacc->cur_msg, rb_version, &pv);
+		if (pv.downloaded >= 0 && (rb_file_info->downloaded = pv.downloaded)
+		    && !json_sha256_copy(pv.sha256, rb_file_info->sha256b64)
+		    && (filepath = pv.file)) {
 			A_INFO_MSG("RB info available from ready-update package.");
 
 			rb_file_info->file    = f_strdup(filepath);
@@ -322,8 +321,16 @@ static int update_get_rollback_package(ua_component_context_t* uacc, pkg_file_t*
 				free(rb_file_info->version);
 			}
 		} else {
-			A_INFO_MSG("Getting RB info from backup manifest.");
-			if (E_UA_OK == get_pkg_file_manifest(uacc->backup_manifest, rb_version, rb_file_info)) {
+			rb_candidate_t* c = rb_plan_find(update_rb_plan(uacc), rb_version);
+			int found;
+			if (c && !c->in_store) {
+				A_INFO_MSG("Getting RB info from rollback plan.");
+				found = (E_UA_OK == rb_plan_copy_backup(c, rb_file_info));
+			} else {
+				A_INFO_MSG("Getting RB info from backup manifest.");
+				found = (E_UA_OK == get_pkg_file_manifest(uacc->backup_manifest, rb_version, rb_file_info));
+			}
+			if (found) {
 				if (update_package_available(rb_file_info, rb_version)) {
 					if (from_backup) *from_backup = 1;
 					rc = E_UA_OK;
@@ -468,6 +475,11 @@ install_state_t update_start_rollback_operations(ua_component_context_t* uacc, c
 
 	};
 
+	if (update_sts == INSTALL_COMPLETED || update_sts == INSTALL_FAILED) {
+		rb_plan_free(uacc->rb_plan);
+		uacc->rb_plan = NULL;
+	}
+
 	if (update_sts == INSTALL_COMPLETED) {
 		A_INFO_MSG("Rollback to version %s has succeeded.", uacc->update_file_info.version);
 
@@ -576,7 +588,7 @@ void update_handle_resume_from_reboot(char* rec_file, runner_info_hash_tree_t* r
 	if (rec_string != NULL) {
 		A_INFO_MSG("Starting resume operations after reboot.");
 		enum json_tokener_error jerr;
-		jo_update_rec = json_tokener_parse_verbose(rec_string, &jerr);
+		jo_update_rec = ua_json_parse(rec_string, &jerr);
 		type          = update_record_get_type(jo_update_rec);
 		if (type) {
 			utarray_init(&ri_list, &ut_ptr_icd);
@@ -670,11 +682,14 @@ int update_parse_json_ready_update(ua_component_context_t* uacc, json_object* js
 			{
 				A_ERROR_MSG("Could not load temp update manifest, getting info from json package object instead.");
 				char* update_file_name = NULL;
-				if (!get_pkg_downloaded_from_json(jsonObj, version_to_update, &uacc->update_file_info.downloaded)) {
+				json_pkg_version_t pv;
+				get_pkg_version_info_from_json(jsonObj, version_to_update, &pv);
+				if (pv.downloaded >= 0) {
+					uacc->update_file_info.downloaded = pv.downloaded;
 					if (uacc->update_file_info.downloaded) {
-						get_pkg_sha256_from_json(jsonObj, version_to_update, uacc->update_file_info.sha256b64);
+						json_sha256_copy(pv.sha256, uacc->update_file_info.sha256b64);
 
-						if (!get_pkg_file_from_json(jsonObj, version_to_update, &update_file_name)) {
+						if ((update_file_name = pv.file)) {
 							#ifdef SUPPORT_UA_DOWNLOAD
 							if (ua_intl.ua_download_required) {
 								char tmp_filename[PATH_MAX] = {0};
@@ -697,6 +712,7 @@ int update_parse_json_ready_update(ua_component_context_t* uacc, json_object* js
 								char* new_file    = NULL;
 								ua_routine_t* uar = uacc->uar;
 								if (uar->on_transfer_file) {
+									TRACE_START(t_cb);
 #ifdef LIBUA_VER_2_0
 									ua_callback_ctl_t uactl = {0};
 									uactl.type     = uacc->update_pkg.type;
@@ -715,6 +731,7 @@ int update_parse_json_ready_update(ua_component_context_t* uacc, json_object* js
 									                               uacc->update_file_info.file,
 									                               &new_file);
 #endif
+									TRACE_SPAN(t_cb, TRACE_CAT_CALLBACK, "on_transfer_file", uacc->update_pkg.name, 0);
 								}
 								if (new_file) {
 									f_free(uacc->update_file_info.file);
@@ -187,15 +187,18 @@ int get_pkg_delta_sha256_from_json(json_object* jsonObj, char* version, char val
 #ifdef SUPPORT_UA_DOWNLOAD
 int get_pkg_version_item_from_json(json_object* jsonObj, char* version, version_item_t* vi)
 {
-	if (jsonObj && version && vi) {
-		if (json_get_property(jsonObj, json_type_string, &vi->sha256, "body", "package", "version-list", version, "sha-256", NULL))
+	json_object* jver = NULL;
+
+	if (jsonObj && version && vi &&
+	    !json_get_property(jsonObj, json_type_object, &jver, "body", "package", "version-list", version, NULL)) {
+		if (json_get_property(jver, json_type_string, &vi->sha256, "sha-256", NULL))
 			return E_UA_ERR;
 
-		if (json_get_property(jsonObj, json_type_boolean, &vi->downloaded, "body", "package", "version-list", version, "downloaded", NULL))
+		if (json_get_property(jver, json_type_boolean, &vi->downloaded, "downloaded", NULL))
 			return E_UA_ERR;
 
 		json_object* jdl = NULL, * jdl_arr = NULL;
-		json_get_property(jsonObj, json_type_array, &jdl_arr, "body", "package", "version-list", version, "downloadables", NULL);
+		json_get_property(jver, json_type_array, &jdl_arr, "downloadables", NULL);
 		int jdl_arr_num = json_object_array_length(jdl_arr);
 		if (!jdl_arr && !json_object_is_type(jdl_arr, json_type_array) && jdl_arr_num < 1)
 			return E_UA_ERR;
@@ -212,10 +215,10 @@ int get_pkg_version_item_from_json(json_object* jsonObj, char* version, version_
 			if (json_get_property(jdl, json_type_string, &vi->downloadable.url, "url", NULL))
 				return E_UA_ERR;
 
-			if (json_get_property(jsonObj, json_type_string, &vi->encryption.method, "body", "package", "version-list", version, "encryption", "method", NULL))
+			if (json_get_property(jver, json_type_string, &vi->encryption.method, "encryption", "method", NULL))
 				return E_UA_ERR;
 
-			if (json_get_property(jsonObj, json_type_string, &vi->encryption.key, "body", "package", "version-list", version, "encryption", "key", NULL))
+			if (json_get_property(jver, json_type_string, &vi->encryption.key, "encryption", "key", NULL))
 				return E_UA_ERR;
 
 			if (!json_get_property(jdl, json_type_string, &vi->downloadable.against_sha256, "against-sha-256", NULL)) // This url is delta URL
@@ -367,3 +370,127 @@ int json_get_property(json_object* json, enum json_type typ, void* value, const
 
 }
 
+
+static char* json_str(json_object* jo)
+{
+	return json_object_is_type(jo, json_type_string) ? (char*)json_object_get_string(jo) : NULL;
+}
+
+static int json_bool_or(json_object* jo, int def)
+{
+	return json_object_is_type(jo, json_type_boolean) ? json_object_get_boolean(jo) : def;
+}
+
+static void parse_pkg_version(json_object* jo, char* version, json_pkg_version_t* pv)
+{
+	memset(pv, 0, sizeof(*pv));
+	pv->version    = version;
+	pv->downloaded = -1;
+	pv->jobj       = jo;
+
+	if (!json_object_is_type(jo, json_type_object))
+		return;
+
+	json_object_object_foreach(jo, key, val) {
+		if (!strcmp(key, "file"))
+			pv->file = json_str(val);
+		else if (!strcmp(key, "sha-256"))
+			pv->sha256 = json_str(val);
+		else if (!strcmp(key, "delta-sha-256"))
+			pv->delta_sha256 = json_str(val);
+		else if (!strcmp(key, "downloaded"))
+			pv->downloaded = json_bool_or(val, -1);
+	}
+}
+
+static void parse_cmd_package(json_object* jo, json_cmd_t* cmd)
+{
+	json_object_object_foreach(jo, key, val) {
+		if (!strcmp(key, "type"))
+			cmd->pkg_type = json_str(val);
+		else if (!strcmp(key, "name"))
+			cmd->pkg_name = json_str(val);
+		else if (!strcmp(key, "version"))
+			cmd->pkg_version = json_str(val);
+		else if (!strcmp(key, "rollback-version"))
+			cmd->rollback_version = json_str(val);
+		else if (!strcmp(key, "rollback-versions")) {
+			if (json_object_is_type(val, json_type_array))
+				cmd->rollback_versions = val;
+		} else if (!strcmp(key, "version-list")) {
+			if (json_object_is_type(val, json_type_object))
+				cmd->version_list = val;
+		}
+	}
+}
+
+int json_cmd_parse(json_object* jsonObj, json_cmd_t* cmd)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->jobj     = jsonObj;
+	cmd->sequence = -1;
+	cmd->rollback = -1;
+
+	if (!json_object_is_type(jsonObj, json_type_object))
+		return E_UA_ERR;
+
+	json_object_object_foreach(jsonObj, key, val) {
+		if (!strcmp(key, "type"))
+			cmd->type = json_str(val);
+		else if (!strcmp(key, "reply-id"))
+			cmd->reply_id = json_str(val);
+		else if (!strcmp(key, "body") && json_object_is_type(val, json_type_object)) {
+			json_object_object_foreach(val, bkey, bval) {
+				if (!strcmp(bkey, "sequence")) {
+					if (json_object_is_type(bval, json_type_int))
+						cmd->sequence = json_object_get_int64(bval);
+				} else if (!strcmp(bkey, "rollback"))
+					cmd->rollback = json_bool_or(bval, -1);
+				else if (!strcmp(bkey, "campaign")) {
+					json_object* id;
+					if (json_object_object_get_ex(bval, "id", &id))
+						cmd->campaign_id = json_str(id);
+				} else if (!strcmp(bkey, "package") && json_object_is_type(bval, json_type_object))
+					parse_cmd_package(bval, cmd);
+			}
+		}
+	}
+
+	return E_UA_OK;
+}
+
+int json_cmd_version(const json_cmd_t* cmd, const char* version, json_pkg_version_t* pv)
+{
+	json_object* jo = NULL;
+
+	if (!cmd || !version || !cmd->version_list || !json_object_object_get_ex(cmd->version_list, version, &jo)) {
+		parse_pkg_version(NULL, (char*)version, pv);
+		return E_UA_ERR;
+	}
+
+	parse_pkg_version(jo, (char*)version, pv);
+	return json_object_is_type(jo, json_type_object) ? E_UA_OK : E_UA_ERR;
+}
+
+int get_pkg_version_info_from_json(json_object* jsonObj, const char* version, json_pkg_version_t* pv)
+{
+	json_object* jo = NULL;
+
+	if (!version || json_get_property(jsonObj, json_type_object, &jo, "body", "package", "version-list", version, NULL)) {
+		parse_pkg_version(NULL, (char*)version, pv);
+		return E_UA_ERR;
+	}
+
+	parse_pkg_version(jo, (char*)version, pv);
+	return E_UA_OK;
+}
+
+int json_sha256_copy(const char* sha256, char value[SHA256_B64_LENGTH])
+{
+	if (sha256 && strlen(sha256) == (SHA256_B64_LENGTH - 1)) {
+		strcpy_s(value, sha256, SHA256_B64_LENGTH);
+		return E_UA_OK;
+	}
+
+	return E_UA_ERR;
+}
@@ -75,4 +75,62 @@ int get_trust_info_from_json(json_object* jsonObj, ua_dl_trust_t* dlt);
 
 int json_get_property(json_object* json, enum json_type typ, void* value, const char* node, ... );
 
+/*
+ * Fields of one "version-list" item. Strings point into the json object
+ * and are valid as long as it is.
+ */
+typedef struct json_pkg_version {
+	char* version;
+	char* file;
+	char* sha256;
+	char* delta_sha256;
+
+	// -1 if not present
+	int downloaded;
+
+	json_object* jobj;
+
+} json_pkg_version_t;
+
+/*
+ * Incoming command decoded in a single pass over its json object. Fields
+ * that are absent or of the wrong type are NULL (or -1 for numbers and
+ * booleans). Strings point into jobj, which must outlive the struct.
+ */
+typedef struct json_cmd {
+	json_object* jobj;
+
+	char* type;
+	char* reply_id;
+
+	int64_t sequence;
+	int rollback;
+	char* campaign_id;
+
+	char* pkg_type;
+	char* pkg_name;
+	char* pkg_version;
+	char* rollback_version;
+	json_object* rollback_versions;
+
+	// items are decoded on request by json_cmd_version()
+	json_object* version_list;
+
+} json_cmd_t;
+
+int json_cmd_parse(json_object* jsonObj, json_cmd_t* cmd);
+
+/*
+ * Decode the "version-list" item of version into pv. pv is always
+ * initialized; E_UA_ERR is returned if there is no such item.
+ */
+int json_cmd_version(const json_cmd_t* cmd, const char* version, json_pkg_version_t* pv);
+
+/*
+ * Look up a single "version-list" item without decoding the whole command.
+ */
+int get_pkg_version_info_from_json(json_object* jsonObj, const char* version, json_pkg_version_t* pv);
+
+int json_sha256_copy(const char* sha256, char value[SHA256_B64_LENGTH]);
+
 #endif /* UA_UTILS_H_ */
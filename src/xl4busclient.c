@@ -13,6 +13,7 @@
 #include "uthash.h"
 #include "handler.h"
 #include "debug.h"
+#include "metrics.h"
 
 static void on_xl4bus_message(struct xl4bus_client* client, xl4bus_message_t* msg);
 static void on_xl4bus_status(struct xl4bus_client* client, xl4bus_client_condition_t cond);
@@ -123,6 +124,7 @@ int xl4bus_client_send_msg(const char* message)
 	if (err != E_XL4BUS_OK) {
 		xl4bus_free_address(addr, 1);
 		A_ERROR_MSG("Error sending message: %s", message);
+		metrics_add(M_BUS_SEND_FAILED, 1);
 	}
 
 	return err;
@@ -152,6 +154,7 @@ int xl4bus_client_send_msg_to_addr(const char* message, xl4bus_address_t* xl4_ad
 	if (err != E_XL4BUS_OK) {
 		xl4bus_free_address(xl4_address, 1);
 		A_ERROR_MSG("Error sending message: %s", message);
+		metrics_add(M_BUS_SEND_FAILED, 1);
 	}
 
 	return err;
@@ -4,12 +4,17 @@
 
 #include "xml.h"
 #include "utlist.h"
+#include "uthash.h"
 #include "debug.h"
+#include <inttypes.h>
 
 static xmlNodePtr get_xml_child(xmlNodePtr parent, xmlChar* name);
 static diff_info_t* get_xml_diff_info(xmlNodePtr ptr);
 static pkg_file_t* get_xml_pkg_file(xmlNodePtr ptr);
-static pkg_file_t* get_xml_version_pkg_file(xmlNodePtr root, char* version);
+static xmlNodePtr get_xml_version_node(xmlNodePtr root, char* version);
+static bks_entry_t* get_xml_store_recipe(xmlNodePtr ptr);
+static void add_xml_store_recipe(xmlNodePtr node, bks_entry_t* recipe);
+static void collect_store_recipe(xmlNodePtr node, bks_entry_t** released);
 
 #define XMLELE_ITER(p, c) \
 	for (c = xmlFirstElementChild(p); c; c = xmlNextElementSibling(c)) \
@@ -203,19 +208,14 @@ static inline int TYPEQL(const xmlChar* a, const xmlChar* b, diff_type_t* typ)
 	return xmlStrEqual(a, b);
 }
 
-int parse_diff_manifest(char* xmlFile, diff_info_t** diffInfo)
+static int parse_diff_doc(xmlDocPtr doc, diff_info_t** diffInfo)
 {
 	int err = E_UA_OK;
 	diff_type_t typ;
 	diff_info_t* di, * aux, * diList = 0;
-	xmlDocPtr doc = NULL;
 	xmlNodePtr root, node, fnode = NULL;
 
-	A_INFO_MSG("parsing diff manifest: %s", xmlFile);
-
 	do {
-		BOLT_IF(!xmlFile || access(xmlFile, R_OK), E_UA_ERR, "diff manifest not available %s", xmlFile);
-		BOLT_SYS(!(doc = xmlReadFile(xmlFile, NULL, 0)), "Could not read xml file %s", xmlFile);
 		root = xmlDocGetRootElement(doc);
 
 		XMLELE_ITER(root, node) {
@@ -237,10 +237,6 @@ int parse_diff_manifest(char* xmlFile, diff_info_t** diffInfo)
 
 	} while (0);
 
-	if (doc) {
-		xmlFreeDoc(doc);
-	}
-
 	if (!err) {
 		*diffInfo = diList;
 	} else {
@@ -253,6 +249,46 @@ int parse_diff_manifest(char* xmlFile, diff_info_t** diffInfo)
 	return err;
 }
 
+int parse_diff_manifest(char* xmlFile, diff_info_t** diffInfo)
+{
+	int err = E_UA_OK;
+	xmlDocPtr doc = NULL;
+
+	A_INFO_MSG("parsing diff manifest: %s", xmlFile);
+
+	do {
+		BOLT_IF(!xmlFile || access(xmlFile, R_OK), E_UA_ERR, "diff manifest not available %s", xmlFile);
+		BOLT_SYS(!(doc = xmlReadFile(xmlFile, NULL, 0)), "Could not read xml file %s", xmlFile);
+		err = parse_diff_doc(doc, diffInfo);
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
+	return err;
+}
+
+int parse_diff_manifest_buf(const char* buf, diff_info_t** diffInfo)
+{
+	int err = E_UA_OK;
+	xmlDocPtr doc = NULL;
+
+	do {
+		BOLT_IF(!buf, E_UA_ARG, "diff manifest not available");
+		BOLT_IF(!(doc = xmlReadMemory(buf, strlen(buf), MANIFEST_DIFF, NULL, 0)), E_UA_ERR, "Could not parse diff manifest");
+		err = parse_diff_doc(doc, diffInfo);
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
+	return err;
+}
+
 
 static pkg_file_t* get_xml_pkg_file(xmlNodePtr ptr)
 {
@@ -310,6 +346,17 @@ static pkg_file_t* get_xml_pkg_file(xmlNodePtr ptr)
 				xmlFree(c);
 			}
 
+		} else if (xmlStrEqual(n->name, XMLT "store")) {
+			pkgFile->stored = 1;
+
+		} else if (xmlStrEqual(n->name, XMLT "verified")) {
+			if ((c = xmlNodeGetContent(n))) {
+				file_stamp_t* fs = &pkgFile->verified;
+				if (sscanf((const char*)c, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64, &fs->dev, &fs->ino, &fs->size, &fs->mtime_ns) != 4)
+					memset(fs, 0, sizeof(file_stamp_t));
+				xmlFree(c);
+			}
+
 
 
 		}
@@ -344,7 +391,7 @@ int parse_pkg_manifest(char* xmlFile, pkg_file_t** pkgFile)
 		XMLELE_ITER_SAFE(root, node, aux)
 		if (xmlStrEqual(node->name, XMLT "package")) {
 			if ((pf = get_xml_pkg_file(node))) {
-				if (!access(pf->file, R_OK)) {
+				if (!access(pf->file, R_OK) || pf->stored) {
 					DL_PREPEND(pfList, pf);
 				} else {
 					free_pkg_file(pf);
@@ -372,6 +419,7 @@ int remove_old_backup(char* xmlFile, char* version)
 	xmlNodePtr root, node, n, aux;
 	xmlChar* c, * backpath;
 	char* tmp_dir;
+	bks_entry_t* released = NULL;
 
 	do {
 		A_INFO_MSG("Cleaning up backup after installing version: %s in %s", version, xmlFile);
@@ -397,6 +445,7 @@ int remove_old_backup(char* xmlFile, char* version)
 									rmdirp(tmp_dir);
 									free(tmp_dir);
 								}
+								collect_store_recipe(node, &released);
 								xmlUnlinkNode(node);
 								xmlFreeNode(node);
 
@@ -427,16 +476,23 @@ int remove_old_backup(char* xmlFile, char* version)
 		xmlFreeDoc(doc);
 	}
 
+	if (!err && released)
+		bkstore_release(xmlFile, released);
+	bkstore_free(released);
+
 	return err;
 }
 
-int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
+static int add_pkg_file_manifest_ex(char* xmlFile, pkg_file_t* pkgFile, int verify, bks_entry_t* recipe)
 {
 	int err = E_UA_OK;
 	xmlDocPtr doc = NULL;
 	xmlNodePtr root, node, n, aux;
 	xmlChar* c;
 	char rb_order[32] = {0};
+	bks_entry_t* released = NULL;
+	file_stamp_t fs;
+	char stamp[96];
 
 	do {
 		if (!access(xmlFile, W_OK) && (doc = xmlReadFile(xmlFile, NULL, 0))) {
@@ -453,6 +509,7 @@ int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
 				if ((c = xmlNodeGetContent(n))) {
 					if (xmlStrEqual(c, XMLT pkgFile->version)) {
 						A_INFO_MSG("Removing pkg entry for version: %s in %s", pkgFile->version, xmlFile);
+						collect_store_recipe(node, &released);
 						xmlUnlinkNode(node);
 						xmlFreeNode(node);
 					}
@@ -473,7 +530,7 @@ int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
 			}
 		}
 
-		if (!sha256xcmp(pkgFile->file, pkgFile->sha_of_sha)) {
+		if (!verify || !sha256xcmp(pkgFile->file, pkgFile->sha_of_sha)) {
 			A_INFO_MSG("Adding pkg entry for version: %s in %s", pkgFile->version, xmlFile);
 
 			node = xmlNewChild(root, NULL, XMLT "package", NULL);
@@ -483,10 +540,19 @@ int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
 			xmlNewChild(node, NULL, XMLT "file", XMLT pkgFile->file);
 			xmlNewChild(node, NULL, XMLT "downloaded", XMLT (pkgFile->downloaded ? "1" : "0"));
 			xmlNewChild(node, NULL, XMLT "rollback-order", XMLT "0");
+			if (recipe)
+				add_xml_store_recipe(node, recipe);
+			else if (!file_stamp(pkgFile->file, &fs)) {
+				snprintf(stamp, sizeof(stamp), "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64, fs.dev, fs.ino, fs.size, fs.mtime_ns);
+				xmlNewChild(node, NULL, XMLT "verified", XMLT stamp);
+			}
 
 			BOLT_SYS(chkdirp(xmlFile), "failed to prepare directory for %s", xmlFile);
 			BOLT_IF((xmlSaveFormatFileEnc(xmlFile, doc, "UTF-8", 1) < 0), E_UA_ERR, "failed to save pkg manifest");
 
+			if (released)
+				bkstore_release(xmlFile, released);
+
 		} else {
 			A_INFO_MSG("Skipping pkg entry for version: %s in %s", pkgFile->version, xmlFile);
 			A_INFO_MSG("Possibly corrupted package file (%s), not matched with exptected sha value (%s)", pkgFile->file, pkgFile->sha256b64);
@@ -498,30 +564,378 @@ int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
 		xmlFreeDoc(doc);
 	}
 
+	bkstore_free(released);
+
+	return err;
+}
+
+
+int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
+{
+	return add_pkg_file_manifest_ex(xmlFile, pkgFile, 1, NULL);
+}
+
+int add_pkg_file_manifest_verified(char* xmlFile, pkg_file_t* pkgFile)
+{
+	return add_pkg_file_manifest_ex(xmlFile, pkgFile, 0, NULL);
+}
+
+int add_pkg_store_manifest(char* xmlFile, pkg_file_t* pkgFile, bks_entry_t* recipe)
+{
+	return add_pkg_file_manifest_ex(xmlFile, pkgFile, 0, recipe);
+}
+
+int list_pkg_manifest(char* xmlFile, pkg_file_t** pkgFile)
+{
+	int err = E_UA_OK;
+	pkg_file_t* pf, * pfList = 0, * aux;
+	int incomplete = 0;
+	xmlDocPtr doc = NULL;
+	xmlNodePtr root, node = NULL;
+
+	do {
+		BOLT_IF(!xmlFile || access(xmlFile, R_OK), E_UA_ERR, "pkg manifest not available %s", xmlFile);
+		BOLT_SYS(!(doc = xmlReadFile(xmlFile, NULL, 0)), "Could not read xml file %s", xmlFile);
+		root = xmlDocGetRootElement(doc);
+
+		XMLELE_ITER_NAME(root, "package", node) {
+			if ((pf = get_xml_pkg_file(node)))
+				DL_APPEND(pfList, pf);
+			else
+				incomplete++;
+		}
+
+		BOLT_IF(incomplete, E_UA_ERR, "%d incomplete pkg node(s) in %s", incomplete, xmlFile);
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
+	if (!err) {
+		*pkgFile = pfList;
+	} else {
+		DL_FOREACH_SAFE(pfList, pf, aux) {
+			DL_DELETE(pfList, pf);
+			free_pkg_file(pf);
+		}
+	}
+
+	return err;
+}
+
+int set_pkg_sha_of_sha_manifest(char* xmlFile, char* version, char* sha_of_sha)
+{
+	int err = E_UA_OK;
+	int found = 0;
+	xmlDocPtr doc = NULL;
+	xmlNodePtr root, node, n;
+	xmlChar* c;
+
+	do {
+		BOLT_SYS(!(doc = xmlReadFile(xmlFile, NULL, 0)), "Could not read xml file %s", xmlFile);
+		root = xmlDocGetRootElement(doc);
+
+		XMLELE_ITER_NAME(root, "package", node) {
+			if ((n = get_xml_child(node, XMLT "version")) && (c = xmlNodeGetContent(n))) {
+				int match = xmlStrEqual(c, XMLT version);
+				xmlFree(c);
+				if (match) {
+					if ((n = get_xml_child(node, XMLT "sha-of-sha")))
+						xmlNodeSetContent(n, XMLT sha_of_sha);
+					else
+						xmlNewChild(node, NULL, XMLT "sha-of-sha", XMLT sha_of_sha);
+					found = 1;
+					break;
+				}
+			}
+		}
+
+		BOLT_IF(!found, E_UA_ERR, "version %s not found in pkg_manifest %s", version, xmlFile);
+		BOLT_IF((xmlSaveFormatFileEnc(xmlFile, doc, "UTF-8", 1) < 0), E_UA_ERR, "failed to save pkg manifest");
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
 	return err;
 }
 
+int remove_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile)
+{
+	int err = E_UA_OK;
+	int removed = 0;
+	xmlDocPtr doc = NULL;
+	xmlNodePtr root, node, aux;
+	pkg_file_t* pf;
+	bks_entry_t* released = NULL;
+
+	do {
+		BOLT_SYS(!(doc = xmlReadFile(xmlFile, NULL, 0)), "Could not read xml file %s", xmlFile);
+		root = xmlDocGetRootElement(doc);
+
+		XMLELE_ITER_SAFE(root, node, aux)
+		if (xmlStrEqual(node->name, XMLT "package")) {
+			if ((pf = get_xml_pkg_file(node))) {
+				if (!strcmp(pf->version, pkgFile->version) && !strcmp(pf->file, pkgFile->file)) {
+					A_INFO_MSG("Removing pkg entry for version: %s in %s", pf->version, xmlFile);
+					collect_store_recipe(node, &released);
+					xmlUnlinkNode(node);
+					xmlFreeNode(node);
+					removed++;
+				}
+				free_pkg_file(pf);
+			}
+		}
+
+		if (!removed)
+			break;
+
+		if (xmlChildElementCount(root) == 0) {
+			unlink(xmlFile);
+			break;
+		}
+
+		BOLT_IF((xmlSaveFormatFileEnc(xmlFile, doc, "UTF-8", 1) < 0), E_UA_ERR, "failed to save pkg manifest");
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
+	if (!err && released)
+		bkstore_release(xmlFile, released);
+	bkstore_free(released);
+
+	return err;
+}
 
-static pkg_file_t* get_xml_version_pkg_file(xmlNodePtr root, char* version)
+static xmlNodePtr get_xml_version_node(xmlNodePtr root, char* version)
 {
 	xmlChar* c;
 	xmlNodePtr node, n;
-	pkg_file_t* pkgFile = NULL;
+	int match = 0;
 
 	XMLELE_ITER_NAME(root, "package", node) {
 		if ((n = get_xml_child(node, XMLT "version"))) {
 			if ((c = xmlNodeGetContent(n))) {
-				if (xmlStrEqual(c, XMLT version)) {
-					pkgFile = get_xml_pkg_file(node);
-				}
+				match = xmlStrEqual(c, XMLT version);
 				xmlFree(c);
 			}
 		}
 
-		if (pkgFile) { break; }
+		if (match) { return node; }
 	}
 
-	return pkgFile;
+	return NULL;
+}
+
+static bks_entry_t* get_xml_store_recipe(xmlNodePtr ptr)
+{
+	xmlChar* c;
+	xmlNodePtr node, n;
+	bks_entry_t* recipe = NULL, * be;
+
+	if (!ptr) { return 0; }
+
+	XMLELE_ITER_NAME(ptr, "entry", node) {
+		be = f_malloc(sizeof(bks_entry_t));
+		DL_APPEND(recipe, be);
+
+		XMLELE_ITER(node, n) {
+			if (!(c = xmlNodeGetContent(n)))
+				continue;
+
+			if (xmlStrEqual(n->name, XMLT "name")) {
+				if (!be->name)
+					be->name = f_strdup((const char*)c);
+			} else if (xmlStrEqual(n->name, XMLT "sha")) {
+				if (strlen((const char*)c) == (SHA256_HEX_LENGTH - 1))
+					strcpy_s(be->sha, (const char*)c, sizeof(be->sha));
+			} else if (xmlStrEqual(n->name, XMLT "method")) {
+				be->method = strtol((const char*)c, NULL, BASE_TEN_CONVERSION);
+			} else if (xmlStrEqual(n->name, XMLT "crc")) {
+				be->crc = strtoul((const char*)c, NULL, BASE_TEN_CONVERSION);
+			} else if (xmlStrEqual(n->name, XMLT "usize")) {
+				be->usize = strtoull((const char*)c, NULL, BASE_TEN_CONVERSION);
+			} else if (xmlStrEqual(n->name, XMLT "csize")) {
+				be->csize = strtoull((const char*)c, NULL, BASE_TEN_CONVERSION);
+			} else if (xmlStrEqual(n->name, XMLT "mode")) {
+				be->mode = strtoul((const char*)c, NULL, 8);
+			} else if (xmlStrEqual(n->name, XMLT "mtime")) {
+				be->mtime = strtoll((const char*)c, NULL, BASE_TEN_CONVERSION);
+			}
+			xmlFree(c);
+		}
+
+		be->is_dir = S(be->name) && be->name[strlen(be->name) - 1] == '/';
+		if (!S(be->name) || (!be->is_dir && !*be->sha)) {
+			A_INFO_MSG("Incomplete store entry");
+			bkstore_free(recipe);
+			return 0;
+		}
+	}
+
+	return recipe;
+}
+
+static void add_xml_store_recipe(xmlNodePtr node, bks_entry_t* recipe)
+{
+	xmlNodePtr store = xmlNewChild(node, NULL, XMLT "store", NULL);
+	xmlNodePtr n;
+	bks_entry_t* be;
+	char num[32];
+
+	DL_FOREACH(recipe, be) {
+		n = xmlNewChild(store, NULL, XMLT "entry", NULL);
+		xmlNewTextChild(n, NULL, XMLT "name", XMLT be->name);
+		if (!be->is_dir) {
+			xmlNewChild(n, NULL, XMLT "sha", XMLT be->sha);
+			snprintf(num, sizeof(num), "%d", be->method);
+			xmlNewChild(n, NULL, XMLT "method", XMLT num);
+			snprintf(num, sizeof(num), "%" PRIu32, be->crc);
+			xmlNewChild(n, NULL, XMLT "crc", XMLT num);
+			snprintf(num, sizeof(num), "%" PRIu64, be->usize);
+			xmlNewChild(n, NULL, XMLT "usize", XMLT num);
+			snprintf(num, sizeof(num), "%" PRIu64, be->csize);
+			xmlNewChild(n, NULL, XMLT "csize", XMLT num);
+		}
+		snprintf(num, sizeof(num), "%o", (unsigned)be->mode);
+		xmlNewChild(n, NULL, XMLT "mode", XMLT num);
+		snprintf(num, sizeof(num), "%" PRId64, be->mtime);
+		xmlNewChild(n, NULL, XMLT "mtime", XMLT num);
+	}
+}
+
+static void collect_store_recipe(xmlNodePtr node, bks_entry_t** released)
+{
+	bks_entry_t* recipe = get_xml_store_recipe(get_xml_child(node, XMLT "store"));
+
+	if (recipe)
+		DL_CONCAT(*released, recipe);
+}
+
+int get_pkg_store_manifest(char* xmlFile, char* version, bks_entry_t** recipe)
+{
+	int err         = E_UA_OK;
+	xmlDocPtr doc   = NULL;
+	xmlNodePtr node = NULL;
+
+	do {
+		BOLT_IF(!xmlFile || !version || !recipe, E_UA_ARG, "Got null pointer(s)");
+		BOLT_SYS(access(xmlFile, R_OK), "pkg manifest (%s)", xmlFile);
+		BOLT_IF(!(doc = xmlReadFile(xmlFile, NULL, 0)), E_UA_ERR, "Could not read xml file %s", xmlFile);
+		BOLT_IF(!(node = get_xml_version_node(xmlDocGetRootElement(doc), version)), E_UA_ERR, "version %s not found in pkg_manifest %s", version, xmlFile);
+		BOLT_IF(!(*recipe = get_xml_store_recipe(get_xml_child(node, XMLT "store"))), E_UA_ERR, "version %s is not in backup store", version);
+
+	} while (0);
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+	return err;
+}
+
+typedef struct store_ref {
+	char sha[SHA256_HEX_LENGTH];
+	xmlNodePtr node;
+	xmlNodePtr refs;
+	long cnt;
+
+	UT_hash_handle hh;
+
+} store_ref_t;
+
+int ref_store_manifest(char* xmlFile, bks_entry_t* recipe, int delta)
+{
+	int err = E_UA_OK;
+	xmlDocPtr doc = NULL;
+	xmlNodePtr root, node, n;
+	xmlChar* c;
+	store_ref_t* refs = NULL, * sr, * aux;
+	bks_entry_t* be;
+	char num[32];
+
+	do {
+		if (!access(xmlFile, W_OK) && (doc = xmlReadFile(xmlFile, NULL, 0))) {
+			root = xmlDocGetRootElement(doc);
+		} else {
+			BOLT_IF(delta < 0, E_UA_ERR, "store manifest not available %s", xmlFile);
+			doc  = xmlNewDoc(XMLT "1.0");
+			root = xmlNewNode(NULL, XMLT "manifest_store");
+			xmlDocSetRootElement(doc, root);
+		}
+
+		XMLELE_ITER_NAME(root, "chunk", node) {
+			if ((n = get_xml_child(node, XMLT "sha")) && (c = xmlNodeGetContent(n))) {
+				sr = f_malloc(sizeof(store_ref_t));
+				strcpy_s(sr->sha, (const char*)c, sizeof(sr->sha));
+				xmlFree(c);
+				sr->node = node;
+				if ((sr->refs = get_xml_child(node, XMLT "refs")) && (c = xmlNodeGetContent(sr->refs))) {
+					sr->cnt = strtol((const char*)c, NULL, BASE_TEN_CONVERSION);
+					xmlFree(c);
+				}
+				HASH_ADD_STR(refs, sha, sr);
+			}
+		}
+
+		DL_FOREACH(recipe, be) {
+			if (be->is_dir)
+				continue;
+
+			HASH_FIND_STR(refs, be->sha, sr);
+			if (!sr) {
+				if (delta < 0)
+					continue;
+				sr = f_malloc(sizeof(store_ref_t));
+				strcpy_s(sr->sha, be->sha, sizeof(sr->sha));
+				sr->node = xmlNewChild(root, NULL, XMLT "chunk", NULL);
+				xmlNewChild(sr->node, NULL, XMLT "sha", XMLT be->sha);
+				sr->refs = xmlNewChild(sr->node, NULL, XMLT "refs", XMLT "0");
+				HASH_ADD_STR(refs, sha, sr);
+			}
+
+			sr->cnt += delta;
+			if (sr->cnt <= 0) {
+				xmlUnlinkNode(sr->node);
+				xmlFreeNode(sr->node);
+				HASH_DEL(refs, sr);
+				free(sr);
+				be->released = 1;
+			} else {
+				snprintf(num, sizeof(num), "%ld", sr->cnt);
+				if (sr->refs)
+					xmlNodeSetContent(sr->refs, XMLT num);
+				else
+					sr->refs = xmlNewChild(sr->node, NULL, XMLT "refs", XMLT num);
+			}
+		}
+
+		if (xmlChildElementCount(root) == 0) {
+			unlink(xmlFile);
+			break;
+		}
+
+		BOLT_SYS(chkdirp(xmlFile), "failed to prepare directory for %s", xmlFile);
+		BOLT_IF((xmlSaveFormatFileEnc(xmlFile, doc, "UTF-8", 1) < 0), E_UA_ERR, "failed to save store manifest");
+
+	} while (0);
+
+	HASH_ITER(hh, refs, sr, aux) {
+		HASH_DEL(refs, sr);
+		free(sr);
+	}
+
+	if (doc) {
+		xmlFreeDoc(doc);
+	}
+
+	return err;
 }
 
 
@@ -530,6 +944,7 @@ int get_pkg_file_manifest(char* xmlFile, char* version, pkg_file_t* pkgFile)
 	int err         = E_UA_OK;
 	xmlDocPtr doc   = NULL;
 	xmlNodePtr root = NULL;
+	xmlNodePtr node = NULL;
 	pkg_file_t* pf  = NULL;
 
 	if (!xmlFile || !version || !pkgFile) {
@@ -542,7 +957,16 @@ int get_pkg_file_manifest(char* xmlFile, char* version, pkg_file_t* pkgFile)
 		BOLT_IF(!(doc = xmlReadFile(xmlFile, NULL, 0)), E_UA_ERR, "Could not read xml file %s", xmlFile);
 
 		root = xmlDocGetRootElement(doc);
-		BOLT_IF(!(pf = get_xml_version_pkg_file(root, version)), E_UA_ERR, "version %s not found in pkg_manifest %s", version, xmlFile);
+		BOLT_IF(!(node = get_xml_version_node(root, version)) || !(pf = get_xml_pkg_file(node)), E_UA_ERR, "version %s not found in pkg_manifest %s", version, xmlFile);
+
+		if (pf->stored && access(pf->file, R_OK)) {
+			bks_entry_t* recipe = get_xml_store_recipe(get_xml_child(node, XMLT "store"));
+			if (bkstore_checkout(xmlFile, recipe, pf))
+				A_ERROR_MSG("Could not check out version %s from backup store", version);
+			else if (S(pf->sha_of_sha))
+				file_stamp(pf->file, &pf->verified);
+			bkstore_free(recipe);
+		}
 
 		memcpy(pkgFile, pf, sizeof(pkg_file_t));
 		free(pf);
@@ -9,12 +9,21 @@
 #include <libxml/parser.h>
 #include "delta.h"
 #include "handler.h"
+#include "bkstore.h"
 
 #define XMLT (xmlChar*)
 
 int parse_diff_manifest(char* xmlFile, diff_info_t** diffInfo);
+int parse_diff_manifest_buf(const char* buf, diff_info_t** diffInfo);
 int parse_pkg_manifest(char* xmlFile, pkg_file_t** pkgFile);
 int add_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile);
+int add_pkg_file_manifest_verified(char* xmlFile, pkg_file_t* pkgFile);
+int add_pkg_store_manifest(char* xmlFile, pkg_file_t* pkgFile, bks_entry_t* recipe);
+int get_pkg_store_manifest(char* xmlFile, char* version, bks_entry_t** recipe);
+int ref_store_manifest(char* xmlFile, bks_entry_t* recipe, int delta);
+int list_pkg_manifest(char* xmlFile, pkg_file_t** pkgFile);
+int set_pkg_sha_of_sha_manifest(char* xmlFile, char* version, char* sha_of_sha);
+int remove_pkg_file_manifest(char* xmlFile, pkg_file_t* pkgFile);
 int get_pkg_file_manifest(char* xmlFile, char* version, pkg_file_t* pkgFile);
 int remove_old_backup(char* xmlFile, char* version);
 void free_pkg_file(pkg_file_t* pkgFile);
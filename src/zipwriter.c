@@ -0,0 +1,786 @@
+/*
+ * zipwriter.c
+ */
+
+#include "zipwriter.h"
+#include "misc.h"
+#include "debug.h"
+#include "scheduler.h"
+#include "utlist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define ZIPW_DICT_SIZE   (32 << 10)
+#define ZIP32_MAX        0xFFFFFFFFULL
+#define ZIP16_MAX        0xFFFF
+
+#define ZIP_LOCAL_SIG    0x04034b50
+#define ZIP_CENTRAL_SIG  0x02014b50
+#define ZIP_EOCD_SIG     0x06054b50
+#define ZIP64_EOCD_SIG   0x06064b50
+#define ZIP64_LOC_SIG    0x07064b50
+#define ZIP64_EXTRA_ID   0x0001
+#define ZIP_FLAG_UTF8    0x0800
+#define ZIP_METHOD_STORE 0
+#define ZIP_METHOD_DEFL  8
+
+/*
+ * Deflate output of one ZIPW_BLOCK_SIZE slice of a member. Blocks other
+ * than the last end on a sync flush, so they concatenate into one stream.
+ */
+typedef struct zipw_block {
+	unsigned char* out;
+	size_t olen;
+	uint32_t crc;
+	uint32_t len;
+	int done;
+	int err;
+
+} zipw_block_t;
+
+typedef struct zipw_entry {
+	char* name;
+	char* path;
+	int is_dir;
+	int store;
+	// path holds the entry data as it goes into the archive
+	int raw;
+	int z64;
+	int level;
+	zipw_block_t* blocks;
+	int nblocks;
+	mode_t mode;
+	uint16_t dos_time;
+	uint16_t dos_date;
+	uint32_t crc;
+	uint64_t usize;
+	uint64_t csize;
+	uint64_t offset;
+
+	struct zipw_entry* next;
+	struct zipw_entry* prev;
+
+} zipw_entry_t;
+
+typedef struct zipw_ctx {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	zipw_entry_t* entries;
+	zipw_entry_t* next_job;
+	int next_blk;
+	// blocks handed out and not yet written, at most window
+	int inflight;
+	int window;
+	int abort;
+
+} zipw_ctx_t;
+
+static const char* zipw_compressed_ext[] = {
+	".zip", ".gz", ".tgz", ".bz2", ".xz", ".txz", ".lz4", ".zst", ".7z",
+	".squashfs", ".sqsh", ".jpg", ".jpeg", ".png", NULL
+};
+
+static int zipw_scan(zipw_entry_t** list, const char* path, const char* base, const zipw_cfg_t* cfg, int* cnt, int* jobs);
+static void zipw_free_entry(zipw_entry_t* ze);
+static zipw_entry_t* zipw_next_deflated(zipw_entry_t* ze);
+static void* zipw_worker(void* arg);
+static void zipw_dos_time(zipw_entry_t* ze, time_t mtime);
+static int zipw_write_entry(FILE* fp, zipw_entry_t* ze, unsigned char* buf);
+static int zipw_write_deflated(FILE* fp, zipw_ctx_t* ctx, zipw_entry_t* ze, unsigned char* buf);
+static int zipw_write_central(FILE* fp, zipw_entry_t* list, int cnt);
+
+static inline unsigned char* put16(unsigned char* p, uint16_t v)
+{
+	p[0] = v & 0xff; p[1] = v >> 8;
+	return p + 2;
+}
+
+static inline unsigned char* put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+	return p + 4;
+}
+
+static inline unsigned char* put64(unsigned char* p, uint64_t v)
+{
+	return put32(put32(p, (uint32_t)v), (uint32_t)(v >> 32));
+}
+
+static int zipw_cmp(zipw_entry_t* a, zipw_entry_t* b)
+{
+	return strcmp(a->name, b->name);
+}
+
+int zipw_archive(const char* archive, const char* path, const zipw_cfg_t* cfg)
+{
+	int err            = E_UA_OK;
+	int cnt            = 0;
+	int jobs           = 0;
+	int nthreads       = 0;
+	int started        = 0;
+	int claimed        = 0;
+	FILE* fp           = 0;
+	unsigned char* buf = 0;
+	zipw_ctx_t ctx     = {0};
+	zipw_entry_t* ze, * aux;
+	pthread_t threads[ZIPW_MAX_THREADS];
+	zipw_cfg_t deflt   = {0};
+	struct stat st;
+
+	if (!cfg)
+		cfg = &deflt;
+
+	A_INFO_MSG("zipping(zipw) %s to %s", path, archive);
+
+	pthread_mutex_init(&ctx.lock, 0);
+	pthread_cond_init(&ctx.cond, 0);
+
+	do {
+		BOLT_SYS(stat(path, &st), "failed to get path status: %s", path);
+		BOLT_IF(!S_ISDIR(st.st_mode), E_UA_ARG, "path is not a directory: %s", path);
+		BOLT_SYS(chkdirp(archive), "failed to prepare directory for %s", archive);
+		err = zipw_scan(&ctx.entries, path, "", cfg, &cnt, &jobs);
+		if (err) break;
+		DL_SORT(ctx.entries, zipw_cmp);
+		ctx.next_job = zipw_next_deflated(ctx.entries);
+
+		nthreads = cfg->threads > 0 ? cfg->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads > ZIPW_MAX_THREADS) nthreads = ZIPW_MAX_THREADS;
+		if (nthreads > jobs) nthreads = jobs;
+		if (nthreads > 0) {
+			// helpers beyond the first count against the CPU jobs of all workers;
+			// the first stands in for the calling job, which is already admitted
+			claimed  = scheduler_claim(SCHED_CPU, nthreads - 1);
+			nthreads = 1 + claimed;
+		}
+		// compressed blocks wait in memory until the writer reaches them
+		ctx.window = 2 * nthreads;
+
+		for (started = 0; started < nthreads; started++) {
+			if (pthread_create(&threads[started], 0, zipw_worker, &ctx)) {
+				A_ERROR_MSG("pthread create");
+				break;
+			}
+		}
+		BOLT_IF(nthreads && !started, E_UA_SYS, "no zip worker started");
+
+		remove(archive);
+		BOLT_SYS(!(fp = fopen(archive, "wb")), "creating file: %s", archive);
+		buf = f_malloc_raw(ua_rw_buff_size);
+
+		DL_FOREACH(ctx.entries, ze) {
+			BOLT_SUB(ze->nblocks ? zipw_write_deflated(fp, &ctx, ze, buf) : zipw_write_entry(fp, ze, buf));
+		}
+
+		if (!err)
+			err = zipw_write_central(fp, ctx.entries, cnt);
+
+	} while (0);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.abort = 1;
+	pthread_cond_broadcast(&ctx.cond);
+	pthread_mutex_unlock(&ctx.lock);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+	scheduler_release(SCHED_CPU, claimed);
+
+	if (fp && fclose(fp)) {
+		A_ERROR_MSG("closing file: %s", archive);
+		if (!err) err = E_UA_SYS;
+	}
+
+	if (err && fp)
+		remove(archive);
+
+	DL_FOREACH_SAFE(ctx.entries, ze, aux) {
+		DL_DELETE(ctx.entries, ze);
+		zipw_free_entry(ze);
+	}
+
+	f_free(buf);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+
+	return err;
+}
+
+int zipw_assemble(const char* archive, const zipw_raw_t* entries, int cnt)
+{
+	int err            = E_UA_OK;
+	FILE* fp           = 0;
+	unsigned char* buf = 0;
+	zipw_entry_t* list = 0, * ze, * aux;
+
+	A_INFO_MSG("assembling(zipw) %d entries to %s", cnt, archive);
+
+	do {
+		for (int i = 0; i < cnt; i++) {
+			const zipw_raw_t* re = &entries[i];
+
+			ze         = f_malloc(sizeof(zipw_entry_t));
+			ze->name   = f_strdup(re->name);
+			ze->path   = f_strdup(re->data);
+			ze->is_dir = re->data == NULL;
+			ze->store  = !re->deflated;
+			ze->raw    = 1;
+			ze->mode   = re->mode;
+			ze->crc    = re->crc;
+			ze->usize  = re->usize;
+			ze->csize  = re->csize;
+			ze->z64    = re->usize >= ZIP32_MAX || re->csize >= ZIP32_MAX;
+			zipw_dos_time(ze, re->mtime);
+			DL_APPEND(list, ze);
+
+			BOLT_IF(!ze->name || (!ze->is_dir && !ze->path), E_UA_ERR, "invalid zip entry at index %d", i);
+		}
+		if (err) break;
+
+		BOLT_SYS(chkdirp(archive), "failed to prepare directory for %s", archive);
+		remove(archive);
+		BOLT_SYS(!(fp = fopen(archive, "wb")), "creating file: %s", archive);
+		buf = f_malloc_raw(ua_rw_buff_size);
+
+		DL_FOREACH(list, ze) {
+			BOLT_SUB(zipw_write_entry(fp, ze, buf));
+		}
+
+		if (!err)
+			err = zipw_write_central(fp, list, cnt);
+
+	} while (0);
+
+	if (fp && fclose(fp)) {
+		A_ERROR_MSG("closing file: %s", archive);
+		if (!err) err = E_UA_SYS;
+	}
+
+	if (err && fp)
+		remove(archive);
+
+	DL_FOREACH_SAFE(list, ze, aux) {
+		DL_DELETE(list, ze);
+		zipw_free_entry(ze);
+	}
+
+	f_free(buf);
+
+	return err;
+}
+
+static int zipw_is_compressed(const char* path)
+{
+	unsigned char magic[6] = {0};
+	size_t len             = strlen(path);
+	FILE* fp;
+
+	for (int i = 0; zipw_compressed_ext[i]; i++) {
+		size_t l = strlen(zipw_compressed_ext[i]);
+		if (len > l && !strcasecmp(path + len - l, zipw_compressed_ext[i]))
+			return 1;
+	}
+
+	if (!(fp = fopen(path, "rb")))
+		return 0;
+	len = fread(magic, 1, sizeof(magic), fp);
+	fclose(fp);
+
+	if (len < 4)
+		return 0;
+
+	return (!memcmp(magic, "\xfd" "7zXZ\0", 6) ||
+	        !memcmp(magic, "\x1f\x8b", 2) ||
+	        !memcmp(magic, "BZh", 3) ||
+	        !memcmp(magic, "PK\x03\x04", 4) ||
+	        !memcmp(magic, "hsqs", 4) ||
+	        !memcmp(magic, "\x28\xb5\x2f\xfd", 4) ||
+	        !memcmp(magic, "\x04\x22\x4d\x18", 4));
+}
+
+static void zipw_set_method(zipw_entry_t* ze, const zipw_cfg_t* cfg)
+{
+	size_t len = strlen(ze->name);
+
+	ze->level = cfg->level > 0 ? cfg->level : ZIPW_DEFAULT_LEVEL;
+
+	for (int i = 0; i < cfg->rule_cnt; i++) {
+		delta_zip_rule_t* r = &cfg->rules[i];
+		size_t l            = S(r->suffix) ? strlen(r->suffix) : 0;
+
+		if (l && len >= l && !strcmp(ze->name + len - l, r->suffix)) {
+			ze->store = (r->method == DZM_STORE);
+			if (r->level > 0) ze->level = r->level;
+			return;
+		}
+	}
+
+	ze->store = zipw_is_compressed(ze->path);
+}
+
+static void zipw_dos_time(zipw_entry_t* ze, time_t mtime)
+{
+	struct tm tm;
+
+	if (!localtime_r(&mtime, &tm) || tm.tm_year < 80) {
+		ze->dos_time = 0;
+		ze->dos_date = (1 << 5) | 1;
+		return;
+	}
+
+	ze->dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+	ze->dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+static int zipw_scan(zipw_entry_t** list, const char* path, const char* base, const zipw_cfg_t* cfg, int* cnt, int* jobs)
+{
+	int err = E_UA_OK;
+	DIR* dir;
+	struct dirent* entry;
+	struct stat st;
+
+	do {
+		BOLT_IF(!(dir = opendir(path)), E_UA_ERR, "failed to open directory %s", path);
+
+		while (!err && (entry = readdir(dir)) != NULL) {
+			if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+
+			char* filepath = JOIN(path, entry->d_name);
+
+			if (stat(filepath, &st)) {
+				A_ERROR_MSG("failed to get path status: %s", filepath);
+				err = E_UA_SYS;
+
+			} else if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+				zipw_entry_t* ze = f_malloc(sizeof(zipw_entry_t));
+				ze->is_dir = S_ISDIR(st.st_mode);
+				ze->name   = f_asprintf("%s%s%s", base, entry->d_name, ze->is_dir ? "/" : "");
+				ze->path   = filepath;
+				ze->mode   = st.st_mode;
+				ze->store  = 1;
+				zipw_dos_time(ze, st.st_mtime);
+				if (!ze->is_dir) {
+					ze->usize = st.st_size;
+					ze->z64   = ze->usize >= ZIP32_MAX;
+					if (ze->usize)
+						zipw_set_method(ze, cfg);
+				}
+				if (!ze->store) {
+					ze->nblocks = (ze->usize + ZIPW_BLOCK_SIZE - 1) / ZIPW_BLOCK_SIZE;
+					ze->blocks  = f_malloc(ze->nblocks * sizeof(zipw_block_t));
+					*jobs      += ze->nblocks;
+				}
+				(*cnt)++;
+				DL_APPEND(*list, ze);
+
+				if (ze->is_dir)
+					err = zipw_scan(list, filepath, ze->name, cfg, cnt, jobs);
+				filepath = 0;
+			}
+
+			f_free(filepath);
+		}
+
+		closedir(dir);
+
+	} while (0);
+
+	return err;
+}
+
+static void zipw_free_entry(zipw_entry_t* ze)
+{
+	for (int i = 0; i < ze->nblocks; i++)
+		f_free(ze->blocks[i].out);
+	f_free(ze->blocks);
+	f_free(ze->name);
+	f_free(ze->path);
+	free(ze);
+}
+
+static zipw_entry_t* zipw_next_deflated(zipw_entry_t* ze)
+{
+	while (ze && !ze->nblocks)
+		ze = ze->next;
+
+	return ze;
+}
+
+/*
+ * Deflate block blk of ze, primed with the data before it so that the
+ * result matches a single stream closely.
+ */
+static int zipw_deflate_block(zipw_entry_t* ze, int blk, int fd, unsigned char* ibuf, z_stream* zs, int* zlevel)
+{
+	int err          = E_UA_OK;
+	zipw_block_t* zb = &ze->blocks[blk];
+	int last         = blk == ze->nblocks - 1;
+	uint64_t start   = (uint64_t)blk * ZIPW_BLOCK_SIZE;
+	size_t dict      = start < ZIPW_DICT_SIZE ? start : ZIPW_DICT_SIZE;
+	size_t len       = last ? ze->usize - start : ZIPW_BLOCK_SIZE;
+	size_t bound;
+	ssize_t nread;
+
+	do {
+		BOLT_SYS((nread = pread(fd, ibuf, dict + len, start - dict)) < 0, "reading from file: %s", ze->path);
+		BOLT_IF((size_t)nread != dict + len, E_UA_ERR, "file size changed while zipping: %s", ze->path);
+
+		if (*zlevel == ze->level) {
+			deflateReset(zs);
+		} else {
+			if (*zlevel >= 0) deflateEnd(zs);
+			*zlevel = -1;
+			memset(zs, 0, sizeof(z_stream));
+			BOLT_IF(deflateInit2(zs, ze->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK,
+			        E_UA_ERR, "deflate init failed: %s", ze->path);
+			*zlevel = ze->level;
+		}
+		BOLT_IF(dict && deflateSetDictionary(zs, ibuf, dict) != Z_OK, E_UA_ERR, "deflate dictionary failed: %s", ze->path);
+
+		// room for the sync flush marker on top of the bound
+		bound = deflateBound(zs, len) + 16;
+		BOLT_SYS(!(zb->out = f_malloc_raw(bound)), "allocating %zu bytes", bound);
+
+		zs->next_in   = ibuf + dict;
+		zs->avail_in  = len;
+		zs->next_out  = zb->out;
+		zs->avail_out = bound;
+		BOLT_IF(deflate(zs, last ? Z_FINISH : Z_SYNC_FLUSH) != (last ? Z_STREAM_END : Z_OK) || zs->avail_in,
+		        E_UA_ERR, "deflate failed: %s", ze->path);
+
+		zb->olen = bound - zs->avail_out;
+		zb->crc  = crc32(crc32(0L, Z_NULL, 0), ibuf + dict, len);
+		zb->len  = len;
+
+	} while (0);
+
+	return err;
+}
+
+static void* zipw_worker(void* arg)
+{
+	zipw_ctx_t* ctx     = arg;
+	unsigned char* ibuf = f_malloc_raw(ZIPW_DICT_SIZE + ZIPW_BLOCK_SIZE);
+	zipw_entry_t* ze, * cur = NULL;
+	int fd              = -1;
+	int zlevel          = -1;
+	int blk             = 0;
+	z_stream zs;
+
+	scheduler_worker();
+	int err;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		while (!ctx->abort && ctx->next_job && ctx->inflight >= ctx->window)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		ze = ctx->abort ? NULL : ctx->next_job;
+		if (ze) {
+			blk = ctx->next_blk++;
+			ctx->inflight++;
+			if (ctx->next_blk == ze->nblocks) {
+				ctx->next_job = zipw_next_deflated(ze->next);
+				ctx->next_blk = 0;
+			}
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (!ze)
+			break;
+
+		if (ze != cur) {
+			if (fd >= 0) close(fd);
+			if ((fd = open(ze->path, O_RDONLY)) < 0)
+				A_ERROR_MSG("opening file: %s", ze->path);
+			cur = ze;
+		}
+
+		if (!ibuf || fd < 0)
+			err = E_UA_SYS;
+		else
+			err = zipw_deflate_block(ze, blk, fd, ibuf, &zs, &zlevel);
+
+		pthread_mutex_lock(&ctx->lock);
+		ze->blocks[blk].err  = err;
+		ze->blocks[blk].done = 1;
+		pthread_cond_broadcast(&ctx->cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	if (zlevel >= 0) deflateEnd(&zs);
+	if (fd >= 0) close(fd);
+	f_free(ibuf);
+
+	return NULL;
+}
+
+static int zipw_copy_data(FILE* fp, const char* path, uint64_t size, uint32_t* crc, unsigned char* buf)
+{
+	int err   = E_UA_OK;
+	FILE* in  = 0;
+	uint64_t total = 0;
+	size_t nread;
+
+	do {
+		BOLT_SYS(!(in = fopen(path, "rb")), "opening file: %s", path);
+
+		if (crc) *crc = crc32(0L, Z_NULL, 0);
+		while ((nread = fread(buf, 1, ua_rw_buff_size, in))) {
+			BOLT_SYS(fwrite(buf, 1, nread, fp) != nread, "writing zip data from %s", path);
+			if (crc) *crc = crc32(*crc, buf, nread);
+			total += nread;
+		}
+		if (err) break;
+		BOLT_SYS(ferror(in), "reading from file: %s", path);
+		BOLT_IF(total != size, E_UA_ERR, "file size changed while zipping: %s", path);
+
+	} while (0);
+
+	if (in) fclose(in);
+
+	return err;
+}
+
+static int zipw_put_local(FILE* fp, zipw_entry_t* ze)
+{
+	int err = E_UA_OK;
+	unsigned char hdr[30 + 20];
+	unsigned char* p = hdr;
+	uint16_t nlen    = strlen(ze->name);
+
+	do {
+		p = put32(p, ZIP_LOCAL_SIG);
+		p = put16(p, ze->z64 ? 45 : 20);
+		p = put16(p, ZIP_FLAG_UTF8);
+		p = put16(p, ze->store ? ZIP_METHOD_STORE : ZIP_METHOD_DEFL);
+		p = put16(p, ze->dos_time);
+		p = put16(p, ze->dos_date);
+		p = put32(p, ze->crc);
+		p = put32(p, ze->z64 ? ZIP32_MAX : ze->csize);
+		p = put32(p, ze->z64 ? ZIP32_MAX : ze->usize);
+		p = put16(p, nlen);
+		p = put16(p, ze->z64 ? 20 : 0);
+
+		BOLT_SYS(fwrite(hdr, 1, p - hdr, fp) != (size_t)(p - hdr), "writing zip header");
+		BOLT_SYS(fwrite(ze->name, 1, nlen, fp) != nlen, "writing zip header");
+
+		if (ze->z64) {
+			p = hdr;
+			p = put16(p, ZIP64_EXTRA_ID);
+			p = put16(p, 16);
+			p = put64(p, ze->usize);
+			p = put64(p, ze->csize);
+			BOLT_SYS(fwrite(hdr, 1, p - hdr, fp) != (size_t)(p - hdr), "writing zip header");
+		}
+
+	} while (0);
+
+	return err;
+}
+
+static int zipw_write_local(FILE* fp, zipw_entry_t* ze)
+{
+	off_t off;
+
+	if ((off = ftello(fp)) < 0) {
+		A_ERROR_MSG("failed to get zip offset");
+		return E_UA_SYS;
+	}
+	ze->offset = off;
+
+	return zipw_put_local(fp, ze);
+}
+
+/*
+ * Rewrite the local header of ze once its data is written and the crc
+ * and sizes are known; the header keeps its length.
+ */
+static int zipw_patch_local(FILE* fp, zipw_entry_t* ze)
+{
+	int err = E_UA_OK;
+	off_t end;
+
+	do {
+		BOLT_SYS((end = ftello(fp)) < 0, "failed to get zip offset");
+		BOLT_SYS(fseeko(fp, ze->offset, SEEK_SET), "failed to seek in zip");
+		BOLT_SUB(zipw_put_local(fp, ze));
+		BOLT_SYS(fseeko(fp, end, SEEK_SET), "failed to seek in zip");
+
+	} while (0);
+
+	return err;
+}
+
+static int zipw_write_entry(FILE* fp, zipw_entry_t* ze, unsigned char* buf)
+{
+	int err = E_UA_OK;
+
+	do {
+		BOLT_SUB(zipw_write_local(fp, ze));
+
+		if (ze->raw && !ze->is_dir) {
+			BOLT_SUB(zipw_copy_data(fp, ze->path, ze->csize, NULL, buf));
+
+		} else if (!ze->is_dir) {
+			BOLT_SUB(zipw_copy_data(fp, ze->path, ze->usize, &ze->crc, buf));
+			ze->csize = ze->usize;
+			BOLT_SUB(zipw_patch_local(fp, ze));
+		}
+
+	} while (0);
+
+	return err;
+}
+
+static int zipw_write_deflated(FILE* fp, zipw_ctx_t* ctx, zipw_entry_t* ze, unsigned char* buf)
+{
+	int err = E_UA_OK;
+	off_t data;
+
+	do {
+		BOLT_SUB(zipw_write_local(fp, ze));
+		BOLT_SYS((data = ftello(fp)) < 0, "failed to get zip offset");
+
+		ze->crc = crc32(0L, Z_NULL, 0);
+		for (int i = 0; i < ze->nblocks; i++) {
+			zipw_block_t* zb = &ze->blocks[i];
+
+			pthread_mutex_lock(&ctx->lock);
+			while (!zb->done)
+				pthread_cond_wait(&ctx->cond, &ctx->lock);
+			pthread_mutex_unlock(&ctx->lock);
+
+			BOLT_IF(zb->err, zb->err, "failed to compress %s", ze->path);
+			BOLT_SYS(fwrite(zb->out, 1, zb->olen, fp) != zb->olen, "writing zip data from %s", ze->path);
+			ze->crc    = crc32_combine(ze->crc, zb->crc, zb->len);
+			ze->csize += zb->olen;
+
+			pthread_mutex_lock(&ctx->lock);
+			Z_FREE(zb->out);
+			ctx->inflight--;
+			pthread_cond_broadcast(&ctx->cond);
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		if (err) break;
+
+		if (ze->csize >= ze->usize) {
+			/* not worth it, store the original data over the deflated one */
+			BOLT_SYS(fseeko(fp, data, SEEK_SET), "failed to seek in zip");
+			ze->store = 1;
+			BOLT_SUB(zipw_copy_data(fp, ze->path, ze->usize, &ze->crc, buf));
+			ze->csize = ze->usize;
+		}
+
+		BOLT_SUB(zipw_patch_local(fp, ze));
+
+	} while (0);
+
+	return err;
+}
+
+static int zipw_write_central(FILE* fp, zipw_entry_t* list, int cnt)
+{
+	int err = E_UA_OK;
+	unsigned char hdr[56 + 20 + 22];
+	unsigned char* p;
+	zipw_entry_t* ze;
+	off_t cd_start, cd_end;
+	uint64_t cd_size;
+
+	do {
+		BOLT_SYS((cd_start = ftello(fp)) < 0, "failed to get zip offset");
+
+		DL_FOREACH(list, ze) {
+			int zu        = ze->usize >= ZIP32_MAX;
+			int zc        = ze->csize >= ZIP32_MAX;
+			int zo        = ze->offset >= ZIP32_MAX;
+			int xlen      = (zu || zc || zo) ? 4 + 8 * (zu + zc + zo) : 0;
+			uint16_t nlen = strlen(ze->name);
+			uint16_t ver  = xlen ? 45 : 20;
+
+			p = hdr;
+			p = put32(p, ZIP_CENTRAL_SIG);
+			p = put16(p, (3 << 8) | ver);
+			p = put16(p, ver);
+			p = put16(p, ZIP_FLAG_UTF8);
+			p = put16(p, ze->store ? ZIP_METHOD_STORE : ZIP_METHOD_DEFL);
+			p = put16(p, ze->dos_time);
+			p = put16(p, ze->dos_date);
+			p = put32(p, ze->crc);
+			p = put32(p, zc ? ZIP32_MAX : ze->csize);
+			p = put32(p, zu ? ZIP32_MAX : ze->usize);
+			p = put16(p, nlen);
+			p = put16(p, xlen);
+			p = put16(p, 0);
+			p = put16(p, 0);
+			p = put16(p, 0);
+			p = put32(p, ((uint32_t)ze->mode << 16) | (ze->is_dir ? 0x10 : 0));
+			p = put32(p, zo ? ZIP32_MAX : ze->offset);
+
+			BOLT_SYS(fwrite(hdr, 1, p - hdr, fp) != (size_t)(p - hdr), "writing zip directory");
+			BOLT_SYS(fwrite(ze->name, 1, nlen, fp) != nlen, "writing zip directory");
+
+			if (xlen) {
+				p = hdr;
+				p = put16(p, ZIP64_EXTRA_ID);
+				p = put16(p, xlen - 4);
+				if (zu) p = put64(p, ze->usize);
+				if (zc) p = put64(p, ze->csize);
+				if (zo) p = put64(p, ze->offset);
+				BOLT_SYS(fwrite(hdr, 1, p - hdr, fp) != (size_t)(p - hdr), "writing zip directory");
+			}
+		}
+
+		if (err) break;
+
+		BOLT_SYS((cd_end = ftello(fp)) < 0, "failed to get zip offset");
+		cd_size = cd_end - cd_start;
+
+		p = hdr;
+		if (cnt >= ZIP16_MAX || (uint64_t)cd_start >= ZIP32_MAX || cd_size >= ZIP32_MAX) {
+			p = put32(p, ZIP64_EOCD_SIG);
+			p = put64(p, 44);
+			p = put16(p, (3 << 8) | 45);
+			p = put16(p, 45);
+			p = put32(p, 0);
+			p = put32(p, 0);
+			p = put64(p, cnt);
+			p = put64(p, cnt);
+			p = put64(p, cd_size);
+			p = put64(p, cd_start);
+
+			p = put32(p, ZIP64_LOC_SIG);
+			p = put32(p, 0);
+			p = put64(p, cd_end);
+			p = put32(p, 1);
+		}
+
+		p = put32(p, ZIP_EOCD_SIG);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put16(p, cnt >= ZIP16_MAX ? ZIP16_MAX : cnt);
+		p = put16(p, cnt >= ZIP16_MAX ? ZIP16_MAX : cnt);
+		p = put32(p, cd_size >= ZIP32_MAX ? ZIP32_MAX : cd_size);
+		p = put32(p, (uint64_t)cd_start >= ZIP32_MAX ? ZIP32_MAX : (uint64_t)cd_start);
+		p = put16(p, 0);
+
+		BOLT_SYS(fwrite(hdr, 1, p - hdr, fp) != (size_t)(p - hdr), "writing zip directory");
+
+		/* a stored rewrite of the last member is shorter than its deflated
+		 * data, drop whatever is left of it after the directory */
+		BOLT_SYS((cd_end = ftello(fp)) < 0, "failed to get zip offset");
+		BOLT_SYS(fflush(fp), "writing zip directory");
+		BOLT_SYS(ftruncate(fileno(fp), cd_end), "failed to truncate zip");
+
+	} while (0);
+
+	return err;
+}
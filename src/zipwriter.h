@@ -0,0 +1,57 @@
+/*
+ * zipwriter.h
+ */
+
+#ifndef UA_ZIPWRITER_H_
+#define UA_ZIPWRITER_H_
+
+#ifdef LIBUA_VER_2_0
+#include "esyncua.h"
+#else
+#include "xl4ua.h"
+#endif
+
+#include <time.h>
+
+#define ZIPW_DEFAULT_LEVEL 6
+#define ZIPW_MAX_THREADS   16
+// members are deflated in slices of this size, one per worker job
+#define ZIPW_BLOCK_SIZE    (256 << 10)
+
+typedef struct zipw_cfg {
+	int level;
+	int threads;
+	delta_zip_rule_t* rules;
+	int rule_cnt;
+
+} zipw_cfg_t;
+
+/*
+ * Archive the content of directory path into a new ZIP file. Members are
+ * deflated in blocks in parallel and streamed into the archive in sorted
+ * path order, without intermediate files. Members that are already
+ * compressed, or that do not shrink, are stored.
+ * cfg may be NULL to use default settings.
+ */
+int zipw_archive(const char* archive, const char* path, const zipw_cfg_t* cfg);
+
+typedef struct zipw_raw {
+	const char* name;
+	// file holding the entry data as it is stored in the archive, NULL for directories
+	const char* data;
+	int deflated;
+	uint32_t crc;
+	uint64_t usize;
+	uint64_t csize;
+	uint32_t mode;
+	time_t mtime;
+
+} zipw_raw_t;
+
+/*
+ * Write a new ZIP file from entries whose data is already in archive form,
+ * stored or raw deflate. Data is copied as is, in the order given.
+ */
+int zipw_assemble(const char* archive, const zipw_raw_t* entries, int cnt);
+
+#endif /* UA_ZIPWRITER_H_ */
@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <signal.h>
 #include "cmocka.h"
 
 #ifdef LIBUA_VER_2_0
@@ -14,6 +15,7 @@
 #endif //LIBUA_VER_2_0
 
 #include "handler.h"
+#include "rjournal.h"
 #include "test_agents/tmpl_updateagent.h"
 #include "test_setup.h"
 
@@ -89,6 +91,25 @@ int __wrap_verify_file_hash_b64(const char* file, const char* sha256_b64)
 }
 
 
+static int journal_kill_after = 0;
+
+void set_journal_kill(int records)
+{
+	journal_kill_after = records;
+}
+
+int __real_rjournal_add(rjournal_t* j, char tag, const char* name);
+
+// power loss right after a record is on disk, the whole process group goes down
+int __wrap_rjournal_add(rjournal_t* j, char tag, const char* name)
+{
+	int err = __real_rjournal_add(j, tag, name);
+
+	if (journal_kill_after && !--journal_kill_after)
+		kill(0, SIGKILL);
+	return err;
+}
+
 int __wrap_reply_id_matched(char* s1, char* s2)
 {
 	return 1;
@@ -7,5 +7,7 @@
 int test_ua_setup(void** state);
 int test_ua_teardown(void** state);
 int __wrap_xl4bus_client_init(char* url, char* cert_dir, char* pwd);
+// kill the calling process group once this many journal records were written, 0 to disable
+void set_journal_kill(int records);
 
 #endif //TEST_SETUP_H_
\ No newline at end of file
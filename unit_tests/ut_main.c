@@ -3,10 +3,20 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <ftw.h>
+#include <inttypes.h>
 #include "cmocka.h"
 
 #include <linux/limits.h>
 #include "handler.h"
+#include "delta.h"
+#include "zipwriter.h"
+#include "xml.h"
 #include "test_setup.h"
 #include "ut_updateagent.h"
 
@@ -24,6 +34,11 @@ static char* cases[] = {
 	"test_delta_dmc_rollback_failure",
 	"test_rollback_mixed",
 	"test_rollback_fake_version",
+	"test_parallel_delta_reconstruct",
+	"test_delta_reconstruct_resume",
+	"test_delta_plan",
+	"test_zip_stored_tail",
+	"test_rollback_from_store",
 };
 
 static void handle_messages_from_file(char* filename, ua_cfg_t* cfg)
@@ -157,6 +172,320 @@ void test_rollback_fake_version(void** state)
 	assert_true(access("/tmp/esync/ECU_HMNS_ROM/manifest_pkg.xml", F_OK));
 }
 
+#define UT_PARALLEL_PATCHES 8
+
+typedef struct ut_patch_job {
+	char diff[PATH_MAX];
+	char new[PATH_MAX];
+	int err;
+	pthread_t tid;
+} ut_patch_job_t;
+
+static void* patch_job(void* arg)
+{
+	ut_patch_job_t* job = (ut_patch_job_t*)arg;
+
+	job->err = delta_reconstruct("../unit_tests/fixure/backup/ECU_HMNS_ROM_4.0/4.0/ECU_HMNS_ROM-4.0.x", job->diff, job->new);
+	return NULL;
+}
+
+void test_parallel_delta_reconstruct(void** state)
+{
+	ua_cfg_t* cfg = NULL;
+	ut_patch_job_t jobs[UT_PARALLEL_PATCHES] = {0};
+	char cmd[PATH_MAX * 2];
+
+	assert_true(!system("rm -rf /data/sota/tmp/parallel && mkdir -p /data/sota/tmp/parallel"));
+	test_ua_setup((void**)&cfg);
+
+	for (int i = 0; i < UT_PARALLEL_PATCHES; i++) {
+		snprintf(jobs[i].diff, sizeof(jobs[i].diff), "/data/sota/tmp/parallel/ECU_HMNS_ROM-3.0-%d.x", i);
+		snprintf(jobs[i].new, sizeof(jobs[i].new), "/data/sota/tmp/parallel/new/ECU_HMNS_ROM-3.0-%d.x", i);
+		snprintf(cmd, sizeof(cmd), "cp -f ../unit_tests/fixure/delta/4.0_3.0/ECU_HMNS_ROM-3.0.x %s", jobs[i].diff);
+		assert_true(!system(cmd));
+	}
+
+	for (int i = 0; i < UT_PARALLEL_PATCHES; i++)
+		assert_true(!pthread_create(&jobs[i].tid, NULL, patch_job, &jobs[i]));
+
+	for (int i = 0; i < UT_PARALLEL_PATCHES; i++) {
+		pthread_join(jobs[i].tid, NULL);
+		assert_int_equal(jobs[i].err, E_UA_OK);
+		assert_true(!access(jobs[i].new, F_OK));
+	}
+
+	test_ua_teardown((void**)&cfg);
+}
+
+#define UT_RESUME_KILLS   10
+#define UT_RESUME_MAX_US  300000
+#define UT_RESUME_RECORDS 100
+#define UT_RESUME_SEED    20240611
+#define UT_RESUME_OLD     "../unit_tests/fixure/backup/ECU_HMNS_ROM_4.0/4.0/ECU_HMNS_ROM-4.0.x"
+#define UT_RESUME_DIFF    "/data/sota/tmp/resume/ECU_HMNS_ROM-3.0.x"
+#define UT_RESUME_NEW     "/data/sota/tmp/resume/new/ECU_HMNS_ROM-3.0.x"
+#define UT_RESUME_JOURNAL "/tmp/esync/delta/ECU_HMNS_ROM-3.0.journal"
+// lk.rom of version 3.0, per the manifest of the diff package
+#define UT_RESUME_SHA     "ba4294f4a4324ad3ab341303833278a30bbcba8a3543cb3778b45aa701405a7e"
+
+static int resume_run(unsigned max_us)
+{
+	int status;
+	pid_t pid;
+
+	assert_true((pid = fork()) >= 0);
+	if (!pid) {
+		setpgid(0, 0);
+		_exit(delta_reconstruct(UT_RESUME_OLD, UT_RESUME_DIFF, UT_RESUME_NEW) ? 1 : 0);
+	}
+	// own group, so the tools it runs go down with it
+	setpgid(pid, pid);
+	if (max_us) {
+		usleep(rand() % max_us);
+		kill(-pid, SIGKILL);
+	}
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(!WIFEXITED(status) || !WEXITSTATUS(status));
+
+	return status;
+}
+
+static void resume_check(void)
+{
+	char hash[SHA256_HEX_LENGTH];
+	pkg_handle_t* ph;
+
+	assert_true(!system("rm -rf /data/sota/tmp/resume/check && mkdir -p /data/sota/tmp/resume/check"));
+	assert_non_null(ph = pkg_open(UT_RESUME_NEW));
+	assert_int_equal(pkg_extract(ph, "/data/sota/tmp/resume/check"), E_UA_OK);
+	pkg_close(ph);
+	assert_int_equal(calc_sha256_hex("/data/sota/tmp/resume/check/lk.rom", hash), E_UA_OK);
+	assert_string_equal(hash, UT_RESUME_SHA);
+}
+
+void test_delta_reconstruct_resume(void** state)
+{
+	int status, killed = 0;
+
+	assert_true(!system("rm -rf /data/sota/tmp/resume && mkdir -p /data/sota/tmp/resume/new"));
+	assert_true(!system("cp -f ../unit_tests/fixure/delta/4.0_3.0/ECU_HMNS_ROM-3.0.x " UT_RESUME_DIFF));
+	assert_int_equal(delta_init("/tmp/esync/", &(delta_cfg_t){.delta_cap = "A:4"}), E_UA_OK);
+
+	// power loss right after the 1st new journal record, then the 2nd, ... until an attempt gets through
+	for (int rec = 1; ; rec++) {
+		assert_true(rec <= UT_RESUME_RECORDS);
+		set_journal_kill(rec);
+		status = resume_run(0);
+		set_journal_kill(0);
+		if (WIFEXITED(status))
+			break;
+
+		assert_true(WIFSIGNALED(status));
+		killed++;
+		// the next attempt starts from what this one journaled
+		assert_true(!access(UT_RESUME_JOURNAL, F_OK));
+	}
+	printf("delta resume: %d attempt(s) killed after a journal record\n", killed);
+	assert_true(killed > 0);
+	assert_true(access(UT_RESUME_JOURNAL, F_OK));
+	resume_check();
+
+	// fixed seed so a failing kill sequence replays; override with UT_RESUME_SEED in the environment
+	unsigned seed = getenv("UT_RESUME_SEED") ? strtoul(getenv("UT_RESUME_SEED"), NULL, 0) : UT_RESUME_SEED;
+	printf("delta resume seed %u\n", seed);
+	srand(seed);
+
+	// power loss at random points, every attempt picks up from the journal of the one before
+	killed = 0;
+	for (int i = 0; i < UT_RESUME_KILLS; i++)
+		killed += WIFSIGNALED(resume_run(UT_RESUME_MAX_US));
+	printf("delta resume: %d of %d attempt(s) killed at random\n", killed, UT_RESUME_KILLS);
+
+	assert_int_equal(delta_reconstruct(UT_RESUME_OLD, UT_RESUME_DIFF, UT_RESUME_NEW), E_UA_OK);
+	resume_check();
+
+	delta_stop();
+}
+
+#define UT_PLAN_DIFF  "/data/sota/tmp/plan/ECU_HMNS_ROM-3.0.x"
+#define UT_PLAN_NEW   "/data/sota/tmp/plan/new/ECU_HMNS_ROM-3.0.x"
+#define UT_PLAN_CACHE "/tmp/esync/delta"
+// estimates are taken against what one reconstruction actually needed
+#define UT_PLAN_SIZE_TOLERANCE 10
+#define UT_PLAN_DISK_OVERSHOOT 3
+
+static uint64_t ut_du_sum;
+
+static int ut_du_add(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+	if (flag == FTW_F)
+		ut_du_sum += st->st_size;
+	return 0;
+}
+
+static uint64_t ut_du(const char* path)
+{
+	ut_du_sum = 0;
+	nftw(path, ut_du_add, 16, FTW_PHYS);
+	return ut_du_sum;
+}
+
+void test_delta_plan(void** state)
+{
+	ua_delta_plan_t plan;
+	ut_patch_job_t job = {0};
+	uint64_t sum = 0, base, used, peak = 0, size = 0;
+	struct stat cs, ns;
+	pkg_handle_t* ph;
+	int zip_local;
+
+	assert_true(!system("rm -rf /data/sota/tmp/plan && mkdir -p /data/sota/tmp/plan/new"));
+	assert_true(!system("cp -f ../unit_tests/fixure/delta/4.0_3.0/ECU_HMNS_ROM-3.0.x " UT_PLAN_DIFF));
+	assert_int_equal(delta_init("/tmp/esync/", &(delta_cfg_t){.delta_cap = "A:4", .space_check = 1}), E_UA_OK);
+
+	assert_int_equal(ua_delta_plan(UT_RESUME_OLD, UT_PLAN_DIFF, UT_PLAN_NEW, &plan), E_UA_OK);
+	assert_true(plan.entry_cnt > 0);
+	assert_true(plan.free_disk > 0 && plan.read_kbps > 0 && plan.write_kbps > 0);
+	for (int i = 0; i < plan.entry_cnt; i++)
+		sum += plan.entries[i].new_size;
+	assert_true(sum == plan.new_pkg_size);
+
+	// nothing was extracted to plan, the reconstruction itself passes the space check
+	assert_true(access(UT_PLAN_CACHE "/ECU_HMNS_ROM-3.0", F_OK));
+
+	// the new package counts against the cache only on the same file system
+	assert_true(!stat("/tmp/esync", &cs) && !stat("/data/sota/tmp/plan/new", &ns));
+	zip_local = cs.st_dev == ns.st_dev;
+	// whatever earlier tests left in the cache is not part of this reconstruction
+	base = ut_du(UT_PLAN_CACHE);
+
+	snprintf(job.diff, sizeof(job.diff), "%s", UT_PLAN_DIFF);
+	snprintf(job.new, sizeof(job.new), "%s", UT_PLAN_NEW);
+	assert_true(!pthread_create(&job.tid, NULL, patch_job, &job));
+	while (pthread_tryjoin_np(job.tid, NULL)) {
+		used = ut_du(UT_PLAN_CACHE) + (zip_local ? ut_du("/data/sota/tmp/plan/new") : 0);
+		if (used > base + peak) peak = used - base;
+		usleep(1000);
+	}
+	assert_int_equal(job.err, E_UA_OK);
+
+	// content of the new package, the manifest of the diff package is not part of the plan
+	assert_non_null(ph = pkg_open(UT_PLAN_NEW));
+	for (int i = 0; i < ph->entry_cnt; i++)
+		size += ph->entries[i].size;
+	pkg_close(ph);
+	printf("delta plan: new %" PRIu64 " of %" PRIu64 ", disk %" PRIu64 " of %" PRIu64 "\n",
+	       plan.new_pkg_size, size, plan.peak_disk, peak);
+
+	assert_true(plan.new_pkg_size * 100 >= size * (100 - UT_PLAN_SIZE_TOLERANCE) &&
+	            plan.new_pkg_size * 100 <= size * (100 + UT_PLAN_SIZE_TOLERANCE));
+	assert_true(peak > 0 && plan.peak_disk >= peak && plan.peak_disk <= peak * UT_PLAN_DISK_OVERSHOOT);
+
+	ua_delta_plan_free(&plan);
+	assert_true(!plan.entries);
+
+	delta_stop();
+}
+
+#define UT_ZIP_DIR  "/data/sota/tmp/zipw"
+#define UT_ZIP_FILE "/data/sota/tmp/zipw.zip"
+// sorts last, random data comes out of deflate larger than it went in
+#define UT_ZIP_TAIL "zz.img"
+
+void test_zip_stored_tail(void** state)
+{
+	unsigned char eocd[22], a[4096], b[4096];
+	zip_int64_t n;
+	zip_file_t* zf;
+	zip_stat_t zs;
+	zip_t* za;
+	FILE* fp;
+	int zerr;
+
+	assert_true(!system("rm -rf " UT_ZIP_DIR " " UT_ZIP_FILE " && mkdir -p " UT_ZIP_DIR));
+	assert_true(!system("cp -f " UT_RESUME_OLD " " UT_ZIP_DIR "/"));
+	assert_true(!system("head -c 3000000 /dev/urandom > " UT_ZIP_DIR "/" UT_ZIP_TAIL));
+
+	assert_int_equal(zipw_archive(UT_ZIP_FILE, UT_ZIP_DIR, &(zipw_cfg_t){.threads = 4}), E_UA_OK);
+
+	// nothing of the deflated attempt may be left after the directory
+	assert_non_null(fp = fopen(UT_ZIP_FILE, "rb"));
+	assert_true(!fseeko(fp, -(off_t)sizeof(eocd), SEEK_END));
+	assert_int_equal(fread(eocd, 1, sizeof(eocd), fp), sizeof(eocd));
+	fclose(fp);
+	assert_memory_equal(eocd, "PK\x05\x06", 4);
+
+	assert_non_null(za = zip_open(UT_ZIP_FILE, ZIP_CHECKCONS | ZIP_RDONLY, &zerr));
+	assert_int_equal(zip_get_num_entries(za, 0), 2);
+	assert_true(!zip_stat(za, UT_ZIP_TAIL, 0, &zs));
+	assert_int_equal(zs.comp_method, ZIP_CM_STORE);
+	assert_true(zs.comp_size == zs.size);
+
+	assert_non_null(zf = zip_fopen(za, UT_ZIP_TAIL, 0));
+	assert_non_null(fp = fopen(UT_ZIP_DIR "/" UT_ZIP_TAIL, "rb"));
+	while ((n = zip_fread(zf, a, sizeof(a))) > 0) {
+		assert_int_equal(fread(b, 1, n, fp), n);
+		assert_memory_equal(a, b, n);
+	}
+	assert_int_equal(n, 0);
+	assert_int_equal(fread(b, 1, 1, fp), 0);
+	fclose(fp);
+	zip_fclose(zf);
+	zip_close(za);
+}
+
+#define UT_STORE_DIR      "/data/sota/tmp/store/backup/ECU_HMNS_ROM"
+#define UT_STORE_MANIFEST UT_STORE_DIR "/manifest_pkg.xml"
+
+void test_rollback_from_store(void** state)
+{
+	ua_cfg_t* cfg               = NULL;
+	ua_component_context_t uacc = {0};
+	pkg_file_t bf = {0}, pf = {0}, uf = {0};
+	update_err_t ue             = UE_NONE;
+	bks_entry_t* recipe         = NULL;
+
+	assert_true(!system("rm -rf /data/sota/tmp/store && mkdir -p " UT_STORE_DIR));
+	test_ua_setup((void**)&cfg);
+
+	// back up 4.0 through the store, only its members are kept
+	bf.version = "4.0";
+	bf.file    = UT_STORE_DIR "/4.0/ECU_HMNS_ROM-4.0.x";
+	assert_int_equal(calculate_sha256_b64(UT_RESUME_OLD, bf.sha256b64), E_UA_OK);
+	assert_int_equal(calc_sha256_x(UT_RESUME_OLD, bf.sha_of_sha), E_UA_OK);
+	assert_int_equal(bkstore_put(UT_STORE_MANIFEST, UT_RESUME_OLD, &recipe), E_UA_OK);
+	assert_int_equal(add_pkg_store_manifest(UT_STORE_MANIFEST, &bf, recipe), E_UA_OK);
+	bkstore_free(recipe);
+	assert_true(access(bf.file, F_OK));
+
+	// checked out with fresh headers, the whole-file hash of the original no longer holds
+	assert_int_equal(get_pkg_file_manifest(UT_STORE_MANIFEST, "4.0", &pf), E_UA_OK);
+	assert_true(pf.stored && !access(pf.file, R_OK));
+	assert_int_not_equal(verify_file_hash_b64(pf.file, pf.sha256b64), E_UA_OK);
+
+	// rollback with package verification enabled
+	uacc.uar                      = get_tmpl_routine();
+	uacc.update_pkg.type          = "/ECU/ROM";
+	uacc.update_pkg.name          = "ECU_HMNS_ROM";
+	uacc.backup_manifest          = UT_STORE_MANIFEST;
+	uacc.is_rollback_installation = 1;
+	assert_int_equal(prepare_install_action(&uacc, &pf, 1, &uf, &ue), INSTALL_READY);
+	assert_string_equal(uf.file, pf.file);
+
+	// the same check must catch a damaged member
+	assert_true(!system("printf x | dd of=" UT_STORE_DIR "/4.0/ECU_HMNS_ROM-4.0.x bs=1 seek=4096 conv=notrunc status=none"));
+	f_free(uf.version);
+	f_free(uf.file);
+	memset(&uf, 0, sizeof(uf));
+	assert_int_equal(prepare_install_action(&uacc, &pf, 1, &uf, &ue), INSTALL_FAILED);
+
+	f_free(uf.version);
+	f_free(uf.file);
+	f_free(pf.version);
+	f_free(pf.file);
+	test_ua_teardown((void**)&cfg);
+}
+
 void test_xl4_msg_file(void** state)
 {
 	handle_messages_from_file(xl4_msg_path, NULL);
@@ -170,6 +499,11 @@ static ut_test_func case_funcs[] = {
 	test_delta_dmc_rollback_failure,
 	test_rollback_mixed,
 	test_rollback_fake_version,
+	test_parallel_delta_reconstruct,
+	test_delta_reconstruct_resume,
+	test_delta_plan,
+	test_zip_stored_tail,
+	test_rollback_from_store,
 
 };
 
@@ -240,6 +574,11 @@ int main(int argc, char** argv)
 			cmocka_unit_test(test_delta_dmc_rollback_failure),
 			cmocka_unit_test(test_rollback_mixed),
 			cmocka_unit_test(test_rollback_fake_version),
+			cmocka_unit_test(test_parallel_delta_reconstruct),
+			cmocka_unit_test(test_delta_reconstruct_resume),
+			cmocka_unit_test(test_delta_plan),
+			cmocka_unit_test(test_zip_stored_tail),
+			cmocka_unit_test(test_rollback_from_store),
 		};
 
 		return cmocka_run_group_tests(tests, NULL, NULL);